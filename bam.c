@@ -50,6 +50,34 @@ int32_t bam_cigar2qlen(const bam1_core_t *c, const uint32_t *cigar)
 	return l;
 }
 
+void bam_cigsum_update(bam1_t *b)
+{
+	const uint32_t *cigar = bam1_cigar(b);
+	bam1_cigsum_t *cs = &b->cs;
+	int k, n = b->core.n_cigar, has_back = 0;
+	int32_t end = b->core.pos, qlen = 0;
+	cs->has_indel = cs->has_splice = 0;
+	cs->lclip = cs->rclip = 0;
+	for (k = 0; k < n; ++k) {
+		int op  = bam_cigar_op(cigar[k]);
+		int len = bam_cigar_oplen(cigar[k]);
+		int type = bam_cigar_type(op);
+		if (type&1) qlen += len;
+		if (type&2) end += len;
+		if (op == BAM_CINS || op == BAM_CDEL) cs->has_indel = 1;
+		else if (op == BAM_CREF_SKIP) cs->has_splice = 1;
+		else if (op == BAM_CBACK) has_back = 1;
+	}
+	for (k = 0; k < n && bam_cigar_op(cigar[k]) == BAM_CHARD_CLIP; ++k);
+	if (k < n && bam_cigar_op(cigar[k]) == BAM_CSOFT_CLIP) cs->lclip = bam_cigar_oplen(cigar[k]);
+	for (k = n - 1; k >= 0 && bam_cigar_op(cigar[k]) == BAM_CHARD_CLIP; --k);
+	if (k >= 0 && bam_cigar_op(cigar[k]) == BAM_CSOFT_CLIP && (k > 0 || cs->lclip == 0))
+		cs->rclip = bam_cigar_oplen(cigar[k]);
+	cs->end = has_back? bam_calend(&b->core, cigar) : end; // 'B' moves backward; rare
+	cs->qlen = qlen;
+	cs->is_valid = 1;
+}
+
 /********************
  * BAM I/O routines *
  ********************/
@@ -74,6 +102,7 @@ void bam_header_destroy(bam_header_t *header)
 	free(header->text);
 	if (header->header) sam_header_destroy(header->header);
 	if (header->rg2lib) sam_tbl_destroy(header->rg2lib);
+	sam_hdict_destroy(header->dict);
 	bam_destroy_header_hash(header);
 	free(header);
 }
@@ -192,18 +221,10 @@ static void swap_endian_data(const bam1_core_t *c, int data_len, uint8_t *data)
 	}
 }
 
-int bam_read1(bamFile fp, bam1_t *b)
+static inline void bam_read1_core(bam1_t *b, int32_t block_len, uint32_t x[8])
 {
 	bam1_core_t *c = &b->core;
-	int32_t block_len, ret, i;
-	uint32_t x[8];
-
-	assert(BAM_CORE_SIZE == 32);
-	if ((ret = bam_read(fp, &block_len, 4)) != 4) {
-		if (ret == 0) return -1; // normal end-of-file
-		else return -2; // truncated
-	}
-	if (bam_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
+	int i;
 	if (bam_is_be) {
 		bam_swap_endian_4p(&block_len);
 		for (i = 0; i < 8; ++i) bam_swap_endian_4p(x + i);
@@ -219,11 +240,48 @@ int bam_read1(bamFile fp, bam1_t *b)
 		kroundup32(b->m_data);
 		b->data = (uint8_t*)realloc(b->data, b->m_data);
 	}
-	if (bam_read(fp, b->data, b->data_len) != b->data_len) return -4;
+}
+
+static inline void bam_read1_data(bam1_t *b)
+{
+	bam1_core_t *c = &b->core;
 	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
 	if (bam_is_be) swap_endian_data(c, b->data_len, b->data);
 	if (bam_no_B) bam_remove_B(b);
-	return 4 + block_len;
+	bam_cigsum_update(b);
+}
+
+int bam_read1(bamFile fp, bam1_t *b)
+{
+	int32_t block_len, ret;
+	uint32_t x[8];
+
+	assert(BAM_CORE_SIZE == 32);
+	if ((ret = bam_read(fp, &block_len, 4)) != 4) {
+		if (ret == 0) return -1; // normal end-of-file
+		else return -2; // truncated
+	}
+	if (bam_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
+	bam_read1_core(b, block_len, x);
+	if (bam_read(fp, b->data, b->data_len) != b->data_len) return -4;
+	bam_read1_data(b);
+	return 4 + b->data_len + BAM_CORE_SIZE;
+}
+
+int bam_read1_bgzf(BGZF *fp, bam1_t *b)
+{
+	int32_t block_len, ret;
+	uint32_t x[8];
+
+	if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
+		if (ret == 0) return -1; // normal end-of-file
+		else return -2; // truncated
+	}
+	if (bgzf_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
+	bam_read1_core(b, block_len, x);
+	if (bgzf_read(fp, b->data, b->data_len) != b->data_len) return -4;
+	bam_read1_data(b);
+	return 4 + b->data_len + BAM_CORE_SIZE;
 }
 
 inline int bam_write1_core(bamFile fp, const bam1_core_t *c, int data_len, uint8_t *data)
@@ -369,14 +427,23 @@ int bam_validate1(const bam_header_t *header, const bam1_t *b)
 	return 1;
 }
 
+sam_hdict_t *bam_header_dict(bam_header_t *h)
+{
+	if (h->dict == 0) h->dict = sam_hdict_parse(h->text, h->l_text);
+	return h->dict;
+}
+
+const char *bam_header_get(bam_header_t *h, const char type[2], const char *id, const char tag[2])
+{
+	return sam_hdict_get(bam_header_dict(h), type, id, tag);
+}
+
 // FIXME: we should also check the LB tag associated with each alignment
 const char *bam_get_library(bam_header_t *h, const bam1_t *b)
 {
 	const uint8_t *rg;
-        if (h->header == 0) h->header = sam_header_parse2(h->text);
-	if (h->rg2lib == 0) h->rg2lib = sam_header_table(h->header, "RG", "ID", "LB");
 	rg = bam_aux_get(b, "RG");
-	return (rg == 0)? 0 : sam_tbl_get(h->rg2lib, (const char*)(rg + 1));
+	return (rg == 0)? 0 : bam_header_get(h, "RG", (const char*)(rg + 1), "LB");
 }
 
 /************
@@ -470,6 +537,7 @@ int bam_remove_B(bam1_t *b)
 	memmove(p, bam1_aux(b), b->l_aux); p += b->l_aux; // set optional fields
 	b->core.n_cigar = l, b->core.l_qseq = j; // update CIGAR length and query length
 	b->data_len = p - b->data; // update record length
+	bam_cigsum_update(b);
 	return 0;
 
 rmB_err:
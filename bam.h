@@ -102,6 +102,7 @@ typedef gzFile bamFile;
   @field hash        hash table for fast name lookup
   @field rg2lib      hash table for @RG-ID -> LB lookup
   @field header      explicit header structure
+  @field dict        dictionary of the header text; see bam_header_dict()
   @field l_text      length of the plain text in the header
   @field text        plain text
 
@@ -114,6 +115,7 @@ typedef struct __bam_header_t {
 	uint32_t *target_len;
 	void *hash, *rg2lib;
         sam_header_t *header; 
+	sam_hdict_t *dict;
 	uint32_t l_text, n_text;
 	char *text;
 } bam_header_t;
@@ -211,6 +213,22 @@ typedef struct {
 	int32_t isize;
 } bam1_core_t;
 
+/*! @typedef
+  @abstract Summary of the CIGAR of an alignment, computed in one pass.
+  @field  end        rightmost coordinate on the reference, as bam_calend()
+  @field  qlen       query length, as bam_cigar2qlen()
+  @field  lclip      length of the leading soft clip
+  @field  rclip      length of the trailing soft clip
+  @field  is_valid   1 iff the other fields reflect the current CIGAR
+  @field  has_indel  1 iff the CIGAR contains I or D
+  @field  has_splice 1 iff the CIGAR contains N
+ */
+typedef struct {
+	int32_t end, qlen;
+	int32_t lclip, rclip;
+	uint32_t is_valid:1, has_indel:1, has_splice:1, dummy:29;
+} bam1_cigsum_t;
+
 /*! @typedef
   @abstract Structure for one alignment.
   @field  core       core information about the alignment
@@ -218,6 +236,7 @@ typedef struct {
   @field  data_len   current length of bam1_t::data
   @field  m_data     maximum length of bam1_t::data
   @field  data       all variable-length data, concatenated; structure: qname-cigar-seq-qual-aux
+  @field  cs         CIGAR summary cached by bam_read1() and sam_read1()
 
   @discussion Notes:
  
@@ -226,11 +245,15 @@ typedef struct {
       on reading or from CIGAR.
    3. cigar data is encoded 4 bytes per CIGAR operation.
    4. seq is nybble-encoded according to bam_nt16_table.
+   5. cs is only meaningful when cs.is_valid is set. Code that modifies
+      CIGAR or core.pos in place must call bam_cigsum_update() or clear
+      cs.is_valid.
  */
 typedef struct {
 	bam1_core_t core;
 	int l_aux, data_len, m_data;
 	uint8_t *data;
+	bam1_cigsum_t cs;
 } bam1_t;
 
 typedef struct __bam_iter_t *bam_iter_t;
@@ -461,6 +484,55 @@ extern "C" {
 	 */
 	int bam_read1(bamFile fp, bam1_t *b);
 
+	/*!
+	  @abstract   Read an alignment from a plain BGZF handle.
+	  @param  fp  BGZF file handler
+	  @param  b   read alignment; all members are updated.
+	  @return     number of bytes read from the file
+
+	  @discussion Same as bam_read1(), but bypasses bamFile. This
+	  lets several threads each read their own part of one BAM.
+	 */
+	int bam_read1_bgzf(BGZF *fp, bam1_t *b);
+
+	/*! @typedef
+	  @abstract  Process a record read by bam_scan_mt(); _off_ is its virtual offset. Return negative to stop with an error
+	 */
+	typedef int (*bam_scan_f)(void *data, const bam1_t *b, uint64_t off);
+
+	/*! @typedef
+	  @abstract  Clear the results of a segment before it is (re)read
+	 */
+	typedef void (*bam_scan_reset_f)(void *data);
+
+	/*!
+	  @abstract Read all records of a BAM on several threads.
+
+	  @discussion The file is cut into segments at BGZF block
+	  boundaries and each segment is read by its own thread, which
+	  finds the first record of its segment by a plausibility check.
+	  A wrong guess is detected from where the previous segment
+	  stopped, and the segment is then reset and read again. Neither
+	  an index nor sorting is required, but the file must end with the
+	  BGZF EOF marker.
+
+	  @param  fn         file name
+	  @param  n_threads  maximum number of segments and threads
+	  @param  func       called on each record; never concurrently for the same segment
+	  @param  reset      called on data[i] before segment i is read; may be NULL
+	  @param  data       data[i] for the i-th segment, in the file order; n_threads elements
+	  @return            number of segments read; 0 if the file cannot be split
+	                     (too small or no EOF marker), or negative on error
+	 */
+	int bam_scan_mt(const char *fn, int n_threads, bam_scan_f func, bam_scan_reset_f reset, void **data);
+
+	/*!
+	  @abstract  Same as bam_scan_mt(), but if _core_only_ is set, only
+	  bam1_t::core of the records is filled; their variable-length data
+	  are skipped without being copied or decoded.
+	 */
+	int bam_scan_mt2(const char *fn, int n_threads, int core_only, bam_scan_f func, bam_scan_reset_f reset, void **data);
+
 	int bam_remove_B(bam1_t *b);
 
 	/*!
@@ -528,6 +600,27 @@ extern "C" {
 
 	const char *bam_get_library(bam_header_t *header, const bam1_t *b);
 
+	/*!
+	  @abstract       Get the dictionary of the header text, parsing it on the first call
+	  @param  header  pointer to the header structure
+	  @return         the dictionary; owned by the header
+
+	  @discussion The dictionary is built in one pass over the text and is
+	  much cheaper than sam_header_parse2() on large headers. It must be
+	  rebuilt by sam_header_parse() after bam_header_t::text is changed.
+	 */
+	sam_hdict_t *bam_header_dict(bam_header_t *header);
+
+	/*!
+	  @abstract       Look up a header value, e.g. the LB of an @RG
+	  @param  header  pointer to the header structure
+	  @param  type    record type: "SQ", "RG" or "PG"
+	  @param  id      SN of an @SQ, or ID of an @RG or @PG
+	  @param  tag     the tag to retrieve
+	  @return         the value; NULL if the record or the tag is absent
+	 */
+	const char *bam_header_get(bam_header_t *header, const char type[2], const char *id, const char tag[2]);
+
 
 	/***************
 	 * pileup APIs *
@@ -576,6 +669,25 @@ extern "C" {
 	void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt);
 	int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp);
 
+	struct __bam_cov_t;
+	typedef struct __bam_cov_t *bam_cov_t;
+
+	/*!
+	  @abstract     Read depth of n inputs without building the pileup
+	  @discussion   bam_cov_auto() gives, at each position covered by some
+	  input, cov[i], the number of reads of the i-th input spanning the
+	  position, which is n_plp[i] of bam_mplp_auto(), and dp[i], the number
+	  of them with a base there of quality at least that set by
+	  bam_cov_set_baseQ(). Reads are filtered and capped as in the pileup.
+	  It returns 1 on a position, 0 at the end and -1 on error; cov and dp
+	  may be NULL.
+	 */
+	bam_cov_t bam_cov_init(int n, bam_plp_auto_f func, void **data);
+	void bam_cov_destroy(bam_cov_t iter);
+	void bam_cov_set_maxcnt(bam_cov_t iter, int maxcnt);
+	void bam_cov_set_baseQ(bam_cov_t iter, int min_baseQ);
+	int bam_cov_auto(bam_cov_t iter, int *_tid, int *_pos, int *cov, int *dp);
+
 	/*! @typedef
 	  @abstract    Type of function to be called by bam_plbuf_push().
 	  @param  tid  chromosome ID as is defined in the header
@@ -631,6 +743,33 @@ extern "C" {
 	 */
 	int bam_index_build(const char *fn);
 
+	/*!
+	  @abstract   Build index for a BAM file with several threads.
+	  @discussion Each thread reads its own part of the file. The
+	  index is identical to the one from bam_index_build(). The file
+	  is read by one thread if it is small, remote or not suitable.
+	  @param  fn         name of the BAM file
+	  @param  fnidx      name of the index file; NULL for "fn.bai"
+	  @param  n_threads  number of threads
+	  @return            0 on success; -1 on error
+	 */
+	int bam_index_build3(const char *fn, const char *fnidx, int n_threads);
+
+	/*!
+	  @abstract   Build a BAI or CSI index for a BAM file.
+	  @discussion A CSI index supports references longer than 512Mbp
+	  and a finer or coarser resolution than BAI. It is written to
+	  "fn.csi" by default and loaded by bam_index_load() when no BAI
+	  is found.
+	  @param  fn         name of the BAM file
+	  @param  fnidx      name of the index file; NULL for "fn.bai" or "fn.csi"
+	  @param  min_shift  the smallest bin spans 2^min_shift bp; 0 for BAI
+	  @param  n_lvls     CSI levels below the root bin; 0 to fit the longest reference
+	  @param  n_threads  number of threads
+	  @return            0 on success; -1 on error
+	 */
+	int bam_index_build4(const char *fn, const char *fnidx, int min_shift, int n_lvls, int n_threads);
+
 	/*!
 	  @abstract   Load index from file "fn.bai".
 	  @param  fn  name of the BAM file (NOT the index file)
@@ -672,6 +811,104 @@ extern "C" {
 	int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b);
 	void bam_iter_destroy(bam_iter_t iter);
 
+	/*! @typedef
+	  @abstract  A region for bam_iter_query_regs(); tid:beg-end, 0-based, half-open
+	 */
+	typedef struct {
+		int tid, beg, end;
+	} bam_region_t;
+
+	/*!
+	  @abstract Iterate over the alignments overlapping any of a list of regions.
+
+	  @discussion The chunks of all regions are merged, so each BGZF
+	  block is read at most once and an alignment overlapping several
+	  regions is returned only once, in the file order. Regions are
+	  sorted internally; those with an invalid tid or no length are
+	  ignored. Read with bam_iter_read(); bam_iter_region() tells which
+	  region the last alignment belongs to.
+
+	  @param  idx   pointer to the alignment index
+	  @param  n     number of regions
+	  @param  regs  the regions
+	  @return       the iterator, to be freed by bam_iter_destroy()
+	 */
+	bam_iter_t bam_iter_query_regs(const bam_index_t *idx, int n, const bam_region_t *regs);
+
+	/*!
+	  @abstract  Index in the list given to bam_iter_query_regs() of the first
+	  region, in the coordinate order, overlapping the alignment last read.
+	 */
+	int bam_iter_region(const bam_iter_t iter);
+
+	/*!
+	  @abstract  Iterate over all records at virtual offsets [beg,end), in the file order.
+	 */
+	bam_iter_t bam_iter_range(uint64_t beg, uint64_t end);
+
+	/*! @typedef
+	  @abstract  A shard of a sorted BAM, from bam_index_shard()
+
+	  @field  tid, beg      where the shard starts; 0-based
+	  @field  tid_end, end  where the next shard starts; INT_MAX on the last reference for the last shard
+	  @field  off, off_end  virtual offsets of the records in the shard; off_end is
+	                        (uint64_t)-1 for the last shard, which also holds the unplaced reads
+	 */
+	typedef struct {
+		int tid, beg, tid_end, end;
+		uint64_t off, off_end;
+	} bam_shard_t;
+
+	/*!
+	  @abstract Split a sorted BAM into shards of about the same compressed size.
+
+	  @discussion The cuts are taken from the linear index, or the bins
+	  for CSI. Positionally the shards tile the references; by
+	  offsets they tile the records, so bam_iter_range(off, off_end)
+	  visits every record exactly once over all shards, while
+	  bam_shard_query() gives the reads overlapping the positions of a
+	  shard.
+
+	  @param  idx       pointer to the alignment index
+	  @param  n         maximum number of shards
+	  @param  off0      virtual offset of the first record, i.e. bam_tell() after the header
+	  @param  n_shards  number of shards returned (out)
+	  @return           the shards in the coordinate order; free() after use
+	 */
+	bam_shard_t *bam_index_shard(const bam_index_t *idx, int n, uint64_t off0, int *n_shards);
+
+	/*!
+	  @abstract  Iterate over the reads overlapping [tid:beg,tid_end:end) of a shard.
+	 */
+	bam_iter_t bam_shard_query(const bam_index_t *idx, const bam_shard_t *s);
+
+	/*! @typedef
+	  @abstract  Process shard _i_ on worker thread _t_ (0 <= t < n_threads); return negative on error
+	 */
+	typedef int (*bam_shard_f)(void *data, int i, int t);
+
+	/*! @typedef
+	  @abstract  Merge the result of shard _i_; called in the shard order, one at a time
+	 */
+	typedef void (*bam_shard_merge_f)(void *data, int i);
+
+	/*!
+	  @abstract Process shards on a pool of threads.
+
+	  @discussion Each worker takes the next unprocessed shard; a worker
+	  should keep its own bamFile, indexed by _t_. The results are merged
+	  in the shard order as soon as all preceding shards are done, so
+	  output can be streamed. No more shards are started after an error.
+
+	  @param  n_threads  number of threads, including the calling one
+	  @param  n_shards   number of shards
+	  @param  func       processes a shard
+	  @param  merge      merges a shard, or NULL
+	  @param  data       passed to func and merge
+	  @return            0 on success, or the first error returned by func
+	 */
+	int bam_shard_run(int n_threads, int n_shards, bam_shard_f func, bam_shard_merge_f merge, void *data);
+
 	/*!
 	  @abstract       Parse a region in the format: "chr2:100,000-200,000".
 	  @discussion     bam_header_t::hash will be initialized if empty.
@@ -743,6 +980,13 @@ extern "C" {
 	*/
 	int32_t bam_cigar2qlen(const bam1_core_t *c, const uint32_t *cigar);
 
+	/*!
+	  @abstract      Recompute the cached CIGAR summary bam1_t::cs
+	  @param  b      pointer to an alignment
+	  @discussion    bam_read1() and sam_read1() call this for every record.
+	*/
+	void bam_cigsum_update(bam1_t *b);
+
 #ifdef __cplusplus
 }
 #endif
@@ -764,6 +1008,26 @@ static inline int bam_reg2bin(uint32_t beg, uint32_t end)
 	return 0;
 }
 
+/*!
+  @abstract  Rightmost coordinate of an alignment, from the cache if available
+  @param  b  pointer to an alignment
+  @return    the same as bam_calend(&b->core, bam1_cigar(b))
+ */
+static inline uint32_t bam1_calend(const bam1_t *b)
+{
+	return b->cs.is_valid? (uint32_t)b->cs.end : bam_calend(&b->core, bam1_cigar(b));
+}
+
+/*!
+  @abstract  Query length of an alignment, from the cache if available
+  @param  b  pointer to an alignment
+  @return    the same as bam_cigar2qlen(&b->core, bam1_cigar(b))
+ */
+static inline int32_t bam1_cigar2qlen(const bam1_t *b)
+{
+	return b->cs.is_valid? b->cs.qlen : bam_cigar2qlen(&b->core, bam1_cigar(b));
+}
+
 /*!
   @abstract     Copy an alignment
   @param  bdst  destination alignment struct
@@ -5,6 +5,10 @@
 #include "bam2bcf.h"
 #include "errmod.h"
 #include "bcftools/bcf.h"
+#include "ksort.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 extern	void ks_introsort_uint32_t(size_t n, uint32_t a[]);
 
@@ -12,9 +16,41 @@ extern	void ks_introsort_uint32_t(size_t n, uint32_t a[]);
 #define CALL_MAX 256
 #define CALL_DEFTHETA 0.83f
 #define DEF_MAPQ 20
+#define CALL_CACHE_SIZE 0x4000
+#define CALL_SIMD_MIN 32
+#define CALL_MVD_SORT_MIN 32
 
 #define CAP_DIST 25
 
+/*
+  bcf_call_glfgen2() reads each pileup record once, into one array per
+  field for all samples of the site. The per-sample sums are then taken
+  over these arrays, with SIMD for samples of many reads. Reads that are
+  not used get zeros, so that they do not contribute.
+ */
+typedef struct {
+	int m;
+	uint8_t *ori, *use, *q, *bq, *mq, *b, *str, *diff, *dist, *alt;
+	int *vpos, *len, *tmp;
+} call_soa_t;
+
+static void call_soa_resize(call_soa_t *a, int n)
+{
+	if (n <= a->m) return;
+	a->m = n; kroundup32(a->m);
+	a->ori = realloc(a->ori, a->m * 10); // ori, use, q, bq, mq, b, str, diff, dist and alt in one block
+	a->use = a->ori + a->m, a->q = a->use + a->m, a->bq = a->q + a->m, a->mq = a->bq + a->m;
+	a->b = a->mq + a->m, a->str = a->b + a->m, a->diff = a->str + a->m, a->dist = a->diff + a->m, a->alt = a->dist + a->m;
+	a->vpos = realloc(a->vpos, a->m * 3 * sizeof(int));
+	a->len = a->vpos + a->m, a->tmp = a->len + a->m;
+}
+
+static void call_soa_destroy(call_soa_t *a)
+{
+	if (a == 0) return;
+	free(a->ori); free(a->vpos); free(a);
+}
+
 bcf_callaux_t *bcf_call_init(double theta, int min_baseQ)
 {
 	bcf_callaux_t *bca;
@@ -24,111 +60,236 @@ bcf_callaux_t *bcf_call_init(double theta, int min_baseQ)
 	bca->openQ = 40; bca->extQ = 20; bca->tandemQ = 100;
 	bca->min_baseQ = min_baseQ;
 	bca->e = errmod_init(1. - theta);
+	bca->ec = errmod_cache_init(CALL_CACHE_SIZE);
 	bca->min_frac = 0.002;
 	bca->min_support = 1;
 	return bca;
 }
 
+/* Seed the sampling of bases at deep sites from the site alone, so that
+ * the calls at a site are the same whichever thread or shard makes them. */
+void bcf_call_seed(bcf_callaux_t *bca, int tid, int pos)
+{
+	uint32_t seed = (uint32_t)pos ^ (uint32_t)tid * 0x9e3779b1u;
+	bca->rand48[0] = 0x330e; bca->rand48[1] = seed & 0xffff; bca->rand48[2] = seed >> 16;
+}
+
 void bcf_call_destroy(bcf_callaux_t *bca)
 {
 	if (bca == 0) return;
-	errmod_destroy(bca->e);
-	free(bca->bases); free(bca->inscns); free(bca);
+	errmod_destroy(bca->e); errmod_cache_destroy(bca->ec); call_soa_destroy((call_soa_t*)bca->soa);
+	free(bca->bases); free(bca->inscns); free(bca->var_pos); free(bca);
 }
+
+KSORT_INIT(callpos, int, ks_lt_generic)
+
+static inline void call_gather1(const bcf_callaux_t *bca, const bam_pileup1_t *p, int ref_base, int ref4, int is_indel, call_soa_t *a, int k)
+{
+	const bam1_t *b = p->b;
+	uint32_t c0 = bam1_cigar(b)[0];
+	int q, x, mapQ, baseQ, is_diff, min_dist, seqQ;
+	// for the variant distance bias, from all reads
+	a->alt[k] = bam1_seqi(bam1_seq(b), p->qpos) != ref_base;
+	a->vpos[k] = p->qpos - ((c0&BAM_CIGAR_MASK) == 4? c0>>BAM_CIGAR_SHIFT : 0);
+	a->len[k] = b->core.l_qseq;
+	if (p->is_del || p->is_refskip || (b->core.flag&BAM_FUNMAP)) {
+		a->ori[k] = 0;
+		goto skip;
+	}
+	a->ori[k] = 1;
+	baseQ = q = is_indel? p->aux&0xff : (int)bam1_qual(b)[p->qpos]; // base/indel quality
+	seqQ = is_indel? (p->aux>>8&0xff) : 99;
+	if (q < bca->min_baseQ) goto skip;
+	if (q > seqQ) q = seqQ;
+	mapQ = b->core.qual < 255? b->core.qual : DEF_MAPQ; // special case for mapQ==255
+	mapQ = mapQ < bca->capQ? mapQ : bca->capQ;
+	if (q > mapQ) q = mapQ;
+	if (q > 63) q = 63;
+	if (q < 4) q = 4;
+	if (!is_indel) {
+		x = bam1_seqi(bam1_seq(b), p->qpos); // base
+		x = bam_nt16_nt4_table[x? x : ref_base]; // x is the 2-bit base
+		is_diff = (ref4 < 4 && x == ref4)? 0 : 1;
+	} else {
+		x = p->aux>>16&0x3f;
+		is_diff = (x != 0);
+	}
+	min_dist = b->core.l_qseq - 1 - p->qpos;
+	if (min_dist > p->qpos) min_dist = p->qpos;
+	if (min_dist > CAP_DIST) min_dist = CAP_DIST;
+	a->use[k] = 1, a->q[k] = q, a->bq[k] = baseQ, a->mq[k] = mapQ;
+	a->b[k] = x, a->str[k] = bam1_strand(b), a->diff[k] = is_diff, a->dist[k] = min_dist;
+	return;
+skip:
+	a->use[k] = a->q[k] = a->bq[k] = a->mq[k] = a->b[k] = a->str[k] = a->diff[k] = a->dist[k] = 0;
+}
+
+// the sum of x[j] & y[j], for bytes of 0 or 1
+static inline int call_bsum(int n, const uint8_t *x, const uint8_t *y)
+{
+	int j = 0, s = 0;
+#ifdef __SSE2__
+	if (n >= 16) {
+		__m128i acc = _mm_setzero_si128(), z = _mm_setzero_si128();
+		for (; j + 16 <= n; j += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(x + j));
+			if (y) v = _mm_and_si128(v, _mm_loadu_si128((const __m128i*)(y + j)));
+			acc = _mm_add_epi64(acc, _mm_sad_epu8(v, z));
+		}
+		s = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+	}
+#endif
+	for (; j < n; ++j) s += y? x[j] & y[j] : x[j];
+	return s;
+}
+
+// the sums of x and x*x over all reads, and over reads with d set
+static inline void call_sum2(int n, const uint8_t *x, const uint8_t *d, int *anno)
+{
+	int j = 0, s = 0, sd = 0, s2 = 0, s2d = 0;
+#ifdef __SSE2__
+	if (n >= 16) {
+		__m128i z = _mm_setzero_si128(), one = _mm_set1_epi16(1), vs = z, vsd = z, vs2 = z, vs2d = z;
+		int32_t u[16];
+		for (; j + 16 <= n; j += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(x + j)), m = _mm_sub_epi8(z, _mm_loadu_si128((const __m128i*)(d + j)));
+			__m128i vm = _mm_and_si128(v, m), lo = _mm_unpacklo_epi8(v, z), hi = _mm_unpackhi_epi8(v, z);
+			__m128i lom = _mm_unpacklo_epi8(vm, z), him = _mm_unpackhi_epi8(vm, z);
+			vs = _mm_add_epi32(vs, _mm_add_epi32(_mm_madd_epi16(lo, one), _mm_madd_epi16(hi, one)));
+			vs2 = _mm_add_epi32(vs2, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+			vsd = _mm_add_epi32(vsd, _mm_add_epi32(_mm_madd_epi16(lom, one), _mm_madd_epi16(him, one)));
+			vs2d = _mm_add_epi32(vs2d, _mm_add_epi32(_mm_madd_epi16(lom, lom), _mm_madd_epi16(him, him)));
+		}
+		_mm_storeu_si128((__m128i*)u, vs); _mm_storeu_si128((__m128i*)(u + 4), vs2);
+		_mm_storeu_si128((__m128i*)(u + 8), vsd); _mm_storeu_si128((__m128i*)(u + 12), vs2d);
+		s = u[0] + u[1] + u[2] + u[3], s2 = u[4] + u[5] + u[6] + u[7];
+		sd = u[8] + u[9] + u[10] + u[11], s2d = u[12] + u[13] + u[14] + u[15];
+	}
+#endif
+	for (; j < n; ++j) {
+		int y = x[j];
+		s += y, s2 += y * y;
+		if (d[j]) sd += y, s2d += y * y;
+	}
+	anno[0] = s - sd, anno[1] = s2 - s2d; // is_diff == 0
+	anno[2] = sd, anno[3] = s2d; // is_diff == 1
+}
+
+/*
+  The mean distance between the variant positions, as the float sum of
+  their pairwise distances divided by the number of pairs. While the sum
+  is below 2^24, each partial sum is exact in a float, so the sum taken
+  in O(n log n) from the sorted positions is the same number; otherwise
+  the pairs are added in the original order, for the same rounding.
+ */
+static float call_mvd(int n, const int *pos, int *tmp)
+{
+	int64_t sum = 0;
+	float mvd = 0;
+	int i, j, n_pairs = (int)((int64_t)n * (n - 1) / 2);
+	if (n_pairs == 0) return 0;
+	if (n < CALL_MVD_SORT_MIN) goto add_pairs;
+	memcpy(tmp, pos, n * sizeof(int));
+	ks_introsort(callpos, n, tmp);
+	for (i = 0; i < n; ++i) sum += (int64_t)tmp[i] * (2 * i - n + 1);
+	if (sum < 1<<24) return (float)sum / n_pairs;
+add_pairs:
+	for (i = 0; i < n; ++i)
+		for (j = 0; j < i; ++j)
+			mvd += abs(pos[i] - pos[j]);
+	return mvd / n_pairs;
+}
+
+// the per-sample results from the reads [k,k+_n) of the arrays
+static void call_sample(bcf_callaux_t *bca, int _n, call_soa_t *a, int k, bcf_callret1_t *r)
+{
+	const uint8_t *use = a->use + k, *q = a->q + k, *b = a->b + k, *str = a->str + k, *diff = a->diff + k, *ori = a->ori + k, *alt = a->alt + k;
+	int i, n, ori_depth, n_s, n_ds, alt_dp, read_len;
+	memset(r, 0, sizeof(bcf_callret1_t));
+	if (_n == 0) return;
+	if (_n >= CALL_SIMD_MIN) { // counts, then the baseQ, mapQ and min_dist sums at anno[x<<2|is_diff<<1|squared]
+		n = call_bsum(_n, use, 0), ori_depth = call_bsum(_n, ori, 0), r->n_supp = call_bsum(_n, diff, 0);
+		n_s = call_bsum(_n, str, 0), n_ds = call_bsum(_n, diff, str);
+		r->anno[0] = n - r->n_supp - n_s + n_ds; // ref, forward
+		r->anno[1] = n_s - n_ds; // ref, reverse
+		r->anno[2] = r->n_supp - n_ds; // non-ref, forward
+		r->anno[3] = n_ds; // non-ref, reverse
+		call_sum2(_n, a->bq + k, diff, r->anno + (1<<2));
+		call_sum2(_n, a->mq + k, diff, r->anno + (2<<2));
+		call_sum2(_n, a->dist + k, diff, r->anno + (3<<2));
+	} else { // too few reads for SIMD to pay off; the same in one pass
+		const uint8_t *bq = a->bq + k, *mq = a->mq + k, *dist = a->dist + k;
+		for (i = ori_depth = 0; i < _n; ++i) {
+			int d = diff[i]<<1;
+			ori_depth += ori[i];
+			if (!use[i]) continue;
+			r->n_supp += diff[i];
+			++r->anno[0<<2|d|str[i]];
+			r->anno[1<<2|d|0] += bq[i], r->anno[1<<2|d|1] += bq[i] * bq[i];
+			r->anno[2<<2|d|0] += mq[i], r->anno[2<<2|d|1] += mq[i] * mq[i];
+			r->anno[3<<2|d|0] += dist[i], r->anno[3<<2|d|1] += dist[i] * dist[i];
+		}
+	}
+	// base sums and the bases for errmod
+	for (i = n = 0; i < _n; ++i) {
+		if (!use[i]) continue;
+		if (b[i] < 4) r->qsum[b[i]] += q[i];
+		bca->bases[n++] = q[i]<<5 | str[i]<<4 | b[i];
+	}
+	r->depth = n; r->ori_depth = ori_depth;
+	// glfgen
+	errmod_cal2(bca->e, bca->ec, bca->rand48, n, 5, bca->bases, r->p);
+	// Calculate the Variant Distance Bias (make it optional?)
+	for (i = alt_dp = read_len = 0; i < _n; ++i) {
+		if (!alt[i]) continue;
+		bca->var_pos[alt_dp++] = a->vpos[k + i];
+		read_len += a->len[k + i];
+	}
+	r->mvd[0] = call_mvd(alt_dp, bca->var_pos, a->tmp);
+	r->mvd[1] = alt_dp;
+	r->mvd[2] = alt_dp ? read_len/alt_dp : 0;
+}
+
 /* ref_base is the 4-bit representation of the reference base. It is
  * negative if we are looking at an indel. */
-int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r)
+int bcf_call_glfgen2(int n, const int *n_plp, bam_pileup1_t * const *plp, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r)
 {
-    static int *var_pos = NULL, nvar_pos = 0;
-	int i, n, ref4, is_indel, ori_depth = 0;
-	memset(r, 0, sizeof(bcf_callret1_t));
+	int i, s, k, N, max_n, ref4, is_indel;
+	call_soa_t *a;
 	if (ref_base >= 0) {
 		ref4 = bam_nt16_nt4_table[ref_base];
 		is_indel = 0;
 	} else ref4 = 4, is_indel = 1;
-	if (_n == 0) return -1;
-	// enlarge the bases array if necessary
-	if (bca->max_bases < _n) {
-		bca->max_bases = _n;
+	for (s = N = max_n = 0; s < n; ++s) {
+		N += n_plp[s];
+		if (n_plp[s] > max_n) max_n = n_plp[s];
+	}
+	// enlarge the arrays if necessary
+	if (bca->soa == 0) bca->soa = calloc(1, sizeof(call_soa_t));
+	a = (call_soa_t*)bca->soa;
+	call_soa_resize(a, N);
+	if (bca->max_bases < max_n) {
+		bca->max_bases = max_n;
 		kroundup32(bca->max_bases);
 		bca->bases = (uint16_t*)realloc(bca->bases, 2 * bca->max_bases);
 	}
-	// fill the bases array
-	memset(r, 0, sizeof(bcf_callret1_t));
-	for (i = n = r->n_supp = 0; i < _n; ++i) {
-		const bam_pileup1_t *p = pl + i;
-		int q, b, mapQ, baseQ, is_diff, min_dist, seqQ;
-		// set base
-		if (p->is_del || p->is_refskip || (p->b->core.flag&BAM_FUNMAP)) continue;
-		++ori_depth;
-		baseQ = q = is_indel? p->aux&0xff : (int)bam1_qual(p->b)[p->qpos]; // base/indel quality
-		seqQ = is_indel? (p->aux>>8&0xff) : 99;
-		if (q < bca->min_baseQ) continue;
-		if (q > seqQ) q = seqQ;
-		mapQ = p->b->core.qual < 255? p->b->core.qual : DEF_MAPQ; // special case for mapQ==255
-		mapQ = mapQ < bca->capQ? mapQ : bca->capQ;
-		if (q > mapQ) q = mapQ;
-		if (q > 63) q = 63;
-		if (q < 4) q = 4;
-		if (!is_indel) {
-			b = bam1_seqi(bam1_seq(p->b), p->qpos); // base
-			b = bam_nt16_nt4_table[b? b : ref_base]; // b is the 2-bit base
-			is_diff = (ref4 < 4 && b == ref4)? 0 : 1;
-		} else {
-			b = p->aux>>16&0x3f;
-			is_diff = (b != 0);
-		}
-		if (is_diff) ++r->n_supp;
-		bca->bases[n++] = q<<5 | (int)bam1_strand(p->b)<<4 | b;
-		// collect annotations
-		if (b < 4) r->qsum[b] += q;
-		++r->anno[0<<2|is_diff<<1|bam1_strand(p->b)];
-		min_dist = p->b->core.l_qseq - 1 - p->qpos;
-		if (min_dist > p->qpos) min_dist = p->qpos;
-		if (min_dist > CAP_DIST) min_dist = CAP_DIST;
-		r->anno[1<<2|is_diff<<1|0] += baseQ;
-		r->anno[1<<2|is_diff<<1|1] += baseQ * baseQ;
-		r->anno[2<<2|is_diff<<1|0] += mapQ;
-		r->anno[2<<2|is_diff<<1|1] += mapQ * mapQ;
-		r->anno[3<<2|is_diff<<1|0] += min_dist;
-		r->anno[3<<2|is_diff<<1|1] += min_dist * min_dist;
+	if (bca->nvar_pos < max_n) {
+		bca->nvar_pos = max_n;
+		bca->var_pos = realloc(bca->var_pos, sizeof(int) * bca->nvar_pos);
 	}
-	r->depth = n; r->ori_depth = ori_depth;
-	// glfgen
-	errmod_cal(bca->e, n, 5, bca->bases, r->p);
-
-    // Calculate the Variant Distance Bias (make it optional?)
-    if ( nvar_pos < _n ) {
-        nvar_pos = _n;
-        var_pos = realloc(var_pos,sizeof(int)*nvar_pos);
-    }
-    int alt_dp=0, read_len=0;
-    for (i=0; i<_n; i++) {
-        const bam_pileup1_t *p = pl + i;
-        if ( bam1_seqi(bam1_seq(p->b),p->qpos) == ref_base ) 
-            continue;
-
-        var_pos[alt_dp] = p->qpos;
-        if ( (bam1_cigar(p->b)[0]&BAM_CIGAR_MASK)==4 )
-            var_pos[alt_dp] -= bam1_cigar(p->b)[0]>>BAM_CIGAR_SHIFT;
-
-        alt_dp++;
-        read_len += p->b->core.l_qseq;
-    }
-    float mvd=0;
-    int j;
-    n=0;
-    for (i=0; i<alt_dp; i++) {
-        for (j=0; j<i; j++) {
-            mvd += abs(var_pos[i] - var_pos[j]);
-            n++;
-        }
-    }
-    r->mvd[0] = n ? mvd/n : 0;
-    r->mvd[1] = alt_dp;
-    r->mvd[2] = alt_dp ? read_len/alt_dp : 0;
+	for (s = k = 0; s < n; ++s)
+		for (i = 0; i < n_plp[s]; ++i, ++k)
+			call_gather1(bca, plp[s] + i, ref_base, ref4, is_indel, a, k);
+	for (s = k = 0; s < n; k += n_plp[s++])
+		call_sample(bca, n_plp[s], a, k, r + s);
+	return 0;
+}
 
-	return r->depth;
+int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r)
+{
+	bam_pileup1_t *p = (bam_pileup1_t*)pl;
+	bcf_call_glfgen2(1, &_n, &p, ref_base, bca, r);
+	return _n? r->depth : -1;
 }
 
 
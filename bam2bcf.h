@@ -16,13 +16,18 @@ typedef struct __bcf_callaux_t {
 	int openQ, extQ, tandemQ; // for indels
 	int min_support; // for collecting indel candidates
 	double min_frac; // for collecting indel candidates
+	int n_threads; // for indel realignment
 	// for internal uses
 	int max_bases;
 	int indel_types[4];
 	int maxins, indelreg;
 	char *inscns;
 	uint16_t *bases;
+	int nvar_pos, *var_pos; // read positions of the variant bases
+	void *soa; // per-read arrays of bcf_call_glfgen2()
 	errmod_t *e;
+	errmod_cache_t *ec; // likelihoods of recently seen multisets of bases
+	unsigned short rand48[3]; // erand48() state for errmod_cal2(); see bcf_call_seed()
 	void *rghash;
 } bcf_callaux_t;
 
@@ -48,7 +53,9 @@ extern "C" {
 
 	bcf_callaux_t *bcf_call_init(double theta, int min_baseQ);
 	void bcf_call_destroy(bcf_callaux_t *bca);
+	void bcf_call_seed(bcf_callaux_t *bca, int tid, int pos);
 	int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r);
+	int bcf_call_glfgen2(int n, const int *n_plp, bam_pileup1_t * const *plp, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r);
 	int bcf_call_combine(int n, const bcf_callret1_t *calls, int ref_base /*4-bit*/, bcf_call_t *call);
 	int bcf_call2bcf(int tid, int pos, bcf_call_t *bc, bcf1_t *b, bcf_callret1_t *bcr, int fmt_flag,
 					 const bcf_callaux_t *bca, const char *ref);
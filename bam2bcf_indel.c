@@ -8,9 +8,13 @@
 #include "khash.h"
 KHASH_SET_INIT_STR(rg)
 
+KHASH_MAP_INIT_INT64(gap, int)
+
 #include "ksort.h"
 KSORT_INIT_GENERIC(uint32_t)
 
+#include "kstring.h"
+
 #define MINUS_CONST 0x10000000
 #define INDEL_WINDOW_SIZE 50
 
@@ -109,12 +113,110 @@ static inline int est_indelreg(int pos, const char *ref, int l, char *ins4)
 	return max_i - pos;
 }
 
+/*
+  Realignment of one read against one candidate haplotype. The sequences
+  are gathered first, so that the kpa_glocal() calls, the bottleneck, can
+  run on threads. A read whose segment, qualities and haplotype segment
+  are the same as those of an earlier job takes the scores of that job.
+ */
+typedef struct {
+	int K, t, rep; // read, type, and the job scored in place of this one
+	int r, lr, q, lq; // haplotype segment in gap_aux_t::ref; query, then qualities, in gap_aux_t::seq
+	int sc1, sc2;
+} gap_job_t;
+
+typedef struct {
+	int n_jobs, m_jobs, n_rep, *rep, n_shards;
+	gap_job_t *jobs;
+	const int *types;
+	kstring_t ref, seq;
+} gap_aux_t;
+
+#define GAP_MIN_MT_JOBS 64
+
+static int gap_job_eq(const gap_aux_t *a, const gap_job_t *x, const gap_job_t *y)
+{
+	return x->lr == y->lr && x->lq == y->lq && abs(a->types[x->t]) == abs(a->types[y->t])
+		&& memcmp(a->ref.s + x->r, a->ref.s + y->r, x->lr) == 0
+		&& memcmp(a->seq.s + x->q, a->seq.s + y->q, x->lq * 2) == 0;
+}
+
+static uint64_t gap_job_hash(const gap_aux_t *a, const gap_job_t *x)
+{
+	uint64_t h = (uint64_t)abs(a->types[x->t])<<32 ^ x->lq;
+	int i;
+	for (i = 0; i < x->lr; ++i) h = (h << 5) - h + a->ref.s[x->r + i];
+	for (i = 0; i < x->lq * 2; ++i) h = (h << 5) - h + a->seq.s[x->q + i];
+	return h;
+}
+
+// score1 with apf1, and score2 with apf2 if the first alignment is poor
+static void gap_job_score(const gap_aux_t *a, gap_job_t *x)
+{
+	const uint8_t *ref = (const uint8_t*)a->ref.s + x->r, *query = (const uint8_t*)a->seq.s + x->q;
+	kpa_par_t apf1 = { 1e-4, 1e-2, 10 }, apf2 = { 1e-6, 1e-3, 10 };
+	int sc, l;
+	apf1.bw = apf2.bw = abs(a->types[x->t]) + 3;
+	sc = kpa_glocal(ref, x->lr, query, x->lq, query + x->lq, &apf1, 0, 0);
+	l = (int)(100. * sc / x->lq + .499); // used for adjusting indelQ below
+	if (l > 255) l = 255;
+	x->sc1 = x->sc2 = sc<<8 | l;
+	if (sc > 5) {
+		sc = kpa_glocal(ref, x->lr, query, x->lq, query + x->lq, &apf2, 0, 0);
+		l = (int)(100. * sc / x->lq + .499);
+		if (l > 255) l = 255;
+		x->sc2 = sc<<8 | l;
+	}
+}
+
+static int gap_shard(void *data, int i, int t)
+{
+	gap_aux_t *a = (gap_aux_t*)data;
+	int k, end = (int)((int64_t)a->n_rep * (i + 1) / a->n_shards);
+	for (k = (int)((int64_t)a->n_rep * i / a->n_shards); k < end; ++k)
+		gap_job_score(a, &a->jobs[a->rep[k]]);
+	return 0;
+}
+
+// score all jobs on _n_threads_ threads, each distinct job once
+static void gap_run(gap_aux_t *a, int n_threads)
+{
+	khash_t(gap) *h = kh_init(gap);
+	int i, j, absent;
+	a->rep = malloc((a->n_jobs + 1) * sizeof(int));
+	for (i = a->n_rep = 0; i < a->n_jobs; ++i) {
+		gap_job_t *x = &a->jobs[i];
+		khint_t k = kh_put(gap, h, gap_job_hash(a, x), &absent);
+		if (absent) kh_val(h, k) = i;
+		else if (gap_job_eq(a, x, &a->jobs[kh_val(h, k)])) {
+			x->rep = kh_val(h, k);
+			continue;
+		}
+		x->rep = i, a->rep[a->n_rep++] = i; // a new job, or a hash collision that is scored on its own
+	}
+	kh_destroy(gap, h);
+	if (n_threads > 1 && a->n_rep >= GAP_MIN_MT_JOBS) {
+		a->n_shards = a->n_rep < n_threads * 8? a->n_rep : n_threads * 8;
+		bam_shard_run(n_threads, a->n_shards, gap_shard, 0, a);
+	} else {
+		a->n_shards = 1;
+		gap_shard(a, 0, 0);
+	}
+	for (j = 0; j < a->n_jobs; ++j) {
+		gap_job_t *x = &a->jobs[j];
+		if (x->rep != j) x->sc1 = a->jobs[x->rep].sc1, x->sc2 = a->jobs[x->rep].sc2;
+	}
+	free(a->rep);
+}
+
 int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_callaux_t *bca, const char *ref,
 					  const void *rghash)
 {
 	int i, s, j, k, t, n_types, *types, max_rd_len, left, right, max_ins, *score1, *score2, max_ref2;
-	int N, K, l_run, ref_type, n_alt;
-	char *inscns = 0, *ref2, *query, **ref_sample;
+	int N, K, l_run, ref_type, n_alt, *qlast;
+	char *inscns = 0, *ref2, **ref_sample;
+	uint8_t *query;
+	gap_aux_t ga;
 	khash_t(rg) *hash = (khash_t(rg)*)rghash;
 	if (ref == 0 || bca == 0) return -1;
 	// mark filtered reads
@@ -157,7 +259,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 						aux[m++] = MINUS_CONST + p->indel;
 					}
 				}
-				j = bam_cigar2qlen(&p->b->core, bam1_cigar(p->b));
+				j = bam1_cigar2qlen(p->b);
 				if (j > max_rd_len) max_rd_len = j;
 			}
 		}
@@ -300,14 +402,15 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 	// compute the likelihood given each type of indel for each read
 	max_ref2 = right - left + 2 + 2 * (max_ins > -types[0]? max_ins : -types[0]);
 	ref2  = calloc(max_ref2, 1);
-	query = calloc(right - left + max_rd_len + max_ins + 2, 1);
 	score1 = calloc(N * n_types, sizeof(int));
 	score2 = calloc(N * n_types, sizeof(int));
+	memset(&ga, 0, sizeof(gap_aux_t));
+	ga.types = types;
+	qlast = malloc(N * 3 * sizeof(int));
+	for (K = 0; K < N; ++K) qlast[K*3] = -1;
 	bca->indelreg = 0;
 	for (t = 0; t < n_types; ++t) {
 		int l, ir;
-		kpa_par_t apf1 = { 1e-4, 1e-2, 10 }, apf2 = { 1e-6, 1e-3, 10 };
-		apf1.bw = apf2.bw = abs(types[t]) + 3;
 		// compute indelreg
 		if (types[t] == 0) ir = 0;
 		else if (types[t] > 0) ir = est_indelreg(pos, ref, types[t], &inscns[t*max_ins]);
@@ -316,6 +419,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 //		fprintf(stderr, "%d, %d, %d\n", pos, types[t], ir);
 		// realignment
 		for (s = K = 0; s < n; ++s) {
+			int r0 = ga.ref.l;
 			// write ref2
 			for (k = 0, j = left; j <= pos; ++j)
 				ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
@@ -326,12 +430,14 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 				ref2[k++] = bam_nt16_nt4_table[(int)ref_sample[s][j-left]];
 			for (; k < max_ref2; ++k) ref2[k] = 4;
 			if (j < right) right = j;
+			if (n_plp[s]) kputsn(ref2, max_ref2, &ga.ref);
 			// align each read to ref2
 			for (i = 0; i < n_plp[s]; ++i, ++K) {
 				bam_pileup1_t *p = plp[s] + i;
-				int qbeg, qend, tbeg, tend, sc, kk;
+				int qbeg, qend, tbeg, tend, kk;
 				uint8_t *seq = bam1_seq(p->b);
 				uint32_t *cigar = bam1_cigar(p->b);
+				gap_job_t *x;
 				if (p->b->core.flag&4) continue; // unmapped reads
 				// FIXME: the following loop should be better moved outside; nonetheless, realignment should be much slower anyway.
 				for (kk = 0; kk < p->b->core.n_cigar; ++kk)
@@ -345,13 +451,27 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 					int l = -types[t];
 					tbeg = tbeg - l > left?  tbeg - l : left;
 				}
+				if (ga.n_jobs == ga.m_jobs) {
+					ga.m_jobs = ga.m_jobs? ga.m_jobs<<1 : 256;
+					ga.jobs = realloc(ga.jobs, ga.m_jobs * sizeof(gap_job_t));
+				}
+				x = &ga.jobs[ga.n_jobs++];
+				x->K = K, x->t = t;
+				x->r = r0 + tbeg - left, x->lr = tend - tbeg + abs(types[t]);
+				x->lq = qend - qbeg;
+				if (qlast[K*3] == qbeg && qlast[K*3+1] == qend) { // the same segment as for the previous type
+					x->q = qlast[K*3+2];
+					continue;
+				}
+				qlast[K*3] = qbeg, qlast[K*3+1] = qend, qlast[K*3+2] = x->q = ga.seq.l;
 				// write the query sequence
+				ks_resize(&ga.seq, ga.seq.l + x->lq * 2 + 1);
+				query = (uint8_t*)ga.seq.s + x->q;
 				for (l = qbeg; l < qend; ++l)
 					query[l - qbeg] = bam_nt16_nt4_table[bam1_seqi(seq, l)];
-				{ // do realignment; this is the bottleneck
+				{ // and the qualities
 					const uint8_t *qual = bam1_qual(p->b), *bq;
-					uint8_t *qq;
-					qq = calloc(qend - qbeg, 1);
+					uint8_t *qq = query + x->lq;
 					bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
 					if (bq) ++bq; // skip type
 					for (l = qbeg; l < qend; ++l) {
@@ -359,32 +479,19 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 						if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
 						if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
 					}
-					sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-									(uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
-					l = (int)(100. * sc / (qend - qbeg) + .499); // used for adjusting indelQ below
-					if (l > 255) l = 255;
-					score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
-					if (sc > 5) {
-						sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-										(uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
-						l = (int)(100. * sc / (qend - qbeg) + .499);
-						if (l > 255) l = 255;
-						score2[K*n_types + t] = sc<<8 | l;
-					}
-					free(qq);
 				}
-/*
-				for (l = 0; l < tend - tbeg + abs(types[t]); ++l)
-					fputc("ACGTN"[(int)ref2[tbeg-left+l]], stderr);
-				fputc('\n', stderr);
-				for (l = 0; l < qend - qbeg; ++l) fputc("ACGTN"[(int)query[l]], stderr);
-				fputc('\n', stderr);
-				fprintf(stderr, "pos=%d type=%d read=%d:%d name=%s qbeg=%d tbeg=%d score=%d\n", pos, types[t], s, i, bam1_qname(p->b), qbeg, tbeg, sc);
-*/
+				ga.seq.l += x->lq * 2;
 			}
 		}
 	}
-	free(ref2); free(query);
+	gap_run(&ga, bca->n_threads); // do realignment; this is the bottleneck
+	for (j = 0; j < ga.n_jobs; ++j) {
+		gap_job_t *x = &ga.jobs[j];
+		score1[x->K*n_types + x->t] = x->sc1;
+		score2[x->K*n_types + x->t] = x->sc2;
+	}
+	free(ga.jobs); free(ga.ref.s); free(ga.seq.s); free(qlast);
+	free(ref2);
 	{ // compute indelQ
 		int *sc, tmp, *sumq;
 		sc   = alloca(n_types * sizeof(int));
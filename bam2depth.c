@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include "bam.h"
+#include "kstring.h"
 
 typedef struct {     // auxiliary data structure
 	bamFile fp;      // the file handler
@@ -19,6 +20,8 @@ typedef struct {     // auxiliary data structure
 void *bed_read(const char *fn); // read a BED or position list file
 void bed_destroy(void *_h);     // destroy the BED data structure
 int bed_overlap(const void *_h, const char *chr, int beg, int end); // test if chr:beg-end overlaps
+bam_region_t *bed_regions(const void *_h, const bam_header_t *header, int *n); // BED regions as a list
+bam_index_t *bam_index_load_local(const char *fn); // load the index; quietly return NULL if absent
 
 // This function reads a BAM alignment from one BAM file.
 static int read_bam(void *data, bam1_t *b) // read level filters better go here to avoid pileup
@@ -27,11 +30,103 @@ static int read_bam(void *data, bam1_t *b) // read level filters better go here
 	int ret = aux->iter? bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
 	if (!(b->core.flag&BAM_FUNMAP)) {
 		if ((int)b->core.qual < aux->min_mapQ) b->core.flag |= BAM_FUNMAP;
-		else if (aux->min_len && bam_cigar2qlen(&b->core, bam1_cigar(b)) < aux->min_len) b->core.flag |= BAM_FUNMAP;
+		else if (aux->min_len && bam1_cigar2qlen(b) < aux->min_len) b->core.flag |= BAM_FUNMAP;
 	}
 	return ret;
 }
 
+typedef struct {     // for computing the depth shard by shard
+	int n, baseQ, mapQ, min_len, max_depth, end;
+	char **fn;       // the BAMs
+	bam_index_t **idx;
+	const bam_header_t *h;
+	void *bed;
+	bam_shard_t *shards;
+	aux_t **data;    // data[t*n+i] for the i-th BAM on the t-th thread
+	kstring_t *out;  // output of each shard
+} depth_shard_t;
+
+static int depth_shard(void *_d, int k, int t)
+{
+	depth_shard_t *d = (depth_shard_t*)_d;
+	const bam_shard_t *s = &d->shards[k];
+	aux_t **data = d->data + t * d->n;
+	kstring_t *out = &d->out[k];
+	int i, tid, pos, *dp;
+	bam_cov_t it;
+	for (i = 0; i < d->n; ++i) {
+		if (data[i] == 0) { // the first shard on this thread; open the BAMs
+			data[i] = calloc(1, sizeof(aux_t));
+			if ((data[i]->fp = bam_open(d->fn[i], "r")) == 0) return -1;
+			bam_header_destroy(bam_header_read(data[i]->fp));
+			data[i]->min_mapQ = d->mapQ, data[i]->min_len = d->min_len;
+		}
+		data[i]->iter = bam_shard_query(d->idx[i], s);
+	}
+	it = bam_cov_init(d->n, read_bam, (void**)data);
+	if (0 < d->max_depth) bam_cov_set_maxcnt(it, d->max_depth);
+	bam_cov_set_baseQ(it, d->baseQ);
+	dp = calloc(d->n, sizeof(int));
+	while (bam_cov_auto(it, &tid, &pos, 0, dp) > 0) {
+		if (tid < s->tid || (tid == s->tid && pos < s->beg)) continue; // before the shard
+		if (tid > s->tid_end || (tid == s->tid_end && pos >= s->end)) break; // in the next shard
+		if (pos >= d->end) continue; // same as the default region
+		if (d->bed && bed_overlap(d->bed, d->h->target_name[tid], pos, pos + 1) == 0) continue;
+		kputs(d->h->target_name[tid], out); kputc('\t', out); kputw(pos + 1, out);
+		for (i = 0; i < d->n; ++i) {
+			kputc('\t', out); kputw(dp[i], out);
+		}
+		kputc('\n', out);
+	}
+	bam_cov_destroy(it);
+	free(dp);
+	for (i = 0; i < d->n; ++i) {
+		bam_iter_destroy(data[i]->iter);
+		data[i]->iter = 0;
+	}
+	return 0;
+}
+
+static void depth_merge(void *_d, int k)
+{
+	depth_shard_t *d = (depth_shard_t*)_d;
+	if (d->out[k].l) fwrite(d->out[k].s, 1, d->out[k].l, stdout);
+	free(d->out[k].s);
+	d->out[k].s = 0;
+}
+
+// compute the depth on n_threads threads; return -1 if some BAM is not indexed
+static int depth_mt(int n, char **fn, const bam_header_t *h, void *bed, int baseQ, int mapQ, int min_len, int max_depth, int end, int n_threads)
+{
+	extern bam_index_t *bam_index_load_local(const char *fn);
+	depth_shard_t d;
+	int i, n_shards, ret = 0;
+	memset(&d, 0, sizeof(depth_shard_t));
+	d.n = n, d.fn = fn, d.h = h, d.bed = bed;
+	d.baseQ = baseQ, d.mapQ = mapQ, d.min_len = min_len, d.max_depth = max_depth, d.end = end;
+	d.idx = calloc(n, sizeof(void*));
+	for (i = 0; i < n; ++i)
+		if ((d.idx[i] = bam_index_load_local(fn[i])) == 0) ret = -1;
+	if (ret == 0) {
+		// shard by the 1st BAM; shards are positional, so they apply to all
+		d.shards = bam_index_shard(d.idx[0], n_threads * 16, 0, &n_shards);
+		d.data = calloc(n_threads * n, sizeof(void*));
+		d.out = calloc(n_shards, sizeof(kstring_t));
+		if (bam_shard_run(n_threads, n_shards, depth_shard, depth_merge, &d) < 0)
+			fprintf(stderr, "[depth_mt] fail to read the input.\n");
+		for (i = 0; i < n_threads * n; ++i) {
+			if (d.data[i] == 0) continue;
+			if (d.data[i]->fp) bam_close(d.data[i]->fp);
+			free(d.data[i]);
+		}
+		for (i = 0; i < n_shards; ++i) free(d.out[i].s);
+		free(d.data); free(d.out); free(d.shards);
+	}
+	for (i = 0; i < n; ++i) bam_index_destroy(d.idx[i]);
+	free(d.idx);
+	return ret;
+}
+
 typedef struct {
     int32_t bin;
     int32_t bin_idx;
@@ -56,17 +151,16 @@ int main(int argc, char *argv[])
 int main_depth(int argc, char *argv[])
 #endif
 {
-	int i, n, tid, beg, end, pos, *n_plp, baseQ = 0, mapQ = 0, min_len = 0, use_circos=0, max_depth=-1;
-	const bam_pileup1_t **plp;
+	int i, n, tid, beg, end, pos, *dp, baseQ = 0, mapQ = 0, min_len = 0, use_circos=0, max_depth=-1, n_threads = 1;
 	char *reg = 0; // specified region
 	void *bed = 0; // BED data structure
 	bam_header_t *h = 0; // BAM header of the 1st input
 	aux_t **data;
-	bam_mplp_t mplp;
+	bam_cov_t it;
         circos_t circos; circos.bin_size = 10000;
 
 	// parse the command line
-	while ((n = getopt(argc, argv, "r:b:q:Q:l:cB:m:")) >= 0) {
+	while ((n = getopt(argc, argv, "r:b:q:Q:l:cB:m:@:")) >= 0) {
 		switch (n) {
 			case 'l': min_len = atoi(optarg); break; // minimum query length
 			case 'r': reg = strdup(optarg); break;   // parsing a region requires a BAM header
@@ -76,10 +170,11 @@ int main_depth(int argc, char *argv[])
 			case 'c': use_circos = 1; break; // circos output
                         case 'm': max_depth = atoi(optarg); break; // max depth
                         case 'B': circos.bin_size = atoi(optarg); break; // circos bin size
+			case '@': n_threads = atoi(optarg); break; // number of threads; needs indexed BAMs
 		}
 	}
 	if (optind == argc) {
-		fprintf(stderr, "Usage: depth [-r reg] [-q baseQthres] [-Q mapQthres] [-l minQLen] [-b in.bed] [-c [-B binSize]] <in1.bam> [...]\n");
+		fprintf(stderr, "Usage: depth [-r reg] [-q baseQthres] [-Q mapQthres] [-l minQLen] [-m maxDepth] [-b in.bed] [-c [-B binSize]] [-@ nThreads] <in1.bam> [...]\n");
 		return 1;
 	}
 
@@ -103,30 +198,37 @@ int main_depth(int argc, char *argv[])
 			bam_index_t *idx = bam_index_load(argv[optind+i]);  // load the index
 			data[i]->iter = bam_iter_query(idx, tid, beg, end); // set the iterator
 			bam_index_destroy(idx); // the index is not needed any more; phase out of the memory
+		} else if (bed) { // if indexed, only read the blocks overlapping the BED regions
+			bam_index_t *idx = bam_index_load_local(argv[optind+i]);
+			if (idx) {
+				int n_regs;
+				bam_region_t *regs = bed_regions(bed, h, &n_regs);
+				data[i]->iter = bam_iter_query_regs(idx, n_regs, regs);
+				free(regs);
+				bam_index_destroy(idx);
+			}
 		}
 	}
+	if (n_threads > 1 && tid < 0 && !use_circos) { // the whole genome; process shards in parallel
+		if (depth_mt(n, argv + optind, h, bed, baseQ, mapQ, min_len, max_depth, end, n_threads) == 0) goto end_depth;
+		fprintf(stderr, "[main_depth] not all BAMs are indexed; using one thread.\n");
+	}
 
-	// the core multi-pileup loop
-	mplp = bam_mplp_init(n, read_bam, (void**)data); // initialization
-        if(0 < max_depth) bam_mplp_set_maxcnt(mplp, max_depth); // set the maximum depth
-	n_plp = calloc(n, sizeof(int)); // n_plp[i] is the number of covering reads from the i-th BAM
-	plp = calloc(n, sizeof(void*)); // plp[i] points to the array of covering reads (internal in mplp)
-	while (bam_mplp_auto(mplp, &tid, &pos, n_plp, plp) > 0) { // come to the next covered position
+	// the core coverage loop; depths are counted from the CIGARs without the pileup
+	it = bam_cov_init(n, read_bam, (void**)data); // initialization
+        if(0 < max_depth) bam_cov_set_maxcnt(it, max_depth); // set the maximum depth
+	bam_cov_set_baseQ(it, baseQ); // base level filter
+	dp = calloc(n, sizeof(int)); // dp[i] is the depth of the i-th BAM after filtering
+	while (bam_cov_auto(it, &tid, &pos, 0, dp) > 0) { // come to the next covered position
                 int32_t cov = 0;
 		if (pos < beg || pos >= end) continue; // out of range; skip
 		if (bed && bed_overlap(bed, h->target_name[tid], pos, pos + 1) == 0) continue; // not in BED; skip
                 if (0 == use_circos) { fputs(h->target_name[tid], stdout); printf("\t%d", pos+1); } // a customized printf() would be faster
-                for (i = 0; i < n; ++i) { // base level filters have to go here
-                    int j, m = 0;
-                    for (j = 0; j < n_plp[i]; ++j) {
-                        const bam_pileup1_t *p = plp[i] + j; // DON'T modfity plp[][] unless you really know
-                        if (p->is_del || p->is_refskip) ++m; // having dels or refskips at tid:pos
-                        else if (bam1_qual(p->b)[p->qpos] < baseQ) ++m; // low base quality
-                    }
-                    if (0 == use_circos) printf("\t%d", n_plp[i] - m); // this the depth to output
-                    else cov += (n_plp[i] - m);
+                for (i = 0; i < n; ++i) cov += dp[i];
+                if (0 == use_circos) {
+                    for (i = 0; i < n; ++i) printf("\t%d", dp[i]); // this the depth to output
+                    putchar('\n');
                 }
-                if (0 == use_circos) putchar('\n');
                 else {
                     pos++; // make one-based
                     int32_t bin_idx = ((pos - (pos % circos.bin_size)) / circos.bin_size);
@@ -142,10 +244,11 @@ int main_depth(int argc, char *argv[])
                     }
                 }
 	}
-	free(n_plp); free(plp);
-	bam_mplp_destroy(mplp);
+	free(dp);
+	bam_cov_destroy(it);
         if (1 == use_circos) circos_print(&circos, h); // print
 
+end_depth:
 	bam_header_destroy(h);
 	for (i = 0; i < n; ++i) {
 		bam_close(data[i]->fp);
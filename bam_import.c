@@ -193,23 +193,22 @@ static inline void append_text(bam_header_t *header, kstring_t *str)
 
 int sam_header_parse(bam_header_t *h)
 {
-	char **tmp;
+	sam_hdict_t *d;
 	int i;
 	free(h->target_len); free(h->target_name);
 	h->n_targets = 0; h->target_len = 0; h->target_name = 0;
+	bam_destroy_header_hash(h); h->hash = 0;
+	sam_hdict_destroy(h->dict); h->dict = 0; // the text may have changed
 	if (h->l_text < 3) return 0;
-	if (h->header == 0) h->header = sam_header_parse2(h->text);
-	tmp = sam_header_list(h->header, "SQ", "SN", &h->n_targets);
+	d = bam_header_dict(h);
+	h->n_targets = sam_hdict_n(d, "SQ");
 	if (h->n_targets == 0) return 0;
 	h->target_name = calloc(h->n_targets, sizeof(void*));
-	for (i = 0; i < h->n_targets; ++i)
-		h->target_name[i] = strdup(tmp[i]);
-	free(tmp);
-	tmp = sam_header_list(h->header, "SQ", "LN", &h->n_targets);
 	h->target_len = calloc(h->n_targets, 4);
-	for (i = 0; i < h->n_targets; ++i)
-		h->target_len[i] = atoi(tmp[i]);
-	free(tmp);
+	for (i = 0; i < h->n_targets; ++i) {
+		h->target_name[i] = strdup(sam_hdict_value(d, "SQ", i, "SN"));
+		h->target_len[i] = atoi(sam_hdict_value(d, "SQ", i, "LN"));
+	}
 	return h->n_targets;
 }
 
@@ -463,6 +462,7 @@ int sam_read1(tamFile fp, bam_header_t *header, bam1_t *b)
 	b->l_aux = doff - doff0;
 	b->data_len = doff;
 	if (bam_no_B) bam_remove_B(b);
+	bam_cigsum_update(b);
 	return z;
 }
 
@@ -1,5 +1,11 @@
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "bam.h"
 #include "khash.h"
 #include "ksort.h"
@@ -36,6 +42,13 @@
   region is short, typically only a few alignments in six bins need to
   be retrieved. The overlapping alignments can be quickly fetched.
 
+  A CSI index generalizes the scheme: the smallest bin spans 2^min_shift
+  bp and there are n_lvls levels below bin 0, each bin having eight
+  children. BAI is the special case min_shift=14 and n_lvls=5. A CSI
+  index does not keep the linear index on disk; instead each bin stores
+  the smallest offset of the alignments overlapping its first window.
+  As the CSI specification requires, the file is BGZF compressed.
+
  */
 
 #define BAM_MIN_CHUNK_GAP 32768
@@ -44,6 +57,9 @@
 
 #define BAM_MAX_BIN 37450 // =(8^6-1)/7+1
 
+#define BAM_CSI_MIN_SHIFT 14 // default min_shift of a CSI index
+#define BAM_CSI_MAX_LVLS  9  // keeps the bin numbers in 32 bits
+
 typedef struct {
 	uint64_t u, v;
 } pair64_t;
@@ -53,6 +69,7 @@ KSORT_INIT(off, pair64_t, pair64_lt)
 
 typedef struct {
 	uint32_t m, n;
+	uint64_t loff; // CSI only: smallest offset of alignments overlapping the first window of the bin
 	pair64_t *list;
 } bam_binlist_t;
 
@@ -65,11 +82,69 @@ KHASH_MAP_INIT_INT(i, bam_binlist_t)
 
 struct __bam_index_t {
 	int32_t n;
+	int32_t min_shift, n_lvls; // 14 and 5 for BAI
+	int is_csi;
 	uint64_t n_no_coor; // unmapped reads without coordinate
-	khash_t(i) **index;
-	bam_lidx_t *index2;
+	khash_t(i) **index; // NULL for a reference not decoded yet
+	bam_lidx_t *index2; // for CSI, only filled when the index is built
+	// for an index loaded from a file
+	uint8_t *mdata; // content of the index file
+	size_t msize;
+	int is_mmap;
+	uint64_t *ref_off; // where each reference starts in mdata
+	pthread_mutex_t lock; // guards lazy decoding
 };
 
+static khash_t(i) *idx_get_ref(const bam_index_t *idx, int tid);
+static void idx_release(uint8_t *data, size_t size, int is_mmap);
+
+static inline int bin_first(int l)
+{
+	return ((1<<((l<<1) + l)) - 1) / 7;
+}
+
+#define idx_meta_bin(idx) (bin_first((idx)->n_lvls + 1) + 1) // the pseudo-bin for the per-reference statistics
+
+// the smallest bin containing [beg,end)
+static inline int idx_reg2bin(int64_t beg, int64_t end, int min_shift, int n_lvls)
+{
+	int l, s = min_shift, t = bin_first(n_lvls);
+	for (--end, l = n_lvls; l > 0; --l, s += 3, t -= 1<<((l<<1) + l))
+		if (beg>>s == end>>s) return t + (beg>>s);
+	return 0;
+}
+
+static inline uint32_t idx_bin(const bam_index_t *idx, const bam1_t *b)
+{
+	int32_t end;
+	if (!idx->is_csi) return b->core.bin; // as the BAM record stores it
+	end = bam1_calend(b);
+	if (end <= b->core.pos) end = b->core.pos + 1;
+	return idx_reg2bin(b->core.pos, end, idx->min_shift, idx->n_lvls);
+}
+
+// min_shift<=0 for BAI; n_lvls<=0 to derive it from the longest reference
+static bam_index_t *idx_init(int32_t n_targets, int64_t max_len, int min_shift, int n_lvls)
+{
+	bam_index_t *idx;
+	int i;
+	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	idx->n = n_targets;
+	if (min_shift > 0) {
+		if (n_lvls <= 0) {
+			int64_t x;
+			max_len += 256;
+			for (n_lvls = 0, x = 1LL<<min_shift; max_len > x; ++n_lvls, x <<= 3);
+		}
+		idx->is_csi = 1;
+		idx->min_shift = min_shift; idx->n_lvls = n_lvls;
+	} else idx->min_shift = BAM_LIDX_SHIFT, idx->n_lvls = 5;
+	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
+	for (i = 0; i < idx->n; ++i) idx->index[i] = kh_init(i);
+	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
+	return idx;
+}
+
 // requirement: len <= LEN_MASK
 static inline void insert_offset(khash_t(i) *h, int bin, uint64_t beg, uint64_t end)
 {
@@ -79,7 +154,7 @@ static inline void insert_offset(khash_t(i) *h, int bin, uint64_t beg, uint64_t
 	k = kh_put(i, h, bin, &ret);
 	l = &kh_value(h, k);
 	if (ret) { // not present
-		l->m = 1; l->n = 0;
+		l->m = 1; l->n = 0; l->loff = 0;
 		l->list = (pair64_t*)calloc(l->m, 16);
 	}
 	if (l->n == l->m) {
@@ -89,11 +164,11 @@ static inline void insert_offset(khash_t(i) *h, int bin, uint64_t beg, uint64_t
 	l->list[l->n].u = beg; l->list[l->n++].v = end;
 }
 
-static inline void insert_offset2(bam_lidx_t *index2, bam1_t *b, uint64_t offset)
+static inline void insert_offset2(bam_lidx_t *index2, bam1_t *b, uint64_t offset, int shift)
 {
 	int i, beg, end;
-	beg = b->core.pos >> BAM_LIDX_SHIFT;
-	end = (bam_calend(&b->core, bam1_cigar(b)) - 1) >> BAM_LIDX_SHIFT;
+	beg = b->core.pos >> shift;
+	end = (bam1_calend(b) - 1) >> shift;
 	if (index2->m < end + 1) {
 		int old_m = index2->m;
 		index2->m = end + 1;
@@ -120,7 +195,7 @@ static void merge_chunks(bam_index_t *idx)
 		index = idx->index[i];
 		for (k = kh_begin(index); k != kh_end(index); ++k) {
 			bam_binlist_t *p;
-			if (!kh_exist(index, k) || kh_key(index, k) == BAM_MAX_BIN) continue;
+			if (!kh_exist(index, k) || kh_key(index, k) == idx_meta_bin(idx)) continue;
 			p = &kh_value(index, k);
 			m = 0;
 			for (l = 1; l < p->n; ++l) {
@@ -148,13 +223,34 @@ static void fill_missing(bam_index_t *idx)
 	}
 }
 
-bam_index_t *bam_index_core(bamFile fp)
+// for CSI, move the linear index into bam_binlist_t::loff
+static void update_loff(bam_index_t *idx)
+{
+	int i, l;
+	khint_t k;
+	if (!idx->is_csi) return;
+	for (i = 0; i < idx->n; ++i) {
+		khash_t(i) *index = idx->index[i];
+		bam_lidx_t *idx2 = &idx->index2[i];
+		for (k = kh_begin(index); k != kh_end(index); ++k) {
+			int bin, bot;
+			if (!kh_exist(index, k) || kh_key(index, k) == idx_meta_bin(idx)) continue;
+			bin = kh_key(index, k);
+			for (l = idx->n_lvls; l > 0 && bin < bin_first(l); --l);
+			bot = (bin - bin_first(l)) << ((idx->n_lvls - l) * 3); // the first leaf under the bin
+			kh_value(index, k).loff = bot < idx2->n? idx2->offset[bot] : 0;
+		}
+	}
+}
+
+static bam_index_t *bam_index_core2(bamFile fp, int min_shift, int n_lvls)
 {
 	bam1_t *b;
 	bam_header_t *h;
 	int i, ret;
+	int64_t max_len;
 	bam_index_t *idx;
-	uint32_t last_bin, save_bin;
+	uint32_t last_bin, save_bin, bin, meta_bin;
 	int32_t last_coor, last_tid, save_tid;
 	bam1_core_t *c;
 	uint64_t save_off, last_off, n_mapped, n_unmapped, off_beg, off_end, n_no_coor;
@@ -165,15 +261,13 @@ bam_index_t *bam_index_core(bamFile fp)
 	    return NULL;
 	}
 
-	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	for (i = 0, max_len = 0; i < h->n_targets; ++i)
+		if (max_len < h->target_len[i]) max_len = h->target_len[i];
+	idx = idx_init(h->n_targets, max_len, min_shift, n_lvls);
+	meta_bin = idx_meta_bin(idx);
 	b = (bam1_t*)calloc(1, sizeof(bam1_t));
 	c = &b->core;
-
-	idx->n = h->n_targets;
 	bam_header_destroy(h);
-	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
-	for (i = 0; i < idx->n; ++i) idx->index[i] = kh_init(i);
-	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
 
 	save_bin = save_tid = last_tid = last_bin = 0xffffffffu;
 	save_off = last_off = bam_tell(fp); last_coor = 0xffffffffu;
@@ -193,19 +287,20 @@ bam_index_t *bam_index_core(bamFile fp)
 					bam1_qname(b), last_coor, c->pos, c->tid+1);
 			return NULL;
 		}
-		if (c->tid >= 0 && !(c->flag & BAM_FUNMAP)) insert_offset2(&idx->index2[b->core.tid], b, last_off);
-		if (c->bin != last_bin) { // then possibly write the binning index
+		if (c->tid >= 0 && !(c->flag & BAM_FUNMAP)) insert_offset2(&idx->index2[b->core.tid], b, last_off, idx->min_shift);
+		bin = idx_bin(idx, b);
+		if (bin != last_bin) { // then possibly write the binning index
 			if (save_bin != 0xffffffffu) // save_bin==0xffffffffu only happens to the first record
 				insert_offset(idx->index[save_tid], save_bin, save_off, last_off);
 			if (last_bin == 0xffffffffu && save_tid != 0xffffffffu) { // write the meta element
 				off_end = last_off;
-				insert_offset(idx->index[save_tid], BAM_MAX_BIN, off_beg, off_end);
-				insert_offset(idx->index[save_tid], BAM_MAX_BIN, n_mapped, n_unmapped);
+				insert_offset(idx->index[save_tid], meta_bin, off_beg, off_end);
+				insert_offset(idx->index[save_tid], meta_bin, n_mapped, n_unmapped);
 				n_mapped = n_unmapped = 0;
 				off_beg = off_end;
 			}
 			save_off = last_off;
-			save_bin = last_bin = c->bin;
+			save_bin = last_bin = bin;
 			save_tid = c->tid;
 			if (save_tid < 0) break;
 		}
@@ -221,11 +316,12 @@ bam_index_t *bam_index_core(bamFile fp)
 	}
 	if (save_tid >= 0) {
 		insert_offset(idx->index[save_tid], save_bin, save_off, bam_tell(fp));
-		insert_offset(idx->index[save_tid], BAM_MAX_BIN, off_beg, bam_tell(fp));
-		insert_offset(idx->index[save_tid], BAM_MAX_BIN, n_mapped, n_unmapped);
+		insert_offset(idx->index[save_tid], meta_bin, off_beg, bam_tell(fp));
+		insert_offset(idx->index[save_tid], meta_bin, n_mapped, n_unmapped);
 	}
 	merge_chunks(idx);
 	fill_missing(idx);
+	update_loff(idx);
 	if (ret >= 0) {
 		while ((ret = bam_read1(fp, b)) >= 0) {
 			++n_no_coor;
@@ -241,6 +337,11 @@ bam_index_t *bam_index_core(bamFile fp)
 	return idx;
 }
 
+bam_index_t *bam_index_core(bamFile fp)
+{
+	return bam_index_core2(fp, 0, 0);
+}
+
 void bam_index_destroy(bam_index_t *idx)
 {
 	khint_t k;
@@ -249,6 +350,7 @@ void bam_index_destroy(bam_index_t *idx)
 	for (i = 0; i < idx->n; ++i) {
 		khash_t(i) *index = idx->index[i];
 		bam_lidx_t *index2 = idx->index2 + i;
+		if (index == 0) continue; // never decoded
 		for (k = kh_begin(index); k != kh_end(index); ++k) {
 			if (kh_exist(index, k))
 				free(kh_value(index, k).list);
@@ -257,20 +359,76 @@ void bam_index_destroy(bam_index_t *idx)
 		free(index2->offset);
 	}
 	free(idx->index); free(idx->index2);
+	if (idx->mdata) {
+		idx_release(idx->mdata, idx->msize, idx->is_mmap);
+		free(idx->ref_off);
+		pthread_mutex_destroy(&idx->lock);
+	}
 	free(idx);
 }
 
+static inline void idx_write32(BGZF *fp, uint32_t x)
+{
+	if (bam_is_be) bam_swap_endian_4p(&x);
+	bgzf_write(fp, &x, 4);
+}
+
+static inline void idx_write64(BGZF *fp, uint64_t x)
+{
+	if (bam_is_be) bam_swap_endian_8p(&x);
+	bgzf_write(fp, &x, 8);
+}
+
+static void bam_index_save_csi(const bam_index_t *idx, BGZF *fp)
+{
+	int32_t i, j;
+	khint_t k;
+	bgzf_write(fp, "CSI\1", 4);
+	idx_write32(fp, idx->min_shift);
+	idx_write32(fp, idx->n_lvls);
+	idx_write32(fp, 0); // no auxiliary data
+	idx_write32(fp, idx->n);
+	for (i = 0; i < idx->n; ++i) {
+		khash_t(i) *index = idx_get_ref(idx, i);
+		idx_write32(fp, kh_size(index));
+		for (k = kh_begin(index); k != kh_end(index); ++k) {
+			bam_binlist_t *p;
+			if (!kh_exist(index, k)) continue;
+			p = &kh_value(index, k);
+			idx_write32(fp, kh_key(index, k));
+			idx_write64(fp, p->loff);
+			idx_write32(fp, p->n);
+			for (j = 0; j < p->n; ++j) {
+				idx_write64(fp, p->list[j].u);
+				idx_write64(fp, p->list[j].v);
+			}
+		}
+	}
+	idx_write64(fp, idx->n_no_coor);
+}
+
 void bam_index_save(const bam_index_t *idx, FILE *fp)
 {
 	int32_t i, size;
 	khint_t k;
+	if (idx->is_csi) { // BGZF compressed, through a duplicate of the descriptor of _fp_
+		BGZF *bfp;
+		fflush(fp);
+		if ((bfp = bgzf_dopen(dup(fileno(fp)), "w")) == 0) {
+			fprintf(stderr, "[bam_index_save] fail to write the CSI index.\n");
+			return;
+		}
+		bam_index_save_csi(idx, bfp);
+		bgzf_close(bfp);
+		return;
+	}
 	fwrite("BAI\1", 1, 4, fp);
 	if (bam_is_be) {
 		uint32_t x = idx->n;
 		fwrite(bam_swap_endian_4p(&x), 4, 1, fp);
 	} else fwrite(&idx->n, 4, 1, fp);
 	for (i = 0; i < idx->n; ++i) {
-		khash_t(i) *index = idx->index[i];
+		khash_t(i) *index = idx_get_ref(idx, i);
 		bam_lidx_t *index2 = idx->index2 + i;
 		// write binning index
 		size = kh_size(index);
@@ -323,67 +481,206 @@ void bam_index_save(const bam_index_t *idx, FILE *fp)
 	fflush(fp);
 }
 
-static bam_index_t *bam_index_load_core(FILE *fp)
+/*
+  Loading. The index file is memory-mapped, or read into memory where
+  mmap() is unavailable, and scanned once for where each reference
+  starts. The bins and the linear index of a reference are decoded the
+  first time they are needed; see idx_get_ref().
+*/
+
+static inline uint32_t idx_get32(const uint8_t *p)
 {
-	int i;
-	char magic[4];
-	bam_index_t *idx;
-	if (fp == 0) {
-		fprintf(stderr, "[bam_index_load_core] fail to load index.\n");
-		return 0;
+	uint32_t x;
+	memcpy(&x, p, 4);
+	if (bam_is_be) bam_swap_endian_4p(&x);
+	return x;
+}
+
+static inline uint64_t idx_get64(const uint8_t *p)
+{
+	uint64_t x;
+	memcpy(&x, p, 8);
+	if (bam_is_be) bam_swap_endian_8p(&x);
+	return x;
+}
+
+// skip the data of a reference; return NULL if it is truncated
+static const uint8_t *idx_skip_ref(const bam_index_t *idx, const uint8_t *p, const uint8_t *end)
+{
+	int32_t j, n_bin, n, l = idx->is_csi? 16 : 8; // bin, [loff,] n_chunk
+	if (end - p < 4) return 0;
+	n_bin = idx_get32(p); p += 4;
+	for (j = 0; j < n_bin; ++j) {
+		if (end - p < l) return 0;
+		n = idx_get32(p + l - 4); p += l;
+		if (n < 0 || (end - p) / 16 < n) return 0;
+		p += (int64_t)n * 16;
 	}
-	fread(magic, 1, 4, fp);
-	if (strncmp(magic, "BAI\1", 4)) {
-		fprintf(stderr, "[bam_index_load] wrong magic number.\n");
-		fclose(fp);
-		return 0;
+	if (!idx->is_csi) { // linear index
+		if (end - p < 4) return 0;
+		n = idx_get32(p); p += 4;
+		if (n < 0 || (end - p) / 8 < n) return 0;
+		p += (int64_t)n * 8;
 	}
-	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));	
-	fread(&idx->n, 4, 1, fp);
-	if (bam_is_be) bam_swap_endian_4p(&idx->n);
-	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
-	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
-	for (i = 0; i < idx->n; ++i) {
-		khash_t(i) *index;
-		bam_lidx_t *index2 = idx->index2 + i;
-		uint32_t key, size;
+	return p;
+}
+
+static void idx_load_ref(bam_index_t *idx, int tid)
+{
+	const uint8_t *p = idx->mdata + idx->ref_off[tid];
+	khash_t(i) *index;
+	bam_lidx_t *index2 = idx->index2 + tid;
+	int32_t j, l, n_bin;
+	index = kh_init(i);
+	n_bin = idx_get32(p); p += 4;
+	for (j = 0; j < n_bin; ++j) {
+		bam_binlist_t *q;
 		khint_t k;
-		int j, ret;
-		bam_binlist_t *p;
-		index = idx->index[i] = kh_init(i);
-		// load binning index
-		fread(&size, 4, 1, fp);
-		if (bam_is_be) bam_swap_endian_4p(&size);
-		for (j = 0; j < (int)size; ++j) {
-			fread(&key, 4, 1, fp);
-			if (bam_is_be) bam_swap_endian_4p(&key);
-			k = kh_put(i, index, key, &ret);
-			p = &kh_value(index, k);
-			fread(&p->n, 4, 1, fp);
-			if (bam_is_be) bam_swap_endian_4p(&p->n);
-			p->m = p->n;
-			p->list = (pair64_t*)malloc(p->m * 16);
-			fread(p->list, 16, p->n, fp);
-			if (bam_is_be) {
-				int x;
-				for (x = 0; x < p->n; ++x) {
-					bam_swap_endian_8p(&p->list[x].u);
-					bam_swap_endian_8p(&p->list[x].v);
-				}
+		int ret;
+		k = kh_put(i, index, idx_get32(p), &ret); p += 4;
+		q = &kh_value(index, k);
+		if (idx->is_csi) q->loff = idx_get64(p), p += 8;
+		else q->loff = 0;
+		q->n = q->m = idx_get32(p); p += 4;
+		q->list = (pair64_t*)malloc(q->m * 16);
+		memcpy(q->list, p, q->n * 16); p += q->n * 16;
+		if (bam_is_be) {
+			for (l = 0; l < q->n; ++l) {
+				bam_swap_endian_8p(&q->list[l].u);
+				bam_swap_endian_8p(&q->list[l].v);
 			}
 		}
-		// load linear index
-		fread(&index2->n, 4, 1, fp);
-		if (bam_is_be) bam_swap_endian_4p(&index2->n);
-		index2->m = index2->n;
+	}
+	if (!idx->is_csi) {
+		index2->n = index2->m = idx_get32(p); p += 4;
 		index2->offset = (uint64_t*)calloc(index2->m, 8);
-		fread(index2->offset, index2->n, 8, fp);
+		memcpy(index2->offset, p, index2->n * 8);
 		if (bam_is_be)
-			for (j = 0; j < index2->n; ++j) bam_swap_endian_8p(&index2->offset[j]);
+			for (l = 0; l < index2->n; ++l) bam_swap_endian_8p(&index2->offset[l]);
+	}
+	idx->index[tid] = index;
+}
+
+// the binning index of a reference, decoded on first use; the linear index is decoded along with it
+static khash_t(i) *idx_get_ref(const bam_index_t *_idx, int tid)
+{
+	bam_index_t *idx = (bam_index_t*)_idx;
+	if (idx->mdata) {
+		pthread_mutex_lock(&idx->lock);
+		if (idx->index[tid] == 0) idx_load_ref(idx, tid);
+		pthread_mutex_unlock(&idx->lock);
+	}
+	return idx->index[tid];
+}
+
+static void idx_release(uint8_t *data, size_t size, int is_mmap)
+{
+#ifndef _WIN32
+	if (is_mmap) {
+		munmap(data, size);
+		return;
+	}
+#endif
+	free(data);
+}
+
+// take the ownership of _data_
+static bam_index_t *bam_index_load_mem(uint8_t *data, size_t size, int is_mmap)
+{
+	const uint8_t *p = data, *end = data + size;
+	bam_index_t *idx;
+	int32_t i;
+	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	if (size >= 16 && memcmp(p, "CSI\1", 4) == 0) {
+		int32_t l_aux;
+		idx->is_csi = 1;
+		idx->min_shift = idx_get32(p + 4);
+		idx->n_lvls = idx_get32(p + 8);
+		l_aux = idx_get32(p + 12);
+		p += 16;
+		if (idx->min_shift <= 0 || idx->n_lvls < 0 || idx->n_lvls > BAM_CSI_MAX_LVLS || l_aux < 0 || end - p < l_aux)
+			goto bad_index;
+		p += l_aux;
+	} else if (size >= 4 && memcmp(p, "BAI\1", 4) == 0) {
+		idx->min_shift = BAM_LIDX_SHIFT; idx->n_lvls = 5;
+		p += 4;
+	} else {
+		fprintf(stderr, "[bam_index_load] wrong magic number.\n");
+		free(idx);
+		idx_release(data, size, is_mmap);
+		return 0;
+	}
+	if (end - p < 4) goto bad_index;
+	idx->n = idx_get32(p); p += 4;
+	if (idx->n < 0) goto bad_index;
+	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
+	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
+	idx->ref_off = (uint64_t*)malloc(idx->n * 8);
+	for (i = 0; i < idx->n; ++i) {
+		idx->ref_off[i] = p - data;
+		if ((p = idx_skip_ref(idx, p, end)) == 0) goto bad_index;
 	}
-	if (fread(&idx->n_no_coor, 8, 1, fp) == 0) idx->n_no_coor = 0;
-	if (bam_is_be) bam_swap_endian_8p(&idx->n_no_coor);
+	idx->n_no_coor = end - p >= 8? idx_get64(p) : 0;
+	idx->mdata = data; idx->msize = size; idx->is_mmap = is_mmap;
+	pthread_mutex_init(&idx->lock, 0);
 	return idx;
+
+bad_index:
+	fprintf(stderr, "[bam_index_load] truncated or corrupted index.\n");
+	free(idx->index); free(idx->index2); free(idx->ref_off);
+	free(idx);
+	idx_release(data, size, is_mmap);
+	return 0;
+}
+
+static bam_index_t *bam_index_load_core(FILE *fp)
+{
+	uint8_t *data = 0;
+	size_t size;
+	int is_mmap = 0;
+	if (fp == 0) {
+		fprintf(stderr, "[bam_index_load_core] fail to load index.\n");
+		return 0;
+	}
+	fseeko(fp, 0, SEEK_END);
+	size = ftello(fp);
+#ifndef _WIN32
+	if (size > 0) {
+		data = (uint8_t*)mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+		if (data == MAP_FAILED) data = 0;
+		else is_mmap = 1;
+	}
+#endif
+	if (data == 0) {
+		data = (uint8_t*)malloc(size? size : 1);
+		fseeko(fp, 0, SEEK_SET);
+		size = fread(data, 1, size, fp);
+	}
+	if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) { // BGZF compressed (CSI); decompress into memory
+		BGZF *bfp;
+		int fd = dup(fileno(fp));
+		size_t m = size > 0x10000? size * 4 : 0x40000;
+		ssize_t l;
+		idx_release(data, size, is_mmap);
+		lseek(fd, 0, SEEK_SET);
+		if ((bfp = bgzf_dopen(fd, "r")) == 0) {
+			fprintf(stderr, "[bam_index_load_core] fail to read the compressed index.\n");
+			return 0;
+		}
+		data = (uint8_t*)malloc(m);
+		size = 0, is_mmap = 0;
+		while ((l = bgzf_read(bfp, data + size, m - size)) > 0) {
+			size += l;
+			if (size == m) data = (uint8_t*)realloc(data, m <<= 1);
+		}
+		bgzf_close(bfp);
+		if (l < 0) {
+			fprintf(stderr, "[bam_index_load_core] fail to decompress the index.\n");
+			free(data);
+			return 0;
+		}
+	}
+	return bam_index_load_mem(data, size, is_mmap);
 }
 
 bam_index_t *bam_index_load_local(const char *_fn)
@@ -409,6 +706,10 @@ bam_index_t *bam_index_load_local(const char *_fn)
 			fp = fopen(fnidx, "rb");
 		}
 	}
+	if (fp == 0) { // try "{fn}.csi"
+		strcpy(fnidx, fn); strcat(fnidx, ".csi");
+		fp = fopen(fnidx, "rb");
+	}
 	free(fnidx); free(fn);
 	if (fp) {
 		bam_index_t *idx = bam_index_load_core(fp);
@@ -470,25 +771,522 @@ bam_index_t *bam_index_load(const char *fn)
 	return idx;
 }
 
-int bam_index_build2(const char *fn, const char *_fnidx)
+/***************************
+ * Block-parallel reading  *
+ ***************************/
+
+/*
+  The compressed file is cut into segments at BGZF block boundaries. A
+  worker opens its own BGZF handle, finds the first record starting in
+  its first block, and reads records until one starts at or beyond the
+  next segment. This needs neither an index nor a sorted file.
+
+  Finding the first record in a block is a guess. The guess is checked
+  against where the previous segment stopped reading, and on a mismatch
+  the segment is reset and read again from that point.
+*/
+
+#define BAM_SCAN_MIN_SEG 0x100000 // do not make segments smaller than 1MB of compressed data
+
+typedef struct {
+	const char *fn;
+	int32_t n_targets;
+	int64_t size; // file size
+	int64_t coff, coff_next; // records starting in blocks [coff,coff_next); coff_next<0 for the last segment
+	uint64_t start; // virtual offset of the first record; 0 to search for it in block coff
+	int core_only; // only fill bam1_t::core
+	bam_scan_f func;
+	bam_scan_reset_f reset;
+	void *data;
+	// results
+	int ret; // 0 on success, -1 if the first record cannot be found, -2 on other errors, or an error from func
+	uint64_t stop; // virtual offset of the first record not read, or the end of file
+} scan_seg_t;
+
+static inline int32_t idx_le32(const uint8_t *p)
+{
+	return (int32_t)((uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24);
+}
+
+// if a plausible record starts at p, return its length including block_size; otherwise 0
+static int scan_check_rec(const uint8_t *p, int avail, int32_t n_targets)
+{
+	int32_t block_size, tid, pos, mtid, mpos, l_qname, n_cigar, l_qseq, i;
+	if (avail < 36) return 0;
+	block_size = idx_le32(p);
+	tid = idx_le32(p + 4); pos = idx_le32(p + 8);
+	l_qname = p[12];
+	n_cigar = idx_le32(p + 16) & 0xffff;
+	l_qseq = idx_le32(p + 20);
+	mtid = idx_le32(p + 24); mpos = idx_le32(p + 28);
+	if (tid < -1 || tid >= n_targets || mtid < -1 || mtid >= n_targets) return 0;
+	if (pos < -1 || mpos < -1 || l_qname < 2 || l_qseq < 0) return 0;
+	if (block_size < 32 || (int64_t)32 + l_qname + n_cigar * 4 + l_qseq + (l_qseq + 1) / 2 > block_size) return 0;
+	if (avail >= 36 + l_qname) { // the read name is in the block
+		const uint8_t *q = p + 36;
+		if (q[l_qname - 1] != 0) return 0;
+		for (i = 0; i < l_qname - 1; ++i)
+			if (q[i] < '!' || q[i] > '~') return 0;
+	}
+	return 4 + block_size;
+}
+
+// find the first record starting in the block at the current position; -1 if not found
+static int scan_sync(BGZF *fp, int32_t n_targets)
+{
+	const uint8_t *p = (const uint8_t*)fp->uncompressed_block;
+	int u, len = fp->block_length;
+	for (u = 0; u + 36 <= len; ++u) {
+		int v = u, l, n = 0;
+		while ((l = scan_check_rec(p + v, len - v, n_targets)) > 0) {
+			++n; v += l;
+			if (v + 36 > len || n == 4) break;
+		}
+		if (l > 0 && (n >= 2 || v + 36 > len)) return u;
+	}
+	return -1;
+}
+
+// skip _len_ bytes in the same way as bgzf_read(); return the number of bytes skipped
+static int scan_skip(BGZF *fp, int len)
+{
+	int n = 0;
+	while (n < len) {
+		int l, available = fp->block_length - fp->block_offset;
+		if (available <= 0) {
+			if (bgzf_read_block(fp) != 0) return -1;
+			available = fp->block_length - fp->block_offset;
+			if (available <= 0) break;
+		}
+		l = len - n < available? len - n : available;
+		fp->block_offset += l;
+		n += l;
+	}
+	if (fp->block_offset == fp->block_length) {
+		fp->block_address = _bgzf_tell(fp->fp);
+		fp->block_offset = fp->block_length = 0;
+	}
+	return n;
+}
+
+// as bam_read1_bgzf(), but only fill b->core and skip the variable-length data
+static int scan_read_core(BGZF *fp, bam1_t *b)
+{
+	bam1_core_t *c = &b->core;
+	int32_t block_len, ret, i;
+	uint32_t x[8];
+	if ((ret = bgzf_read(fp, &block_len, 4)) != 4) {
+		if (ret == 0) return -1; // normal end-of-file
+		else return -2; // truncated
+	}
+	if (bgzf_read(fp, x, 32) != 32) return -3;
+	if (bam_is_be) {
+		bam_swap_endian_4p(&block_len);
+		for (i = 0; i < 8; ++i) bam_swap_endian_4p(x + i);
+	}
+	c->tid = x[0]; c->pos = x[1];
+	c->bin = x[2]>>16; c->qual = x[2]>>8&0xff; c->l_qname = x[2]&0xff;
+	c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+	b->data_len = b->l_aux = 0;
+	if (scan_skip(fp, block_len - 32) != block_len - 32) return -4;
+	return 4 + block_len;
+}
+
+static void *scan_worker(void *data)
+{
+	scan_seg_t *s = (scan_seg_t*)data;
+	BGZF *fp;
+	bam1_t *b;
+	uint64_t off;
+	int ret = 0;
+
+	if (s->reset) s->reset(s->data);
+	s->ret = -2;
+	if ((fp = bgzf_open(s->fn, "r")) == 0) return 0;
+	if (s->start == 0) { // find the first record
+		int u;
+		if (bgzf_seek(fp, s->coff<<16, SEEK_SET) < 0 || bgzf_read_block(fp) < 0) goto end_worker;
+		if ((u = scan_sync(fp, s->n_targets)) < 0) {
+			s->ret = -1;
+			goto end_worker;
+		}
+		s->start = s->coff<<16 | u;
+	}
+	if (bgzf_seek(fp, s->start, SEEK_SET) < 0) goto end_worker;
+	b = bam_init1();
+	off = s->start;
+	while (s->coff_next < 0 || (int64_t)(off>>16) < s->coff_next) {
+		if ((ret = s->core_only? scan_read_core(fp, b) : bam_read1_bgzf(fp, b)) < 0) {
+			if (ret == -1 && s->coff_next < 0) { // normal end-of-file
+				// the serial indexer ends the last chunk at bam_tell() after the failed read
+#ifndef _PBGZF_USE
+				off = bgzf_tell(fp);
+#else
+				off = (uint64_t)(s->size - 28) << 32; // PBGZF takes the reader's virtual offset as the block address
+#endif
+				if (_bgzf_tell(fp->fp) == s->size) ret = 0; // otherwise stopped at an empty block in the middle
+			}
+			break;
+		}
+		if ((ret = s->func(s->data, b, off)) < 0) break;
+		off = bgzf_tell(fp);
+	}
+	s->stop = off;
+	s->ret = ret < 0? ret : 0;
+	bam_destroy1(b);
+end_worker:
+	bgzf_close(fp);
+	return 0;
+}
+
+// return the compressed offset of the first BGZF block at or after _from_; -1 if not found
+static int64_t scan_find_block(FILE *fp, int64_t from, int64_t size)
+{
+	uint8_t *buf;
+	int i, n;
+	int64_t ret = -1;
+	buf = (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE * 2 + 18);
+	if (fseeko(fp, from, SEEK_SET) == 0) {
+		n = fread(buf, 1, BGZF_MAX_BLOCK_SIZE * 2 + 18, fp);
+		for (i = 0; i + 18 <= n; ++i) {
+			int bsize;
+			if (!bgzf_check_header(buf + i)) continue;
+			bsize = (buf[i+16] | buf[i+17]<<8) + 1;
+			if (from + i + bsize == size || (i + bsize + 18 <= n && bgzf_check_header(buf + i + bsize))) {
+				ret = from + i;
+				break;
+			}
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+// read the header and cut the file into at most n_threads segments; NULL if it is too small or has no EOF marker
+static scan_seg_t *scan_split(const char *fn, int n_threads, int *n_seg, int32_t *n_targets, int64_t *max_len)
+{
+	BGZF *fp;
+	FILE *fpr;
+	scan_seg_t *seg;
+	int32_t i, j, l, x[2];
+	uint8_t buf[1024];
+	int64_t size, c;
+	uint64_t first;
+
+	// read the header
+	*max_len = 0;
+	if ((fp = bgzf_open(fn, "r")) == 0) return 0;
+	if (bgzf_read(fp, x, 4) != 4 || strncmp((char*)x, "BAM\1", 4)) {
+		bgzf_close(fp);
+		return 0;
+	}
+	bgzf_read(fp, &l, 4);
+	if (bam_is_be) bam_swap_endian_4p(&l);
+	for (; l > 0; l -= j) // skip the header text
+		if ((j = bgzf_read(fp, buf, l < 1024? l : 1024)) <= 0) break;
+	if (bgzf_read(fp, n_targets, 4) != 4) l = -1;
+	if (bam_is_be) bam_swap_endian_4p(n_targets);
+	for (i = 0; i < *n_targets && l == 0; ++i) {
+		int32_t l_name;
+		if (bgzf_read(fp, &l_name, 4) != 4) { l = -1; break; }
+		if (bam_is_be) bam_swap_endian_4p(&l_name);
+		if (l_name < 0 || l_name > 1024 || bgzf_read(fp, buf, l_name) != l_name) { l = -1; break; }
+		if (bgzf_read(fp, x, 4) != 4) l = -1;
+		if (bam_is_be) bam_swap_endian_4p(x);
+		if (*max_len < (uint32_t)x[0]) *max_len = (uint32_t)x[0];
+	}
+	first = bgzf_tell(fp);
+	bgzf_close(fp);
+	if (l != 0) return 0;
+
+	// cut the file into segments
+	if ((fpr = fopen(fn, "rb")) == 0) return 0;
+	fseeko(fpr, 0, SEEK_END);
+	size = ftello(fpr);
+	if (size / n_threads < BAM_SCAN_MIN_SEG) n_threads = size / BAM_SCAN_MIN_SEG;
+	if (n_threads >= 2 && fseeko(fpr, -28, SEEK_END) == 0 && fread(buf, 1, 28, fpr) == 28) { // look for the EOF marker
+		if (!bgzf_check_header(buf) || buf[16] != 27 || buf[17] != 0 || idx_le32(buf + 24) != 0) n_threads = 0;
+	} else n_threads = 0;
+	if (n_threads < 2) {
+		fclose(fpr);
+		return 0;
+	}
+	seg = (scan_seg_t*)calloc(n_threads, sizeof(scan_seg_t));
+	seg[0].coff = first>>16; seg[0].start = first;
+	for (i = 1, *n_seg = 1; i < n_threads; ++i) {
+		c = scan_find_block(fpr, size / n_threads * i, size);
+		if (c > seg[*n_seg-1].coff) seg[(*n_seg)++].coff = c;
+	}
+	fclose(fpr);
+	for (i = 0; i < *n_seg; ++i) {
+		seg[i].fn = fn;
+		seg[i].n_targets = *n_targets;
+		seg[i].size = size;
+		seg[i].coff_next = i + 1 < *n_seg? seg[i+1].coff : -1;
+	}
+	return seg;
+}
+
+// read all segments on one thread each; return 0 if all succeed
+static int scan_run(scan_seg_t *seg, int n_seg)
+{
+	pthread_t *tid;
+	pthread_attr_t attr;
+	int i;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	tid = (pthread_t*)calloc(n_seg, sizeof(pthread_t));
+	for (i = 0; i < n_seg; ++i) pthread_create(&tid[i], &attr, scan_worker, &seg[i]);
+	for (i = 0; i < n_seg; ++i) pthread_join(tid[i], 0);
+	free(tid);
+	for (i = 0; i < n_seg; ++i) {
+		if (i > 0 && (seg[i].ret != 0 || seg[i].start != seg[i-1].stop)) {
+			seg[i].start = seg[i-1].stop; // the guess was wrong; read again from the right place
+			scan_worker(&seg[i]);
+		}
+		if (seg[i].ret != 0) return seg[i].ret;
+	}
+	return 0;
+}
+
+int bam_scan_mt2(const char *fn, int n_threads, int core_only, bam_scan_f func, bam_scan_reset_f reset, void **data)
+{
+	scan_seg_t *seg;
+	int32_t n_targets;
+	int64_t max_len;
+	int i, n_seg, ret;
+	if ((seg = scan_split(fn, n_threads, &n_seg, &n_targets, &max_len)) == 0) return 0;
+	for (i = 0; i < n_seg; ++i)
+		seg[i].core_only = core_only, seg[i].func = func, seg[i].reset = reset, seg[i].data = data[i];
+	ret = scan_run(seg, n_seg);
+	free(seg);
+	return ret < 0? ret : n_seg;
+}
+
+int bam_scan_mt(const char *fn, int n_threads, bam_scan_f func, bam_scan_reset_f reset, void **data)
+{
+	return bam_scan_mt2(fn, n_threads, 0, func, reset, data);
+}
+
+/******************************
+ * Multi-threaded index build *
+ ******************************/
+
+/*
+  Each segment of a block-parallel read keeps the runs of consecutive
+  records falling in the same bin and a partial linear index per
+  reference. Replaying the runs in file order then inserts exactly the
+  same chunks in the same order as bam_index_core(), so the output is
+  identical.
+*/
+
+typedef struct {
+	int32_t tid;
+	uint32_t bin;
+	uint64_t beg, end; // [beg,end) virtual offsets
+	uint64_t n_mapped, n_unmapped;
+} idx_run_t;
+
+typedef struct {
+	int32_t tid;
+	bam_lidx_t lidx;
+} idx_lpart_t;
+
+typedef struct {
+	const bam_index_t *idx; // parameters of the index being built
+	int64_t n_rec;
+	int32_t first_tid, first_pos, last_tid, last_pos; // last_* ignores records without coordinates
+	uint64_t n_no_coor;
+	int n_run, m_run;
+	idx_run_t *run;
+	int n_lp, m_lp;
+	idx_lpart_t *lp;
+} idx_seg_t;
+
+static void idx_seg_reset(void *data)
+{
+	idx_seg_t *s = (idx_seg_t*)data;
+	int i;
+	for (i = 0; i < s->n_lp; ++i) free(s->lp[i].lidx.offset);
+	s->n_lp = s->n_run = 0;
+	s->n_rec = 0; s->n_no_coor = 0;
+	s->first_tid = s->last_tid = -1;
+	s->first_pos = s->last_pos = -1;
+}
+
+static int idx_seg_rec(void *data, const bam1_t *b, uint64_t off)
+{
+	idx_seg_t *s = (idx_seg_t*)data;
+	const bam1_core_t *c = &b->core;
+	idx_run_t *r = s->n_run? &s->run[s->n_run-1] : 0;
+	idx_lpart_t *lp = s->n_lp? &s->lp[s->n_lp-1] : 0;
+	uint32_t bin;
+	if (s->n_rec++ == 0) s->first_tid = c->tid, s->first_pos = c->pos;
+	if (c->tid < 0) {
+		if (s->n_no_coor++ == 0 && r) r->end = off;
+		return 0;
+	}
+	if (s->n_no_coor || c->tid >= s->idx->n) return -5; // unsorted or corrupted
+	if (s->last_tid >= 0 && (c->tid < s->last_tid || (c->tid == s->last_tid && c->pos < s->last_pos)))
+		return -5; // unsorted
+	s->last_tid = c->tid; s->last_pos = c->pos;
+	if (!(c->flag & BAM_FUNMAP)) {
+		if (lp == 0 || lp->tid != c->tid) {
+			if (s->n_lp == s->m_lp) {
+				s->m_lp = s->m_lp? s->m_lp<<1 : 4;
+				s->lp = (idx_lpart_t*)realloc(s->lp, s->m_lp * sizeof(idx_lpart_t));
+			}
+			lp = &s->lp[s->n_lp++];
+			memset(lp, 0, sizeof(idx_lpart_t));
+			lp->tid = c->tid;
+		}
+		insert_offset2(&lp->lidx, (bam1_t*)b, off, s->idx->min_shift);
+	}
+	bin = idx_bin(s->idx, b);
+	if (r == 0 || r->tid != c->tid || r->bin != bin) {
+		if (r) r->end = off;
+		if (s->n_run == s->m_run) {
+			s->m_run = s->m_run? s->m_run<<1 : 64;
+			s->run = (idx_run_t*)realloc(s->run, s->m_run * sizeof(idx_run_t));
+		}
+		r = &s->run[s->n_run++];
+		r->tid = c->tid; r->bin = bin;
+		r->beg = off; r->n_mapped = r->n_unmapped = 0;
+	}
+	if (c->flag & BAM_FUNMAP) ++r->n_unmapped;
+	else ++r->n_mapped;
+	return 0;
+}
+
+static bam_index_t *bam_index_core_mt(const char *fn, int n_threads, int min_shift, int n_lvls)
+{
+	bam_index_t *idx = 0;
+	scan_seg_t *seg;
+	idx_seg_t *iseg;
+	int32_t n_targets, i, l, last_tid, last_pos;
+	int64_t max_len;
+	uint64_t meta_bin;
+	int n_seg, j, k, have = 0;
+	idx_run_t cur;
+	uint64_t off_beg = 0, n_mapped = 0, n_unmapped = 0, n_no_coor = 0;
+
+	if ((seg = scan_split(fn, n_threads, &n_seg, &n_targets, &max_len)) == 0) return 0;
+	idx = idx_init(n_targets, max_len, min_shift, n_lvls);
+	meta_bin = idx_meta_bin(idx);
+	iseg = (idx_seg_t*)calloc(n_seg, sizeof(idx_seg_t));
+	for (i = 0; i < n_seg; ++i) {
+		iseg[i].idx = idx;
+		seg[i].func = idx_seg_rec, seg[i].reset = idx_seg_reset, seg[i].data = &iseg[i];
+	}
+
+	// index each segment
+	if (scan_run(seg, n_seg) != 0) goto end_mt;
+	for (i = 0; i < n_seg; ++i) // end the last run where the segment stops
+		if (iseg[i].n_run && iseg[i].n_no_coor == 0)
+			iseg[i].run[iseg[i].n_run-1].end = seg[i].stop;
+
+	// check sorting across segments
+	for (i = 0, l = 0, last_tid = last_pos = -1; i < n_seg; ++i) {
+		idx_seg_t *s = &iseg[i];
+		if (s->n_rec == 0) continue;
+		if (s->first_tid >= 0) {
+			if (l) goto end_mt; // reads with coordinates after reads without coordinates
+			if (last_tid >= 0 && (s->first_tid < last_tid || (s->first_tid == last_tid && s->first_pos < last_pos)))
+				goto end_mt;
+		}
+		if (s->last_tid >= 0) last_tid = s->last_tid, last_pos = s->last_pos;
+		if (s->n_no_coor) l = 1;
+	}
+
+	// replay the runs in the file order
+	memset(&cur, 0, sizeof(idx_run_t));
+	for (i = 0; i < n_seg; ++i) {
+		idx_seg_t *s = &iseg[i];
+		for (j = 0; j < s->n_run; ++j) {
+			idx_run_t *r = &s->run[j];
+			if (have && cur.tid == r->tid && cur.bin == r->bin) cur.end = r->end; // a run cut by the segment boundary
+			else {
+				if (have) {
+					insert_offset(idx->index[cur.tid], cur.bin, cur.beg, cur.end);
+					if (cur.tid != r->tid) { // write the meta element
+						insert_offset(idx->index[cur.tid], meta_bin, off_beg, r->beg);
+						insert_offset(idx->index[cur.tid], meta_bin, n_mapped, n_unmapped);
+						n_mapped = n_unmapped = 0;
+						off_beg = r->beg;
+					}
+				} else off_beg = r->beg;
+				cur = *r; have = 1;
+			}
+			n_mapped += r->n_mapped; n_unmapped += r->n_unmapped;
+		}
+		for (j = 0; j < s->n_lp; ++j) {
+			bam_lidx_t *p = &s->lp[j].lidx, *q = &idx->index2[s->lp[j].tid];
+			if (q->m < p->m) {
+				int old_m = q->m;
+				q->m = p->m;
+				q->offset = (uint64_t*)realloc(q->offset, q->m * 8);
+				memset(q->offset + old_m, 0, 8 * (q->m - old_m));
+			}
+			for (k = 0; k < p->m; ++k)
+				if (q->offset[k] == 0) q->offset[k] = p->offset[k];
+			q->n = p->n;
+		}
+		n_no_coor += s->n_no_coor;
+	}
+	if (have) {
+		if (n_no_coor == 0) cur.end = seg[n_seg-1].stop; // the end of file
+		insert_offset(idx->index[cur.tid], cur.bin, cur.beg, cur.end);
+		insert_offset(idx->index[cur.tid], meta_bin, off_beg, cur.end);
+		insert_offset(idx->index[cur.tid], meta_bin, n_mapped, n_unmapped);
+	}
+	merge_chunks(idx);
+	fill_missing(idx);
+	update_loff(idx);
+	idx->n_no_coor = n_no_coor;
+	have = -1; // success
+
+end_mt:
+	for (i = 0; i < n_seg; ++i) {
+		idx_seg_reset(&iseg[i]);
+		free(iseg[i].run); free(iseg[i].lp);
+	}
+	free(iseg); free(seg);
+	if (have != -1) {
+		bam_index_destroy(idx);
+		idx = 0;
+	}
+	return idx;
+}
+
+int bam_index_build4(const char *fn, const char *_fnidx, int min_shift, int n_lvls, int n_threads)
 {
 	char *fnidx;
 	FILE *fpidx;
 	bamFile fp;
-	bam_index_t *idx;
-	if ((fp = bam_open(fn, "r")) == 0) {
-		fprintf(stderr, "[bam_index_build2] fail to open the BAM file.\n");
+	bam_index_t *idx = 0;
+	if (min_shift > 0 && (min_shift + n_lvls * 3 > 62 || n_lvls > BAM_CSI_MAX_LVLS)) {
+		fprintf(stderr, "[bam_index_build2] invalid min_shift/depth for a CSI index.\n");
 		return -1;
 	}
-	idx = bam_index_core(fp);
-	bam_close(fp);
+	if (n_threads > 1 && strstr(fn, "ftp://") != fn && strstr(fn, "http://") != fn)
+		idx = bam_index_core_mt(fn, n_threads, min_shift, n_lvls);
+	if (idx == 0) { // single-threaded, or the file is not suitable for the multi-threaded indexer
+		if ((fp = bam_open(fn, "r")) == 0) {
+			fprintf(stderr, "[bam_index_build2] fail to open the BAM file.\n");
+			return -1;
+		}
+		idx = bam_index_core2(fp, min_shift, n_lvls);
+		bam_close(fp);
+	}
 	if(idx == 0) {
 		fprintf(stderr, "[bam_index_build2] fail to index the BAM file.\n");
 		return -1;
 	}
 	if (_fnidx == 0) {
 		fnidx = (char*)calloc(strlen(fn) + 5, 1);
-		strcpy(fnidx, fn); strcat(fnidx, ".bai");
+		strcpy(fnidx, fn); strcat(fnidx, idx->is_csi? ".csi" : ".bai");
 	} else fnidx = strdup(_fnidx);
 	fpidx = fopen(fnidx, "wb");
 	if (fpidx == 0) {
@@ -503,6 +1301,16 @@ int bam_index_build2(const char *fn, const char *_fnidx)
 	return 0;
 }
 
+int bam_index_build3(const char *fn, const char *_fnidx, int n_threads)
+{
+	return bam_index_build4(fn, _fnidx, 0, 0, n_threads);
+}
+
+int bam_index_build2(const char *fn, const char *_fnidx)
+{
+	return bam_index_build3(fn, _fnidx, 0);
+}
+
 int bam_index_build(const char *fn)
 {
 	return bam_index_build2(fn, 0);
@@ -510,12 +1318,27 @@ int bam_index_build(const char *fn)
 
 int bam_index(int argc, char *argv[])
 {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: samtools index <in.bam> [out.index]\n");
+	int c, n_threads = 0, min_shift = 0, n_lvls = 0;
+	while ((c = getopt(argc, argv, "@:cm:d:")) >= 0) {
+		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
+		case 'c': if (min_shift == 0) min_shift = BAM_CSI_MIN_SHIFT; break;
+		case 'm': min_shift = atoi(optarg); break;
+		case 'd': n_lvls = atoi(optarg); break;
+		}
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   samtools index [options] <in.bam> [out.index]\n\n");
+		fprintf(stderr, "Options: -c        generate a CSI index instead of BAI\n");
+		fprintf(stderr, "         -m INT    CSI: the smallest bin spans 2^INT bp [%d]\n", BAM_CSI_MIN_SHIFT);
+		fprintf(stderr, "         -d INT    CSI: number of levels below the root bin [fit the longest reference]\n");
+		fprintf(stderr, "         -@ INT    number of threads [1]\n");
+		fprintf(stderr, "\n");
 		return 1;
 	}
-	if (argc >= 3) bam_index_build2(argv[1], argv[2]);
-	else bam_index_build(argv[1]);
+	if (min_shift < 0 || (n_lvls > 0 && min_shift == 0)) min_shift = BAM_CSI_MIN_SHIFT; // -m or -d imply -c
+	bam_index_build4(argv[optind], optind + 2 <= argc? argv[optind+1] : 0, min_shift, n_lvls, n_threads);
 	return 0;
 }
 
@@ -537,9 +1360,9 @@ int bam_idxstats(int argc, char *argv[])
 	if (idx == 0) { fprintf(stderr, "[%s] fail to load the index.\n", __func__); return 1; }
 	for (i = 0; i < idx->n; ++i) {
 		khint_t k;
-		khash_t(i) *h = idx->index[i];
+		khash_t(i) *h = idx_get_ref(idx, i);
 		printf("%s\t%d", header->target_name[i], header->target_len[i]);
-		k = kh_get(i, h, BAM_MAX_BIN);
+		k = kh_get(i, h, idx_meta_bin(idx));
 		if (k != kh_end(h))
 			printf("\t%llu\t%llu", (long long)kh_val(h, k).list[1].u, (long long)kh_val(h, k).list[1].v);
 		else printf("\t0\t0");
@@ -551,56 +1374,79 @@ int bam_idxstats(int argc, char *argv[])
 	return 0;
 }
 
-static inline int reg2bins(uint32_t beg, uint32_t end, uint16_t list[BAM_MAX_BIN])
+// bins overlapping [beg,end); with min_shift=14 and n_lvls=5 this is the UCSC scheme
+static inline int reg2bins(int64_t beg, int64_t end, int min_shift, int n_lvls, int *m, uint32_t **list)
 {
-	int i = 0, k;
+	int i = 0, l, t, s = min_shift + n_lvls * 3;
 	if (beg >= end) return 0;
-	if (end >= 1u<<29) end = 1u<<29;
-	--end;
-	list[i++] = 0;
-	for (k =    1 + (beg>>26); k <=    1 + (end>>26); ++k) list[i++] = k;
-	for (k =    9 + (beg>>23); k <=    9 + (end>>23); ++k) list[i++] = k;
-	for (k =   73 + (beg>>20); k <=   73 + (end>>20); ++k) list[i++] = k;
-	for (k =  585 + (beg>>17); k <=  585 + (end>>17); ++k) list[i++] = k;
-	for (k = 4681 + (beg>>14); k <= 4681 + (end>>14); ++k) list[i++] = k;
+	if (end >= 1LL<<s) end = 1LL<<s;
+	for (--end, l = t = 0; l <= n_lvls; s -= 3, t += 1<<((l<<1) + l), ++l) {
+		int64_t k, b = t + (beg>>s), e = t + (end>>s);
+		if (i + e - b + 1 > *m) {
+			*m = i + e - b + 1;
+			kroundup32(*m);
+			*list = (uint32_t*)realloc(*list, *m * 4);
+		}
+		for (k = b; k <= e; ++k) (*list)[i++] = k;
+	}
 	return i;
 }
 
 static inline int is_overlap(uint32_t beg, uint32_t end, const bam1_t *b)
 {
 	uint32_t rbeg = b->core.pos;
-	uint32_t rend = b->core.n_cigar? bam_calend(&b->core, bam1_cigar(b)) : b->core.pos + 1;
+	uint32_t rend = b->core.n_cigar? bam1_calend(b) : b->core.pos + 1;
 	return (rend > beg && rbeg < end);
 }
 
+typedef struct {
+	int tid, beg, end, i; // i: index in the caller's list
+} iter_reg_t;
+
+#define iter_reg_lt(a, b) ((a).tid < (b).tid || ((a).tid == (b).tid && (a).beg < (b).beg))
+KSORT_INIT(reg, iter_reg_t, iter_reg_lt)
+
 struct __bam_iter_t {
 	int from_first; // read from the first record; no random access
+	int is_range; // return all records in the chunks; no region
 	int tid, beg, end, n_off, i, finished;
 	uint64_t curr_off;
 	pair64_t *off;
+	// for a multi-region iterator
+	int n_reg, reg_i, reg; // reg_i: the first region not passed yet; reg: region of the last record
+	iter_reg_t *regs; // sorted by (tid,beg)
 };
 
-// bam_fetch helper function retrieves 
-bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
+// chunks possibly overlapping tid:beg-end, not sorted
+static pair64_t *iter_chunks(const bam_index_t *idx, int tid, int beg, int end, int *cnt_off)
 {
-	uint16_t *bins;
-	int i, n_bins, n_off;
+	uint32_t *bins = 0;
+	int i, n_bins, n_off, m_bins = 0;
 	pair64_t *off;
 	khint_t k;
 	khash_t(i) *index;
 	uint64_t min_off;
-	bam_iter_t iter = 0;
 
-	if (beg < 0) beg = 0;
-	if (end < beg) return 0;
-	// initialize iter
-	iter = calloc(1, sizeof(struct __bam_iter_t));
-	iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
-	//
-	bins = (uint16_t*)calloc(BAM_MAX_BIN, 2);
-	n_bins = reg2bins(beg, end, bins);
-	index = idx->index[tid];
-	if (idx->index2[tid].n > 0) {
+	*cnt_off = 0;
+	index = idx_get_ref(idx, tid);
+	if (beg == 0 && end >= 1LL<<(idx->min_shift + idx->n_lvls * 3)) { // the whole reference; faster than listing all possible bins
+		bins = (uint32_t*)malloc((kh_size(index) + 1) * 4);
+		for (k = kh_begin(index), n_bins = 0; k != kh_end(index); ++k)
+			if (kh_exist(index, k) && kh_key(index, k) != idx_meta_bin(idx))
+				bins[n_bins++] = kh_key(index, k);
+	} else n_bins = reg2bins(beg, end, idx->min_shift, idx->n_lvls, &m_bins, &bins);
+	if (idx->is_csi) { // the offset of the bin at, or closest to the left of, the leaf bin containing beg
+		int bin = bin_first(idx->n_lvls) + (beg>>idx->min_shift);
+		do {
+			int first;
+			if ((k = kh_get(i, index, bin)) != kh_end(index)) break;
+			first = (((bin - 1)>>3)<<3) + 1; // the first sibling
+			if (bin > first) --bin;
+			else bin = (bin - 1)>>3; // the parent
+		} while (bin);
+		if (bin == 0) k = kh_get(i, index, bin);
+		min_off = k != kh_end(index)? kh_val(index, k).loff : 0;
+	} else if (idx->index2[tid].n > 0) {
 		min_off = (beg>>BAM_LIDX_SHIFT >= idx->index2[tid].n)? idx->index2[tid].offset[idx->index2[tid].n-1]
 			: idx->index2[tid].offset[beg>>BAM_LIDX_SHIFT];
 		if (min_off == 0) { // improvement for index files built by tabix prior to 0.1.4
@@ -616,7 +1462,7 @@ bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
 			n_off += kh_value(index, k).n;
 	}
 	if (n_off == 0) {
-		free(bins); return iter;
+		free(bins); return 0;
 	}
 	off = (pair64_t*)calloc(n_off, 16);
 	for (i = n_off = 0; i < n_bins; ++i) {
@@ -629,39 +1475,94 @@ bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
 	}
 	free(bins);
 	if (n_off == 0) {
-		free(off); return iter;
-	}
-	{
-		bam1_t *b = (bam1_t*)calloc(1, sizeof(bam1_t));
-		int l;
-		ks_introsort(off, n_off, off);
-		// resolve completely contained adjacent blocks
-		for (i = 1, l = 0; i < n_off; ++i)
-			if (off[l].v < off[i].v)
-				off[++l] = off[i];
-		n_off = l + 1;
-		// resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
-		for (i = 1; i < n_off; ++i)
-			if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
-		{ // merge adjacent blocks
+		free(off); return 0;
+	}
+	*cnt_off = n_off;
+	return off;
+}
+
+// sort chunks, and merge overlapping or adjacent ones; return the new number of chunks
+static int iter_coalesce(pair64_t *off, int n_off)
+{
+	int i, l;
+	if (n_off == 0) return 0;
+	ks_introsort(off, n_off, off);
+	// resolve completely contained adjacent blocks
+	for (i = 1, l = 0; i < n_off; ++i)
+		if (off[l].v < off[i].v)
+			off[++l] = off[i];
+	n_off = l + 1;
+	// resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
+	for (i = 1; i < n_off; ++i)
+		if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
+	{ // merge adjacent blocks
 #if defined(BAM_TRUE_OFFSET) || defined(BAM_VIRTUAL_OFFSET16)
-			for (i = 1, l = 0; i < n_off; ++i) {
+		for (i = 1, l = 0; i < n_off; ++i) {
 #ifdef BAM_TRUE_OFFSET
-				if (off[l].v + BAM_MIN_CHUNK_GAP > off[i].u) off[l].v = off[i].v;
+			if (off[l].v + BAM_MIN_CHUNK_GAP > off[i].u) off[l].v = off[i].v;
 #else
-				if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
+			if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
 #endif
-				else off[++l] = off[i];
-			}
-			n_off = l + 1;
+			else off[++l] = off[i];
+		}
+		n_off = l + 1;
 #endif
+	}
+	return n_off;
+}
+
+// bam_fetch helper function retrieves 
+bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
+{
+	bam_iter_t iter = 0;
+
+	if (beg < 0) beg = 0;
+	if (end < beg) return 0;
+	// initialize iter
+	iter = calloc(1, sizeof(struct __bam_iter_t));
+	iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
+	iter->off = iter_chunks(idx, tid, beg, end, &iter->n_off);
+	iter->n_off = iter_coalesce(iter->off, iter->n_off);
+	return iter;
+}
+
+bam_iter_t bam_iter_query_regs(const bam_index_t *idx, int n, const bam_region_t *regs)
+{
+	bam_iter_t iter;
+	int i, m_off = 0;
+
+	iter = calloc(1, sizeof(struct __bam_iter_t));
+	iter->i = -1; iter->reg = -1;
+	iter->regs = (iter_reg_t*)calloc(n > 0? n : 1, sizeof(iter_reg_t));
+	for (i = 0; i < n; ++i) {
+		iter_reg_t *r;
+		pair64_t *off;
+		int n_off;
+		if (regs[i].tid < 0 || regs[i].tid >= idx->n || regs[i].end <= regs[i].beg) continue;
+		r = &iter->regs[iter->n_reg++];
+		r->tid = regs[i].tid, r->beg = regs[i].beg > 0? regs[i].beg : 0, r->end = regs[i].end, r->i = i;
+		// union the chunks of all regions; each block will then be read at most once
+		if ((off = iter_chunks(idx, r->tid, r->beg, r->end, &n_off)) == 0) continue;
+		if (iter->n_off + n_off > m_off) {
+			m_off = iter->n_off + n_off;
+			kroundup32(m_off);
+			iter->off = (pair64_t*)realloc(iter->off, m_off * 16);
 		}
-		bam_destroy1(b);
+		memcpy(iter->off + iter->n_off, off, n_off * 16);
+		iter->n_off += n_off;
+		free(off);
 	}
-	iter->n_off = n_off; iter->off = off;
+	ks_introsort(reg, iter->n_reg, iter->regs);
+	iter->n_off = iter_coalesce(iter->off, iter->n_off);
+	if (iter->n_off == 0) { free(iter->off); iter->off = 0; }
 	return iter;
 }
 
+int bam_iter_region(const bam_iter_t iter)
+{
+	return iter && iter->regs? iter->reg : 0;
+}
+
 pair64_t *get_chunk_coordinates(const bam_index_t *idx, int tid, int beg, int end, int *cnt_off)
 { // for pysam compatibility
 	bam_iter_t iter;
@@ -674,7 +1575,26 @@ pair64_t *get_chunk_coordinates(const bam_index_t *idx, int tid, int beg, int en
 
 void bam_iter_destroy(bam_iter_t iter)
 {
-	if (iter) { free(iter->off); free(iter); }
+	if (iter) { free(iter->off); free(iter->regs); free(iter); }
+}
+
+// the first region overlapping _b_; -1 if there is none, or -2 if all regions are before _b_
+static int iter_match(bam_iter_t iter, const bam1_t *b)
+{
+	int j;
+	uint32_t rend;
+	for (; iter->reg_i < iter->n_reg; ++iter->reg_i) { // skip regions ending before b
+		const iter_reg_t *r = &iter->regs[iter->reg_i];
+		if (r->tid > b->core.tid || (r->tid == b->core.tid && r->end > b->core.pos)) break;
+	}
+	if (b->core.tid < 0 || iter->reg_i == iter->n_reg) return -2;
+	rend = b->core.n_cigar? bam1_calend(b) : b->core.pos + 1;
+	for (j = iter->reg_i; j < iter->n_reg; ++j) {
+		const iter_reg_t *r = &iter->regs[j];
+		if (r->tid != b->core.tid || (uint32_t)r->beg >= rend) break;
+		if (is_overlap(r->beg, r->end, b)) return r->i;
+	}
+	return -1;
 }
 
 int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
@@ -699,7 +1619,14 @@ int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
 		}
 		if ((ret = bam_read1(fp, b)) >= 0) {
 			iter->curr_off = bam_tell(fp);
-			if (b->core.tid != iter->tid || b->core.pos >= iter->end) { // no need to proceed
+			if (iter->is_range) return ret;
+			if (iter->regs) {
+				if ((iter->reg = iter_match(iter, b)) >= 0) return ret;
+				if (iter->reg == -2) { // past the last region
+					ret = bam_validate1(NULL, b)? -1 : -5;
+					break;
+				}
+			} else if (b->core.tid != iter->tid || b->core.pos >= iter->end) { // no need to proceed
 				ret = bam_validate1(NULL, b)? -1 : -5; // determine whether end of region or error
 				break;
 			}
@@ -722,3 +1649,173 @@ int bam_fetch(bamFile fp, const bam_index_t *idx, int tid, int beg, int end, voi
 	bam_destroy1(b);
 	return (ret == -1)? 0 : ret;
 }
+
+bam_iter_t bam_iter_range(uint64_t beg, uint64_t end)
+{
+	bam_iter_t iter;
+	iter = calloc(1, sizeof(struct __bam_iter_t));
+	iter->i = -1; iter->is_range = 1;
+	if (beg < end) {
+		iter->n_off = 1;
+		iter->off = (pair64_t*)malloc(16);
+		iter->off[0].u = beg, iter->off[0].v = end;
+	}
+	return iter;
+}
+
+/*
+  Sharding. Shards are cut at the windows of the linear index (BAI) or at
+  the first windows of the bins (CSI) such that they have about the same compressed size.
+  A shard is at the same time a range of virtual offsets, which covers
+  each record exactly once with the unplaced reads in the last shard, and
+  a range of positions, for tools that need every read overlapping a
+  position.
+ */
+
+typedef struct {
+	int tid, pos;
+	uint64_t off;
+} idx_cut_t;
+
+#define idx_cut_lt(a, b) ((a).pos < (b).pos)
+KSORT_INIT(cut, idx_cut_t, idx_cut_lt)
+
+static inline void idx_push_cut(int *n, int *m, idx_cut_t **cut, int tid, int64_t pos, uint64_t off)
+{
+	if (pos > INT_MAX || off == 0) return;
+	if (*n == *m) {
+		*m = *m? *m<<1 : 256;
+		*cut = (idx_cut_t*)realloc(*cut, *m * sizeof(idx_cut_t));
+	}
+	(*cut)[*n].tid = tid, (*cut)[*n].pos = pos, (*cut)[*n].off = off;
+	++*n;
+}
+
+bam_shard_t *bam_index_shard(const bam_index_t *idx, int n, uint64_t off0, int *n_shards)
+{
+	idx_cut_t *cut = 0;
+	bam_shard_t *s;
+	int i, j, n_cut = 0, m_cut = 0;
+	uint64_t max_off = off0, size;
+
+	// candidate cuts in the coordinate order, and roughly the end of the placed records
+	for (i = 0; i < idx->n; ++i) {
+		khash_t(i) *h = idx_get_ref(idx, i);
+		int n0 = n_cut;
+		khint_t k;
+		for (k = kh_begin(h); k != kh_end(h); ++k) {
+			bam_binlist_t *p;
+			if (!kh_exist(h, k) || kh_key(h, k) == idx_meta_bin(idx)) continue;
+			p = &kh_val(h, k);
+			for (j = 0; j < p->n; ++j)
+				if (p->list[j].u > max_off) max_off = p->list[j].u; // .v may be an EOF offset of another form
+			if (idx->is_csi) { // cut at the first window of the bin
+				int l, bin = kh_key(h, k);
+				for (l = idx->n_lvls; l > 0 && bin < bin_first(l); --l);
+				idx_push_cut(&n_cut, &m_cut, &cut, i, (int64_t)(bin - bin_first(l)) << ((idx->n_lvls - l) * 3 + idx->min_shift), p->loff);
+			}
+		}
+		if (idx->is_csi) ks_introsort(cut, n_cut - n0, cut + n0);
+		else {
+			const bam_lidx_t *l = &idx->index2[i];
+			for (j = 0; j < l->n; ++j)
+				idx_push_cut(&n_cut, &m_cut, &cut, i, (int64_t)j << BAM_LIDX_SHIFT, l->offset[j]);
+		}
+	}
+	// take a cut each time another 1/n of the compressed data is passed
+	if (n < 1) n = 1;
+	size = (max_off>>16) > (off0>>16)? (max_off>>16) - (off0>>16) : 0;
+	s = (bam_shard_t*)calloc(n, sizeof(bam_shard_t));
+	s[0].off = off0;
+	for (i = 0, *n_shards = 1; i < n_cut && *n_shards < n; ++i) {
+		const idx_cut_t *c = &cut[i];
+		bam_shard_t *q = &s[*n_shards - 1];
+		if (c->off <= q->off || (c->tid == q->tid && c->pos <= q->beg)) continue;
+		if (((c->off>>16) - (off0>>16)) * n < size * *n_shards) continue;
+		q->tid_end = c->tid, q->end = c->pos, q->off_end = c->off;
+		++q;
+		q->tid = c->tid, q->beg = c->pos, q->off = c->off;
+		++*n_shards;
+	}
+	s[*n_shards - 1].tid_end = idx->n - 1;
+	s[*n_shards - 1].end = INT_MAX;
+	s[*n_shards - 1].off_end = (uint64_t)-1;
+	free(cut);
+	return s;
+}
+
+bam_iter_t bam_shard_query(const bam_index_t *idx, const bam_shard_t *s)
+{
+	bam_region_t *regs;
+	bam_iter_t iter;
+	int tid, n = 0;
+	regs = (bam_region_t*)calloc(s->tid_end - s->tid + 1, sizeof(bam_region_t));
+	for (tid = s->tid; tid <= s->tid_end; ++tid, ++n) { // empty regions are skipped by bam_iter_query_regs()
+		regs[n].tid = tid;
+		regs[n].beg = tid == s->tid? s->beg : 0;
+		regs[n].end = tid == s->tid_end? s->end : INT_MAX;
+	}
+	iter = bam_iter_query_regs(idx, n, regs);
+	free(regs);
+	return iter;
+}
+
+typedef struct {
+	int n_shards, next, n_merged, ret;
+	uint8_t *done;
+	bam_shard_f func;
+	bam_shard_merge_f merge;
+	void *data;
+	pthread_mutex_t lock;
+} shard_pool_t;
+
+typedef struct {
+	shard_pool_t *p;
+	int t;
+} shard_worker_t;
+
+static void *shard_worker(void *_w)
+{
+	shard_worker_t *w = (shard_worker_t*)_w;
+	shard_pool_t *p = w->p;
+	for (;;) {
+		int i, ret;
+		pthread_mutex_lock(&p->lock);
+		i = p->ret < 0? p->n_shards : p->next++; // stop taking shards after an error
+		pthread_mutex_unlock(&p->lock);
+		if (i >= p->n_shards) break;
+		ret = p->func(p->data, i, w->t);
+		pthread_mutex_lock(&p->lock);
+		if (ret < 0 && p->ret == 0) p->ret = ret;
+		p->done[i] = 1;
+		// merge the finished shards in order; done under the lock so merges never run concurrently
+		while (p->ret == 0 && p->n_merged < p->n_shards && p->done[p->n_merged]) {
+			if (p->merge) p->merge(p->data, p->n_merged);
+			++p->n_merged;
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+	return 0;
+}
+
+int bam_shard_run(int n_threads, int n_shards, bam_shard_f func, bam_shard_merge_f merge, void *data)
+{
+	shard_pool_t p;
+	shard_worker_t *w;
+	pthread_t *tid;
+	int t;
+	memset(&p, 0, sizeof(shard_pool_t));
+	p.n_shards = n_shards, p.func = func, p.merge = merge, p.data = data;
+	p.done = (uint8_t*)calloc(n_shards > 0? n_shards : 1, 1);
+	pthread_mutex_init(&p.lock, 0);
+	if (n_threads < 1) n_threads = 1;
+	w = (shard_worker_t*)calloc(n_threads, sizeof(shard_worker_t));
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	for (t = 0; t < n_threads; ++t) w[t].p = &p, w[t].t = t;
+	for (t = 1; t < n_threads; ++t) pthread_create(&tid[t], 0, shard_worker, &w[t]);
+	shard_worker(&w[0]); // the calling thread is worker 0
+	for (t = 1; t < n_threads; ++t) pthread_join(tid[t], 0);
+	pthread_mutex_destroy(&p.lock);
+	free(w); free(tid); free(p.done);
+	return p.ret;
+}
@@ -18,7 +18,7 @@ void bam_template_cigar(bam1_t *b1, bam1_t *b2, kstring_t *str)
 		kputw(bam_cigar_oplen(cigar[i]), str);
 		kputc(bam_cigar_opchr(cigar[i]), str);
 	}
-	end = bam_calend(&b1->core, cigar);
+	end = bam1_calend(b1);
 	kputw(b2->core.pos - end, str);
 	kputc('T', str);
 	kputc((b2->core.flag & BAM_FREAD1)? '1' : '2', str); // segment index
@@ -52,7 +52,7 @@ void bam_mating_core(bamFile in, bamFile out, int remove_reads)
             if ( !remove_reads ) bam_write1(out, cur);
             continue;
         }
-		cur_end = bam_calend(&cur->core, bam1_cigar(cur));
+		cur_end = bam1_calend(cur);
 		if (cur_end > (int)header->target_len[cur->core.tid]) cur->core.flag |= BAM_FUNMAP;
 		if (cur->core.flag & BAM_FSECONDARY) 
         {
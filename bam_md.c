@@ -305,19 +305,118 @@ int bam_prob_realn(bam1_t *b, const char *ref)
 	return bam_prob_realn_core(b, ref, 1);
 }
 
+typedef struct { // for calmd on several threads; reads are processed in batches
+	int flt_flag, max_nm, is_realn, capQ, baq_flag;
+	int n, m;           // reads in the batch
+	bam1_t **b;
+	char **ref;         // ref[i] is the reference of b[i]
+	samfile_t *fpout;
+	// the reference cache: sequences used by the current batch
+	faidx_t *fai;
+	const bam_header_t *h;
+	int n_seq, m_seq;
+	int *seq_tid, *seq_used;
+	char **seq;
+} calmd_aux_t;
+
+#define CALMD_CHUNK 1024
+
+static char *calmd_ref(calmd_aux_t *a, int tid, int batch)
+{
+	int i, len;
+	for (i = 0; i < a->n_seq; ++i)
+		if (a->seq_tid[i] == tid) break;
+	if (i == a->n_seq) {
+		if (a->n_seq == a->m_seq) {
+			a->m_seq = a->m_seq? a->m_seq<<1 : 4;
+			a->seq_tid = realloc(a->seq_tid, a->m_seq * sizeof(int));
+			a->seq_used = realloc(a->seq_used, a->m_seq * sizeof(int));
+			a->seq = realloc(a->seq, a->m_seq * sizeof(char*));
+		}
+		a->seq_tid[i] = tid;
+		a->seq[i] = fai_fetch(a->fai, a->h->target_name[tid], &len);
+		if (a->seq[i] == 0)
+			fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n", a->h->target_name[tid]);
+		++a->n_seq;
+	}
+	a->seq_used[i] = batch;
+	return a->seq[i];
+}
+
+static void calmd1(calmd_aux_t *a, bam1_t *b, char *ref)
+{
+	if (b->core.tid < 0) return;
+	if (a->is_realn) bam_prob_realn_core(b, ref, a->baq_flag);
+	if (a->capQ > 10) {
+		int q = bam_cap_mapQ(b, ref, a->capQ);
+		if (b->core.qual > q) b->core.qual = q;
+	}
+	if (ref) bam_fillmd1_core(b, ref, a->flt_flag, a->max_nm);
+}
+
+static int calmd_chunk(void *data, int k, int t)
+{
+	calmd_aux_t *a = (calmd_aux_t*)data;
+	int i, end = (k + 1) * CALMD_CHUNK < a->n? (k + 1) * CALMD_CHUNK : a->n;
+	for (i = k * CALMD_CHUNK; i < end; ++i) calmd1(a, a->b[i], a->ref[i]);
+	return 0;
+}
+
+static void calmd_write(void *data, int k)
+{
+	calmd_aux_t *a = (calmd_aux_t*)data;
+	int i, end = (k + 1) * CALMD_CHUNK < a->n? (k + 1) * CALMD_CHUNK : a->n;
+	for (i = k * CALMD_CHUNK; i < end; ++i) samwrite(a->fpout, a->b[i]);
+}
+
+// read, process and write the input in batches of reads, each processed on n_threads threads
+static void calmd_mt(calmd_aux_t *a, samfile_t *fp, int n_threads)
+{
+	int i, j, batch = 0, is_eof = 0;
+	a->m = CALMD_CHUNK * n_threads * 16;
+	a->b = calloc(a->m, sizeof(bam1_t*));
+	a->ref = calloc(a->m, sizeof(char*));
+	for (i = 0; i < a->m; ++i) a->b[i] = bam_init1();
+	while (!is_eof) {
+		for (a->n = 0; a->n < a->m; ++a->n) {
+			bam1_t *b = a->b[a->n];
+			if (samread(fp, b) < 0) {
+				is_eof = 1;
+				break;
+			}
+			a->ref[a->n] = b->core.tid >= 0? calmd_ref(a, b->core.tid, batch) : 0;
+		}
+		bam_shard_run(n_threads, (a->n + CALMD_CHUNK - 1) / CALMD_CHUNK, calmd_chunk, calmd_write, a);
+		for (i = j = 0; i < a->n_seq; ++i) { // drop the sequences not used by this batch
+			if (a->seq_used[i] != batch) {
+				free(a->seq[i]);
+				continue;
+			}
+			a->seq_tid[j] = a->seq_tid[i], a->seq_used[j] = a->seq_used[i], a->seq[j++] = a->seq[i];
+		}
+		a->n_seq = j;
+		++batch;
+	}
+	for (i = 0; i < a->m; ++i) bam_destroy1(a->b[i]);
+	for (i = 0; i < a->n_seq; ++i) free(a->seq[i]);
+	free(a->b); free(a->ref);
+	free(a->seq_tid); free(a->seq_used); free(a->seq);
+}
+
 int bam_fillmd(int argc, char *argv[])
 {
-	int c, flt_flag, tid = -2, ret, len, is_bam_out, is_sam_in, is_uncompressed, max_nm, is_realn, capQ, baq_flag;
+	int c, flt_flag, tid = -2, ret, len, is_bam_out, is_sam_in, is_uncompressed, max_nm, is_realn, capQ, baq_flag, n_threads = 1;
 	samfile_t *fp, *fpout = 0;
 	faidx_t *fai;
 	char *ref = 0, mode_w[8], mode_r[8];
 	bam1_t *b;
+	calmd_aux_t a;
 
 	flt_flag = UPDATE_NM | UPDATE_MD;
 	is_bam_out = is_sam_in = is_uncompressed = is_realn = max_nm = capQ = baq_flag = 0;
 	mode_w[0] = mode_r[0] = 0;
 	strcpy(mode_r, "r"); strcpy(mode_w, "w");
-	while ((c = getopt(argc, argv, "EqreuNhbSC:n:Ad")) >= 0) {
+	while ((c = getopt(argc, argv, "EqreuNhbSC:n:Ad@:")) >= 0) {
 		switch (c) {
 		case 'r': is_realn = 1; break;
 		case 'e': flt_flag |= USE_EQUAL; break;
@@ -332,6 +431,7 @@ int bam_fillmd(int argc, char *argv[])
 		case 'C': capQ = atoi(optarg); break;
 		case 'A': baq_flag |= 1; break;
 		case 'E': baq_flag |= 2; break;
+		case '@': n_threads = atoi(optarg); break;
 		default: fprintf(stderr, "[bam_fillmd] unrecognized option '-%c'\n", c); return 1;
 		}
 	}
@@ -348,7 +448,8 @@ int bam_fillmd(int argc, char *argv[])
 		fprintf(stderr, "         -S       the input is SAM with header\n");
 		fprintf(stderr, "         -A       modify the quality string\n");
 		fprintf(stderr, "         -r       compute the BQ tag (without -A) or cap baseQ by BAQ (with -A)\n");
-		fprintf(stderr, "         -E       extended BAQ for better sensitivity but lower specificity\n\n");
+		fprintf(stderr, "         -E       extended BAQ for better sensitivity but lower specificity\n");
+		fprintf(stderr, "         -@ INT   number of threads [1]\n\n");
 		return 1;
 	}
 	fp = samopen(argv[optind], mode_r, 0);
@@ -360,10 +461,14 @@ int bam_fillmd(int argc, char *argv[])
 	fpout = samopen("-", mode_w, fp->header);
 	fai = fai_load(argv[optind+1]);
 
-	b = bam_init1();
-	while ((ret = samread(fp, b)) >= 0) {
-		if (b->core.tid >= 0) {
-			if (tid != b->core.tid) {
+	memset(&a, 0, sizeof(calmd_aux_t));
+	a.flt_flag = flt_flag, a.max_nm = max_nm, a.is_realn = is_realn, a.capQ = capQ, a.baq_flag = baq_flag;
+	a.fpout = fpout, a.fai = fai, a.h = fp->header;
+	if (n_threads > 1) calmd_mt(&a, fp, n_threads);
+	else {
+		b = bam_init1();
+		while ((ret = samread(fp, b)) >= 0) {
+			if (b->core.tid >= 0 && tid != b->core.tid) {
 				free(ref);
 				ref = fai_fetch(fai, fp->header->target_name[b->core.tid], &len);
 				tid = b->core.tid;
@@ -371,16 +476,11 @@ int bam_fillmd(int argc, char *argv[])
 					fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
 							fp->header->target_name[tid]);
 			}
-			if (is_realn) bam_prob_realn_core(b, ref, baq_flag);
-			if (capQ > 10) {
-				int q = bam_cap_mapQ(b, ref, capQ);
-				if (b->core.qual > q) b->core.qual = q;
-			}
-			if (ref) bam_fillmd1_core(b, ref, flt_flag, max_nm);
+			calmd1(&a, b, ref);
+			samwrite(fpout, b);
 		}
-		samwrite(fpout, b);
+		bam_destroy1(b);
 	}
-	bam_destroy1(b);
 
 	free(ref);
 	fai_destroy(fai);
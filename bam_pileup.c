@@ -3,60 +3,14 @@
 #include <ctype.h>
 #include <assert.h>
 #include "sam.h"
+#include "ksort.h"
 
 typedef struct {
 	int k, x, y, end;
+	int op, len; // of CIGAR operation k
 } cstate_t;
 
-static cstate_t g_cstate_null = { -1, 0, 0, 0 };
-
-typedef struct __linkbuf_t {
-	bam1_t b;
-	uint32_t beg, end;
-	cstate_t s;
-	struct __linkbuf_t *next;
-} lbnode_t;
-
-/* --- BEGIN: Memory pool */
-
-typedef struct {
-	int cnt, n, max;
-	lbnode_t **buf;
-} mempool_t;
-
-static mempool_t *mp_init()
-{
-	mempool_t *mp;
-	mp = (mempool_t*)calloc(1, sizeof(mempool_t));
-	return mp;
-}
-static void mp_destroy(mempool_t *mp)
-{
-	int k;
-	for (k = 0; k < mp->n; ++k) {
-		free(mp->buf[k]->b.data);
-		free(mp->buf[k]);
-	}
-	free(mp->buf);
-	free(mp);
-}
-static inline lbnode_t *mp_alloc(mempool_t *mp)
-{
-	++mp->cnt;
-	if (mp->n == 0) return (lbnode_t*)calloc(1, sizeof(lbnode_t));
-	else return mp->buf[--mp->n];
-}
-static inline void mp_free(mempool_t *mp, lbnode_t *p)
-{
-	--mp->cnt; p->next = 0; // clear lbnode_t::next here
-	if (mp->n == mp->max) {
-		mp->max = mp->max? mp->max<<1 : 256;
-		mp->buf = (lbnode_t**)realloc(mp->buf, sizeof(lbnode_t*) * mp->max);
-	}
-	mp->buf[mp->n++] = p;
-}
-
-/* --- END: Memory pool */
+static cstate_t g_cstate_null = { -1, 0, 0, 0, 0, 0 };
 
 /* --- BEGIN: Auxiliary functions */
 
@@ -115,6 +69,7 @@ static inline int resolve_cigar2(bam_pileup1_t *p, uint32_t pos, cstate_t *s)
 	{ // collect pileup information
 		int op, l;
 		op = _cop(cigar[s->k]); l = _cln(cigar[s->k]);
+		s->op = op, s->len = l;
 		p->is_del = p->indel = p->is_refskip = 0;
 		if (s->x + l - 1 == pos && s->k + 1 < c->n_cigar) { // peek the next operation
 			int op2 = _cop(cigar[s->k+1]);
@@ -148,45 +103,101 @@ static inline int resolve_cigar2(bam_pileup1_t *p, uint32_t pos, cstate_t *s)
  * pileup iterator *
  *******************/
 
+/*
+  The reads overlapping the pileup are kept in the input order in arrays
+  indexed alike (structure of arrays), which are compacted while a
+  position is scanned. The records themselves are not copied: the "auto"
+  interface reads into a spare record that is kept as it is, and records
+  of the reads that have ended are reused with their data capacity.
+
+  Once the buffer holds maxcnt reads, the reads starting at the current
+  position are sampled: those with the smallest keys, a seeded hash of
+  the read name, are kept. A read with a larger key than all those kept
+  is rejected before it is copied; otherwise it takes the place of the
+  kept read with the largest key. The sample is uniform over the reads
+  starting at the position and does not depend on the order of reads or
+  on where the input is split.
+ */
+
+#define PLP_SEED 11
+
+// max-heap of key<<32|j, for the j-th read from the start of the window
+KSORT_INIT(plpkey, uint64_t, ks_lt_generic)
+
+static inline uint32_t plp_key(const bam1_t *b)
+{
+	const char *s = bam1_qname(b);
+	uint32_t key = *s;
+	if (key) for (++s; *s; ++s) key = (key << 5) - key + *s;
+	key ^= PLP_SEED;
+	key += ~(key << 15);
+	key ^=  (key >> 10);
+	key +=  (key << 3);
+	key ^=  (key >> 6);
+	key += ~(key << 11);
+	key ^=  (key >> 16);
+	return key;
+}
+
 struct __bam_plp_t {
-	mempool_t *mp;
-	lbnode_t *head, *tail, *dummy;
+	int n, m;          // reads in the pileup buffer
+	bam1_t **b;        // records, in the input order
+	int32_t *b_tid;
+	uint32_t *beg, *end;
+	cstate_t *s;       // CIGAR state of each read
+	int n_free, m_free;
+	bam1_t **free;     // records to reuse
 	int32_t tid, pos, max_tid, max_pos;
 	int is_eof, flag_mask, max_plp, error, maxcnt;
 	bam_pileup1_t *plp;
+	// the window: the last win_n reads in the buffer, all starting at win_tid:win_pos
+	int32_t win_tid, win_pos;
+	int win_n, m_win, is_full;
+	uint64_t *win;     // heap of the keys, once the buffer is full
 	// for the "auto" interface only
-	bam1_t *b;
+	bam1_t *next;      // the record to read into
 	bam_plp_auto_f func;
 	void *data;
 };
 
+static inline bam1_t *plp_alloc(bam_plp_t iter)
+{
+	return iter->n_free? iter->free[--iter->n_free] : (bam1_t*)calloc(1, sizeof(bam1_t));
+}
+
+static inline void plp_free(bam_plp_t iter, bam1_t *b)
+{
+	if (iter->n_free == iter->m_free) {
+		iter->m_free = iter->m_free? iter->m_free<<1 : 256;
+		iter->free = (bam1_t**)realloc(iter->free, sizeof(bam1_t*) * iter->m_free);
+	}
+	iter->free[iter->n_free++] = b;
+}
+
 bam_plp_t bam_plp_init(bam_plp_auto_f func, void *data)
 {
 	bam_plp_t iter;
 	iter = calloc(1, sizeof(struct __bam_plp_t));
-	iter->mp = mp_init();
-	iter->head = iter->tail = mp_alloc(iter->mp);
-	iter->dummy = mp_alloc(iter->mp);
 	iter->max_tid = iter->max_pos = -1;
 	iter->flag_mask = BAM_DEF_MASK;
 	iter->maxcnt = 8000;
+	iter->win_tid = -1;
 	if (func) {
 		iter->func = func;
 		iter->data = data;
-		iter->b = bam_init1();
+		iter->next = bam_init1();
 	}
 	return iter;
 }
 
 void bam_plp_destroy(bam_plp_t iter)
 {
-	mp_free(iter->mp, iter->dummy);
-	mp_free(iter->mp, iter->head);
-	if (iter->mp->cnt != 0)
-		fprintf(stderr, "[bam_plp_destroy] memory leak: %d. Continue anyway.\n", iter->mp->cnt);
-	mp_destroy(iter->mp);
-	if (iter->b) bam_destroy1(iter->b);
-	free(iter->plp);
+	int i;
+	bam_plp_reset(iter);
+	for (i = 0; i < iter->n_free; ++i) bam_destroy1(iter->free[i]);
+	if (iter->next) bam_destroy1(iter->next);
+	free(iter->b); free(iter->b_tid); free(iter->beg); free(iter->end); free(iter->s);
+	free(iter->free); free(iter->plp); free(iter->win);
 	free(iter);
 }
 
@@ -194,73 +205,134 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 {
 	if (iter->error) { *_n_plp = -1; return 0; }
 	*_n_plp = 0;
-	if (iter->is_eof && iter->head->next == 0) return 0;
+	if (iter->is_eof && iter->n == 0) return 0;
 	while (iter->is_eof || iter->max_tid > iter->tid || (iter->max_tid == iter->tid && iter->max_pos > iter->pos)) {
-		int n_plp = 0;
-		lbnode_t *p, *q;
-		// write iter->plp at iter->pos
-		iter->dummy->next = iter->head;
-		for (p = iter->head, q = iter->dummy; p->next; q = p, p = p->next) {
-			if (p->b.core.tid < iter->tid || (p->b.core.tid == iter->tid && p->end <= iter->pos)) { // then remove
-				q->next = p->next; mp_free(iter->mp, p); p = q;
-			} else if (p->b.core.tid == iter->tid && p->beg <= iter->pos) { // here: p->end > pos; then add to pileup
+		int i, j, n_plp = 0;
+		// write iter->plp at iter->pos, dropping the reads that have ended
+		for (i = j = 0; i < iter->n; ++i) {
+			bam1_t *b = iter->b[i];
+			cstate_t *c;
+			if (iter->b_tid[i] < iter->tid || (iter->b_tid[i] == iter->tid && iter->end[i] <= iter->pos)) { // then remove
+				plp_free(iter, b);
+				continue;
+			}
+			if (j < i) {
+				iter->b[j] = b, iter->b_tid[j] = iter->b_tid[i], iter->beg[j] = iter->beg[i], iter->end[j] = iter->end[i];
+				iter->s[j] = iter->s[i];
+			}
+			c = &iter->s[j];
+			if (iter->b_tid[j] == iter->tid && iter->beg[j] <= iter->pos) { // here: end > pos; then add to pileup
+				bam_pileup1_t *p;
 				if (n_plp == iter->max_plp) { // then double the capacity
 					iter->max_plp = iter->max_plp? iter->max_plp<<1 : 256;
 					iter->plp = (bam_pileup1_t*)realloc(iter->plp, sizeof(bam_pileup1_t) * iter->max_plp);
 				}
-				iter->plp[n_plp].b = &p->b;
-				if (resolve_cigar2(iter->plp + n_plp, iter->pos, &p->s)) ++n_plp; // actually always true...
+				p = iter->plp + n_plp++;
+				p->b = b;
+				if (c->k >= 0 && (int)iter->pos - c->x < c->len - 1) { // before the last base of an operation; no need to look at the record
+					p->indel = 0;
+					if (c->op == BAM_CDEL || c->op == BAM_CREF_SKIP) p->is_del = 1, p->qpos = c->y, p->is_refskip = (c->op == BAM_CREF_SKIP);
+					else p->is_del = p->is_refskip = 0, p->qpos = c->y + (iter->pos - c->x);
+					p->is_head = (iter->pos == iter->beg[j]); p->is_tail = (iter->pos == c->end);
+				} else resolve_cigar2(p, iter->pos, c);
 			}
+			++j;
 		}
-		iter->head = iter->dummy->next; // dummy->next may be changed
+		iter->n = j;
 		*_n_plp = n_plp; *_tid = iter->tid; *_pos = iter->pos;
 		// update iter->tid and iter->pos
-		if (iter->head->next) {
-			if (iter->tid > iter->head->b.core.tid) {
+		if (iter->n) {
+			int32_t tid = iter->b_tid[0];
+			if (iter->tid > tid) {
 				fprintf(stderr, "[%s] unsorted input. Pileup aborts.\n", __func__);
 				iter->error = 1;
 				*_n_plp = -1;
 				return 0;
 			}
-		}
-		if (iter->tid < iter->head->b.core.tid) { // come to a new reference sequence
-			iter->tid = iter->head->b.core.tid; iter->pos = iter->head->beg; // jump to the next reference
-		} else if (iter->pos < iter->head->beg) { // here: tid == head->b.core.tid
-			iter->pos = iter->head->beg; // jump to the next position
-		} else ++iter->pos; // scan contiguously
+			if (iter->tid < tid) { // come to a new reference sequence
+				iter->tid = tid; iter->pos = iter->beg[0]; // jump to the next reference
+			} else if (iter->pos < iter->beg[0]) { // here: tid == b[0]->core.tid
+				iter->pos = iter->beg[0]; // jump to the next position
+			} else ++iter->pos; // scan contiguously
+		} else ++iter->pos; // only at the end of the input
 		// return
 		if (n_plp) return iter->plp;
-		if (iter->is_eof && iter->head->next == 0) break;
+		if (iter->is_eof && iter->n == 0) break;
 	}
 	return 0;
 }
 
+// add _b_ to the pileup; copy it if _copy_, or keep it otherwise. Return 1 if added
+static int plp_push1(bam_plp_t iter, bam1_t *b, int copy)
+{
+	uint32_t beg, end;
+	if (b->core.tid < 0) return 0;
+	if (b->core.flag & iter->flag_mask) return 0;
+	beg = b->core.pos; end = bam1_calend(b);
+	if (b->core.tid < iter->max_tid) {
+		fprintf(stderr, "[bam_pileup_core] the input is not sorted (chromosomes out of order)\n");
+		iter->error = 1;
+		return -1;
+	}
+	if ((b->core.tid == iter->max_tid) && (beg < iter->max_pos)) {
+		fprintf(stderr, "[bam_pileup_core] the input is not sorted (reads out of order)\n");
+		iter->error = 1;
+		return -1;
+	}
+	iter->max_tid = b->core.tid; iter->max_pos = beg;
+	if (end <= iter->pos && b->core.tid <= iter->tid) return 0; // ended before the current position
+	if (b->core.tid != iter->win_tid || beg != iter->win_pos) { // start a new window
+		iter->win_tid = b->core.tid, iter->win_pos = beg;
+		iter->win_n = iter->is_full = 0;
+	}
+	// the list this replaced also counted a tail and a dummy node
+	if (iter->tid == b->core.tid && iter->pos == beg && iter->n + 2 > iter->maxcnt) { // full; sample the window
+		uint32_t key;
+		int k;
+		if (iter->win_n == 0) return 0;
+		if (!iter->is_full) { // key the reads in the window
+			if (iter->win_n > iter->m_win) {
+				iter->m_win = iter->win_n;
+				kroundup32(iter->m_win);
+				iter->win = (uint64_t*)realloc(iter->win, sizeof(uint64_t) * iter->m_win);
+			}
+			for (k = 0; k < iter->win_n; ++k)
+				iter->win[k] = (uint64_t)plp_key(iter->b[iter->n - iter->win_n + k]) << 32 | k;
+			ks_heapmake(plpkey, iter->win_n, iter->win);
+			iter->is_full = 1;
+		}
+		key = plp_key(b);
+		if (key >= iter->win[0] >> 32) return 0; // not in the sample
+		k = iter->n - iter->win_n + (uint32_t)iter->win[0];
+		if (copy) b = bam_copy1(iter->b[k], b);
+		else plp_free(iter, iter->b[k]);
+		iter->b[k] = b; iter->end[k] = end;
+		iter->s[k] = g_cstate_null; iter->s[k].end = end - 1;
+		iter->win[0] = (uint64_t)key << 32 | (uint32_t)iter->win[0];
+		ks_heapadjust(plpkey, 0, iter->win_n, iter->win);
+		return 1;
+	}
+	if (iter->n == iter->m) {
+		iter->m = iter->m? iter->m<<1 : 256;
+		iter->b = (bam1_t**)realloc(iter->b, sizeof(bam1_t*) * iter->m);
+		iter->b_tid = (int32_t*)realloc(iter->b_tid, sizeof(int32_t) * iter->m);
+		iter->beg = (uint32_t*)realloc(iter->beg, sizeof(uint32_t) * iter->m);
+		iter->end = (uint32_t*)realloc(iter->end, sizeof(uint32_t) * iter->m);
+		iter->s = (cstate_t*)realloc(iter->s, sizeof(cstate_t) * iter->m);
+	}
+	if (copy) b = bam_copy1(plp_alloc(iter), b);
+	iter->b[iter->n] = b; iter->b_tid[iter->n] = b->core.tid;
+	iter->beg[iter->n] = beg; iter->end[iter->n] = end;
+	iter->s[iter->n] = g_cstate_null; iter->s[iter->n].end = end - 1; // initialize cstate_t
+	++iter->n; ++iter->win_n;
+	return 1;
+}
+
 int bam_plp_push(bam_plp_t iter, const bam1_t *b)
 {
 	if (iter->error) return -1;
-	if (b) {
-		if (b->core.tid < 0) return 0;
-		if (b->core.flag & iter->flag_mask) return 0;
-		if (iter->tid == b->core.tid && iter->pos == b->core.pos && iter->mp->cnt > iter->maxcnt) return 0;
-		bam_copy1(&iter->tail->b, b);
-		iter->tail->beg = b->core.pos; iter->tail->end = bam_calend(&b->core, bam1_cigar(b));
-		iter->tail->s = g_cstate_null; iter->tail->s.end = iter->tail->end - 1; // initialize cstate_t
-		if (b->core.tid < iter->max_tid) {
-			fprintf(stderr, "[bam_pileup_core] the input is not sorted (chromosomes out of order)\n");
-			iter->error = 1;
-			return -1;
-		}
-		if ((b->core.tid == iter->max_tid) && (iter->tail->beg < iter->max_pos)) {
-			fprintf(stderr, "[bam_pileup_core] the input is not sorted (reads out of order)\n");
-			iter->error = 1;
-			return -1;
-		}
-		iter->max_tid = b->core.tid; iter->max_pos = iter->tail->beg;
-		if (iter->tail->end > iter->pos || iter->tail->b.core.tid > iter->tid) {
-			iter->tail->next = mp_alloc(iter->mp);
-			iter->tail = iter->tail->next;
-		}
-	} else iter->is_eof = 1;
+	if (b) return plp_push1(iter, (bam1_t*)b, 1) < 0? -1 : 0;
+	iter->is_eof = 1;
 	return 0;
 }
 
@@ -272,11 +344,13 @@ const bam_pileup1_t *bam_plp_auto(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 	else { // no pileup line can be obtained; read alignments
 		*_n_plp = 0;
 		if (iter->is_eof) return 0;
-		while (iter->func(iter->data, iter->b) >= 0) {
-			if (bam_plp_push(iter, iter->b) < 0) {
+		while (iter->func(iter->data, iter->next) >= 0) {
+			int ret = plp_push1(iter, iter->next, 0);
+			if (ret < 0) {
 				*_n_plp = -1;
 				return 0;
 			}
+			if (ret > 0) iter->next = plp_alloc(iter); // the record is kept in the pileup
 			if ((plp = bam_plp_next(iter, _tid, _pos, _n_plp)) != 0) return plp;
 			// otherwise no pileup line can be returned; read the next alignment.
 		}
@@ -288,16 +362,13 @@ const bam_pileup1_t *bam_plp_auto(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 
 void bam_plp_reset(bam_plp_t iter)
 {
-	lbnode_t *p, *q;
+	int i;
 	iter->max_tid = iter->max_pos = -1;
 	iter->tid = iter->pos = 0;
 	iter->is_eof = 0;
-	for (p = iter->head; p->next;) {
-		q = p->next;
-		mp_free(iter->mp, p);
-		p = q;
-	}
-	iter->head = iter->tail;
+	for (i = 0; i < iter->n; ++i) plp_free(iter, iter->b[i]);
+	iter->n = 0;
+	iter->win_tid = -1, iter->win_n = iter->is_full = 0;
 }
 
 void bam_plp_set_mask(bam_plp_t iter, int mask)
@@ -371,29 +442,75 @@ int bam_plbuf_push(const bam1_t *b, bam_plbuf_t *buf)
  * mpileup *
  ***********/
 
+/*
+  The inputs are kept in a min-heap on their next position, so a call only
+  advances and re-inserts the inputs reported at the previous position,
+  and only pops those at the new minimum: O(k log n) for k inputs at a
+  position out of n.
+ */
+
+typedef struct {
+	uint64_t pos; // tid<<32|pos of the next pileup line of input i
+	int i;
+} mplp_node_t;
+
+// ties are broken by the input index, so that inputs are popped in the input order
+#define mplp_node_lt(a, b) ((a).pos < (b).pos || ((a).pos == (b).pos && (a).i < (b).i))
+
 struct __bam_mplp_t {
 	int n;
-	uint64_t min, *pos;
+	uint64_t min;
 	bam_plp_t *iter;
 	int *n_plp;
 	const bam_pileup1_t **plp;
+	int n_heap, n_cur;
+	mplp_node_t *heap;
+	int *cur; // inputs at iter->min, in the input order
+	int *out_n_plp; // the output arrays last written
+	const bam_pileup1_t **out_plp;
 };
 
+static inline void mplp_heap_up(mplp_node_t *h, int k)
+{
+	mplp_node_t t = h[k];
+	while (k > 0) {
+		int p = (k - 1) >> 1;
+		if (!mplp_node_lt(t, h[p])) break;
+		h[k] = h[p]; k = p;
+	}
+	h[k] = t;
+}
+
+static inline void mplp_heap_down(mplp_node_t *h, int n, int k)
+{
+	mplp_node_t t = h[k];
+	for (;;) {
+		int c = (k << 1) + 1;
+		if (c >= n) break;
+		if (c + 1 < n && mplp_node_lt(h[c+1], h[c])) ++c;
+		if (!mplp_node_lt(h[c], t)) break;
+		h[k] = h[c]; k = c;
+	}
+	h[k] = t;
+}
+
 bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data)
 {
 	int i;
 	bam_mplp_t iter;
 	iter = calloc(1, sizeof(struct __bam_mplp_t));
-	iter->pos = calloc(n, 8);
 	iter->n_plp = calloc(n, sizeof(int));
 	iter->plp = calloc(n, sizeof(void*));
 	iter->iter = calloc(n, sizeof(void*));
+	iter->heap = calloc(n, sizeof(mplp_node_t));
+	iter->cur = calloc(n, sizeof(int));
 	iter->n = n;
 	iter->min = (uint64_t)-1;
 	for (i = 0; i < n; ++i) {
 		iter->iter[i] = bam_plp_init(func, data[i]);
-		iter->pos[i] = iter->min;
+		iter->cur[i] = i; // all inputs are advanced at the first call
 	}
+	iter->n_cur = n;
 	return iter;
 }
 
@@ -408,30 +525,315 @@ void bam_mplp_destroy(bam_mplp_t iter)
 {
 	int i;
 	for (i = 0; i < iter->n; ++i) bam_plp_destroy(iter->iter[i]);
-	free(iter->iter); free(iter->pos); free(iter->n_plp); free(iter->plp);
+	free(iter->iter); free(iter->n_plp); free(iter->plp);
+	free(iter->heap); free(iter->cur);
 	free(iter);
 }
 
 int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp)
 {
-	int i, ret = 0;
-	uint64_t new_min = (uint64_t)-1;
+	int i, j;
+	// advance the inputs at the last position
+	for (j = 0; j < iter->n_cur; ++j) {
+		int tid, pos;
+		mplp_node_t *h;
+		i = iter->cur[j];
+		iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
+		if (iter->plp[i] == 0) continue; // no more pileup lines from this input
+		h = &iter->heap[iter->n_heap];
+		h->pos = (uint64_t)tid<<32 | pos, h->i = i;
+		mplp_heap_up(iter->heap, iter->n_heap++);
+	}
+	// clear the last output; all of it if the arrays are new
+	if (n_plp != iter->out_n_plp || plp != iter->out_plp) {
+		memset(n_plp, 0, iter->n * sizeof(int));
+		memset(plp, 0, iter->n * sizeof(void*));
+		iter->out_n_plp = n_plp, iter->out_plp = plp;
+	} else {
+		for (j = 0; j < iter->n_cur; ++j)
+			n_plp[iter->cur[j]] = 0, plp[iter->cur[j]] = 0;
+	}
+	iter->n_cur = 0;
+	if (iter->n_heap == 0) {
+		iter->min = (uint64_t)-1;
+		return 0;
+	}
+	// take all inputs at the new minimum
+	iter->min = iter->heap[0].pos;
+	while (iter->n_heap > 0 && iter->heap[0].pos == iter->min) {
+		i = iter->heap[0].i;
+		iter->cur[iter->n_cur++] = i;
+		n_plp[i] = iter->n_plp[i], plp[i] = iter->plp[i];
+		iter->heap[0] = iter->heap[--iter->n_heap];
+		if (iter->n_heap > 0) mplp_heap_down(iter->heap, iter->n_heap, 0);
+	}
+	*_tid = iter->min>>32; *_pos = (uint32_t)iter->min;
+	return iter->n_cur;
+}
+
+/************
+ * coverage *
+ ************/
+
+/*
+  Read counts per position without the pileup. Each read adds +1 at the
+  start and -1 past the end of its span, and of each of its M/=/X
+  segments, to a difference array; prefix sums give the counts. The
+  array is a ring over the positions that reads can still reach, so it
+  only grows with the longest read span. A position is final, and is
+  output, once the next read of every input starts after it. Reads
+  starting at the same position are kept aside, by swapping records, to
+  be taken out again if the pileup would drop them from its sample.
+ */
+
+typedef struct {
+	bam1_t *b;          // the next read
+	int32_t tid, pos;   // of the last read, to check the order
+	int32_t kept_tid, kept_pos; // of the last read the pileup would keep, where its cursor is
+	int n_end, m_end;
+	mplp_node_t *end;   // min-heap of the ends of the reads the pileup would hold, but those in the window
+	int32_t win_tid, win_pos;
+	int win_n, m_win, m_win_b, is_full, n_pool;
+	bam1_t **win_b, **pool; // reads in the window; records to reuse
+	uint64_t *win;      // as in bam_plp_t
+} cov_input_t;
+
+struct __bam_cov_t {
+	int n, maxcnt, min_baseQ, error, is_init;
+	bam_plp_auto_f func;
+	void **data;
+	cov_input_t *in;
+	int n_heap;
+	mplp_node_t *heap;  // inputs on the position of their next read
+	int32_t tid, pos, fin, max_end; // the next position to output; positions before fin are final
+	int m;              // size of the ring, a power of 2
+	int32_t *d;         // d[(pos&(m-1))*2n+i]: the difference of cov of the i-th input; d[..+n+i] that of dp
+	int32_t *cnt;       // cov and dp at pos
+};
+
+bam_cov_t bam_cov_init(int n, bam_plp_auto_f func, void **data)
+{
+	int i;
+	bam_cov_t iter;
+	iter = calloc(1, sizeof(struct __bam_cov_t));
+	iter->n = n, iter->func = func, iter->data = data;
+	iter->maxcnt = 8000;
+	iter->in = calloc(n, sizeof(cov_input_t));
+	for (i = 0; i < n; ++i) iter->in[i].b = bam_init1(), iter->in[i].win_tid = -1;
+	iter->heap = calloc(n, sizeof(mplp_node_t));
+	iter->cnt = calloc(2 * n, sizeof(int32_t));
+	iter->tid = -1, iter->max_end = -1;
+	return iter;
+}
+
+void bam_cov_set_maxcnt(bam_cov_t iter, int maxcnt)
+{
+	iter->maxcnt = maxcnt;
+}
+
+void bam_cov_set_baseQ(bam_cov_t iter, int min_baseQ)
+{
+	iter->min_baseQ = min_baseQ;
+}
+
+void bam_cov_destroy(bam_cov_t iter)
+{
+	int i;
 	for (i = 0; i < iter->n; ++i) {
-		if (iter->pos[i] == iter->min) {
-			int tid, pos;
-			iter->plp[i] = bam_plp_auto(iter->iter[i], &tid, &pos, &iter->n_plp[i]);
-			iter->pos[i] = (uint64_t)tid<<32 | pos;
+		cov_input_t *in = &iter->in[i];
+		int j;
+		for (j = 0; j < in->win_n; ++j) bam_destroy1(in->win_b[j]);
+		for (j = 0; j < in->n_pool; ++j) bam_destroy1(in->pool[j]);
+		bam_destroy1(in->b);
+		free(in->end); free(in->win_b); free(in->pool); free(in->win);
+	}
+	free(iter->in); free(iter->heap); free(iter->d); free(iter->cnt);
+	free(iter);
+}
+
+// read the next usable read of input i and put the input in the heap; return 0 at the end
+static int cov_read(bam_cov_t iter, int i)
+{
+	cov_input_t *in = &iter->in[i];
+	while (iter->func(iter->data[i], in->b) >= 0) {
+		const bam1_core_t *c = &in->b->core;
+		if (c->tid < 0 || (c->flag & BAM_DEF_MASK)) continue;
+		if (c->tid < in->tid || (c->tid == in->tid && c->pos < in->pos)) {
+			fprintf(stderr, "[bam_cov_auto] the input is not sorted.\n");
+			iter->error = 1;
+			return -1;
 		}
-		if (iter->plp[i] && iter->pos[i] < new_min) new_min = iter->pos[i];
+		in->tid = c->tid, in->pos = c->pos;
+		iter->heap[iter->n_heap].pos = (uint64_t)c->tid<<32 | c->pos;
+		iter->heap[iter->n_heap].i = i;
+		mplp_heap_up(iter->heap, iter->n_heap++);
+		return 1;
 	}
-	iter->min = new_min;
-	if (new_min == (uint64_t)-1) return 0;
-	*_tid = new_min>>32; *_pos = (uint32_t)new_min;
-	for (i = 0; i < iter->n; ++i) {
-		if (iter->pos[i] == iter->min) { // FIXME: valgrind reports "uninitialised value(s) at this line"
-			n_plp[i] = iter->n_plp[i], plp[i] = iter->plp[i];
-			++ret;
-		} else n_plp[i] = 0, plp[i] = 0;
+	return 0;
+}
+
+// make the ring hold the positions from iter->pos to end
+static void cov_reserve(bam_cov_t iter, int32_t end)
+{
+	int n2 = iter->n * 2, m = iter->m;
+	int32_t p, *d;
+	if (end - iter->pos < m) return;
+	m = end - iter->pos + 1;
+	kroundup32(m);
+	d = calloc((size_t)m * n2, sizeof(int32_t));
+	for (p = iter->pos; p <= iter->max_end; ++p)
+		memcpy(d + (size_t)(p & (m - 1)) * n2, iter->d + (size_t)(p & (iter->m - 1)) * n2, n2 * sizeof(int32_t));
+	free(iter->d);
+	iter->d = d, iter->m = m;
+}
+
+#define cov_diff(iter, p, k) ((iter)->d[(size_t)((p) & ((iter)->m - 1)) * (iter)->n * 2 + (k)])
+
+// add the counts of b to the i-th input, or take them out if w < 0
+static void cov_walk(bam_cov_t iter, int i, const bam1_t *b, int w)
+{
+	const bam1_core_t *c = &b->core;
+	const uint32_t *cigar = bam1_cigar(b);
+	int32_t end = bam1_calend(b), x, y, k;
+	if (end <= c->pos) return;
+	if (w > 0) {
+		cov_reserve(iter, end);
+		if (end > iter->max_end) iter->max_end = end;
+	}
+	cov_diff(iter, c->pos, i) += w; cov_diff(iter, end, i) -= w;
+	for (k = 0, x = c->pos, y = 0; k < c->n_cigar; ++k) {
+		int op = cigar[k] & BAM_CIGAR_MASK, l = cigar[k] >> BAM_CIGAR_SHIFT;
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			if (iter->min_baseQ > 0) { // runs of bases passing the quality threshold
+				const uint8_t *qual = bam1_qual(b) + y;
+				int j, j0;
+				for (j = 0; j < l; ) {
+					for (; j < l && qual[j] < iter->min_baseQ; ++j);
+					for (j0 = j; j < l && qual[j] >= iter->min_baseQ; ++j);
+					if (j > j0) cov_diff(iter, x + j0, iter->n + i) += w, cov_diff(iter, x + j, iter->n + i) -= w;
+				}
+			} else cov_diff(iter, x, iter->n + i) += w, cov_diff(iter, x + l, iter->n + i) -= w;
+			x += l, y += l;
+		} else if (op == BAM_CDEL || op == BAM_CREF_SKIP) x += l;
+		else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) y += l;
+	}
+}
+
+static inline void cov_push_end(cov_input_t *in, int32_t end)
+{
+	if (in->n_end == in->m_end) {
+		in->m_end = in->m_end? in->m_end<<1 : 256;
+		in->end = realloc(in->end, in->m_end * sizeof(mplp_node_t));
+	}
+	in->end[in->n_end].pos = end, in->end[in->n_end].i = 0;
+	mplp_heap_up(in->end, in->n_end++);
+}
+
+// add in->b, the next read of the i-th input, and get a record for its next read
+static void cov_add(bam_cov_t iter, int i)
+{
+	cov_input_t *in = &iter->in[i];
+	bam1_t *b = in->b, *t;
+	const bam1_core_t *c = &b->core;
+	int32_t end = bam1_calend(b);
+	if (c->tid != in->win_tid || c->pos != in->win_pos) { // close the window
+		int j;
+		for (j = 0; j < in->win_n; ++j) {
+			cov_push_end(in, bam1_calend(in->win_b[j]));
+			in->pool[in->n_pool++] = in->win_b[j];
+		}
+		in->win_n = in->is_full = 0;
+		in->win_tid = c->tid, in->win_pos = c->pos;
+	}
+	// drop the reads that bam_plp_next() would have removed by now
+	if (c->tid != in->kept_tid) in->n_end = 0;
+	while (in->n_end > 0 && (int64_t)in->end[0].pos < c->pos) {
+		in->end[0] = in->end[--in->n_end];
+		if (in->n_end > 0) mplp_heap_down(in->end, in->n_end, 0);
+	}
+	if (c->tid == in->kept_tid && end <= in->kept_pos) return; // ended before the cursor
+	if (c->tid == in->kept_tid && c->pos == in->kept_pos && in->n_end + in->win_n + 2 > iter->maxcnt) { // full; sample as bam_plp_push() would
+		uint32_t key;
+		int j;
+		if (in->win_n == 0) return;
+		if (!in->is_full) {
+			if (in->win_n > in->m_win) {
+				in->m_win = in->win_n;
+				kroundup32(in->m_win);
+				in->win = realloc(in->win, sizeof(uint64_t) * in->m_win);
+			}
+			for (j = 0; j < in->win_n; ++j)
+				in->win[j] = (uint64_t)plp_key(in->win_b[j]) << 32 | j;
+			ks_heapmake(plpkey, in->win_n, in->win);
+			in->is_full = 1;
+		}
+		key = plp_key(b);
+		if (key >= in->win[0] >> 32) return;
+		j = (uint32_t)in->win[0];
+		cov_walk(iter, i, in->win_b[j], -1);
+		cov_walk(iter, i, b, 1);
+		t = in->win_b[j], in->win_b[j] = b, in->b = t;
+		in->win[0] = (uint64_t)key << 32 | j;
+		ks_heapadjust(plpkey, 0, in->win_n, in->win);
+		return;
+	}
+	in->kept_tid = c->tid, in->kept_pos = c->pos;
+	cov_walk(iter, i, b, 1);
+	if (in->win_n == in->m_win_b) {
+		in->m_win_b = in->m_win_b? in->m_win_b<<1 : 256;
+		in->win_b = realloc(in->win_b, sizeof(bam1_t*) * in->m_win_b);
+		in->pool = realloc(in->pool, sizeof(bam1_t*) * in->m_win_b);
+	}
+	in->win_b[in->win_n++] = b;
+	in->b = in->n_pool? in->pool[--in->n_pool] : bam_init1();
+}
+
+int bam_cov_auto(bam_cov_t iter, int *_tid, int *_pos, int *cov, int *dp)
+{
+	int i, n = iter->n;
+	if (iter->error) return -1;
+	if (!iter->is_init) {
+		for (i = 0; i < n; ++i)
+			if (cov_read(iter, i) < 0) return -1;
+		iter->is_init = 1;
+	}
+	for (;;) {
+		bam1_t *b;
+		// output the covered positions before fin
+		while (iter->pos < iter->fin && iter->pos <= iter->max_end) {
+			int32_t *d = &cov_diff(iter, iter->pos, 0);
+			int sum = 0;
+			for (i = 0; i < n * 2; ++i)
+				iter->cnt[i] += d[i], d[i] = 0;
+			for (i = 0; i < n; ++i) sum += iter->cnt[i];
+			if (sum > 0) {
+				*_tid = iter->tid, *_pos = iter->pos++;
+				if (cov) memcpy(cov, iter->cnt, n * sizeof(int));
+				if (dp) memcpy(dp, iter->cnt + n, n * sizeof(int));
+				return 1;
+			}
+			++iter->pos;
+		}
+		if (iter->pos < iter->fin) iter->pos = iter->fin; // no reads in between
+		if (iter->n_heap == 0) { // no more reads
+			if (iter->pos > iter->max_end) return 0;
+			iter->fin = iter->max_end + 1;
+			continue;
+		}
+		// the next read of all inputs
+		i = iter->heap[0].i;
+		b = iter->in[i].b;
+		if (b->core.tid != iter->tid) { // come to a new reference; finish the last one first
+			if (iter->pos <= iter->max_end) {
+				iter->fin = iter->max_end + 1;
+				continue;
+			}
+			iter->tid = b->core.tid, iter->pos = b->core.pos, iter->max_end = -1;
+		}
+		iter->fin = b->core.pos;
+		cov_add(iter, i);
+		iter->heap[0] = iter->heap[--iter->n_heap];
+		if (iter->n_heap > 0) mplp_heap_down(iter->heap, iter->n_heap, 0);
+		if (cov_read(iter, i) < 0) return -1;
 	}
-	return ret;
 }
@@ -4,31 +4,18 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include "sam.h"
 #include "faidx.h"
 #include "kstring.h"
 
-static inline int printw(int c, FILE *fp)
-{
-	char buf[16];
-	int l, x;
-	if (c == 0) return fputc('0', fp);
-	for (l = 0, x = c < 0? -c : c; x > 0; x /= 10) buf[l++] = x%10 + '0';
-	if (c < 0) buf[l++] = '-';
-	buf[l] = 0;
-	for (x = 0; x < l/2; ++x) {
-		int y = buf[x]; buf[x] = buf[l-1-x]; buf[l-1-x] = y;
-	}
-	fputs(buf, fp);
-	return 0;
-}
-
-static inline void pileup_seq(const bam_pileup1_t *p, int pos, int ref_len, const char *ref)
+static inline void pileup_seq(const bam_pileup1_t *p, int pos, int ref_len, const char *ref, kstring_t *s)
 {
 	int j;
 	if (p->is_head) {
-		putchar('^');
-		putchar(p->b->core.qual > 93? 126 : p->b->core.qual + 33);
+		kputc('^', s);
+		kputc(p->b->core.qual > 93? 126 : p->b->core.qual + 33, s);
 	}
 	if (!p->is_del) {
 		int c = bam_nt16_rev_table[bam1_seqi(bam1_seq(p->b), p->qpos)];
@@ -40,22 +27,22 @@ static inline void pileup_seq(const bam_pileup1_t *p, int pos, int ref_len, cons
 			if (c == '=') c = bam1_strand(p->b)? ',' : '.';
 			else c = bam1_strand(p->b)? tolower(c) : toupper(c);
 		}
-		putchar(c);
-	} else putchar(p->is_refskip? (bam1_strand(p->b)? '<' : '>') : '*');
+		kputc(c, s);
+	} else kputc(p->is_refskip? (bam1_strand(p->b)? '<' : '>') : '*', s);
 	if (p->indel > 0) {
-		putchar('+'); printw(p->indel, stdout);
+		kputc('+', s); kputw(p->indel, s);
 		for (j = 1; j <= p->indel; ++j) {
 			int c = bam_nt16_rev_table[bam1_seqi(bam1_seq(p->b), p->qpos + j)];
-			putchar(bam1_strand(p->b)? tolower(c) : toupper(c));
+			kputc(bam1_strand(p->b)? tolower(c) : toupper(c), s);
 		}
 	} else if (p->indel < 0) {
-		printw(p->indel, stdout);
+		kputw(p->indel, s);
 		for (j = 1; j <= -p->indel; ++j) {
 			int c = (ref && (int)pos+j < ref_len)? ref[pos+j] : 'N';
-			putchar(bam1_strand(p->b)? tolower(c) : toupper(c));
+			kputc(bam1_strand(p->b)? tolower(c) : toupper(c), s);
 		}
 	}
-	if (p->is_tail) putchar('$');
+	if (p->is_tail) kputc('$', s);
 }
 
 #include <assert.h>
@@ -76,22 +63,45 @@ static inline void pileup_seq(const bam_pileup1_t *p, int pos, int ref_len, cons
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, int beg, int end);
+bam_region_t *bed_regions(const void *_h, const bam_header_t *header, int *n);
+bam_index_t *bam_index_load_local(const char *fn);
 
 typedef struct {
 	int max_mq, min_mq, flag, min_baseQ, capQ_thres, max_depth, max_indel_depth, fmt_flag;
 	int openQ, extQ, tandemQ, min_support; // for indels
 	double min_frac; // for indels
-	char *reg, *pl_list;
+	int n_threads, shard_pad; // for -@
+	char *reg, *pl_list, *view_opts; // view_opts: for -c
+	bcf_queue_t *q; // with -c, the records go to bcftools view on another thread
 	faidx_t *fai;
 	void *bed, *rghash;
 } mplp_conf_t;
 
+typedef struct {
+	int tid, len, cnt;
+	char *seq;
+} mplp_seq_t;
+
+typedef struct { // reference sequences loaded on demand and shared by all threads
+	faidx_t *fai;
+	const bam_header_t *h;
+	int n, m;
+	mplp_seq_t *a;
+	pthread_mutex_t lock;
+} mplp_refs_t;
+
+typedef struct { // the sequences used by one pileup: the one at the output and the one of the latest read
+	mplp_refs_t *refs;
+	int pin; // tid at the output, which is kept loaded
+	int tid[2], len[2];
+	char *seq[2];
+} mplp_ref_t;
+
 typedef struct {
 	bamFile fp;
 	bam_iter_t iter;
 	bam_header_t *h;
-	int ref_id;
-	char *ref;
+	mplp_ref_t *ref;
 	const mplp_conf_t *conf;
 } mplp_aux_t;
 
@@ -101,6 +111,72 @@ typedef struct {
 	bam_pileup1_t **plp;
 } mplp_pileup_t;
 
+static char *refs_acquire(mplp_refs_t *r, int tid, int *len)
+{
+	mplp_seq_t *p;
+	int i;
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->n && r->a[i].tid != tid; ++i);
+	if (i == r->n) { // not loaded; faidx is not thread safe, so fetch under the lock
+		if (r->n == r->m) {
+			r->m = r->m? r->m<<1 : 4;
+			r->a = realloc(r->a, r->m * sizeof(mplp_seq_t));
+		}
+		p = &r->a[r->n++];
+		p->tid = tid, p->cnt = 0, p->len = 0;
+		p->seq = faidx_fetch_seq(r->fai, r->h->target_name[tid], 0, 0x7fffffff, &p->len);
+	}
+	p = &r->a[i];
+	++p->cnt;
+	*len = p->len;
+	pthread_mutex_unlock(&r->lock);
+	return p->seq;
+}
+
+static void refs_release(mplp_refs_t *r, int tid)
+{
+	int i;
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->n && r->a[i].tid != tid; ++i);
+	if (i < r->n && --r->a[i].cnt == 0) {
+		free(r->a[i].seq);
+		r->a[i] = r->a[--r->n];
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+// the reference of _tid_, or NULL without -f; is_out marks the one at the output
+static char *mplp_get_ref(mplp_ref_t *r, int tid, int is_out, int *len)
+{
+	int k;
+	*len = 0;
+	if (r->refs == 0) return 0;
+	for (k = 0; k < 2 && r->tid[k] != tid; ++k);
+	if (k == 2) { // replace the sequence not at the output; reads may run ahead into the next reference
+		k = (r->tid[0] >= 0 && (r->tid[0] == r->pin || r->tid[1] < 0))? 1 : 0;
+		if (r->tid[k] >= 0) refs_release(r->refs, r->tid[k]);
+		r->seq[k] = refs_acquire(r->refs, tid, &r->len[k]);
+		r->tid[k] = tid;
+	}
+	if (is_out) r->pin = tid;
+	*len = r->len[k];
+	return r->seq[k];
+}
+
+static void mplp_ref_init(mplp_ref_t *r, mplp_refs_t *refs)
+{
+	memset(r, 0, sizeof(mplp_ref_t));
+	r->refs = refs;
+	r->pin = r->tid[0] = r->tid[1] = -1;
+}
+
+static void mplp_ref_destroy(mplp_ref_t *r)
+{
+	int k;
+	for (k = 0; k < 2; ++k)
+		if (r->tid[k] >= 0) refs_release(r->refs, r->tid[k]);
+}
+
 static int mplp_func(void *data, bam1_t *b)
 {
 	extern int bam_realn(bam1_t *b, const char *ref);
@@ -109,7 +185,8 @@ static int mplp_func(void *data, bam1_t *b)
 	mplp_aux_t *ma = (mplp_aux_t*)data;
 	int ret, skip = 0;
 	do {
-		int has_ref;
+		int ref_len;
+		char *ref;
 		ret = ma->iter? bam_iter_read(ma->fp, ma->iter, b) : bam_read1(ma->fp, b);
 		if (ret < 0) break;
 		if (b->core.tid < 0 || (b->core.flag&BAM_FUNMAP)) { // exclude unmapped reads
@@ -117,7 +194,7 @@ static int mplp_func(void *data, bam1_t *b)
 			continue;
 		}
 		if (ma->conf->bed) { // test overlap
-			skip = !bed_overlap(ma->conf->bed, ma->h->target_name[b->core.tid], b->core.pos, bam_calend(&b->core, bam1_cigar(b)));
+			skip = !bed_overlap(ma->conf->bed, ma->h->target_name[b->core.tid], b->core.pos, bam1_calend(b));
 			if (skip) continue;
 		}
 		if (ma->conf->rghash) { // exclude read groups
@@ -131,11 +208,12 @@ static int mplp_func(void *data, bam1_t *b)
 			for (i = 0; i < b->core.l_qseq; ++i)
 				qual[i] = qual[i] > 31? qual[i] - 31 : 0;
 		}
-		has_ref = (ma->ref && ma->ref_id == b->core.tid)? 1 : 0;
+		// the reference of the read itself, which may be ahead of the output
+		ref = (ma->conf->flag&MPLP_REALN) || ma->conf->capQ_thres > 10? mplp_get_ref(ma->ref, b->core.tid, 0, &ref_len) : 0;
 		skip = 0;
-		if (has_ref && (ma->conf->flag&MPLP_REALN)) bam_prob_realn_core(b, ma->ref, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
-		if (has_ref && ma->conf->capQ_thres > 10) {
-			int q = bam_cap_mapQ(b, ma->ref, ma->conf->capQ_thres);
+		if (ref && (ma->conf->flag&MPLP_REALN)) bam_prob_realn_core(b, ref, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
+		if (ref && ma->conf->capQ_thres > 10) {
+			int q = bam_cap_mapQ(b, ref, ma->conf->capQ_thres);
 			if (q < 0) skip = 1;
 			else if (b->core.qual > q) b->core.qual = q;
 		}
@@ -145,7 +223,7 @@ static int mplp_func(void *data, bam1_t *b)
 	return ret;
 }
 
-static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf,
+static void group_smpl(mplp_pileup_t *m, const bam_sample_t *sm, kstring_t *buf,
 					   int n, char *const*fn, int *n_plp, const bam_pileup1_t **plp, int ignore_rg)
 {
 	int i, j;
@@ -172,31 +250,360 @@ static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf,
 	}
 }
 
+typedef struct { // for printing or calling the pileup; one per thread
+	const mplp_conf_t *conf;
+	const bam_header_t *h;
+	const bam_sample_t *sm;
+	const bcf_hdr_t *bh;
+	char **fn;
+	int n, max_indel_depth;
+	void *rghash;
+	bcf_callaux_t *bca;
+	bcf_callret1_t *bcr;
+	bcf_call_t bc;
+	mplp_pileup_t gplp;
+	kstring_t buf;
+} mplp_out_t;
+
+static void mplp_out_init(mplp_out_t *o, const mplp_conf_t *conf, int n, char **fn, const bam_header_t *h,
+						  const bam_sample_t *sm, const bcf_hdr_t *bh, void *rghash, int max_indel_depth)
+{
+	memset(o, 0, sizeof(mplp_out_t));
+	o->conf = conf, o->n = n, o->fn = fn, o->h = h, o->sm = sm, o->bh = bh;
+	o->rghash = rghash, o->max_indel_depth = max_indel_depth;
+	o->gplp.n = sm->n;
+	o->gplp.n_plp = calloc(sm->n, sizeof(int));
+	o->gplp.m_plp = calloc(sm->n, sizeof(int));
+	o->gplp.plp = calloc(sm->n, sizeof(void*));
+	if (conf->flag & MPLP_GLF) {
+		o->bca = bcf_call_init(-1., conf->min_baseQ);
+		o->bcr = calloc(sm->n, sizeof(bcf_callret1_t));
+		o->bca->rghash = rghash;
+		o->bca->openQ = conf->openQ, o->bca->extQ = conf->extQ, o->bca->tandemQ = conf->tandemQ;
+		o->bca->min_frac = conf->min_frac;
+		o->bca->min_support = conf->min_support;
+	}
+}
+
+static void mplp_out_destroy(mplp_out_t *o)
+{
+	int i;
+	for (i = 0; i < o->gplp.n; ++i) free(o->gplp.plp[i]);
+	free(o->gplp.plp); free(o->gplp.n_plp); free(o->gplp.m_plp);
+	bcf_call_destroy(o->bca); free(o->bc.PL); free(o->bcr);
+	free(o->buf.s);
+}
+
+typedef struct { // the output at a few positions or of a shard
+	kstring_t s; // the pileup text or the BCF bytes
+	int n, m;
+	bcf1_t **b;  // the BCF records with -c
+} mplp_buf_t;
+
+static void mplp_buf_destroy(mplp_buf_t *s)
+{
+	int i;
+	for (i = 0; i < s->n; ++i) bcf_destroy(s->b[i]);
+	free(s->s.s); free(s->b);
+	memset(s, 0, sizeof(mplp_buf_t));
+}
+
+// append _b_ to _s_ and free it, or keep it as is for bcftools view
+static void mplp_buf_bcf(const mplp_out_t *o, mplp_buf_t *s, bcf1_t *b)
+{
+	extern int bcf_write_s(kstring_t *s, const bcf_hdr_t *h, const bcf1_t *b);
+	if (o->conf->q) {
+		if (s->n == s->m) {
+			s->m = s->m? s->m<<1 : 256;
+			s->b = realloc(s->b, s->m * sizeof(void*));
+		}
+		s->b[s->n++] = b;
+	} else {
+		bcf_write_s(&s->s, o->bh, b);
+		bcf_destroy(b);
+	}
+}
+
+// append the pileup text or the BCF records at tid:pos to _buf_
+static void mplp_out_pos(mplp_out_t *o, int tid, int pos, int *n_plp, const bam_pileup1_t **plp, const char *ref, int ref_len, mplp_buf_t *buf)
+{
+	const mplp_conf_t *conf = o->conf;
+	kstring_t *s = &buf->s;
+	int i;
+	if (conf->flag & MPLP_GLF) {
+		int total_depth, _ref0, ref16;
+		bcf1_t *b = calloc(1, sizeof(bcf1_t));
+		for (i = total_depth = 0; i < o->n; ++i) total_depth += n_plp[i];
+		group_smpl(&o->gplp, o->sm, &o->buf, o->n, o->fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
+		_ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
+		ref16 = bam_nt16_table[_ref0];
+		bcf_call_seed(o->bca, tid, pos);
+		bcf_call_glfgen2(o->gplp.n, o->gplp.n_plp, o->gplp.plp, ref16, o->bca, o->bcr);
+		bcf_call_combine(o->gplp.n, o->bcr, ref16, &o->bc);
+		bcf_call2bcf(tid, pos, &o->bc, b, o->bcr, conf->fmt_flag, 0, 0);
+		mplp_buf_bcf(o, buf, b);
+		// call indels
+		if (!(conf->flag&MPLP_NO_INDEL) && total_depth < o->max_indel_depth && bcf_call_gap_prep(o->gplp.n, o->gplp.n_plp, o->gplp.plp, pos, o->bca, ref, o->rghash) >= 0) {
+			bcf_call_glfgen2(o->gplp.n, o->gplp.n_plp, o->gplp.plp, -1, o->bca, o->bcr);
+			if (bcf_call_combine(o->gplp.n, o->bcr, -1, &o->bc) >= 0) {
+				b = calloc(1, sizeof(bcf1_t));
+				bcf_call2bcf(tid, pos, &o->bc, b, o->bcr, conf->fmt_flag, o->bca, ref);
+				mplp_buf_bcf(o, buf, b);
+			}
+		}
+	} else {
+		kputs(o->h->target_name[tid], s); kputc('\t', s);
+		kputw(pos + 1, s); kputc('\t', s);
+		kputc((ref && pos < ref_len)? ref[pos] : 'N', s);
+		for (i = 0; i < o->n; ++i) {
+			int j, cnt;
+			for (j = cnt = 0; j < n_plp[i]; ++j) {
+				const bam_pileup1_t *p = plp[i] + j;
+				if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ) ++cnt;
+			}
+			kputc('\t', s); kputw(cnt, s); kputc('\t', s);
+			if (n_plp[i] == 0) {
+				kputs("*\t*", s);
+				if (conf->flag & MPLP_PRINT_POS) kputs("\t*", s);
+			} else {
+				for (j = 0; j < n_plp[i]; ++j) {
+					const bam_pileup1_t *p = plp[i] + j;
+					if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ)
+						pileup_seq(plp[i] + j, pos, ref_len, ref, s);
+				}
+				kputc('\t', s);
+				for (j = 0; j < n_plp[i]; ++j) {
+					const bam_pileup1_t *p = plp[i] + j;
+					int c = bam1_qual(p->b)[p->qpos];
+					if (c >= conf->min_baseQ) {
+						c = c + 33 < 126? c + 33 : 126;
+						kputc(c, s);
+					}
+				}
+				if (conf->flag & MPLP_PRINT_MAPQ) {
+					kputc('\t', s);
+					for (j = 0; j < n_plp[i]; ++j) {
+						int c = plp[i][j].b->core.qual + 33;
+						if (c > 126) c = 126;
+						kputc(c, s);
+					}
+				}
+				if (conf->flag & MPLP_PRINT_POS) {
+					kputc('\t', s);
+					for (j = 0; j < n_plp[i]; ++j) {
+						if (j > 0) kputc(',', s);
+						kputw(plp[i][j].qpos + 1, s);
+					}
+				}
+			}
+		}
+		kputc('\n', s);
+	}
+}
+
+// write out what has been collected in _s_
+static void mplp_flush(const mplp_conf_t *conf, bcf_t *bp, mplp_buf_t *s)
+{
+	if (s->n) bcf_queue_put(conf->q, s->n, s->b), s->n = 0;
+	if (s->s.l == 0) return;
+	if (conf->flag & MPLP_GLF) bgzf_write(bp->fp, s->s.s, s->s.l);
+	else fwrite(s->s.s, 1, s->s.l, stdout);
+	s->s.l = 0;
+}
+
+typedef struct { // for the pileup shard by shard
+	const mplp_conf_t *conf;
+	int n, n_regs, max_depth;
+	char **fn;       // the BAMs
+	bam_index_t **idx;
+	const bam_header_t *h;
+	bam_region_t *regs; // the -l regions; NULL for the whole genome
+	bam_shard_t *shards;
+	bcf_t *bp;
+	mplp_aux_t **data; // data[t*n+i] for the i-th BAM on the t-th thread
+	mplp_ref_t *ref;   // one per thread
+	mplp_out_t *out;   // one per thread
+	mplp_buf_t *s;     // output of each shard
+} mplp_shard_t;
+
+// the regions to read for shard _s_, which start shard_pad bp earlier
+static bam_region_t *mplp_shard_regs(const mplp_shard_t *d, const bam_shard_t *s, int *n)
+{
+	bam_region_t *regs;
+	int i, tid, beg = s->beg > d->conf->shard_pad? s->beg - d->conf->shard_pad : 0;
+	*n = 0;
+	if (d->regs == 0) {
+		regs = calloc(s->tid_end - s->tid + 1, sizeof(bam_region_t));
+		for (tid = s->tid; tid <= s->tid_end; ++tid, ++*n) { // empty regions are skipped by bam_iter_query_regs()
+			regs[*n].tid = tid;
+			regs[*n].beg = tid == s->tid? beg : 0;
+			regs[*n].end = tid == s->tid_end? s->end : INT_MAX;
+		}
+	} else {
+		regs = calloc(d->n_regs, sizeof(bam_region_t));
+		for (i = 0; i < d->n_regs; ++i) {
+			bam_region_t r = d->regs[i];
+			if (r.tid < s->tid || r.tid > s->tid_end) continue;
+			if (r.tid == s->tid && r.beg < beg) r.beg = beg;
+			if (r.tid == s->tid_end && r.end > s->end) r.end = s->end;
+			if (r.beg < r.end) regs[(*n)++] = r;
+		}
+	}
+	return regs;
+}
+
+static int mplp_shard(void *_d, int k, int t)
+{
+	mplp_shard_t *d = (mplp_shard_t*)_d;
+	const bam_shard_t *s = &d->shards[k];
+	mplp_aux_t **data = d->data + t * d->n;
+	bam_region_t *regs;
+	int i, n_regs, tid, pos, ref_tid = -1, ref_len = 0, *n_plp;
+	const bam_pileup1_t **plp;
+	char *ref = 0;
+	bam_mplp_t iter;
+	regs = mplp_shard_regs(d, s, &n_regs);
+	for (i = 0; i < d->n; ++i) {
+		if (data[i] == 0) { // the first shard on this thread; open the BAMs
+			data[i] = calloc(1, sizeof(mplp_aux_t));
+			if ((data[i]->fp = bam_open(d->fn[i], "r")) == 0) {
+				free(regs);
+				return -1;
+			}
+			bam_header_destroy(bam_header_read(data[i]->fp));
+			data[i]->h = (bam_header_t*)d->h, data[i]->ref = &d->ref[t], data[i]->conf = d->conf;
+		}
+		data[i]->iter = bam_iter_query_regs(d->idx[i], n_regs, regs);
+	}
+	free(regs);
+	iter = bam_mplp_init(d->n, mplp_func, (void**)data);
+	bam_mplp_set_maxcnt(iter, d->max_depth);
+	n_plp = calloc(d->n, sizeof(int));
+	plp = calloc(d->n, sizeof(void*));
+	while (bam_mplp_auto(iter, &tid, &pos, n_plp, plp) > 0) {
+		if (tid < s->tid || (tid == s->tid && pos < s->beg)) continue; // before the shard
+		if (tid > s->tid_end || (tid == s->tid_end && pos >= s->end)) break; // in the next shard
+		if (d->conf->bed && !bed_overlap(d->conf->bed, d->h->target_name[tid], pos, pos+1)) continue;
+		if (tid != ref_tid) ref = mplp_get_ref(&d->ref[t], tid, 1, &ref_len), ref_tid = tid;
+		mplp_out_pos(&d->out[t], tid, pos, n_plp, plp, ref, ref_len, &d->s[k]);
+	}
+	bam_mplp_destroy(iter);
+	free(n_plp); free(plp);
+	for (i = 0; i < d->n; ++i) {
+		bam_iter_destroy(data[i]->iter);
+		data[i]->iter = 0;
+	}
+	return 0;
+}
+
+static void mplp_merge(void *_d, int k)
+{
+	mplp_shard_t *d = (mplp_shard_t*)_d;
+	mplp_flush(d->conf, d->bp, &d->s[k]);
+	mplp_buf_destroy(&d->s[k]);
+}
+
+// the pileup on conf->n_threads threads; return -1 if some BAM is not indexed
+static int mpileup_mt(mplp_conf_t *conf, int n, char **fn, const bam_header_t *h, const bam_sample_t *sm,
+					  const bcf_hdr_t *bh, bcf_t *bp, void *rghash, mplp_refs_t *refs, int max_depth, int max_indel_depth)
+{
+	mplp_shard_t d;
+	int i, n_shards, n_threads = conf->n_threads, ret = 0;
+	int64_t len;
+	memset(&d, 0, sizeof(mplp_shard_t));
+	d.conf = conf, d.n = n, d.fn = fn, d.h = h, d.bp = bp, d.max_depth = max_depth;
+	d.idx = calloc(n, sizeof(void*));
+	for (i = 0; i < n; ++i)
+		if (strcmp(fn[i], "-") == 0 || (d.idx[i] = bam_index_load_local(fn[i])) == 0) ret = -1;
+	if (ret == 0) {
+		// shard by the 1st BAM, at least 16 shards per thread and about 1Mbp per shard to bound the buffered output
+		for (i = 0, len = 0; i < h->n_targets; ++i) len += h->target_len[i];
+		d.shards = bam_index_shard(d.idx[0], len>>20 > n_threads * 16? len>>20 : n_threads * 16, 0, &n_shards);
+		if (conf->bed) d.regs = bed_regions(conf->bed, h, &d.n_regs);
+		d.data = calloc(n_threads * n, sizeof(void*));
+		d.ref = calloc(n_threads, sizeof(mplp_ref_t));
+		d.out = calloc(n_threads, sizeof(mplp_out_t));
+		for (i = 0; i < n_threads; ++i) {
+			mplp_ref_init(&d.ref[i], refs);
+			mplp_out_init(&d.out[i], conf, n, fn, h, sm, bh, rghash, max_indel_depth);
+		}
+		d.s = calloc(n_shards, sizeof(mplp_buf_t));
+		if (bam_shard_run(n_threads, n_shards, mplp_shard, mplp_merge, &d) < 0)
+			fprintf(stderr, "[%s] fail to read the input.\n", __func__);
+		for (i = 0; i < n_threads * n; ++i) {
+			if (d.data[i] == 0) continue;
+			if (d.data[i]->fp) bam_close(d.data[i]->fp);
+			free(d.data[i]);
+		}
+		for (i = 0; i < n_threads; ++i) {
+			mplp_ref_destroy(&d.ref[i]);
+			mplp_out_destroy(&d.out[i]);
+		}
+		for (i = 0; i < n_shards; ++i) mplp_buf_destroy(&d.s[i]);
+		free(d.data); free(d.ref); free(d.out); free(d.s); free(d.shards); free(d.regs);
+	}
+	for (i = 0; i < n; ++i)
+		if (d.idx[i]) bam_index_destroy(d.idx[i]);
+	free(d.idx);
+	return ret;
+}
+
+typedef struct { // bcftools view on the records of the pileup, for -c
+	void *vc; // the view options, parsed before the thread starts
+	bcf_hdr_t *h;
+	bcf_queue_t *q;
+	int ret;
+} mplp_view_t;
+
+static void *mplp_view(void *_v)
+{
+	extern int bcfview_run(void *vc, bcf_hdr_t *h, bcf_queue_t *in);
+	mplp_view_t *v = (mplp_view_t*)_v;
+	v->ret = bcfview_run(v->vc, v->h, v->q);
+	bcf_queue_close(v->q); // if view has stopped early, the pileup only drops its records
+	return 0;
+}
+
 static int mpileup(mplp_conf_t *conf, int n, char **fn)
 {
 	extern void *bcf_call_add_rg(void *rghash, const char *hdtext, const char *list);
 	extern void bcf_call_del_rghash(void *rghash);
+	extern void *bcfview_init(int argc, char *argv[], const char *func);
 	mplp_aux_t **data;
-	int i, tid, pos, *n_plp, tid0 = -1, beg0 = 0, end0 = 1u<<29, ref_len, ref_tid = -1, max_depth, max_indel_depth;
+	int i, tid, pos, *n_plp, tid0 = -1, beg0 = 0, end0 = 1u<<29, ref_len = 0, ref_tid = -1, max_depth, max_indel_depth;
 	const bam_pileup1_t **plp;
 	bam_mplp_t iter;
 	bam_header_t *h = 0;
-	char *ref;
+	char *ref = 0;
 	void *rghash = 0;
 
-	bcf_callaux_t *bca = 0;
-	bcf_callret1_t *bcr = 0;
-	bcf_call_t bc;
 	bcf_t *bp = 0;
 	bcf_hdr_t *bh = 0;
 
 	bam_sample_t *sm = 0;
-	kstring_t buf;
-	mplp_pileup_t gplp;
+	mplp_refs_t refs;
+	mplp_ref_t mref;
+	mplp_out_t out;
+	mplp_buf_t s;
+	mplp_view_t view;
+	pthread_t view_tid;
 
-	memset(&gplp, 0, sizeof(mplp_pileup_t));
-	memset(&buf, 0, sizeof(kstring_t));
-	memset(&bc, 0, sizeof(bcf_call_t));
+	memset(&refs, 0, sizeof(mplp_refs_t));
+	memset(&s, 0, sizeof(mplp_buf_t));
+	memset(&view, 0, sizeof(mplp_view_t));
+	if (conf->view_opts) { // parse the options of bcftools view here, as getopt() is not thread safe
+		kstring_t str;
+		int *off, k, argc;
+		char **argv;
+		str.l = str.m = 0; str.s = 0;
+		kputs("view ", &str); kputs(conf->view_opts, &str);
+		off = ksplit(&str, 0, &argc);
+		argv = calloc(argc + 1, sizeof(char*));
+		for (k = 0; k < argc; ++k) argv[k] = str.s + off[k];
+		view.vc = bcfview_init(argc, argv, __func__);
+		free(off); free(argv); free(str.s);
+		if (view.vc == 0) return 1;
+	}
 	data = calloc(n, sizeof(void*));
 	plp = calloc(n, sizeof(void*));
 	n_plp = calloc(n, sizeof(int*));
@@ -208,6 +615,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 		data[i] = calloc(1, sizeof(mplp_aux_t));
 		data[i]->fp = strcmp(fn[i], "-") == 0? bam_dopen(fileno(stdin), "r") : bam_open(fn[i], "r");
 		data[i]->conf = conf;
+		data[i]->ref = &mref;
 		h_tmp = bam_header_read(data[i]->fp);
 		data[i]->h = i? h : h_tmp; // for i==0, "h" has not been set yet
 		bam_smpl_add(sm, fn[i], (conf->flag&MPLP_IGNORE_RG)? 0 : h_tmp->text);
@@ -227,6 +635,16 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 			if (i == 0) tid0 = tid, beg0 = beg, end0 = end;
 			data[i]->iter = bam_iter_query(idx, tid, beg, end);
 			bam_index_destroy(idx);
+		} else if (conf->bed) { // if indexed, only read the blocks overlapping the BED regions
+			bam_index_t *idx = bam_index_load_local(fn[i]);
+			if (idx) {
+				bam_region_t *regs;
+				int n_regs;
+				regs = bed_regions(conf->bed, h_tmp, &n_regs);
+				data[i]->iter = bam_iter_query_regs(idx, n_regs, regs);
+				free(regs);
+				bam_index_destroy(idx);
+			}
 		}
 		if (i == 0) h = h_tmp;
 		else {
@@ -234,10 +652,6 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 			bam_header_destroy(h_tmp);
 		}
 	}
-	gplp.n = sm->n;
-	gplp.n_plp = calloc(sm->n, sizeof(int));
-	gplp.m_plp = calloc(sm->n, sizeof(int));
-	gplp.plp = calloc(sm->n, sizeof(void*));
 
 	fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, sm->n, n);
 	// write the VCF header
@@ -245,7 +659,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 		kstring_t s;
 		bh = calloc(1, sizeof(bcf_hdr_t));
 		s.l = s.m = 0; s.s = 0;
-		bp = bcf_open("-", (conf->flag&MPLP_NO_COMP)? "wu" : "w");
+		if (conf->view_opts == 0) bp = bcf_open("-", (conf->flag&MPLP_NO_COMP)? "wu" : "w");
 		for (i = 0; i < h->n_targets; ++i) {
 			kputs(h->target_name[i], &s);
 			kputc('\0', &s);
@@ -264,20 +678,16 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 		bh->l_txt = 1 + sprintf(bh->txt, "##samtoolsVersion=%s\n", BAM_VERSION);
 		free(s.s);
 		bcf_hdr_sync(bh);
-		bcf_hdr_write(bp, bh);
-		bca = bcf_call_init(-1., conf->min_baseQ);
-		bcr = calloc(sm->n, sizeof(bcf_callret1_t));
-		bca->rghash = rghash;
-		bca->openQ = conf->openQ, bca->extQ = conf->extQ, bca->tandemQ = conf->tandemQ;
-		bca->min_frac = conf->min_frac;
-		bca->min_support = conf->min_support;
+		if (conf->view_opts) { // start bcftools view, which takes the records from conf->q
+			view.h = bh, view.q = conf->q = bcf_queue_init(4096);
+			pthread_create(&view_tid, 0, mplp_view, &view);
+		} else bcf_hdr_write(bp, bh);
 	}
-	if (tid0 >= 0 && conf->fai) { // region is set
-		ref = faidx_fetch_seq(conf->fai, h->target_name[tid0], 0, 0x7fffffff, &ref_len);
-		ref_tid = tid0;
-		for (i = 0; i < n; ++i) data[i]->ref = ref, data[i]->ref_id = tid0;
-	} else ref_tid = -1, ref = 0;
-	iter = bam_mplp_init(n, mplp_func, (void**)data);
+	if (conf->fai) {
+		refs.fai = conf->fai, refs.h = h;
+		pthread_mutex_init(&refs.lock, 0);
+	}
+	mplp_ref_init(&mref, conf->fai? &refs : 0);
 	max_depth = conf->max_depth;
 	if (max_depth * sm->n > 1<<20)
 		fprintf(stderr, "(%s) Max depth is above 1M. Potential memory hog!\n", __func__);
@@ -286,103 +696,47 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 		fprintf(stderr, "<%s> Set max per-file depth to %d\n", __func__, max_depth);
 	}
 	max_indel_depth = conf->max_indel_depth * sm->n;
+	if (conf->n_threads > 1 && tid0 < 0) { // the whole genome or the BED regions; process shards in parallel
+		if (mpileup_mt(conf, n, fn, h, sm, bh, bp, rghash, mref.refs, max_depth, max_indel_depth) == 0) goto end_mplp;
+		fprintf(stderr, "[%s] -@ needs indexed BAMs; continue with one thread.\n", __func__);
+	}
+	mplp_out_init(&out, conf, n, fn, h, sm, bh, rghash, max_indel_depth);
+	if (out.bca) out.bca->n_threads = conf->n_threads; // the only use of threads for a single region
+	iter = bam_mplp_init(n, mplp_func, (void**)data);
 	bam_mplp_set_maxcnt(iter, max_depth);
 	while (bam_mplp_auto(iter, &tid, &pos, n_plp, plp) > 0) {
 		if (conf->reg && (pos < beg0 || pos >= end0)) continue; // out of the region requested
 		if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, h->target_name[tid], pos, pos+1)) continue;
-		if (tid != ref_tid) {
-			free(ref); ref = 0;
-			if (conf->fai) ref = faidx_fetch_seq(conf->fai, h->target_name[tid], 0, 0x7fffffff, &ref_len);
-			for (i = 0; i < n; ++i) data[i]->ref = ref, data[i]->ref_id = tid;
-			ref_tid = tid;
-		}
-		if (conf->flag & MPLP_GLF) {
-			int total_depth, _ref0, ref16;
-			bcf1_t *b = calloc(1, sizeof(bcf1_t));
-			for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
-			group_smpl(&gplp, sm, &buf, n, fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
-			_ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
-			ref16 = bam_nt16_table[_ref0];
-			for (i = 0; i < gplp.n; ++i)
-				bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], ref16, bca, bcr + i);
-			bcf_call_combine(gplp.n, bcr, ref16, &bc);
-			bcf_call2bcf(tid, pos, &bc, b, bcr, conf->fmt_flag, 0, 0);
-			bcf_write(bp, bh, b);
-			bcf_destroy(b);
-			// call indels
-			if (!(conf->flag&MPLP_NO_INDEL) && total_depth < max_indel_depth && bcf_call_gap_prep(gplp.n, gplp.n_plp, gplp.plp, pos, bca, ref, rghash) >= 0) {
-				for (i = 0; i < gplp.n; ++i)
-					bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], -1, bca, bcr + i);
-				if (bcf_call_combine(gplp.n, bcr, -1, &bc) >= 0) {
-					b = calloc(1, sizeof(bcf1_t));
-					bcf_call2bcf(tid, pos, &bc, b, bcr, conf->fmt_flag, bca, ref);
-					bcf_write(bp, bh, b);
-					bcf_destroy(b);
-				}
-			}
-		} else {
-			printf("%s\t%d\t%c", h->target_name[tid], pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');
-			for (i = 0; i < n; ++i) {
-				int j, cnt;
-				for (j = cnt = 0; j < n_plp[i]; ++j) {
-					const bam_pileup1_t *p = plp[i] + j;
-					if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ) ++cnt;
-				}
-				printf("\t%d\t", cnt);
-				if (n_plp[i] == 0) {
-					printf("*\t*"); // FIXME: printf() is very slow...
-					if (conf->flag & MPLP_PRINT_POS) printf("\t*");
-				} else {
-					for (j = 0; j < n_plp[i]; ++j) {
-						const bam_pileup1_t *p = plp[i] + j;
-						if (bam1_qual(p->b)[p->qpos] >= conf->min_baseQ)
-							pileup_seq(plp[i] + j, pos, ref_len, ref);
-					}
-					putchar('\t');
-					for (j = 0; j < n_plp[i]; ++j) {
-						const bam_pileup1_t *p = plp[i] + j;
-						int c = bam1_qual(p->b)[p->qpos];
-						if (c >= conf->min_baseQ) {
-							c = c + 33 < 126? c + 33 : 126;
-							putchar(c);
-						}
-					}
-					if (conf->flag & MPLP_PRINT_MAPQ) {
-						putchar('\t');
-						for (j = 0; j < n_plp[i]; ++j) {
-							int c = plp[i][j].b->core.qual + 33;
-							if (c > 126) c = 126;
-							putchar(c);
-						}
-					}
-					if (conf->flag & MPLP_PRINT_POS) {
-						putchar('\t');
-						for (j = 0; j < n_plp[i]; ++j) {
-							if (j > 0) putchar(',');
-							printf("%d", plp[i][j].qpos + 1); // FIXME: printf() is very slow...
-						}
-					}
-				}
-			}
-			putchar('\n');
-		}
+		if (tid != ref_tid) ref = mplp_get_ref(&mref, tid, 1, &ref_len), ref_tid = tid;
+		mplp_out_pos(&out, tid, pos, n_plp, plp, ref, ref_len, &s);
+		if (s.s.l >= 0x10000 || s.n >= 256) mplp_flush(conf, bp, &s);
 	}
+	mplp_flush(conf, bp, &s);
+	bam_mplp_destroy(iter);
+	mplp_out_destroy(&out);
 
+end_mplp:
+	if (conf->q) {
+		bcf_queue_close(conf->q);
+		pthread_join(view_tid, 0);
+		bcf_queue_destroy(conf->q);
+		conf->q = 0;
+	}
 	bcf_close(bp);
-	bam_smpl_destroy(sm); free(buf.s);
-	for (i = 0; i < gplp.n; ++i) free(gplp.plp[i]);
-	free(gplp.plp); free(gplp.n_plp); free(gplp.m_plp);
+	bam_smpl_destroy(sm); mplp_buf_destroy(&s);
 	bcf_call_del_rghash(rghash);
-	bcf_hdr_destroy(bh); bcf_call_destroy(bca); free(bc.PL); free(bcr);
-	bam_mplp_destroy(iter);
+	bcf_hdr_destroy(bh);
+	mplp_ref_destroy(&mref);
+	if (conf->fai) pthread_mutex_destroy(&refs.lock);
+	free(refs.a);
 	bam_header_destroy(h);
 	for (i = 0; i < n; ++i) {
 		bam_close(data[i]->fp);
 		if (data[i]->iter) bam_iter_destroy(data[i]->iter);
 		free(data[i]);
 	}
-	free(data); free(plp); free(ref); free(n_plp);
-	return 0;
+	free(data); free(plp); free(n_plp);
+	return view.ret? 1 : 0;
 }
 
 #define MAX_PATH_LEN 1024
@@ -439,7 +793,7 @@ int bam_mpileup(int argc, char *argv[])
 	int c;
     const char *file_list = NULL;
     char **fn = NULL;
-    int nfiles = 0, use_orphan = 0;
+    int nfiles = 0, use_orphan = 0, ret;
 	mplp_conf_t mplp;
 	memset(&mplp, 0, sizeof(mplp_conf_t));
 	mplp.max_mq = 60;
@@ -449,7 +803,8 @@ int bam_mpileup(int argc, char *argv[])
 	mplp.openQ = 40; mplp.extQ = 20; mplp.tandemQ = 100;
 	mplp.min_frac = 0.002; mplp.min_support = 1;
 	mplp.flag = MPLP_NO_ORPHAN | MPLP_REALN;
-	while ((c = getopt(argc, argv, "Agf:r:l:M:q:Q:uaRC:BDSd:L:b:P:o:e:h:Im:F:EG:6OsV")) >= 0) {
+	mplp.n_threads = 1; mplp.shard_pad = 1000;
+	while ((c = getopt(argc, argv, "Agf:r:l:M:q:Q:uaRC:BDSd:L:b:P:o:e:h:Im:F:EG:6OsVW:@:c:")) >= 0) {
 		switch (c) {
 		case 'f':
 			mplp.fai = fai_load(optarg);
@@ -461,6 +816,7 @@ int bam_mpileup(int argc, char *argv[])
 		case 'P': mplp.pl_list = strdup(optarg); break;
 		case 'g': mplp.flag |= MPLP_GLF; break;
 		case 'u': mplp.flag |= MPLP_NO_COMP | MPLP_GLF; break;
+		case 'c': mplp.view_opts = strdup(optarg); mplp.flag |= MPLP_GLF; break;
 		case 'a': mplp.flag |= MPLP_NO_ORPHAN | MPLP_REALN; break;
 		case 'B': mplp.flag &= ~MPLP_REALN; break;
 		case 'D': mplp.fmt_flag |= B2B_FMT_DP; break;
@@ -484,6 +840,8 @@ int bam_mpileup(int argc, char *argv[])
 		case 'F': mplp.min_frac = atof(optarg); break;
 		case 'm': mplp.min_support = atoi(optarg); break;
 		case 'L': mplp.max_indel_depth = atoi(optarg); break;
+		case 'W': mplp.shard_pad = atoi(optarg); break;
+		case '@': mplp.n_threads = atoi(optarg); break;
 		case 'G': {
 				FILE *fp_rg;
 				char buf[1024];
@@ -517,7 +875,10 @@ int bam_mpileup(int argc, char *argv[])
 		fprintf(stderr, "       -R           ignore RG tags\n");
 		fprintf(stderr, "       -q INT       skip alignments with mapQ smaller than INT [%d]\n", mplp.min_mq);
 		fprintf(stderr, "       -Q INT       skip bases with baseQ/BAQ smaller than INT [%d]\n", mplp.min_baseQ);
+		fprintf(stderr, "       -W INT       with -@, pile up INT bp before each shard for the -d cap [%d]\n", mplp.shard_pad);
+		fprintf(stderr, "       -@ INT       number of threads; for indel realignment only with -r [%d]\n", mplp.n_threads);
 		fprintf(stderr, "\nOutput options:\n\n");
+		fprintf(stderr, "       -c STR       call with `bcftools view STR' in this process (e.g. '-vcg') [null]\n");
 		fprintf(stderr, "       -D           output per-sample DP in BCF (require -g/-u)\n");
 		fprintf(stderr, "       -g           generate BCF output (genotype likelihoods)\n");
 		fprintf(stderr, "       -O           output base positions on reads (disabled by -g/-u)\n");
@@ -540,13 +901,13 @@ int bam_mpileup(int argc, char *argv[])
 	bam_no_B = 1;
     if (file_list) {
         if ( read_file_list(file_list,&nfiles,&fn) ) return 1;
-        mpileup(&mplp,nfiles,fn);
+        ret = mpileup(&mplp,nfiles,fn);
         for (c=0; c<nfiles; c++) free(fn[c]);
         free(fn);
-    } else mpileup(&mplp, argc - optind, argv + optind);
+    } else ret = mpileup(&mplp, argc - optind, argv + optind);
 	if (mplp.rghash) bcf_str2id_thorough_destroy(mplp.rghash);
-	free(mplp.reg); free(mplp.pl_list);
+	free(mplp.reg); free(mplp.pl_list); free(mplp.view_opts);
 	if (mplp.fai) fai_destroy(mplp.fai);
 	if (mplp.bed) bed_destroy(mplp.bed);
-	return 0;
+	return ret;
 }
@@ -106,7 +106,7 @@ void bam_rmdupse_core(samfile_t *in, samfile_t *out, int force_se)
 	queue = kl_init(q);
 	while (samread(in, b) >= 0) {
 		bam1_core_t *c = &b->core;
-		int endpos = bam_calend(c, bam1_cigar(b));
+		int endpos = bam1_calend(b);
 		int score = sum_qual(b);
 		
 		if (last_tid != c->tid) {
@@ -46,19 +46,119 @@ bam_flagstat_t *bam_flagstat_core(bamFile fp)
 		fprintf(stderr, "[bam_flagstat_core] Truncated file? Continue anyway.\n");
 	return s;
 }
+
+static void flagstat_add(bam_flagstat_t *s, const bam_flagstat_t *t)
+{
+	long long *x = (long long*)s; // all members are long long
+	const long long *y = (const long long*)t;
+	int i;
+	for (i = 0; i < sizeof(bam_flagstat_t) / sizeof(long long); ++i) x[i] += y[i];
+}
+
+static int flagstat_rec(void *data, const bam1_t *b, uint64_t off)
+{
+	flagstat_loop((bam_flagstat_t*)data, &b->core);
+	return 0;
+}
+
+static void flagstat_reset(void *data)
+{
+	memset(data, 0, sizeof(bam_flagstat_t));
+}
+
+// count pieces of a BAM cut at BGZF blocks on their own threads; NULL if the file cannot be cut
+static bam_flagstat_t *bam_flagstat_blocks(const char *fn, int n_threads)
+{
+	bam_flagstat_t *s = 0, *part;
+	void **data;
+	int i, n;
+	part = (bam_flagstat_t*)calloc(n_threads, sizeof(bam_flagstat_t));
+	data = (void**)calloc(n_threads, sizeof(void*));
+	for (i = 0; i < n_threads; ++i) data[i] = &part[i];
+	if ((n = bam_scan_mt2(fn, n_threads, 1, flagstat_rec, flagstat_reset, data)) > 0) { // the counts only need the core
+		s = (bam_flagstat_t*)calloc(1, sizeof(bam_flagstat_t));
+		for (i = 0; i < n; ++i) flagstat_add(s, &part[i]);
+	}
+	free(data); free(part);
+	return s;
+}
+
+typedef struct {
+	const char *fn;
+	const bam_shard_t *shards;
+	bamFile *fp; // one per thread
+	bam_flagstat_t *s; // one per shard
+} flagstat_shard_t;
+
+static int flagstat_shard(void *data, int i, int t)
+{
+	flagstat_shard_t *d = (flagstat_shard_t*)data;
+	bam_flagstat_t *s = &d->s[i];
+	bam_iter_t iter;
+	bam1_t *b;
+	int ret;
+	if (d->fp[t] == 0) {
+		if ((d->fp[t] = bam_open(d->fn, "r")) == 0) return -1;
+		bam_header_destroy(bam_header_read(d->fp[t]));
+	}
+	b = bam_init1();
+	iter = bam_iter_range(d->shards[i].off, d->shards[i].off_end);
+	while ((ret = bam_iter_read(d->fp[t], iter, b)) >= 0)
+		flagstat_loop(s, &b->core);
+	bam_iter_destroy(iter);
+	bam_destroy1(b);
+	if (ret != -1)
+		fprintf(stderr, "[bam_flagstat_core] Truncated file? Continue anyway.\n");
+	return 0;
+}
+
+// count each shard of an indexed BAM on its own thread; NULL if there is no index
+static bam_flagstat_t *bam_flagstat_shards(const char *fn, uint64_t off0, int n_threads)
+{
+	extern bam_index_t *bam_index_load_local(const char *fn);
+	flagstat_shard_t d;
+	bam_index_t *idx;
+	bam_flagstat_t *s;
+	int i, n_shards;
+	if ((idx = bam_index_load_local(fn)) == 0) return 0;
+	d.fn = fn;
+	d.shards = bam_index_shard(idx, n_threads * 8, off0, &n_shards);
+	d.fp = (bamFile*)calloc(n_threads, sizeof(bamFile));
+	d.s = (bam_flagstat_t*)calloc(n_shards, sizeof(bam_flagstat_t));
+	s = (bam_flagstat_t*)calloc(1, sizeof(bam_flagstat_t));
+	if (bam_shard_run(n_threads, n_shards, flagstat_shard, 0, &d) == 0) {
+		for (i = 0; i < n_shards; ++i) flagstat_add(s, &d.s[i]);
+	} else free(s), s = 0;
+	for (i = 0; i < n_threads; ++i)
+		if (d.fp[i]) bam_close(d.fp[i]);
+	free(d.fp); free(d.s); free((bam_shard_t*)d.shards);
+	bam_index_destroy(idx);
+	return s;
+}
+
 int bam_flagstat(int argc, char *argv[])
 {
 	bamFile fp;
 	bam_header_t *header;
-	bam_flagstat_t *s;
+	bam_flagstat_t *s = 0;
+	int c, n_threads = 1;
+	while ((c = getopt(argc, argv, "@:")) >= 0) {
+		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
+		}
+	}
 	if (argc == optind) {
-		fprintf(stderr, "Usage: samtools flagstat <in.bam>\n");
+		fprintf(stderr, "Usage: samtools flagstat [-@ INT] <in.bam>\n");
 		return 1;
 	}
 	fp = strcmp(argv[optind], "-")? bam_open(argv[optind], "r") : bam_dopen(fileno(stdin), "r");
 	assert(fp);
 	header = bam_header_read(fp);
-	s = bam_flagstat_core(fp);
+	if (n_threads > 1 && strcmp(argv[optind], "-")) {
+		s = bam_flagstat_blocks(argv[optind], n_threads); // no index needed
+		if (s == 0) s = bam_flagstat_shards(argv[optind], bam_tell(fp), n_threads);
+	}
+	if (s == 0) s = bam_flagstat_core(fp);
 	printf("%lld + %lld in total (QC-passed reads + QC-failed reads)\n", s->n_reads[0], s->n_reads[1]);
 	printf("%lld + %lld duplicates\n", s->n_dup[0], s->n_dup[1]);
 	printf("%lld + %lld mapped (%.2f%%:%.2f%%)\n", s->n_mapped[0], s->n_mapped[1], (float)s->n_mapped[0] / s->n_reads[0] * 100.0, (float)s->n_mapped[1] / s->n_reads[1] * 100.0);
@@ -58,7 +58,6 @@ typedef struct {
 	int ccol, last_pos, row_shift, base_for, color_for, is_dot, l_ref, ins, no_skip, show_name;
 	char *ref;
     char *sample;   //TODO: multiple samples and read groups
-    void *rg2sm;
 } tview_t;
 
 int tv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *pl, void *data)
@@ -217,8 +216,6 @@ tview_t *tv_init(const char *fn, const char *fn_fa, char *samples)
     if ( samples ) 
     {
         tv->sample = samples;
-        tv->header->header = sam_header_parse2(tv->header->text);
-        tv->rg2sm = sam_header_table(tv->header->header, "RG", "ID", "SM");
     }
 
 	initscr();
@@ -266,7 +263,7 @@ int tv_fetch_func(const bam1_t *b, void *data)
     {
         const uint8_t *rg = bam_aux_get(b, "RG");
         if ( !rg ) return 0; 
-        const char *sm = sam_tbl_get(tv->rg2sm, (const char*)(rg + 1));
+        const char *sm = bam_header_get(tv->header, "RG", (const char*)(rg + 1), "SM");
         if ( !sm ) return 0;
         if ( strcmp(sm,tv->sample) ) return 0;
     }
@@ -277,6 +274,7 @@ int tv_fetch_func(const bam1_t *b, void *data)
 			if ((cigar[i]&0xf) == BAM_CREF_SKIP)
 				cigar[i] = cigar[i]>>4<<4 | BAM_CDEL;
 		}
+		((bam1_t*)b)->cs.has_splice = 0;
 	}
 	bam_lplbuf_push(b, tv->lplbuf);
 	return 0;
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "kstring.h"
 #include "bcf.h"
 
@@ -151,23 +152,47 @@ int bcf_sync(bcf1_t *b)
 	return 0;
 }
 
-int bcf_write(bcf_t *bp, const bcf_hdr_t *h, const bcf1_t *b)
+typedef void (*bcf_put_f)(void *data, const void *p, int l);
+
+// serialize _b_ through _put_; shared by bcf_write() and bcf_write_s()
+static int bcf_write_core(const bcf_hdr_t *h, const bcf1_t *b, bcf_put_f put, void *data)
 {
 	int i, l = 0;
 	if (b == 0) return -1;
-	bgzf_write(bp->fp, &b->tid, 4);
-	bgzf_write(bp->fp, &b->pos, 4);
-	bgzf_write(bp->fp, &b->qual, 4);
-	bgzf_write(bp->fp, &b->l_str, 4);
-	bgzf_write(bp->fp, b->str, b->l_str);
+	put(data, &b->tid, 4);
+	put(data, &b->pos, 4);
+	put(data, &b->qual, 4);
+	put(data, &b->l_str, 4);
+	put(data, b->str, b->l_str);
 	l = 12 + b->l_str;
 	for (i = 0; i < b->n_gi; ++i) {
-		bgzf_write(bp->fp, b->gi[i].data, b->gi[i].len * h->n_smpl);
+		put(data, b->gi[i].data, b->gi[i].len * h->n_smpl);
 		l += b->gi[i].len * h->n_smpl;
 	}
 	return l;
 }
 
+static void bcf_put_bgzf(void *fp, const void *p, int l)
+{
+	bgzf_write((bcfFile)fp, p, l);
+}
+
+static void bcf_put_str(void *s, const void *p, int l)
+{
+	kputsn((const char*)p, l, (kstring_t*)s);
+}
+
+int bcf_write(bcf_t *bp, const bcf_hdr_t *h, const bcf1_t *b)
+{
+	return bcf_write_core(h, b, bcf_put_bgzf, bp->fp);
+}
+
+// append the bytes bcf_write() would write to _s_
+int bcf_write_s(kstring_t *s, const bcf_hdr_t *h, const bcf1_t *b)
+{
+	return bcf_write_core(h, b, bcf_put_str, s);
+}
+
 int bcf_read(bcf_t *bp, const bcf_hdr_t *h, bcf1_t *b)
 {
 	int i, l = 0;
@@ -210,6 +235,14 @@ static inline void fmt_str(const char *p, kstring_t *s)
 	else kputs(p, s);
 }
 
+// append 0..255 to _s_, which has the room
+static inline void fmt_u8(int x, kstring_t *s)
+{
+	if (x >= 100) s->s[s->l++] = '0' + x / 100, x %= 100, s->s[s->l++] = '0' + x / 10;
+	else if (x >= 10) s->s[s->l++] = '0' + x / 10;
+	s->s[s->l++] = '0' + x % 10;
+}
+
 void bcf_fmt_core(const bcf_hdr_t *h, bcf1_t *b, kstring_t *s)
 {
 	int i, j, x;
@@ -261,10 +294,12 @@ void bcf_fmt_core(const bcf_hdr_t *h, bcf1_t *b, kstring_t *s)
 			if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
 				uint8_t *d = (uint8_t*)b->gi[i].data + j * x;
 				int k;
+				ks_resize(s, s->l + x * 4 + 1);
 				for (k = 0; k < x; ++k) {
-					if (k > 0) kputc(',', s);
-					kputw(d[k], s);
+					if (k > 0) s->s[s->l++] = ',';
+					fmt_u8(d[k], s);
 				}
+				s->s[s->l] = 0;
 			} else if (b->gi[i].fmt == bcf_str2int("DP", 2) || b->gi[i].fmt == bcf_str2int("DV", 2)) {
 				kputw(((uint16_t*)b->gi[i].data)[j], s);
 			} else if (b->gi[i].fmt == bcf_str2int("GQ", 2)) {
@@ -347,7 +382,7 @@ int bcf_cpy(bcf1_t *r, const bcf1_t *b)
 		r->m_str = b->m_str;
 		r->str = realloc(r->str, r->m_str);
 	}
-	memcpy(r->str, b->str, r->m_str);
+	memcpy(r->str, b->str, b->l_str);
 	bcf_sync(r); // calling bcf_sync() is simple but inefficient
 	for (i = 0; i < r->n_gi; ++i)
 		memcpy(r->gi[i].data, b->gi[i].data, r->n_smpl * r->gi[i].len);
@@ -363,3 +398,82 @@ int bcf_is_indel(const bcf1_t *b)
 			return 1;
 	return 0;
 }
+
+/*
+  A bounded queue of records from one thread to another, for calling on
+  the records of samtools mpileup without writing and reading BCF.
+ */
+struct __bcf_queue_t {
+	pthread_mutex_t lock;
+	pthread_cond_t not_full, not_empty;
+	int max, n, head, is_closed; // records in a ring of max slots; n from head
+	bcf1_t **a;
+};
+
+bcf_queue_t *bcf_queue_init(int max)
+{
+	bcf_queue_t *q;
+	q = calloc(1, sizeof(bcf_queue_t));
+	q->max = max > 0? max : 1;
+	q->a = calloc(q->max, sizeof(void*));
+	pthread_mutex_init(&q->lock, 0);
+	pthread_cond_init(&q->not_full, 0);
+	pthread_cond_init(&q->not_empty, 0);
+	return q;
+}
+
+void bcf_queue_destroy(bcf_queue_t *q)
+{
+	int i;
+	if (q == 0) return;
+	for (i = 0; i < q->n; ++i) bcf_destroy(q->a[(q->head + i) % q->max]);
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+	free(q->a); free(q);
+}
+
+int bcf_queue_put(bcf_queue_t *q, int n, bcf1_t **b)
+{
+	int i = 0;
+	pthread_mutex_lock(&q->lock);
+	while (i < n && !q->is_closed) {
+		while (q->n == q->max && !q->is_closed)
+			pthread_cond_wait(&q->not_full, &q->lock);
+		for (; i < n && q->n < q->max && !q->is_closed; ++i)
+			q->a[(q->head + q->n++) % q->max] = b[i];
+		pthread_cond_signal(&q->not_empty);
+	}
+	pthread_mutex_unlock(&q->lock);
+	if (i == n) return 0;
+	for (; i < n; ++i) bcf_destroy(b[i]); // the reader has gone
+	return -1;
+}
+
+int bcf_queue_get(bcf_queue_t *q, bcf1_t *b)
+{
+	bcf1_t *r, tmp;
+	pthread_mutex_lock(&q->lock);
+	while (q->n == 0 && !q->is_closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if (q->n == 0) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+	r = q->a[q->head];
+	q->head = (q->head + 1) % q->max, --q->n;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	tmp = *b; *b = *r; *r = tmp; // the pointers in bcf1_t are into memory of its own
+	bcf_destroy(r);
+	return 1;
+}
+
+void bcf_queue_close(bcf_queue_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->is_closed = 1;
+	pthread_cond_broadcast(&q->not_full);
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
@@ -93,6 +93,19 @@ typedef struct {
 
 struct __bcf_idx_t;
 typedef struct __bcf_idx_t bcf_idx_t;
+struct __bcf_iter_t;
+typedef struct __bcf_iter_t *bcf_iter_t;
+
+// a region for bcf_iter_query_regs(); tid:beg-end, 0-based, half-open
+typedef struct {
+	int tid, beg, end;
+} bcf_region_t;
+
+struct __bcf_gtc_t;
+typedef struct __bcf_gtc_t bcf_gtc_t;
+
+struct __bcf_queue_t;
+typedef struct __bcf_queue_t bcf_queue_t;
 
 #ifdef __cplusplus
 extern "C" {
@@ -135,6 +148,8 @@ extern "C" {
 	int vcf_dictread(bcf_t *bp, bcf_hdr_t *h, const char *fn);
 	// read a VCF/BCF record; return -1 on end-of-file and <-1 for errors
 	int vcf_read(bcf_t *bp, bcf_hdr_t *h, bcf1_t *b);
+	// parse VCF records ahead on n_threads threads, from the first vcf_read() on
+	void vcf_set_threads(bcf_t *bp, int n_threads);
 	// write the VCF header
 	int vcf_hdr_write(bcf_t *bp, const bcf_hdr_t *h);
 	// write a VCF record
@@ -165,12 +180,37 @@ extern "C" {
 	int bcf_str2id(void *_hash, const char *str);
 	void *bcf_str2id_init();
 
+	// a queue of at most max records from one thread to another
+	bcf_queue_t *bcf_queue_init(int max);
+	void bcf_queue_destroy(bcf_queue_t *q);
+	// append b[0..n-1], which the queue then owns; wait while full; -1 if closed and the records are freed
+	int bcf_queue_put(bcf_queue_t *q, int n, bcf1_t **b);
+	// move the next record into b; wait while empty; -1 if closed and empty
+	int bcf_queue_get(bcf_queue_t *q, bcf1_t *b);
+	// no more records from the writer, or no more reading by the reader
+	void bcf_queue_close(bcf_queue_t *q);
+
 	// indexing related functions
 	int bcf_idx_build(const char *fn);
 	uint64_t bcf_idx_query(const bcf_idx_t *idx, int tid, int beg);
 	int bcf_parse_region(void *str2id, const char *str, int *tid, int *begin, int *end);
 	bcf_idx_t *bcf_idx_load(const char *fn);
 	void bcf_idx_destroy(bcf_idx_t *idx);
+	// records overlapping tid:beg-end, read with bcf_iter_read(); NULL if tid is not in the index
+	bcf_iter_t bcf_iter_query(const bcf_idx_t *idx, int tid, int beg, int end);
+	// records overlapping any of regs[0..n-1], each returned once in the file order; blocks shared by regions are read once
+	bcf_iter_t bcf_iter_query_regs(const bcf_idx_t *idx, int n, const bcf_region_t *regs);
+	// the next record of the iterator from a BCF; -1 when it is done
+	int bcf_iter_read(bcf_t *bp, bcf_iter_t iter, const bcf_hdr_t *h, bcf1_t *b);
+	void bcf_iter_destroy(bcf_iter_t iter);
+
+	// write fn.gtc, a per-sample columnar copy of the FORMAT fields of the BCF fn
+	int bcf_gtc_build(const char *fn);
+	// map fn.gtc; NULL if absent or not built from the current fn
+	bcf_gtc_t *bcf_gtc_load(const char *fn, const bcf_hdr_t *h);
+	// the next record with samples list[0..n-1] only, as from bcf_read() and then bcf_subsam()
+	int bcf_gtc_read(bcf_gtc_t *c, int n, const int *list, bcf1_t *b);
+	void bcf_gtc_destroy(bcf_gtc_t *c);
 
 #ifdef __cplusplus
 }
@@ -8,6 +8,7 @@ KHASH_MAP_INIT_STR(str2id, int)
 #ifdef _WIN32
 #define srand48(x) srand(x)
 #define drand48() ((double)rand() / RAND_MAX)
+#define erand48(x) drand48()
 #endif
 
 // FIXME: valgrind report a memory leak in this function. Probably it does not get deallocated...
@@ -246,12 +247,16 @@ int bcf_anno_max(bcf1_t *b)
 int bcf_shuffle(bcf1_t *b, int seed)
 {
 	int i, j, *a;
+	unsigned short x[3]; // the state srand48(seed) would set, kept local so that threads do not share it
+	x[0] = 0x330e; x[1] = seed & 0xffff; x[2] = (unsigned)seed >> 16;
+#ifdef _WIN32
 	if (seed > 0) srand48(seed);
+#endif
 	a = malloc(b->n_smpl * sizeof(int));
 	for (i = 0; i < b->n_smpl; ++i) a[i] = i;
 	for (i = b->n_smpl; i > 1; --i) {
 		int tmp;
-		j = (int)(drand48() * i);
+		j = (int)((seed > 0? erand48(x) : drand48()) * i);
 		tmp = a[j]; a[j] = a[i-1]; a[i-1] = tmp;
 	}
 	for (j = 0; j < b->n_gi; ++j) {
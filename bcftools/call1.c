@@ -3,6 +3,7 @@
 #include <math.h>
 #include <zlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include "bcf.h"
 #include "prob1.h"
 #include "kstring.h"
@@ -34,6 +35,7 @@ KSTREAM_INIT(gzFile, gzread, 16384)
 #define VC_PAIRCALL 0x20000
 #define VC_QCNT     0x40000
 #define VC_INDEL_ONLY 0x80000
+#define VC_GTC      0x100000
 
 typedef struct {
 	int flag, prior_type, n1, n_sub, *sublist, n_perm;
@@ -42,11 +44,17 @@ typedef struct {
 	uint8_t *ploidy;
 	double theta, pref, indel_frac, min_perm_p, min_smpl_frac, min_lrt;
 	void *bed;
+	int n_threads, *seeds;
+	bcf_queue_t *in; // records from another thread instead of in.bcf; see bcfview_init()
+	const char *func; // the command, for messages
+	bcf_iter_t iter; // the region, or the -l regions, of an indexed BCF; NULL to read all records
+	bcf_gtc_t *gtc; // columnar cache of in.bcf for -s; records from it are already subsampled
 } viewconf_t;
 
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, int beg, int end);
+const uint64_t *bed_reglist(const void *_h, const char *chr, int *n);
 
 typedef struct {
 	double p[4];
@@ -294,132 +302,408 @@ static void write_header(bcf_hdr_t *h)
 }
 
 double bcf_pair_freq(const bcf1_t *b0, const bcf1_t *b1, double f[4]);
+int bcf_2qcall(bcf_hdr_t *h, bcf1_t *b);
+int bcf_fix_gt(bcf1_t *b);
+int bcf_anno_max(bcf1_t *b);
+int bcf_shuffle(bcf1_t *b, int seed);
+int bcf_trio_call(uint32_t *prep, const bcf1_t *b, int *llr, int64_t *gt);
+int bcf_pair_call(const bcf1_t *b);
+int bcf_min_diff(const bcf1_t *b);
+int bcf_smpl_covered(const bcf1_t *b);
 
-int bcfview(int argc, char *argv[])
+static inline int view_read(const viewconf_t *vc, bcf_t *bp, bcf_hdr_t *h, bcf1_t *b)
 {
-	extern int bcf_2qcall(bcf_hdr_t *h, bcf1_t *b);
-	extern void bcf_p1_indel_prior(bcf_p1aux_t *ma, double x);
-	extern int bcf_fix_gt(bcf1_t *b);
-	extern int bcf_anno_max(bcf1_t *b);
-	extern int bcf_shuffle(bcf1_t *b, int seed);
-	extern uint32_t *bcf_trio_prep(int is_x, int is_son);
-	extern int bcf_trio_call(uint32_t *prep, const bcf1_t *b, int *llr, int64_t *gt);
-	extern int bcf_pair_call(const bcf1_t *b);
-	extern int bcf_min_diff(const bcf1_t *b);
+	if (vc->iter) return bcf_iter_read(bp, vc->iter, h, b);
+	if (vc->gtc) return bcf_gtc_read(vc->gtc, vc->n_sub, vc->sublist, b);
+	return vc->in? bcf_queue_get(vc->in, b) : vcf_read(bp, h, b);
+}
 
-	bcf_t *bp, *bout = 0;
-	bcf1_t *b, *blast;
-	int c, *seeds = 0;
-	uint64_t n_processed = 0, qcnt[256];
-	viewconf_t vc;
-	bcf_p1aux_t *p1 = 0;
-	bcf_hdr_t *hin, *hout;
+// the -l regions on the references of _h_, for bcf_iter_query_regs()
+static bcf_region_t *view_bed_regions(const void *bed, const bcf_hdr_t *h, int *n)
+{
+	bcf_region_t *regs = 0;
+	int i, j, m = 0;
+	for (i = *n = 0; i < h->n_ref; ++i) {
+		int n_a;
+		const uint64_t *a = bed_reglist(bed, h->ns[i], &n_a);
+		if (*n + n_a > m) {
+			m = *n + n_a;
+			kroundup32(m);
+			regs = realloc(regs, m * sizeof(bcf_region_t));
+		}
+		for (j = 0; j < n_a; ++j, ++*n) {
+			regs[*n].tid = i;
+			regs[*n].beg = a[j]>>32;
+			regs[*n].end = (int32_t)a[j];
+		}
+	}
+	return regs;
+}
+
+// filters applied before a site is counted as processed; -1 if past the region, 0 to skip and 1 to keep
+static int view_filter(const viewconf_t *vc, const bcf_hdr_t *h, bcf1_t *b, int tid, int begin, int end)
+{
+	int is_indel;
+	if ((vc->flag & VC_VARONLY) && strcmp(b->alt, "X") == 0) return 0;
+	if ((vc->flag & VC_VARONLY) && vc->min_smpl_frac > 0.) {
+		int n = bcf_smpl_covered(b);
+		if ((double)n / b->n_smpl < vc->min_smpl_frac) return 0;
+	}
+	if (vc->n_sub && vc->gtc == 0) bcf_subsam(vc->n_sub, vc->sublist, b);
+	if (vc->flag & VC_FIX_PL) bcf_fix_pl(b);
+	is_indel = bcf_is_indel(b);
+	if ((vc->flag & VC_NO_INDEL) && is_indel) return 0;
+	if ((vc->flag & VC_INDEL_ONLY) && !is_indel) return 0;
+	if ((vc->flag & VC_ACGT_ONLY) && !is_indel) {
+		int x;
+		if (b->ref[0] == 0 || b->ref[1] != 0) return 0;
+		x = toupper(b->ref[0]);
+		if (x != 'A' && x != 'C' && x != 'G' && x != 'T') return 0;
+	}
+	if (vc->bed && !bed_overlap(vc->bed, h->ns[b->tid], b->pos, b->pos + strlen(b->ref))) return 0;
+	if (tid >= 0) {
+		int l = strlen(b->ref);
+		l = b->pos + (l > 0? l : 1);
+		if (b->tid != tid || b->pos >= end) return -1;
+		if (!(l > begin && end > b->pos)) return 0;
+	}
+	return 1;
+}
+
+// per-site analyses, independent of other sites; 0 to drop the site, 1 to output it and 2 to output it in the QCALL format
+static int view_call(const viewconf_t *vc, bcf_p1aux_t *p1, bcf1_t *b, uint64_t *qcnt)
+{
+	int cons_llr = -1;
+	int64_t cons_gt = -1;
+	double em[10];
+	if ((vc->flag & VC_QCNT) && !bcf_is_indel(b)) { // summarize the difference
+		int x = bcf_min_diff(b);
+		if (x > 255) x = 255;
+		if (x >= 0) ++qcnt[x];
+	}
+	if (vc->flag & VC_QCALL) return 2; // output QCALL format; STOP here
+	if (vc->trio_aux) // do trio calling
+		bcf_trio_call(vc->trio_aux, b, &cons_llr, &cons_gt);
+	else if (vc->flag & VC_PAIRCALL)
+		cons_llr = bcf_pair_call(b);
+	if (vc->flag & (VC_CALL|VC_ADJLD|VC_EM)) bcf_gl2pl(b);
+	if (vc->flag & VC_EM) bcf_em1(b, vc->n1, 0x1ff, em);
+	else {
+		int i;
+		for (i = 0; i < 9; ++i) em[i] = -1.;
+	}
+	if (vc->flag & VC_CALL) { // call variants
+		bcf_p1rst_t pr;
+		int calret = bcf_p1_cal(b, (em[7] >= 0 && em[7] < vc->min_lrt), p1, &pr);
+		if (pr.p_ref >= vc->pref && (vc->flag & VC_VARONLY)) return 0;
+		if (vc->n_perm && vc->n1 > 0 && pr.p_chi2 < vc->min_perm_p) { // permutation test
+			bcf_p1rst_t r;
+			int i, n = 0;
+			for (i = 0; i < vc->n_perm; ++i) {
+#ifdef BCF_PERM_LRT // LRT based permutation is much faster but less robust to artifacts
+				double x[10];
+				bcf_shuffle(b, vc->seeds[i]);
+				bcf_em1(b, vc->n1, 1<<7, x);
+				if (x[7] < em[7]) ++n;
+#else
+				bcf_shuffle(b, vc->seeds[i]);
+				bcf_p1_cal(b, 1, p1, &r);
+				if (pr.p_chi2 >= r.p_chi2) ++n;
+#endif
+			}
+			pr.perm_rank = n;
+		}
+		if (calret >= 0) update_bcf1(b, p1, &pr, vc->pref, vc->flag, em, cons_llr, cons_gt);
+	} else if (vc->flag & VC_EM) update_bcf1(b, 0, 0, 0, vc->flag, em, cons_llr, cons_gt);
+	return 1;
+}
+
+// the steps that depend on the previous site, then output
+static void view_write(const viewconf_t *vc, bcf_t *bout, bcf_hdr_t *h, bcf1_t *b, bcf1_t *blast)
+{
+	if (vc->flag & VC_ADJLD) { // compute LD
+		double f[4], r2;
+		if ((r2 = bcf_pair_freq(blast, b, f)) >= 0) {
+			kstring_t s;
+			s.m = s.l = 0; s.s = 0;
+			if (*b->info) kputc(';', &s);
+			ksprintf(&s, "NEIR=%.3f;NEIF4=%.3f,%.3f,%.3f,%.3f", r2, f[0], f[1], f[2], f[3]);
+			bcf_append_info(b, s.s, s.l);
+			free(s.s);
+		}
+		bcf_cpy(blast, b);
+	}
+	if (vc->flag & VC_ANNO_MAX) bcf_anno_max(b);
+	if (vc->flag & VC_NO_GENO) { // do not output GENO fields
+		b->n_gi = 0;
+		b->fmt[0] = '\0';
+		b->l_str = b->fmt - b->str + 1;
+	} else bcf_fix_gt(b);
+	vcf_write(bout, h, b);
+}
+
+/*
+  With -@, a reader thread reads and filters sites in batches, workers
+  run view_call() on whole batches, each with its own copy of the
+  bcf_p1aux_t, and the calling thread writes the batches in the input
+  order. The AFS of each batch is added to the main bcf_p1aux_t as the
+  batch is written. Batches end where the serial loop reports progress,
+  so that the same sites are reported.
+ */
+
+#define VIEW_BATCH 256
+
+typedef struct {
+	int n, done;
+	bcf1_t **b;
+	int *ret;              // view_call() of b[i]
+	uint64_t n_processed;  // sites processed up to the end of the batch
+	double *afs;           // AFS of the batch; by bcf_p1_take_afs()
+} view_batch_t;
+
+typedef struct {
+	const viewconf_t *vc;
+	bcf_t *bp;
+	bcf_hdr_t *hin;
 	int tid, begin, end;
-	char moder[4], modew[4];
+	const bcf_p1aux_t *p1;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int n_slots, is_eof;
+	view_batch_t *slot;    // batch i is in slot[i % n_slots]
+	int64_t n_read, n_taken, n_written;
+	uint64_t qcnt[256];
+} view_mt_t;
 
-	tid = begin = end = -1;
-	memset(&vc, 0, sizeof(viewconf_t));
-	vc.prior_type = vc.n1 = -1; vc.theta = 1e-3; vc.pref = 0.5; vc.indel_frac = -1.; vc.n_perm = 0; vc.min_perm_p = 0.01; vc.min_smpl_frac = 0; vc.min_lrt = 1;
+static void *view_reader(void *data)
+{
+	view_mt_t *m = (view_mt_t*)data;
+	uint64_t n_processed = 0;
+	int is_eof = 0;
+	while (!is_eof) {
+		view_batch_t *q;
+		pthread_mutex_lock(&m->lock);
+		while (m->n_read - m->n_written == m->n_slots)
+			pthread_cond_wait(&m->cv, &m->lock);
+		pthread_mutex_unlock(&m->lock);
+		q = &m->slot[m->n_read % m->n_slots];
+		for (q->n = 0; q->n < VIEW_BATCH;) {
+			int ret = -1;
+			if (view_read(m->vc, m->bp, m->hin, q->b[q->n]) > 0)
+				ret = view_filter(m->vc, m->hin, q->b[q->n], m->tid, m->begin, m->end);
+			if (ret < 0) {
+				is_eof = 1;
+				break;
+			}
+			if (ret == 0) continue;
+			++q->n;
+			if (++n_processed % 100000 == 0) break;
+		}
+		q->n_processed = n_processed;
+		q->done = 0;
+		pthread_mutex_lock(&m->lock);
+		++m->n_read;
+		m->is_eof = is_eof;
+		pthread_cond_broadcast(&m->cv);
+		pthread_mutex_unlock(&m->lock);
+	}
+	return 0;
+}
+
+static void *view_worker(void *data)
+{
+	view_mt_t *m = (view_mt_t*)data;
+	bcf_p1aux_t *p1 = m->p1? bcf_p1_dup(m->p1) : 0;
+	uint64_t qcnt[256];
+	int i;
 	memset(qcnt, 0, 8 * 256);
-	while ((c = getopt(argc, argv, "FN1:l:cC:eHAGvbSuP:t:p:QgLi:IMs:D:U:X:d:T:Yw")) >= 0) {
+	for (;;) {
+		view_batch_t *q;
+		pthread_mutex_lock(&m->lock);
+		while (m->n_taken == m->n_read && !m->is_eof)
+			pthread_cond_wait(&m->cv, &m->lock);
+		if (m->n_taken == m->n_read) {
+			pthread_mutex_unlock(&m->lock);
+			break;
+		}
+		q = &m->slot[m->n_taken++ % m->n_slots];
+		pthread_mutex_unlock(&m->lock);
+		for (i = 0; i < q->n; ++i)
+			q->ret[i] = view_call(m->vc, p1, q->b[i], qcnt);
+		if (p1) q->afs = bcf_p1_take_afs(p1);
+		pthread_mutex_lock(&m->lock);
+		q->done = 1;
+		pthread_cond_broadcast(&m->cv);
+		pthread_mutex_unlock(&m->lock);
+	}
+	pthread_mutex_lock(&m->lock);
+	for (i = 0; i < 256; ++i) m->qcnt[i] += qcnt[i];
+	pthread_mutex_unlock(&m->lock);
+	bcf_p1_destroy(p1);
+	return 0;
+}
+
+static void view_mt(const viewconf_t *vc, bcf_t *bp, bcf_hdr_t *hin, bcf_t *bout, bcf_hdr_t *hout, bcf_p1aux_t *p1,
+					int tid, int begin, int end, bcf1_t *blast, uint64_t *qcnt)
+{
+	view_mt_t m;
+	pthread_t *wid, rid;
+	int i, j;
+	memset(&m, 0, sizeof(view_mt_t));
+	m.vc = vc; m.bp = bp; m.hin = hin; m.p1 = p1;
+	m.tid = tid; m.begin = begin; m.end = end;
+	m.n_slots = vc->n_threads * 2;
+	m.slot = calloc(m.n_slots, sizeof(view_batch_t));
+	for (i = 0; i < m.n_slots; ++i) {
+		m.slot[i].b = calloc(VIEW_BATCH, sizeof(void*));
+		m.slot[i].ret = calloc(VIEW_BATCH, sizeof(int));
+		for (j = 0; j < VIEW_BATCH; ++j) m.slot[i].b[j] = calloc(1, sizeof(bcf1_t));
+	}
+	pthread_mutex_init(&m.lock, 0);
+	pthread_cond_init(&m.cv, 0);
+	wid = calloc(vc->n_threads, sizeof(pthread_t));
+	pthread_create(&rid, 0, view_reader, &m);
+	for (i = 0; i < vc->n_threads; ++i) pthread_create(&wid[i], 0, view_worker, &m);
+	for (;;) {
+		view_batch_t *q;
+		int is_end;
+		pthread_mutex_lock(&m.lock);
+		while (!(m.n_written < m.n_read && m.slot[m.n_written % m.n_slots].done) && !(m.is_eof && m.n_written == m.n_read))
+			pthread_cond_wait(&m.cv, &m.lock);
+		is_end = (m.n_written == m.n_read);
+		pthread_mutex_unlock(&m.lock);
+		if (is_end) break;
+		q = &m.slot[m.n_written % m.n_slots];
+		for (i = 0; i < q->n; ++i) {
+			if (q->ret[i] == 2) bcf_2qcall(hout, q->b[i]);
+			else if (q->ret[i]) view_write(vc, bout, hout, q->b[i], blast);
+		}
+		if (q->afs) {
+			bcf_p1_add_afs(p1, q->afs);
+			q->afs = 0;
+		}
+		if ((vc->flag & VC_CALL) && !(vc->flag & VC_QCALL) && q->n && q->n_processed % 100000 == 0) {
+			fprintf(stderr, "[%s] %ld sites processed.\n", vc->func, (long)q->n_processed);
+			bcf_p1_dump_afs(p1);
+		}
+		pthread_mutex_lock(&m.lock);
+		++m.n_written;
+		pthread_cond_broadcast(&m.cv);
+		pthread_mutex_unlock(&m.lock);
+	}
+	pthread_join(rid, 0);
+	for (i = 0; i < vc->n_threads; ++i) pthread_join(wid[i], 0);
+	for (i = 0; i < 256; ++i) qcnt[i] += m.qcnt[i];
+	pthread_cond_destroy(&m.cv);
+	pthread_mutex_destroy(&m.lock);
+	for (i = 0; i < m.n_slots; ++i) {
+		for (j = 0; j < VIEW_BATCH; ++j) bcf_destroy(m.slot[i].b[j]);
+		free(m.slot[i].b); free(m.slot[i].ret);
+	}
+	free(m.slot); free(wid);
+}
+
+// the defaults of bcftools view
+static void view_init(viewconf_t *vc, const char *func)
+{
+	memset(vc, 0, sizeof(viewconf_t));
+	vc->func = func;
+	vc->prior_type = vc->n1 = -1; vc->theta = 1e-3; vc->pref = 0.5; vc->indel_frac = -1.; vc->n_perm = 0; vc->min_perm_p = 0.01; vc->min_smpl_frac = 0; vc->min_lrt = 1; vc->n_threads = 1;
+}
+
+// parse the options of bcftools view; return the index of the first other argument, or -1 on a bad option
+static int view_opts(viewconf_t *vc, int argc, char *argv[])
+{
+	extern uint32_t *bcf_trio_prep(int is_x, int is_son);
+	int c, i;
+	while ((c = getopt(argc, argv, "FN1:l:cC:eHAGvbSuP:t:p:QgLi:IMs:D:U:X:d:T:Yw@:k")) >= 0) {
 		switch (c) {
-		case '1': vc.n1 = atoi(optarg); break;
-		case 'l': vc.bed = bed_read(optarg); break;
-		case 'D': vc.fn_dict = strdup(optarg); break;
-		case 'F': vc.flag |= VC_FIX_PL; break;
-		case 'N': vc.flag |= VC_ACGT_ONLY; break;
-		case 'G': vc.flag |= VC_NO_GENO; break;
-		case 'A': vc.flag |= VC_KEEPALT; break;
-		case 'b': vc.flag |= VC_BCFOUT; break;
-		case 'S': vc.flag |= VC_VCFIN; break;
-		case 'c': vc.flag |= VC_CALL; break;
-		case 'e': vc.flag |= VC_EM; break;
-		case 'v': vc.flag |= VC_VARONLY | VC_CALL; break;
-		case 'u': vc.flag |= VC_UNCOMP | VC_BCFOUT; break;
-		case 'g': vc.flag |= VC_CALL_GT | VC_CALL; break;
-		case 'I': vc.flag |= VC_NO_INDEL; break;
-		case 'w': vc.flag |= VC_INDEL_ONLY; break;
-		case 'M': vc.flag |= VC_ANNO_MAX; break;
-		case 'Y': vc.flag |= VC_QCNT; break;
-		case 't': vc.theta = atof(optarg); break;
-		case 'p': vc.pref = atof(optarg); break;
-		case 'i': vc.indel_frac = atof(optarg); break;
-		case 'Q': vc.flag |= VC_QCALL; break;
-		case 'L': vc.flag |= VC_ADJLD; break;
-		case 'U': vc.n_perm = atoi(optarg); break;
-		case 'C': vc.min_lrt = atof(optarg); break;
-		case 'X': vc.min_perm_p = atof(optarg); break;
-		case 'd': vc.min_smpl_frac = atof(optarg); break;
-		case 's': vc.subsam = read_samples(optarg, &vc.n_sub);
-			vc.ploidy = calloc(vc.n_sub + 1, 1);
-			for (tid = 0; tid < vc.n_sub; ++tid) vc.ploidy[tid] = vc.subsam[tid][strlen(vc.subsam[tid]) + 1];
-			tid = -1;
+		case '1': vc->n1 = atoi(optarg); break;
+		case 'l': vc->bed = bed_read(optarg); break;
+		case 'D': vc->fn_dict = strdup(optarg); break;
+		case 'F': vc->flag |= VC_FIX_PL; break;
+		case 'N': vc->flag |= VC_ACGT_ONLY; break;
+		case 'G': vc->flag |= VC_NO_GENO; break;
+		case 'A': vc->flag |= VC_KEEPALT; break;
+		case 'b': vc->flag |= VC_BCFOUT; break;
+		case 'S': vc->flag |= VC_VCFIN; break;
+		case 'c': vc->flag |= VC_CALL; break;
+		case 'e': vc->flag |= VC_EM; break;
+		case 'v': vc->flag |= VC_VARONLY | VC_CALL; break;
+		case 'u': vc->flag |= VC_UNCOMP | VC_BCFOUT; break;
+		case 'g': vc->flag |= VC_CALL_GT | VC_CALL; break;
+		case 'I': vc->flag |= VC_NO_INDEL; break;
+		case 'w': vc->flag |= VC_INDEL_ONLY; break;
+		case 'M': vc->flag |= VC_ANNO_MAX; break;
+		case 'Y': vc->flag |= VC_QCNT; break;
+		case 'k': vc->flag |= VC_GTC; break;
+		case 't': vc->theta = atof(optarg); break;
+		case 'p': vc->pref = atof(optarg); break;
+		case 'i': vc->indel_frac = atof(optarg); break;
+		case 'Q': vc->flag |= VC_QCALL; break;
+		case 'L': vc->flag |= VC_ADJLD; break;
+		case 'U': vc->n_perm = atoi(optarg); break;
+		case 'C': vc->min_lrt = atof(optarg); break;
+		case 'X': vc->min_perm_p = atof(optarg); break;
+		case 'd': vc->min_smpl_frac = atof(optarg); break;
+		case '@': vc->n_threads = atoi(optarg); break;
+		case 's': vc->subsam = read_samples(optarg, &vc->n_sub);
+			vc->ploidy = calloc(vc->n_sub + 1, 1);
+			for (i = 0; i < vc->n_sub; ++i) vc->ploidy[i] = vc->subsam[i][strlen(vc->subsam[i]) + 1];
 			break;
 		case 'T':
-			if (strcmp(optarg, "trioauto") == 0) vc.trio_aux = bcf_trio_prep(0, 0);
-			else if (strcmp(optarg, "trioxd") == 0) vc.trio_aux = bcf_trio_prep(1, 0);
-			else if (strcmp(optarg, "trioxs") == 0) vc.trio_aux = bcf_trio_prep(1, 1);
-			else if (strcmp(optarg, "pair") == 0) vc.flag |= VC_PAIRCALL;
+			if (strcmp(optarg, "trioauto") == 0) vc->trio_aux = bcf_trio_prep(0, 0);
+			else if (strcmp(optarg, "trioxd") == 0) vc->trio_aux = bcf_trio_prep(1, 0);
+			else if (strcmp(optarg, "trioxs") == 0) vc->trio_aux = bcf_trio_prep(1, 1);
+			else if (strcmp(optarg, "pair") == 0) vc->flag |= VC_PAIRCALL;
 			else {
-				fprintf(stderr, "[%s] Option '-T' can only take value trioauto, trioxd or trioxs.\n", __func__);
-				return 1;
+				fprintf(stderr, "[%s] Option '-T' can only take value trioauto, trioxd or trioxs.\n", vc->func);
+				return -1;
 			}
 			break;
 		case 'P':
-			if (strcmp(optarg, "full") == 0) vc.prior_type = MC_PTYPE_FULL;
-			else if (strcmp(optarg, "cond2") == 0) vc.prior_type = MC_PTYPE_COND2;
-			else if (strcmp(optarg, "flat") == 0) vc.prior_type = MC_PTYPE_FLAT;
-			else vc.prior_file = strdup(optarg);
+			if (strcmp(optarg, "full") == 0) vc->prior_type = MC_PTYPE_FULL;
+			else if (strcmp(optarg, "cond2") == 0) vc->prior_type = MC_PTYPE_COND2;
+			else if (strcmp(optarg, "flat") == 0) vc->prior_type = MC_PTYPE_FLAT;
+			else vc->prior_file = strdup(optarg);
 			break;
 		}
 	}
-	if (argc == optind) {
-		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage: bcftools view [options] <in.bcf> [reg]\n\n");
-		fprintf(stderr, "Input/output options:\n\n");
-		fprintf(stderr, "       -A        keep all possible alternate alleles at variant sites\n");
-		fprintf(stderr, "       -b        output BCF instead of VCF\n");
-		fprintf(stderr, "       -D FILE   sequence dictionary for VCF->BCF conversion [null]\n");
-		fprintf(stderr, "       -F        PL generated by r921 or before (which generate old ordering)\n");
-		fprintf(stderr, "       -G        suppress all individual genotype information\n");
-		fprintf(stderr, "       -l FILE   list of sites (chr pos) or regions (BED) to output [all sites]\n");
-		fprintf(stderr, "       -L        calculate LD for adjacent sites\n");
-		fprintf(stderr, "       -N        skip sites where REF is not A/C/G/T\n");
-		fprintf(stderr, "       -Q        output the QCALL likelihood format\n");
-		fprintf(stderr, "       -s FILE   list of samples to use [all samples]\n");
-		fprintf(stderr, "       -S        input is VCF\n");
-		fprintf(stderr, "       -u        uncompressed BCF output (force -b)\n");
-		fprintf(stderr, "\nConsensus/variant calling options:\n\n");
-		fprintf(stderr, "       -c        SNP calling (force -e)\n");
-		fprintf(stderr, "       -d FLOAT  skip loci where less than FLOAT fraction of samples covered [0]\n");
-		fprintf(stderr, "       -e        likelihood based analyses\n");
-		fprintf(stderr, "       -g        call genotypes at variant sites (force -c)\n");
-		fprintf(stderr, "       -i FLOAT  indel-to-substitution ratio [%.4g]\n", vc.indel_frac);
-		fprintf(stderr, "       -I        skip indels\n");
-		fprintf(stderr, "       -p FLOAT  variant if P(ref|D)<FLOAT [%.3g]\n", vc.pref);
-		fprintf(stderr, "       -P STR    type of prior: full, cond2, flat [full]\n");
-		fprintf(stderr, "       -t FLOAT  scaled substitution mutation rate [%.4g]\n", vc.theta);
-		fprintf(stderr, "       -T STR    constrained calling; STR can be: pair, trioauto, trioxd and trioxs (see manual) [null]\n");
-		fprintf(stderr, "       -v        output potential variant sites only (force -c)\n");
-		fprintf(stderr, "\nContrast calling and association test options:\n\n");
-		fprintf(stderr, "       -1 INT    number of group-1 samples [0]\n");
-		fprintf(stderr, "       -C FLOAT  posterior constrast for LRT<FLOAT and P(ref|D)<0.5 [%g]\n", vc.min_lrt);
-		fprintf(stderr, "       -U INT    number of permutations for association testing (effective with -1) [0]\n");
-		fprintf(stderr, "       -X FLOAT  only perform permutations for P(chi^2)<FLOAT [%g]\n", vc.min_perm_p);
-		fprintf(stderr, "\n");
-		return 1;
-	}
+	return optind;
+}
+
+/*
+  Run bcftools view with the options in _vc_, on in.bcf [reg] given in
+  argv, or with a queue, on the records from another thread: h is then
+  their header, which is kept by the caller, and argv is empty.
+ */
+static int view_run(viewconf_t *_vc, int argc, char *argv[], bcf_hdr_t *h, bcf_queue_t *in)
+{
+	extern void bcf_p1_indel_prior(bcf_p1aux_t *ma, double x);
+
+	bcf_t *bp, *bout = 0;
+	bcf1_t *b, *blast;
+	int c, ret;
+	uint64_t n_processed = 0, qcnt[256];
+	viewconf_t vc = *_vc;
+	bcf_p1aux_t *p1 = 0;
+	bcf_hdr_t *hin, *hout;
+	int tid, begin, end;
+	char moder[4], modew[4];
 
+	tid = begin = end = -1;
+	vc.in = in;
+	memset(qcnt, 0, 8 * 256);
 	if (vc.flag & VC_CALL) vc.flag |= VC_EM;
 	if ((vc.flag & VC_VCFIN) && (vc.flag & VC_BCFOUT) && vc.fn_dict == 0) {
-		fprintf(stderr, "[%s] For VCF->BCF conversion please specify the sequence dictionary with -D\n", __func__);
+		fprintf(stderr, "[%s] For VCF->BCF conversion please specify the sequence dictionary with -D\n", vc.func);
 		return 1;
 	}
 	if (vc.n1 <= 0) vc.n_perm = 0; // TODO: give a warning here!
 	if (vc.n_perm > 0) {
-		seeds = malloc(vc.n_perm * sizeof(int));
+		vc.seeds = malloc(vc.n_perm * sizeof(int));
 		srand48(time(0));
-		for (c = 0; c < vc.n_perm; ++c) seeds[c] = lrand48();
+		for (c = 0; c < vc.n_perm; ++c) vc.seeds[c] = lrand48();
 	}
 	b = calloc(1, sizeof(bcf1_t));
 	blast = calloc(1, sizeof(bcf1_t));
@@ -428,10 +712,18 @@ int bcfview(int argc, char *argv[])
 	strcpy(modew, "w");
 	if (vc.flag & VC_BCFOUT) strcat(modew, "b");
 	if (vc.flag & VC_UNCOMP) strcat(modew, "u");
-	bp = vcf_open(argv[optind], moder);
-	hin = hout = vcf_hdr_read(bp);
-	if (vc.fn_dict && (vc.flag & VC_VCFIN))
-		vcf_dictread(bp, hin, vc.fn_dict);
+	if (in == 0 && (vc.flag & VC_GTC)) {
+		if ((vc.flag & VC_VCFIN) || strcmp(argv[0], "-") == 0)
+			fprintf(stderr, "[%s] -k needs a BCF file; no cache is written.\n", vc.func);
+		else if (bcf_gtc_build(argv[0]) < 0) return 1;
+	}
+	if (in == 0) {
+		bp = vcf_open(argv[0], moder);
+		hin = hout = vcf_hdr_read(bp);
+		if (vc.fn_dict && (vc.flag & VC_VCFIN))
+			vcf_dictread(bp, hin, vc.fn_dict);
+		if (vc.n_threads > 1) vcf_set_threads(bp, vc.n_threads); // for VCF input
+	} else bp = 0, hin = hout = h;
 	bout = vcf_open("-", modew);
 	if (!(vc.flag & VC_QCALL)) {
 		if (vc.n_sub) {
@@ -445,7 +737,7 @@ int bcfview(int argc, char *argv[])
 		p1 = bcf_p1_init(hout->n_smpl, vc.ploidy);
 		if (vc.prior_file) {
 			if (bcf_p1_read_prior(p1, vc.prior_file) < 0) {
-				fprintf(stderr, "[%s] fail to read the prior AFS.\n", __func__);
+				fprintf(stderr, "[%s] fail to read the prior AFS.\n", vc.func);
 				return 1;
 			}
 		} else bcf_p1_init_prior(p1, vc.prior_type, vc.theta);
@@ -455,124 +747,44 @@ int bcfview(int argc, char *argv[])
 		}
 		if (vc.indel_frac > 0.) bcf_p1_indel_prior(p1, vc.indel_frac); // otherwise use the default indel_frac
 	}
-	if (optind + 1 < argc && !(vc.flag&VC_VCFIN)) {
-		void *str2id = bcf_build_refhash(hout);
-		if (bcf_parse_region(str2id, argv[optind+1], &tid, &begin, &end) >= 0) {
-			bcf_idx_t *idx;
-			idx = bcf_idx_load(argv[optind]);
-			if (idx) {
-				uint64_t off;
-				off = bcf_idx_query(idx, tid, begin);
-				if (off == 0) {
-					fprintf(stderr, "[%s] no records in the query region.\n", __func__);
-					return 1; // FIXME: a lot of memory leaks...
-				}
-				bgzf_seek(bp->fp, off, SEEK_SET);
-				bcf_idx_destroy(idx);
-			}
+	if (in == 0 && !(vc.flag&VC_VCFIN) && (argc > 1 || vc.bed)) { // random access to the region(s)
+		bcf_idx_t *idx = bcf_idx_load(argv[0]);
+		if (argc > 1) {
+			void *str2id = bcf_build_refhash(hin);
+			if (bcf_parse_region(str2id, argv[1], &tid, &begin, &end) >= 0 && idx)
+				vc.iter = bcf_iter_query(idx, tid, begin, end);
+			bcf_str2id_destroy(str2id);
+		} else if (idx) { // only the blocks overlapping the -l regions
+			int n_regs;
+			bcf_region_t *regs = view_bed_regions(vc.bed, hin, &n_regs);
+			vc.iter = bcf_iter_query_regs(idx, n_regs, regs);
+			free(regs);
 		}
+		bcf_idx_destroy(idx);
 	}
-	while (vcf_read(bp, hin, b) > 0) {
-		int is_indel, cons_llr = -1;
-		int64_t cons_gt = -1;
-		double em[10];
-		if ((vc.flag & VC_VARONLY) && strcmp(b->alt, "X") == 0) continue;
-		if ((vc.flag & VC_VARONLY) && vc.min_smpl_frac > 0.) {
-			extern int bcf_smpl_covered(const bcf1_t *b);
-			int n = bcf_smpl_covered(b);
-			if ((double)n / b->n_smpl < vc.min_smpl_frac) continue;
-		}
-		if (vc.n_sub) bcf_subsam(vc.n_sub, vc.sublist, b);
-		if (vc.flag & VC_FIX_PL) bcf_fix_pl(b);
-		is_indel = bcf_is_indel(b);
-		if ((vc.flag & VC_NO_INDEL) && is_indel) continue;
-		if ((vc.flag & VC_INDEL_ONLY) && !is_indel) continue;
-		if ((vc.flag & VC_ACGT_ONLY) && !is_indel) {
-			int x;
-			if (b->ref[0] == 0 || b->ref[1] != 0) continue;
-			x = toupper(b->ref[0]);
-			if (x != 'A' && x != 'C' && x != 'G' && x != 'T') continue;
-		}
-		if (vc.bed && !bed_overlap(vc.bed, hin->ns[b->tid], b->pos, b->pos + strlen(b->ref))) continue;
-		if (tid >= 0) {
-			int l = strlen(b->ref);
-			l = b->pos + (l > 0? l : 1);
-			if (b->tid != tid || b->pos >= end) break;
-			if (!(l > begin && end > b->pos)) continue;
-		}
+	if (vc.sublist && vc.iter == 0 && tid < 0 && in == 0 && !(vc.flag&VC_VCFIN)
+		&& !((vc.flag & VC_VARONLY) && vc.min_smpl_frac > 0.)) // the cache gives the -s samples only
+		vc.gtc = bcf_gtc_load(argv[0], hin);
+	if (vc.n_threads > 1) view_mt(&vc, bp, hin, bout, hout, p1, tid, begin, end, blast, qcnt);
+	else while (view_read(&vc, bp, hin, b) > 0) {
+		if ((ret = view_filter(&vc, hin, b, tid, begin, end)) < 0) break;
+		if (ret == 0) continue;
 		++n_processed;
-		if ((vc.flag & VC_QCNT) && !is_indel) { // summarize the difference
-			int x = bcf_min_diff(b);
-			if (x > 255) x = 255;
-			if (x >= 0) ++qcnt[x];
+		ret = view_call(&vc, p1, b, qcnt);
+		if ((vc.flag & VC_CALL) && !(vc.flag & VC_QCALL) && n_processed % 100000 == 0) {
+			fprintf(stderr, "[%s] %ld sites processed.\n", vc.func, (long)n_processed);
+			bcf_p1_dump_afs(p1);
 		}
-		if (vc.flag & VC_QCALL) { // output QCALL format; STOP here
-			bcf_2qcall(hout, b);
-			continue;
-		}
-		if (vc.trio_aux) // do trio calling
-			bcf_trio_call(vc.trio_aux, b, &cons_llr, &cons_gt);
-		else if (vc.flag & VC_PAIRCALL)
-			cons_llr = bcf_pair_call(b);
-		if (vc.flag & (VC_CALL|VC_ADJLD|VC_EM)) bcf_gl2pl(b);
-		if (vc.flag & VC_EM) bcf_em1(b, vc.n1, 0x1ff, em);
-		else {
-			int i;
-			for (i = 0; i < 9; ++i) em[i] = -1.;
-		}
-		if (vc.flag & VC_CALL) { // call variants
-			bcf_p1rst_t pr;
-			int calret = bcf_p1_cal(b, (em[7] >= 0 && em[7] < vc.min_lrt), p1, &pr);
-			if (n_processed % 100000 == 0) {
-				fprintf(stderr, "[%s] %ld sites processed.\n", __func__, (long)n_processed);
-				bcf_p1_dump_afs(p1);
-			}
-			if (pr.p_ref >= vc.pref && (vc.flag & VC_VARONLY)) continue;
-			if (vc.n_perm && vc.n1 > 0 && pr.p_chi2 < vc.min_perm_p) { // permutation test
-				bcf_p1rst_t r;
-				int i, n = 0;
-				for (i = 0; i < vc.n_perm; ++i) {
-#ifdef BCF_PERM_LRT // LRT based permutation is much faster but less robust to artifacts
-					double x[10];
-					bcf_shuffle(b, seeds[i]);
-					bcf_em1(b, vc.n1, 1<<7, x);
-					if (x[7] < em[7]) ++n;
-#else
-					bcf_shuffle(b, seeds[i]);
-					bcf_p1_cal(b, 1, p1, &r);
-					if (pr.p_chi2 >= r.p_chi2) ++n;
-#endif
-				}
-				pr.perm_rank = n;
-			}
-			if (calret >= 0) update_bcf1(b, p1, &pr, vc.pref, vc.flag, em, cons_llr, cons_gt);
-		} else if (vc.flag & VC_EM) update_bcf1(b, 0, 0, 0, vc.flag, em, cons_llr, cons_gt);
-		if (vc.flag & VC_ADJLD) { // compute LD
-			double f[4], r2;
-			if ((r2 = bcf_pair_freq(blast, b, f)) >= 0) {
-				kstring_t s;
-				s.m = s.l = 0; s.s = 0;
-				if (*b->info) kputc(';', &s);
-				ksprintf(&s, "NEIR=%.3f;NEIF4=%.3f,%.3f,%.3f,%.3f", r2, f[0], f[1], f[2], f[3]);
-				bcf_append_info(b, s.s, s.l);
-				free(s.s);
-			}
-			bcf_cpy(blast, b);
-		}
-		if (vc.flag & VC_ANNO_MAX) bcf_anno_max(b);
-		if (vc.flag & VC_NO_GENO) { // do not output GENO fields
-			b->n_gi = 0;
-			b->fmt[0] = '\0';
-			b->l_str = b->fmt - b->str + 1;
-		} else bcf_fix_gt(b);
-		vcf_write(bout, hout, b);
+		if (ret == 2) bcf_2qcall(hout, b);
+		else if (ret) view_write(&vc, bout, hout, b, blast);
 	}
 	if (vc.prior_file) free(vc.prior_file);
 	if (vc.flag & VC_CALL) bcf_p1_dump_afs(p1);
 	if (hin != hout) bcf_hdr_destroy(hout);
-	bcf_hdr_destroy(hin);
+	if (in == 0) bcf_hdr_destroy(hin);
 	bcf_destroy(b); bcf_destroy(blast);
-	vcf_close(bp); vcf_close(bout);
+	if (bp) vcf_close(bp);
+	vcf_close(bout);
 	if (vc.fn_dict) free(vc.fn_dict);
 	if (vc.ploidy) free(vc.ploidy);
 	if (vc.trio_aux) free(vc.trio_aux);
@@ -582,10 +794,82 @@ int bcfview(int argc, char *argv[])
 		free(vc.subsam); free(vc.sublist);
 	}
 	if (vc.bed) bed_destroy(vc.bed);
+	bcf_iter_destroy(vc.iter);
+	bcf_gtc_destroy(vc.gtc);
 	if (vc.flag & VC_QCNT)
 		for (c = 0; c < 256; ++c)
 			fprintf(stderr, "QT\t%d\t%lld\n", c, (long long)qcnt[c]);
-	if (seeds) free(seeds);
+	if (vc.seeds) free(vc.seeds);
 	if (p1) bcf_p1_destroy(p1);
 	return 0;
 }
+
+
+int bcfview(int argc, char *argv[])
+{
+	viewconf_t vc;
+	int k;
+	view_init(&vc, __func__);
+	if ((k = view_opts(&vc, argc, argv)) < 0) return 1;
+	if (k == argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage: bcftools view [options] <in.bcf> [reg]\n\n");
+		fprintf(stderr, "Input/output options:\n\n");
+		fprintf(stderr, "       -A        keep all possible alternate alleles at variant sites\n");
+		fprintf(stderr, "       -b        output BCF instead of VCF\n");
+		fprintf(stderr, "       -D FILE   sequence dictionary for VCF->BCF conversion [null]\n");
+		fprintf(stderr, "       -F        PL generated by r921 or before (which generate old ordering)\n");
+		fprintf(stderr, "       -G        suppress all individual genotype information\n");
+		fprintf(stderr, "       -l FILE   list of sites (chr pos) or regions (BED) to output; fetched by the index if in.bcf has one [all sites]\n");
+		fprintf(stderr, "       -L        calculate LD for adjacent sites\n");
+		fprintf(stderr, "       -N        skip sites where REF is not A/C/G/T\n");
+		fprintf(stderr, "       -Q        output the QCALL likelihood format\n");
+		fprintf(stderr, "       -s FILE   list of samples to use [all samples]\n");
+		fprintf(stderr, "       -S        input is VCF\n");
+		fprintf(stderr, "       -k        write in.bcf.gtc, a per-sample copy of the genotypes that speeds up -s on later runs\n");
+		fprintf(stderr, "       -u        uncompressed BCF output (force -b)\n");
+		fprintf(stderr, "\nConsensus/variant calling options:\n\n");
+		fprintf(stderr, "       -c        SNP calling (force -e)\n");
+		fprintf(stderr, "       -d FLOAT  skip loci where less than FLOAT fraction of samples covered [0]\n");
+		fprintf(stderr, "       -e        likelihood based analyses\n");
+		fprintf(stderr, "       -g        call genotypes at variant sites (force -c)\n");
+		fprintf(stderr, "       -i FLOAT  indel-to-substitution ratio [%.4g]\n", vc.indel_frac);
+		fprintf(stderr, "       -I        skip indels\n");
+		fprintf(stderr, "       -p FLOAT  variant if P(ref|D)<FLOAT [%.3g]\n", vc.pref);
+		fprintf(stderr, "       -P STR    type of prior: full, cond2, flat [full]\n");
+		fprintf(stderr, "       -t FLOAT  scaled substitution mutation rate [%.4g]\n", vc.theta);
+		fprintf(stderr, "       -T STR    constrained calling; STR can be: pair, trioauto, trioxd and trioxs (see manual) [null]\n");
+		fprintf(stderr, "       -v        output potential variant sites only (force -c)\n");
+		fprintf(stderr, "       -@ INT    number of threads for calling and VCF parsing; output is identical [1]\n");
+		fprintf(stderr, "\nContrast calling and association test options:\n\n");
+		fprintf(stderr, "       -1 INT    number of group-1 samples [0]\n");
+		fprintf(stderr, "       -C FLOAT  posterior constrast for LRT<FLOAT and P(ref|D)<0.5 [%g]\n", vc.min_lrt);
+		fprintf(stderr, "       -U INT    number of permutations for association testing (effective with -1) [0]\n");
+		fprintf(stderr, "       -X FLOAT  only perform permutations for P(chi^2)<FLOAT [%g]\n", vc.min_perm_p);
+		fprintf(stderr, "\n");
+		return 1;
+	}
+
+	return view_run(&vc, argc - k, argv + k, 0, 0);
+}
+
+// parse the options of bcftools view for bcfview_run(); NULL on a bad option
+void *bcfview_init(int argc, char *argv[], const char *func)
+{
+	viewconf_t *vc = malloc(sizeof(viewconf_t));
+	view_init(vc, func);
+	optind = 1; // the caller has finished with getopt() for its own options
+	if (view_opts(vc, argc, argv) < 0) {
+		free(vc);
+		return 0;
+	}
+	return vc;
+}
+
+// bcftools view on the records from _in_, with options from bcfview_init(); may run on another thread
+int bcfview_run(void *vc, bcf_hdr_t *h, bcf_queue_t *in)
+{
+	int ret = view_run((viewconf_t*)vc, 0, 0, h, in);
+	free(vc);
+	return ret;
+}
@@ -1,10 +1,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "bcf.h"
 #include "kmin.h"
 
 static double g_q2p[256];
+static pthread_once_t g_q2p_once = PTHREAD_ONCE_INIT;
 
 #define ITER_MAX 50
 #define ITER_TRY 10
@@ -15,16 +17,20 @@ extern double kf_gammaq(double, double);
 /*
 	Generic routines
  */
+static void q2p_init(void)
+{
+	int i;
+	for (i = 0; i < 256; ++i)
+		g_q2p[i] = pow(10., -i / 10.);
+}
+
 // get the 3 genotype likelihoods
 static double *get_pdg3(const bcf1_t *b)
 {
 	double *pdg;
 	const uint8_t *PL = 0;
 	int i, PL_len = 0;
-	// initialize g_q2p if necessary
-	if (g_q2p[0] == 0.)
-		for (i = 0; i < 256; ++i)
-			g_q2p[i] = pow(10., -i / 10.);
+	pthread_once(&g_q2p_once, q2p_init); // bcfview may call this on several threads
 	// set PL and PL_len
 	for (i = 0; i < b->n_gi; ++i) {
 		if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
@@ -239,14 +245,15 @@ int bcf_em1(const bcf1_t *b, int n1, int flag, double x[10])
 #define _G2(h, k) ((h&1) + (k&1))
 
 // 0: the previous site; 1: the current site
-static int pair_freq_iter(int n, double *pdg[2], double f[4])
+static int pair_freq_iter(int n, const double *pdg[2], double f[4])
 {
 	double ff[4];
 	int i, k, h;
 //	printf("%lf,%lf,%lf,%lf\n", f[0], f[1], f[2], f[3]);
 	memset(ff, 0, 4 * sizeof(double));
 	for (i = 0; i < n; ++i) {
-		double *p[2], sum, tmp;
+		const double *p[2];
+		double sum, tmp;
 		p[0] = pdg[0] + i * 3; p[1] = pdg[1] + i * 3;
 		for (k = 0, sum = 0.; k < 4; ++k)
 			for (h = 0; h < 4; ++h)
@@ -263,22 +270,22 @@ static int pair_freq_iter(int n, double *pdg[2], double f[4])
 	return 0;
 }
 
-double bcf_pair_freq(const bcf1_t *b0, const bcf1_t *b1, double f[4])
+// genotype likelihoods of a site for bcf_pair_freq2(); NULL if it has no PL or only one allele
+double *bcf_pair_pdg(const bcf1_t *b)
 {
-	const bcf1_t *b[2];
-	int i, j, n_smpl;
-	double *pdg[2], flast[4], r, f0[2];
-	// initialize others
-	if (b0->n_smpl != b1->n_smpl) return -1; // different number of samples
-	n_smpl = b0->n_smpl;
-	b[0] = b0; b[1] = b1;
+	if (b->n_alleles < 2) return 0; // one allele only
+	return get_pdg3(b);
+}
+
+// bcf_pair_freq() on the bcf_pair_pdg() of two sites with n samples; pdg can be shared between threads
+double bcf_pair_freq2(int n_smpl, const double *pdg0, const double *pdg1, double f[4])
+{
+	int i, j;
+	const double *pdg[2];
+	double flast[4], r, f0[2];
 	f[0] = f[1] = f[2] = f[3] = -1.;
-	if (b[0]->n_alleles < 2 || b[1]->n_alleles < 2) return -1; // one allele only
-	pdg[0] = get_pdg3(b0); pdg[1] = get_pdg3(b1);
-	if (pdg[0] == 0 || pdg[1] == 0) {
-		free(pdg[0]); free(pdg[1]);
-		return -1;
-	}
+	if (pdg0 == 0 || pdg1 == 0) return -1;
+	pdg[0] = pdg0; pdg[1] = pdg1;
 	// set the initial value
 	f0[0] = est_freq(n_smpl, pdg[0]);
 	f0[1] = est_freq(n_smpl, pdg[1]);
@@ -295,8 +302,6 @@ double bcf_pair_freq(const bcf1_t *b0, const bcf1_t *b1, double f[4])
 		}
 		if (eps < EPS) break;
 	}
-	// free
-	free(pdg[0]); free(pdg[1]);
 	{ // calculate r^2
 		double p[2], q[2], D;
 		p[0] = f[0] + f[1]; q[0] = 1 - p[0];
@@ -308,3 +313,13 @@ double bcf_pair_freq(const bcf1_t *b0, const bcf1_t *b1, double f[4])
 	}
 	return r;
 }
+
+double bcf_pair_freq(const bcf1_t *b0, const bcf1_t *b1, double f[4])
+{
+	double *pdg[2], r;
+	if (b0->n_smpl != b1->n_smpl) return -1; // different number of samples
+	pdg[0] = bcf_pair_pdg(b0); pdg[1] = bcf_pair_pdg(b1);
+	r = bcf_pair_freq2(b0->n_smpl, pdg[0], pdg[1], f);
+	free(pdg[0]); free(pdg[1]);
+	return r;
+}
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "kstring.h"
+#include "bcf.h"
+
+/*
+  A columnar cache of the FORMAT fields of a BCF, in {in.bcf}.gtc, for
+  reading a few samples out of many without decoding whole records.
+
+  The file is in the byte order of the machine writing it:
+
+    gtc_hdr_t
+    gtc_site_t site[n_sites]     // one per record, in the file order
+    char pool[l_pool]            // bcf1_t::str of the records
+    padding to a multiple of 8
+    uint8_t col[n_smpl][len]     // per-sample column
+
+  The FORMAT fields of sample j at site i are the gi[].len bytes of
+  each field in turn, starting at col[j] + site[i].col_off. The cache
+  is only used if the BCF has the size and mtime, to the nanosecond
+  where the system has it, recorded in it.
+ */
+
+#define GTC_BUF 0x10000000 // bytes of columns buffered before they are written to their places
+
+typedef struct {
+	char magic[4]; // "GTC\1"
+	uint32_t order; // 0x01020304 in the byte order of the writer
+	int32_t n_smpl, bcf_mtime_ns; // bcf_mtime_ns: the nanoseconds of bcf_mtime
+	int64_t n_sites;
+	uint64_t l_pool, len; // len: bytes per sample column
+	int64_t bcf_size, bcf_mtime; // of the BCF the cache was built from
+} gtc_hdr_t;
+
+typedef struct {
+	int32_t tid, pos, l_str;
+	float qual;
+	uint64_t str_off, col_off;
+} gtc_site_t;
+
+struct __bcf_gtc_t {
+	gtc_hdr_t *hdr;
+	const gtc_site_t *site;
+	const char *pool;
+	const uint8_t *col;
+	int64_t i; // the next site to read
+	uint8_t *data;
+	size_t size;
+	int is_mmap;
+};
+
+static char *gtc_name(const char *fn)
+{
+	char *s = (char*)malloc(strlen(fn) + 5);
+	strcat(strcpy(s, fn), ".gtc");
+	return s;
+}
+
+static inline int32_t gtc_mtime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+	return st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	return 0;
+#else
+	return st->st_mtim.tv_nsec;
+#endif
+}
+
+static inline uint64_t gtc_pad8(uint64_t x)
+{
+	return (x + 7) >> 3 << 3;
+}
+
+int bcf_gtc_build(const char *fn)
+{
+	bcf_t *bp;
+	bcf_hdr_t *h;
+	bcf1_t *b;
+	gtc_hdr_t hdr;
+	gtc_site_t *site = 0;
+	kstring_t pool;
+	struct stat st;
+	FILE *fp;
+	char *fngtc;
+	uint8_t *buf = 0;
+	uint64_t data_off, m_buf = 0;
+	int64_t m = 0, i0, i1;
+	int j, k;
+	if (stat(fn, &st) != 0 || (bp = bcf_open(fn, "r")) == 0) {
+		fprintf(stderr, "[bcf_gtc_build] fail to open the BCF file.\n");
+		return -1;
+	}
+	h = bcf_hdr_read(bp);
+	b = calloc(1, sizeof(bcf1_t));
+	memset(&hdr, 0, sizeof(gtc_hdr_t));
+	memcpy(hdr.magic, "GTC\1", 4);
+	hdr.order = 0x01020304;
+	hdr.n_smpl = h->n_smpl;
+	hdr.bcf_size = st.st_size; hdr.bcf_mtime = st.st_mtime; hdr.bcf_mtime_ns = gtc_mtime_ns(&st);
+	pool.l = pool.m = 0; pool.s = 0;
+	// the site table
+	while (bcf_read(bp, h, b) > 0) {
+		gtc_site_t *p;
+		if (hdr.n_sites == m) {
+			m = m? m<<1 : 1024;
+			site = realloc(site, m * sizeof(gtc_site_t));
+		}
+		p = &site[hdr.n_sites++];
+		p->tid = b->tid, p->pos = b->pos, p->l_str = b->l_str, p->qual = b->qual;
+		p->str_off = pool.l; p->col_off = hdr.len;
+		kputsn(b->str, b->l_str, &pool);
+		for (k = 0; k < b->n_gi; ++k) hdr.len += b->gi[k].len;
+	}
+	bcf_close(bp);
+	hdr.l_pool = pool.l;
+	fngtc = gtc_name(fn);
+	if ((fp = fopen(fngtc, "wb")) == 0) {
+		fprintf(stderr, "[bcf_gtc_build] fail to create %s.\n", fngtc);
+		free(fngtc); free(site); free(pool.s);
+		bcf_destroy(b); bcf_hdr_destroy(h);
+		return -1;
+	}
+	fwrite(&hdr, sizeof(gtc_hdr_t), 1, fp);
+	fwrite(site, sizeof(gtc_site_t), hdr.n_sites, fp);
+	fwrite(pool.s, 1, pool.l, fp);
+	fwrite("\0\0\0\0\0\0\0", 1, gtc_pad8(pool.l) - pool.l, fp);
+	// the columns, in one more pass: a block of sites is filled for all samples, then each sample's part is written in place
+	data_off = gtc_pad8(sizeof(gtc_hdr_t) + hdr.n_sites * sizeof(gtc_site_t) + pool.l);
+	bp = bcf_open(fn, "r");
+	bcf_hdr_destroy(bcf_hdr_read(bp));
+	for (i0 = 0; i0 < hdr.n_sites; i0 = i1) {
+		uint64_t off0 = site[i0].col_off, l, off;
+		int64_t i;
+		for (i1 = i0 + 1; i1 < hdr.n_sites; ++i1) { // at least one site, and more while they fit in GTC_BUF
+			uint64_t end = i1 + 1 < hdr.n_sites? site[i1 + 1].col_off : hdr.len;
+			if ((end - off0) * h->n_smpl > GTC_BUF) break;
+		}
+		l = (i1 < hdr.n_sites? site[i1].col_off : hdr.len) - off0; // bytes per sample in this block
+		if (l * h->n_smpl > m_buf) {
+			m_buf = l * h->n_smpl;
+			buf = realloc(buf, m_buf);
+		}
+		for (i = i0; i < i1 && bcf_read(bp, h, b) > 0; ++i) {
+			off = site[i].col_off - off0;
+			for (k = 0; k < b->n_gi; ++k) {
+				const uint8_t *data = (const uint8_t*)b->gi[k].data;
+				int len = b->gi[k].len;
+				for (j = 0; j < h->n_smpl; ++j)
+					memcpy(buf + (uint64_t)j * l + off, data + j * len, len);
+				off += len;
+			}
+		}
+		if (l == 0) continue;
+		for (j = 0; j < h->n_smpl; ++j) {
+			fseeko(fp, data_off + (uint64_t)j * hdr.len + off0, SEEK_SET);
+			fwrite(buf + (uint64_t)j * l, 1, l, fp);
+		}
+	}
+	bcf_close(bp);
+	free(buf);
+	j = fclose(fp) == 0? 0 : -1;
+	if (j < 0) {
+		fprintf(stderr, "[bcf_gtc_build] fail to write %s.\n", fngtc);
+		remove(fngtc);
+	}
+	free(fngtc); free(site); free(pool.s);
+	bcf_destroy(b); bcf_hdr_destroy(h);
+	return j;
+}
+
+static void gtc_release(uint8_t *data, size_t size, int is_mmap)
+{
+#ifndef _WIN32
+	if (is_mmap) {
+		munmap(data, size);
+		return;
+	}
+#endif
+	free(data);
+}
+
+bcf_gtc_t *bcf_gtc_load(const char *fn, const bcf_hdr_t *h)
+{
+	bcf_gtc_t *c;
+	gtc_hdr_t *hdr;
+	struct stat st;
+	FILE *fp;
+	char *fngtc;
+	uint8_t *data = 0;
+	size_t size;
+	uint64_t off;
+	int is_mmap = 0;
+	if (stat(fn, &st) != 0) return 0;
+	fngtc = gtc_name(fn);
+	fp = fopen(fngtc, "rb");
+	free(fngtc);
+	if (fp == 0) return 0;
+	fseeko(fp, 0, SEEK_END);
+	size = ftello(fp);
+	if (size < sizeof(gtc_hdr_t)) {
+		fclose(fp);
+		return 0;
+	}
+#ifndef _WIN32
+	data = (uint8_t*)mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (data == MAP_FAILED) data = 0;
+	else is_mmap = 1;
+#endif
+	if (data == 0) {
+		data = (uint8_t*)malloc(size);
+		fseeko(fp, 0, SEEK_SET);
+		size = fread(data, 1, size, fp);
+	}
+	fclose(fp);
+	hdr = (gtc_hdr_t*)data;
+	off = gtc_pad8(sizeof(gtc_hdr_t) + hdr->n_sites * sizeof(gtc_site_t) + hdr->l_pool);
+	if (memcmp(hdr->magic, "GTC\1", 4) || hdr->order != 0x01020304 || off + hdr->len * hdr->n_smpl != size) {
+		fprintf(stderr, "[bcf_gtc_load] the genotype cache is corrupted or from another machine; ignored.\n");
+		gtc_release(data, size, is_mmap);
+		return 0;
+	}
+	if (hdr->n_smpl != h->n_smpl || hdr->bcf_size != st.st_size || hdr->bcf_mtime != st.st_mtime || hdr->bcf_mtime_ns != gtc_mtime_ns(&st)) {
+		fprintf(stderr, "[bcf_gtc_load] the genotype cache is older than the BCF; ignored.\n");
+		gtc_release(data, size, is_mmap);
+		return 0;
+	}
+	c = calloc(1, sizeof(bcf_gtc_t));
+	c->data = data; c->size = size; c->is_mmap = is_mmap;
+	c->hdr = hdr;
+	c->site = (const gtc_site_t*)(data + sizeof(gtc_hdr_t));
+	c->pool = (const char*)(c->site + hdr->n_sites);
+	c->col = data + off;
+	return c;
+}
+
+int bcf_gtc_read(bcf_gtc_t *c, int n, const int *list, bcf1_t *b)
+{
+	const gtc_site_t *s;
+	uint64_t off;
+	int i, j, l;
+	if (c->i == c->hdr->n_sites) return -1;
+	s = &c->site[c->i++];
+	b->tid = s->tid; b->pos = s->pos; b->qual = s->qual; b->l_str = s->l_str;
+	if (b->l_str > b->m_str) {
+		b->m_str = b->l_str;
+		kroundup32(b->m_str);
+		b->str = realloc(b->str, b->m_str);
+	}
+	memcpy(b->str, c->pool + s->str_off, b->l_str);
+	b->n_smpl = n;
+	if (bcf_sync(b) < 0) return -2;
+	l = 12 + b->l_str;
+	for (i = 0, off = s->col_off; i < b->n_gi; ++i) {
+		uint8_t *data = (uint8_t*)b->gi[i].data;
+		int len = b->gi[i].len;
+		for (j = 0; j < n; ++j)
+			memcpy(data + j * len, c->col + list[j] * c->hdr->len + off, len);
+		off += len;
+		l += len * n;
+	}
+	return l;
+}
+
+void bcf_gtc_destroy(bcf_gtc_t *c)
+{
+	if (c == 0) return;
+	gtc_release(c->data, c->size, c->is_mmap);
+	free(c);
+}
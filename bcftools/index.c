@@ -4,11 +4,28 @@
 #include "bam_endian.h"
 #include "kstring.h"
 #include "bcf.h"
+#include "khash.h"
+#include "ksort.h"
 #ifdef _USE_KNETFILE
 #include "knetfile.h"
 #endif
 
 #define TAD_LIDX_SHIFT 13
+#define BCF_MAX_BIN    37450 // =(8^6-1)/7+1; the UCSC binning scheme as in BAM
+
+typedef struct {
+	uint64_t u, v;
+} pair64_t;
+
+#define pair64_lt(a,b) ((a).u < (b).u)
+KSORT_INIT(bcf_off, pair64_t, pair64_lt)
+
+typedef struct {
+	uint32_t m, n;
+	pair64_t *list;
+} bcf_binlist_t;
+
+KHASH_MAP_INIT_INT(i, bcf_binlist_t)
 
 typedef struct {
 	int32_t n, m;
@@ -17,13 +34,69 @@ typedef struct {
 
 struct __bcf_idx_t {
 	int32_t n;
+	khash_t(i) **index; // binning index; NULL if loaded from a "BCI\4" file, which only has the linear index
 	bcf_lidx_t *index2;
 };
 
+// the end of a record on the reference: the position past the REF allele
+static inline int bcf_rec_end(const bcf1_t *b)
+{
+	int l = strlen(b->ref);
+	return b->pos + (l > 0? l : 1);
+}
+
+// the smallest bin containing [beg,end)
+static inline int bcf_reg2bin(uint32_t beg, uint32_t end)
+{
+	if (end > 1u<<29) return 0;
+	--end;
+	if (beg>>14 == end>>14) return 4681 + (beg>>14);
+	if (beg>>17 == end>>17) return  585 + (beg>>17);
+	if (beg>>20 == end>>20) return   73 + (beg>>20);
+	if (beg>>23 == end>>23) return    9 + (beg>>23);
+	if (beg>>26 == end>>26) return    1 + (beg>>26);
+	return 0;
+}
+
+// bins overlapping [beg,end)
+static inline int reg2bins(uint32_t beg, uint32_t end, uint16_t list[BCF_MAX_BIN])
+{
+	int i = 0, k;
+	if (beg >= end) return 0;
+	list[i++] = 0;
+	if (beg >= 1u<<29) return i; // only bin 0 holds records past 512Mbp
+	if (end > 1u<<29) end = 1u<<29;
+	--end;
+	for (k =    1 + (beg>>26); k <=    1 + (end>>26); ++k) list[i++] = k;
+	for (k =    9 + (beg>>23); k <=    9 + (end>>23); ++k) list[i++] = k;
+	for (k =   73 + (beg>>20); k <=   73 + (end>>20); ++k) list[i++] = k;
+	for (k =  585 + (beg>>17); k <=  585 + (end>>17); ++k) list[i++] = k;
+	for (k = 4681 + (beg>>14); k <= 4681 + (end>>14); ++k) list[i++] = k;
+	return i;
+}
+
 /************
  * indexing *
  ************/
 
+static inline void insert_offset(khash_t(i) *h, int bin, uint64_t beg, uint64_t end)
+{
+	khint_t k;
+	bcf_binlist_t *l;
+	int ret;
+	k = kh_put(i, h, bin, &ret);
+	l = &kh_value(h, k);
+	if (ret) { // not present
+		l->m = 1; l->n = 0;
+		l->list = (pair64_t*)calloc(l->m, 16);
+	}
+	if (l->n == l->m) {
+		l->m <<= 1;
+		l->list = (pair64_t*)realloc(l->list, l->m * 16);
+	}
+	l->list[l->n].u = beg; l->list[l->n++].v = end;
+}
+
 static inline void insert_offset2(bcf_lidx_t *index2, int _beg, int _end, uint64_t offset)
 {
 	int i, beg, end;
@@ -45,49 +118,94 @@ static inline void insert_offset2(bcf_lidx_t *index2, int _beg, int _end, uint64
 	if (index2->n < end + 1) index2->n = end + 1;
 }
 
+// merge the chunks of a bin that start in the BGZF block where the previous one ends
+static void merge_chunks(bcf_idx_t *idx)
+{
+	int i, l, m;
+	khint_t k;
+	for (i = 0; i < idx->n; ++i) {
+		khash_t(i) *index = idx->index[i];
+		for (k = kh_begin(index); k != kh_end(index); ++k) {
+			bcf_binlist_t *p;
+			if (!kh_exist(index, k)) continue;
+			p = &kh_value(index, k);
+			for (l = 1, m = 0; l < p->n; ++l) {
+				if (p->list[m].v>>16 == p->list[l].u>>16) p->list[m].v = p->list[l].v;
+				else p->list[++m] = p->list[l];
+			}
+			p->n = m + 1;
+		}
+	}
+}
+
 bcf_idx_t *bcf_idx_core(bcf_t *bp, bcf_hdr_t *h)
 {
 	bcf_idx_t *idx;
-	int32_t last_coor, last_tid;
-	uint64_t last_off;
-	kstring_t *str;
+	int32_t last_coor, last_tid, save_tid;
+	uint32_t last_bin, save_bin;
+	uint64_t last_off, save_off;
 	BGZF *fp = bp->fp;
 	bcf1_t *b;
-	int ret;
+	int i, ret;
 
 	b = calloc(1, sizeof(bcf1_t));
-	str = calloc(1, sizeof(kstring_t));
 	idx = (bcf_idx_t*)calloc(1, sizeof(bcf_idx_t));
 	idx->n = h->n_ref;
 	idx->index2 = calloc(h->n_ref, sizeof(bcf_lidx_t));
+	idx->index = calloc(h->n_ref, sizeof(void*));
+	for (i = 0; i < h->n_ref; ++i) idx->index[i] = kh_init(i);
 
-	last_tid = 0xffffffffu;
-	last_off = bgzf_tell(fp); last_coor = 0xffffffffu;
+	save_bin = last_bin = 0xffffffffu; save_tid = last_tid = -1;
+	save_off = last_off = bgzf_tell(fp); last_coor = 0xffffffffu;
 	while ((ret = bcf_read(bp, h, b)) > 0) {
-		int end, tmp;
+		int end;
+		uint32_t bin;
+		if (b->tid < 0 || b->tid >= h->n_ref) {
+			fprintf(stderr, "[bcf_idx_core] the reference ID %d is not in the header\n", b->tid);
+			bcf_idx_destroy(idx); bcf_destroy(b);
+			return 0;
+		}
 		if (last_tid != b->tid) { // change of chromosomes
 			last_tid = b->tid;
+			last_bin = 0xffffffffu;
 		} else if (last_coor > b->pos) {
 			fprintf(stderr, "[bcf_idx_core] the input is out of order\n");
-			free(str->s); free(str); free(idx); bcf_destroy(b);
+			bcf_idx_destroy(idx); bcf_destroy(b);
 			return 0;
 		}
-		tmp = strlen(b->ref);
-		end = b->pos + (tmp > 0? tmp : 1);
+		end = bcf_rec_end(b);
 		insert_offset2(&idx->index2[b->tid], b->pos, end, last_off);
+		bin = bcf_reg2bin(b->pos, end);
+		if (bin != last_bin) { // a new chunk; save the previous one
+			if (save_bin != 0xffffffffu)
+				insert_offset(idx->index[save_tid], save_bin, save_off, last_off);
+			save_off = last_off;
+			save_bin = last_bin = bin;
+			save_tid = b->tid;
+		}
 		last_off = bgzf_tell(fp);
 		last_coor = b->pos;
 	}
-	free(str->s); free(str); bcf_destroy(b);
+	if (save_bin != 0xffffffffu)
+		insert_offset(idx->index[save_tid], save_bin, save_off, last_off);
+	merge_chunks(idx);
+	bcf_destroy(b);
 	return idx;
 }
 
 void bcf_idx_destroy(bcf_idx_t *idx)
 {
 	int i;
+	khint_t k;
 	if (idx == 0) return;
-	for (i = 0; i < idx->n; ++i) free(idx->index2[i].offset);
-	free(idx->index2);
+	for (i = 0; i < idx->n; ++i) {
+		free(idx->index2[i].offset);
+		if (idx->index == 0) continue;
+		for (k = kh_begin(idx->index[i]); k != kh_end(idx->index[i]); ++k)
+			if (kh_exist(idx->index[i], k)) free(kh_value(idx->index[i], k).list);
+		kh_destroy(i, idx->index[i]);
+	}
+	free(idx->index2); free(idx->index);
 	free(idx);
 }
 
@@ -95,17 +213,45 @@ void bcf_idx_destroy(bcf_idx_t *idx)
  * index file I/O *
  ******************/
 
+static inline void idx_write32(BGZF *fp, uint32_t x, int is_be)
+{
+	if (is_be) bam_swap_endian_4p(&x);
+	bgzf_write(fp, &x, 4);
+}
+
+static inline void idx_write64(BGZF *fp, uint64_t x, int is_be)
+{
+	if (is_be) bam_swap_endian_8p(&x);
+	bgzf_write(fp, &x, 8);
+}
+
+/* "BCI\5": for each reference, the binning index as in BAI, i.e. n_bin
+ * and then (bin, n_chunk, chunk_beg/chunk_end...) per bin, followed by
+ * the linear index as in "BCI\4". */
 void bcf_idx_save(const bcf_idx_t *idx, BGZF *fp)
 {
 	int32_t i, ti_is_be;
 	ti_is_be = bam_is_big_endian();
-	bgzf_write(fp, "BCI\4", 4);
-	if (ti_is_be) {
-		uint32_t x = idx->n;
-		bgzf_write(fp, bam_swap_endian_4p(&x), 4);
-	} else bgzf_write(fp, &idx->n, 4);
+	bgzf_write(fp, "BCI\5", 4);
+	idx_write32(fp, idx->n, ti_is_be);
 	for (i = 0; i < idx->n; ++i) {
+		khash_t(i) *index = idx->index[i];
 		bcf_lidx_t *index2 = idx->index2 + i;
+		khint_t k;
+		int j;
+		// write the binning index
+		idx_write32(fp, kh_size(index), ti_is_be);
+		for (k = kh_begin(index); k != kh_end(index); ++k) {
+			bcf_binlist_t *p;
+			if (!kh_exist(index, k)) continue;
+			p = &kh_value(index, k);
+			idx_write32(fp, kh_key(index, k), ti_is_be);
+			idx_write32(fp, p->n, ti_is_be);
+			for (j = 0; j < p->n; ++j) {
+				idx_write64(fp, p->list[j].u, ti_is_be);
+				idx_write64(fp, p->list[j].v, ti_is_be);
+			}
+		}
 		// write linear index (index2)
 		if (ti_is_be) {
 			int x = index2->n;
@@ -124,7 +270,7 @@ void bcf_idx_save(const bcf_idx_t *idx, BGZF *fp)
 
 static bcf_idx_t *bcf_idx_load_core(BGZF *fp)
 {
-	int i, ti_is_be;
+	int i, ti_is_be, has_bins;
 	char magic[4];
 	bcf_idx_t *idx;
 	ti_is_be = bam_is_big_endian();
@@ -133,7 +279,9 @@ static bcf_idx_t *bcf_idx_load_core(BGZF *fp)
 		return 0;
 	}
 	bgzf_read(fp, magic, 4);
-	if (strncmp(magic, "BCI\4", 4)) {
+	if (strncmp(magic, "BCI\5", 4) == 0) has_bins = 1;
+	else if (strncmp(magic, "BCI\4", 4) == 0) has_bins = 0;
+	else {
 		fprintf(stderr, "[%s] wrong magic number.\n", __func__);
 		return 0;
 	}
@@ -141,9 +289,39 @@ static bcf_idx_t *bcf_idx_load_core(BGZF *fp)
 	bgzf_read(fp, &idx->n, 4);
 	if (ti_is_be) bam_swap_endian_4p(&idx->n);
 	idx->index2 = (bcf_lidx_t*)calloc(idx->n, sizeof(bcf_lidx_t));
+	if (has_bins) idx->index = calloc(idx->n, sizeof(void*));
 	for (i = 0; i < idx->n; ++i) {
 		bcf_lidx_t *index2 = idx->index2 + i;
 		int j;
+		if (has_bins) {
+			int32_t n_bin;
+			khash_t(i) *index;
+			index = idx->index[i] = kh_init(i);
+			bgzf_read(fp, &n_bin, 4);
+			if (ti_is_be) bam_swap_endian_4p(&n_bin);
+			for (j = 0; j < n_bin; ++j) {
+				uint32_t bin;
+				int ret;
+				khint_t k;
+				bcf_binlist_t *p;
+				bgzf_read(fp, &bin, 4);
+				if (ti_is_be) bam_swap_endian_4p(&bin);
+				k = kh_put(i, index, bin, &ret);
+				p = &kh_value(index, k);
+				bgzf_read(fp, &p->n, 4);
+				if (ti_is_be) bam_swap_endian_4p(&p->n);
+				p->m = p->n;
+				p->list = (pair64_t*)malloc(p->m * 16);
+				bgzf_read(fp, p->list, 16 * p->n);
+				if (ti_is_be) {
+					int x;
+					for (x = 0; x < p->n; ++x) {
+						bam_swap_endian_8p(&p->list[x].u);
+						bam_swap_endian_8p(&p->list[x].v);
+					}
+				}
+			}
+		}
 		bgzf_read(fp, &index2->n, 4);
 		if (ti_is_be) bam_swap_endian_4p(&index2->n);
 		index2->m = index2->n;
@@ -251,6 +429,8 @@ int bcf_idx_build2(const char *fn, const char *_fnidx)
 	h = bcf_hdr_read(bp);
 	idx = bcf_idx_core(bp, h);
 	bcf_close(bp);
+	bcf_hdr_destroy(h);
+	if (idx == 0) return -1;
 	if (_fnidx == 0) {
 		fnidx = (char*)calloc(strlen(fn) + 5, 1);
 		strcpy(fnidx, fn); strcat(fnidx, ".bci");
@@ -313,15 +493,186 @@ int bcf_parse_region(void *str2id, const char *str, int *tid, int *begin, int *e
  * retrieve a specified region *
  *******************************/
 
+// the offset of the first record overlapping any position from _beg_ on; 0 if there is none
 uint64_t bcf_idx_query(const bcf_idx_t *idx, int tid, int beg)
 {
-	uint64_t min_off, *offset;
+	const bcf_lidx_t *index2;
 	int i;
+	if (tid < 0 || tid >= idx->n) return 0;
+	if (beg < 0) beg = 0;
+	index2 = &idx->index2[tid];
+	for (i = beg>>TAD_LIDX_SHIFT; i < index2->n && index2->offset[i] == 0; ++i);
+	return i < index2->n? index2->offset[i] : 0;
+}
+
+struct __bcf_iter_t {
+	int tid, beg, end, n_off, i, finished;
+	uint64_t curr_off;
+	pair64_t *off;
+	// for a multi-region iterator
+	int n_reg, reg_i; // reg_i: the first region not passed yet
+	bcf_region_t *regs; // sorted by (tid,beg)
+};
+
+#define reg_lt(a, b) ((a).tid < (b).tid || ((a).tid == (b).tid && (a).beg < (b).beg))
+KSORT_INIT(bcf_reg, bcf_region_t, reg_lt)
+
+// chunks possibly overlapping tid:beg-end, not sorted
+static pair64_t *iter_chunks(const bcf_idx_t *idx, int tid, int beg, int end, int *cnt_off)
+{
+	uint16_t *bins;
+	int i, n_bins, n_off;
+	pair64_t *off;
+	khint_t k;
+	khash_t(i) *index;
+	uint64_t min_off;
+
+	*cnt_off = 0;
+	if ((min_off = bcf_idx_query(idx, tid, beg)) == 0) return 0; // nothing at or after beg
+	if (idx->index == 0) { // linear index only; read from min_off until the iterator passes the region
+		off = (pair64_t*)calloc(1, 16);
+		off->u = min_off; off->v = (uint64_t)-1;
+		*cnt_off = 1;
+		return off;
+	}
+	index = idx->index[tid];
+	bins = (uint16_t*)calloc(BCF_MAX_BIN, 2);
+	n_bins = reg2bins(beg, end, bins);
+	for (i = n_off = 0; i < n_bins; ++i)
+		if ((k = kh_get(i, index, bins[i])) != kh_end(index))
+			n_off += kh_value(index, k).n;
+	if (n_off == 0) {
+		free(bins); return 0;
+	}
+	off = (pair64_t*)calloc(n_off, 16);
+	for (i = n_off = 0; i < n_bins; ++i) {
+		if ((k = kh_get(i, index, bins[i])) != kh_end(index)) {
+			int j;
+			bcf_binlist_t *p = &kh_value(index, k);
+			for (j = 0; j < p->n; ++j)
+				if (p->list[j].v > min_off) {
+					off[n_off] = p->list[j];
+					if (off[n_off].u < min_off) off[n_off].u = min_off;
+					++n_off;
+				}
+		}
+	}
+	free(bins);
+	if (n_off == 0) {
+		free(off); return 0;
+	}
+	*cnt_off = n_off;
+	return off;
+}
+
+// sort chunks, and merge overlapping ones or those sharing a BGZF block; return the new number of chunks
+static int iter_coalesce(pair64_t *off, int n_off)
+{
+	int i, l;
+	if (n_off == 0) return 0;
+	ks_introsort(bcf_off, n_off, off);
+	for (i = 1, l = 0; i < n_off; ++i) {
+		if (off[l].v>>16 >= off[i].u>>16) { // overlapping or in the same block
+			if (off[l].v < off[i].v) off[l].v = off[i].v;
+		} else off[++l] = off[i];
+	}
+	return l + 1;
+}
+
+bcf_iter_t bcf_iter_query(const bcf_idx_t *idx, int tid, int beg, int end)
+{
+	bcf_iter_t iter;
 	if (beg < 0) beg = 0;
-	offset = idx->index2[tid].offset;
-	for (i = beg>>TAD_LIDX_SHIFT; i < idx->index2[tid].n && offset[i] == 0; ++i);
-	min_off = (i == idx->index2[tid].n)? offset[idx->index2[tid].n-1] : offset[i];
-	return min_off;
+	if (tid < 0 || tid >= idx->n || end < beg) return 0;
+	iter = calloc(1, sizeof(struct __bcf_iter_t));
+	iter->tid = tid, iter->beg = beg, iter->end = end; iter->i = -1;
+	iter->off = iter_chunks(idx, tid, beg, end, &iter->n_off);
+	iter->n_off = iter_coalesce(iter->off, iter->n_off);
+	return iter;
+}
+
+bcf_iter_t bcf_iter_query_regs(const bcf_idx_t *idx, int n, const bcf_region_t *regs)
+{
+	bcf_iter_t iter;
+	int i, m_off = 0;
+
+	iter = calloc(1, sizeof(struct __bcf_iter_t));
+	iter->i = -1;
+	iter->regs = (bcf_region_t*)calloc(n > 0? n : 1, sizeof(bcf_region_t));
+	for (i = 0; i < n; ++i) {
+		bcf_region_t *r;
+		pair64_t *off;
+		int n_off;
+		if (regs[i].tid < 0 || regs[i].tid >= idx->n || regs[i].end <= regs[i].beg) continue;
+		r = &iter->regs[iter->n_reg++];
+		r->tid = regs[i].tid, r->beg = regs[i].beg > 0? regs[i].beg : 0, r->end = regs[i].end;
+		// union the chunks of all regions; each block will then be read at most once
+		if ((off = iter_chunks(idx, r->tid, r->beg, r->end, &n_off)) == 0) continue;
+		if (iter->n_off + n_off > m_off) {
+			m_off = iter->n_off + n_off;
+			kroundup32(m_off);
+			iter->off = (pair64_t*)realloc(iter->off, m_off * 16);
+		}
+		memcpy(iter->off + iter->n_off, off, n_off * 16);
+		iter->n_off += n_off;
+		free(off);
+	}
+	ks_introsort(bcf_reg, iter->n_reg, iter->regs);
+	iter->n_off = iter_coalesce(iter->off, iter->n_off);
+	if (iter->n_off == 0) { free(iter->off); iter->off = 0; }
+	return iter;
+}
+
+void bcf_iter_destroy(bcf_iter_t iter)
+{
+	if (iter) { free(iter->off); free(iter->regs); free(iter); }
+}
+
+// 1 if _b_ overlaps a region, 0 if not, or -1 if all regions are before _b_
+static int iter_match(bcf_iter_t iter, const bcf1_t *b)
+{
+	int j, end;
+	for (; iter->reg_i < iter->n_reg; ++iter->reg_i) { // skip regions ending before b
+		const bcf_region_t *r = &iter->regs[iter->reg_i];
+		if (r->tid > b->tid || (r->tid == b->tid && r->end > b->pos)) break;
+	}
+	if (iter->reg_i == iter->n_reg) return -1;
+	end = bcf_rec_end(b);
+	for (j = iter->reg_i; j < iter->n_reg; ++j) {
+		const bcf_region_t *r = &iter->regs[j];
+		if (r->tid != b->tid || r->beg >= end) break;
+		if (r->end > b->pos) return 1;
+	}
+	return 0;
+}
+
+int bcf_iter_read(bcf_t *bp, bcf_iter_t iter, const bcf_hdr_t *h, bcf1_t *b)
+{
+	int ret;
+	if (iter == 0 || iter->finished || iter->off == 0) return -1;
+	for (;;) {
+		if (iter->curr_off == 0 || iter->curr_off >= iter->off[iter->i].v) { // then jump to the next chunk
+			if (iter->i == iter->n_off - 1) { ret = -1; break; } // no more chunks
+			if (iter->i < 0 || iter->off[iter->i].v != iter->off[iter->i+1].u) { // not adjacent chunks; then seek
+				bgzf_seek(bp->fp, iter->off[iter->i+1].u, SEEK_SET);
+				iter->curr_off = bgzf_tell(bp->fp);
+			}
+			++iter->i;
+		}
+		if ((ret = bcf_read(bp, h, b)) > 0) {
+			iter->curr_off = bgzf_tell(bp->fp);
+			if (iter->regs) {
+				int x = iter_match(iter, b);
+				if (x > 0) return ret;
+				if (x < 0) { ret = -1; break; } // past the last region
+			} else if (b->tid != iter->tid || b->pos >= iter->end) { // no need to proceed
+				ret = -1;
+				break;
+			} else if (bcf_rec_end(b) > iter->beg) return ret;
+		} else break; // end of file or error
+	}
+	iter->finished = 1;
+	return ret;
 }
 
 int bcf_main_index(int argc, char *argv[])
@@ -2,12 +2,15 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "knetfile.h"
 #include "bcf.h"
 
 #include "kseq.h"
 KSTREAM_INIT(gzFile, gzread, 0x10000)
 
+#include "ksort.h"
+
 int bcfview(int argc, char *argv[]);
 int bcf_main_index(int argc, char *argv[]);
 
@@ -47,69 +50,217 @@ int bcf_cat(int n, char * const *fn)
 	return 0;
 }
 
-extern double bcf_pair_freq(const bcf1_t *b0, const bcf1_t *b1, double f[4]);
+extern double *bcf_pair_pdg(const bcf1_t *b);
+extern double bcf_pair_freq2(int n_smpl, const double *pdg0, const double *pdg1, double f[4]);
+
+#define LD_BATCH 0x4000 // number of pairs computed in one go
+#define LD_CHUNK 64     // pairs taken by a thread at a time
+#define LD_SITES 0x1000 // with -w, new sites read at most before a batch is run and the window is trimmed
+
+/* A batch of pairs; pair k is between the sites with genotype
+ * likelihoods pdg[k<<1] and pdg[k<<1|1], from bcf_pair_pdg(). */
+typedef struct {
+	int n_smpl, n, m, next;
+	const double **pdg;
+	double *r2, *f; // r^2, and the four haplotype frequencies at f[k<<2]
+	pthread_mutex_t lock;
+} ld_batch_t;
+
+static void ld_push(ld_batch_t *a, const double *pdg0, const double *pdg1)
+{
+	if (a->n == a->m) {
+		a->m = a->m? a->m<<1 : 256;
+		a->pdg = realloc(a->pdg, a->m * 2 * sizeof(void*));
+		a->r2 = realloc(a->r2, a->m * sizeof(double));
+		a->f = realloc(a->f, a->m * 4 * sizeof(double));
+	}
+	a->pdg[a->n<<1] = pdg0; a->pdg[a->n<<1|1] = pdg1;
+	++a->n;
+}
+
+static void *ld_worker(void *data)
+{
+	ld_batch_t *a = (ld_batch_t*)data;
+	for (;;) {
+		int k, beg;
+		pthread_mutex_lock(&a->lock);
+		beg = a->next; a->next += LD_CHUNK;
+		pthread_mutex_unlock(&a->lock);
+		if (beg >= a->n) break;
+		for (k = beg; k < a->n && k < beg + LD_CHUNK; ++k) {
+			double r = bcf_pair_freq2(a->n_smpl, a->pdg[k<<1], a->pdg[k<<1|1], a->f + (k<<2));
+			a->r2[k] = r * r;
+		}
+	}
+	return 0;
+}
+
+// compute the pairs of a batch on n_threads threads; the results do not depend on n_threads
+static void ld_run(ld_batch_t *a, int n_threads)
+{
+	pthread_t *tid;
+	int i;
+	a->next = 0;
+	if (n_threads > (a->n + LD_CHUNK - 1) / LD_CHUNK) n_threads = (a->n + LD_CHUNK - 1) / LD_CHUNK;
+	if (n_threads <= 1) {
+		ld_worker(a);
+		return;
+	}
+	tid = calloc(n_threads, sizeof(pthread_t));
+	for (i = 1; i < n_threads; ++i) pthread_create(&tid[i], 0, ld_worker, a);
+	ld_worker(a);
+	for (i = 1; i < n_threads; ++i) pthread_join(tid[i], 0);
+	free(tid);
+}
+
+static void ld_init(ld_batch_t *a, int n_smpl)
+{
+	memset(a, 0, sizeof(ld_batch_t));
+	a->n_smpl = n_smpl;
+	pthread_mutex_init(&a->lock, 0);
+}
+
+static void ld_destroy(ld_batch_t *a)
+{
+	free(a->pdg); free(a->r2); free(a->f);
+	pthread_mutex_destroy(&a->lock);
+}
+
+static inline void ld_print(const bcf_hdr_t *h, int tid0, int pos0, int tid1, int pos1, double r2, const double *f)
+{
+	printf("%s\t%d\t%s\t%d\t%.4g\t%.4g\t%.4g\t%.4g\t%.4g\n", h->ns[tid0], pos0+1, h->ns[tid1], pos1+1,
+		r2, f[0], f[1], f[2], f[3]);
+}
+
+#define LDPAIR_BATCH 4096 // pairs read from the list at a time
+
+KSORT_INIT(ld_key, uint64_t, ks_lt_generic)
+
+typedef struct {
+	int tid0, pos0, tid1, pos1;
+} ld_pair_t;
+
+// index of key in the sorted keys[0..n-1], or -1
+static inline int ld_key_find(int n, const uint64_t *keys, uint64_t key)
+{
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		if (keys[mid] < key) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < n && keys[lo] == key? lo : -1;
+}
 
 int bcf_main_ldpair(int argc, char *argv[])
 {
 	bcf_t *fp;
 	bcf_hdr_t *h;
-	bcf1_t *b0, *b1;
+	bcf1_t *b;
 	bcf_idx_t *idx;
 	kstring_t str;
 	void *str2id;
 	gzFile fplist;
 	kstream_t *ks;
-	int dret, lineno = 0;
-	if (argc < 3) {
-		fprintf(stderr, "Usage: bcftools ldpair <in.bcf> <in.list>\n");
+	ld_batch_t a;
+	ld_pair_t *pairs;
+	uint64_t *keys;
+	bcf_region_t *regs;
+	double **pdg;
+	uint8_t *found;
+	int c, dret, n_threads = 1, is_eof = 0;
+	while ((c = getopt(argc, argv, "@:")) >= 0) {
+		switch (c) {
+		case '@': n_threads = atoi(optarg); break;
+		}
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "\nUsage:   bcftools ldpair [-@ INT] <in.bcf> <in.list>\n\n");
+		fprintf(stderr, "Options: -@ INT   number of threads [1]\n\n");
+		fprintf(stderr, "Notes: in.list has \"chr1 pos1 chr2 pos2\" per line; a pair is skipped if\n");
+		fprintf(stderr, "       a site is not in in.bcf.\n\n");
 		return 1;
 	}
-	fplist = gzopen(argv[2], "rb");
+	fplist = gzopen(argv[optind+1], "rb");
 	ks = ks_init(fplist);
 	memset(&str, 0, sizeof(kstring_t));
-	fp = bcf_open(argv[1], "rb");
+	fp = bcf_open(argv[optind], "rb");
 	h = bcf_hdr_read(fp);
 	str2id = bcf_build_refhash(h);
-	idx = bcf_idx_load(argv[1]);
+	idx = bcf_idx_load(argv[optind]);
 	if (idx == 0) {
 		fprintf(stderr, "[%s] No bcf index is found. Abort!\n", __func__);
 		return 1;
 	}
-	b0 = calloc(1, sizeof(bcf1_t));
-	b1 = calloc(1, sizeof(bcf1_t));
-	while (ks_getuntil(ks, '\n', &str, &dret) >= 0) {
-		char *p, *q;
-		int k;
-		int tid0 = -1, tid1 = -1, pos0 = -1, pos1 = -1;
-		++lineno;
-		for (p = q = str.s, k = 0; *p; ++p) {
-			if (*p == ' ' || *p == '\t') {
-				*p = '\0';
-				if (k == 0) tid0 = bcf_str2id(str2id, q);
-				else if (k == 1) pos0 = atoi(q) - 1;
-				else if (k == 2) tid1 = strcmp(q, "=")? bcf_str2id(str2id, q) : tid0;
-				else if (k == 3) pos1 = atoi(q) - 1;
-				q = p + 1;
-				++k;
+	b = calloc(1, sizeof(bcf1_t));
+	ld_init(&a, h->n_smpl);
+	pairs = malloc(LDPAIR_BATCH * sizeof(ld_pair_t));
+	keys = malloc(LDPAIR_BATCH * 2 * 8);
+	regs = malloc(LDPAIR_BATCH * 2 * sizeof(bcf_region_t));
+	pdg = malloc(LDPAIR_BATCH * 2 * sizeof(void*));
+	found = malloc(LDPAIR_BATCH * 2);
+	while (!is_eof) {
+		int i, k, n = 0, n_keys;
+		bcf_iter_t iter;
+		while (n < LDPAIR_BATCH) { // read a batch of pairs
+			char *p, *q;
+			ld_pair_t *r = &pairs[n];
+			if (ks_getuntil(ks, '\n', &str, &dret) < 0) {
+				is_eof = 1;
+				break;
+			}
+			r->tid0 = r->tid1 = r->pos0 = r->pos1 = -1;
+			for (p = q = str.s, k = 0; *p; ++p) {
+				if (*p == ' ' || *p == '\t') {
+					*p = '\0';
+					if (k == 0) r->tid0 = bcf_str2id(str2id, q);
+					else if (k == 1) r->pos0 = atoi(q) - 1;
+					else if (k == 2) r->tid1 = strcmp(q, "=")? bcf_str2id(str2id, q) : r->tid0;
+					else if (k == 3) r->pos1 = atoi(q) - 1;
+					q = p + 1;
+					++k;
+				}
 			}
+			if (k == 3) r->pos1 = atoi(q) - 1;
+			if (r->tid0 >= 0 && r->tid1 >= 0 && r->pos0 >= 0 && r->pos1 >= 0) ++n;
+		}
+		// fetch the sites of all pairs in one pass over the BCF
+		for (i = 0; i < n; ++i) {
+			keys[i<<1]   = (uint64_t)pairs[i].tid0<<32 | pairs[i].pos0;
+			keys[i<<1|1] = (uint64_t)pairs[i].tid1<<32 | pairs[i].pos1;
+		}
+		ks_introsort(ld_key, n<<1, keys);
+		for (i = n_keys = 0; i < n<<1; ++i)
+			if (n_keys == 0 || keys[i] != keys[n_keys-1]) keys[n_keys++] = keys[i];
+		for (i = 0; i < n_keys; ++i) {
+			regs[i].tid = keys[i]>>32; regs[i].beg = (uint32_t)keys[i]; regs[i].end = regs[i].beg + 1;
+			pdg[i] = 0; found[i] = 0;
+		}
+		iter = bcf_iter_query_regs(idx, n_keys, regs);
+		while (bcf_iter_read(fp, iter, h, b) > 0) {
+			k = ld_key_find(n_keys, keys, (uint64_t)b->tid<<32 | b->pos);
+			if (k >= 0 && !found[k]) found[k] = 1, pdg[k] = bcf_pair_pdg(b);
 		}
-		if (k == 3) pos1 = atoi(q) - 1;
-		if (tid0 >= 0 && tid1 >= 0 && pos0 >= 0 && pos1 >= 0) {
-			uint64_t off;
-			double r, f[4];
-			off = bcf_idx_query(idx, tid0, pos0);
-			bgzf_seek(fp->fp, off, SEEK_SET);
-			while (bcf_read(fp, h, b0) >= 0 && b0->pos != pos0);
-			off = bcf_idx_query(idx, tid1, pos1);
-			bgzf_seek(fp->fp, off, SEEK_SET);
-			while (bcf_read(fp, h, b1) >= 0 && b1->pos != pos1);
-			r = bcf_pair_freq(b0, b1, f);
-			r *= r;
-			printf("%s\t%d\t%s\t%d\t%.4g\t%.4g\t%.4g\t%.4g\t%.4g\n", h->ns[tid0], pos0+1, h->ns[tid1], pos1+1,
-				r, f[0], f[1], f[2], f[3]);
-		} //else fprintf(stderr, "[%s] Parse error at line %d.\n", __func__, lineno);
+		bcf_iter_destroy(iter);
+		// compute and print; pairs with a site absent from the BCF are skipped
+		for (i = 0, a.n = 0; i < n; ++i) {
+			int k0 = ld_key_find(n_keys, keys, (uint64_t)pairs[i].tid0<<32 | pairs[i].pos0);
+			int k1 = ld_key_find(n_keys, keys, (uint64_t)pairs[i].tid1<<32 | pairs[i].pos1);
+			if (found[k0] && found[k1]) ld_push(&a, pdg[k0], pdg[k1]);
+			else pairs[i].tid0 = -1;
+		}
+		ld_run(&a, n_threads);
+		for (i = k = 0; i < n; ++i) {
+			ld_pair_t *r = &pairs[i];
+			if (r->tid0 < 0) continue;
+			ld_print(h, r->tid0, r->pos0, r->tid1, r->pos1, a.r2[k], a.f + (k<<2));
+			++k;
+		}
+		for (i = 0; i < n_keys; ++i) free(pdg[i]);
 	}
-	bcf_destroy(b0); bcf_destroy(b1);
+	free(pairs); free(keys); free(regs); free(pdg); free(found);
+	ld_destroy(&a);
+	bcf_destroy(b);
 	bcf_idx_destroy(idx);
 	bcf_str2id_destroy(str2id);
 	bcf_hdr_destroy(h);
@@ -120,44 +271,95 @@ int bcf_main_ldpair(int argc, char *argv[])
 	return 0;
 }
 
+typedef struct {
+	int tid, pos;
+	double *pdg; // from bcf_pair_pdg()
+} ld_site_t;
+
 int bcf_main_ld(int argc, char *argv[])
 {
 	bcf_t *fp;
 	bcf_hdr_t *h;
-	bcf1_t **b, *b0;
-	int i, j, m, n;
-	double f[4];
-	if (argc == 1) {
-		fprintf(stderr, "Usage: bcftools ld <in.bcf>\n");
+	bcf1_t *b;
+	ld_site_t *s = 0;
+	ld_batch_t a;
+	int c, i, j, k, n = 0, m = 0, n_threads = 1, max_dist = -1;
+	while ((c = getopt(argc, argv, "w:@:")) >= 0) {
+		switch (c) {
+		case 'w': max_dist = atoi(optarg); break;
+		case '@': n_threads = atoi(optarg); break;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "\nUsage:   bcftools ld [-w INT] [-@ INT] <in.bcf>\n\n");
+		fprintf(stderr, "Options: -w INT   only pairs at most INT bp apart, one pair per line as from ldpair [all pairs as a matrix]\n");
+		fprintf(stderr, "         -@ INT   number of threads [1]\n\n");
 		return 1;
 	}
-	fp = bcf_open(argv[1], "rb");
+	fp = bcf_open(argv[optind], "rb");
 	h = bcf_hdr_read(fp);
-	// read the entire BCF
-	m = n = 0; b = 0;
-	b0 = calloc(1, sizeof(bcf1_t));
-	while (bcf_read(fp, h, b0) >= 0) {
-		if (m == n) {
-			m = m? m<<1 : 16;
-			b = realloc(b, sizeof(void*) * m);
+	b = calloc(1, sizeof(bcf1_t));
+	ld_init(&a, h->n_smpl);
+	if (max_dist < 0) { // all pairs; read the entire BCF
+		while (bcf_read(fp, h, b) >= 0) {
+			if (m == n) {
+				m = m? m<<1 : 16;
+				s = realloc(s, sizeof(ld_site_t) * m);
+			}
+			s[n].tid = b->tid, s[n].pos = b->pos;
+			s[n++].pdg = bcf_pair_pdg(b);
 		}
-		b[n] = calloc(1, sizeof(bcf1_t));
-		bcf_cpy(b[n++], b0);
-	}
-	bcf_destroy(b0);
-	// compute pair-wise r^2
-	printf("%d\n", n); // the number of loci
-	for (i = 0; i < n; ++i) {
-		printf("%s:%d", h->ns[b[i]->tid], b[i]->pos + 1);
-		for (j = 0; j < i; ++j) {
-			double r = bcf_pair_freq(b[i], b[j], f);
-			printf("\t%.3f", r*r);
+		printf("%d\n", n); // the number of loci
+		for (i = 0; i < n;) { // rows i..j-1 in one batch
+			for (j = i, a.n = 0; j < n && (a.n == 0 || a.n + j <= LD_BATCH); ++j)
+				for (k = 0; k < j; ++k) ld_push(&a, s[j].pdg, s[k].pdg);
+			ld_run(&a, n_threads);
+			for (k = 0; i < j; ++i) {
+				int l;
+				printf("%s:%d", h->ns[s[i].tid], s[i].pos + 1);
+				for (l = 0; l < i; ++l) printf("\t%.3f", a.r2[k++]);
+				printf("\t1.000\n");
+			}
+		}
+	} else { // streaming over a window of sites at most max_dist apart
+		int is_eof = 0;
+		while (!is_eof) {
+			int i0 = n; // new sites of the batch: s[i0..n-1]; earlier ones are the window
+			for (a.n = 0; a.n < LD_BATCH && n - i0 < LD_SITES;) { // sparse sites give few pairs; bound the sites too
+				double *pdg;
+				if (bcf_read(fp, h, b) < 0) {
+					is_eof = 1;
+					break;
+				}
+				if ((pdg = bcf_pair_pdg(b)) == 0) continue; // no PL or ALT
+				if (m == n) {
+					m = m? m<<1 : 16;
+					s = realloc(s, sizeof(ld_site_t) * m);
+				}
+				s[n].tid = b->tid, s[n].pos = b->pos, s[n].pdg = pdg;
+				for (j = n; j > 0 && s[j-1].tid == b->tid && b->pos - s[j-1].pos <= max_dist; --j);
+				for (; j < n; ++j) ld_push(&a, s[j].pdg, pdg);
+				++n;
+			}
+			ld_run(&a, n_threads);
+			for (i = i0, k = 0; i < n; ++i) {
+				for (j = i; j > 0 && s[j-1].tid == s[i].tid && s[i].pos - s[j-1].pos <= max_dist; --j);
+				for (; j < i; ++j, ++k)
+					ld_print(h, s[j].tid, s[j].pos, s[i].tid, s[i].pos, a.r2[k], a.f + (k<<2));
+			}
+			if (n == 0) continue;
+			// drop the sites out of reach of the sites to come
+			for (j = 0; j < n - 1 && (s[j].tid != s[n-1].tid || s[n-1].pos - s[j].pos > max_dist); ++j)
+				free(s[j].pdg);
+			memmove(s, s + j, (n - j) * sizeof(ld_site_t));
+			n -= j;
 		}
-		printf("\t1.000\n");
 	}
 	// free
-	for (i = 0; i < n; ++i) bcf_destroy(b[i]);
-	free(b);
+	for (i = 0; i < n; ++i) free(s[i].pdg);
+	free(s);
+	ld_destroy(&a);
+	bcf_destroy(b);
 	bcf_hdr_destroy(h);
 	bcf_close(fp);
 	return 0;
@@ -177,7 +379,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Command: view      print, extract, convert and call SNPs from BCF\n");
 		fprintf(stderr, "         index     index BCF\n");
 		fprintf(stderr, "         cat       concatenate BCFs\n");
-		fprintf(stderr, "         ld        compute all-pair r^2\n");
+		fprintf(stderr, "         ld        compute all-pair r^2, or r^2 in a window\n");
 		fprintf(stderr, "         ldpair    compute r^2 between requested pairs\n");
 		fprintf(stderr, "\n");
 		return 1;
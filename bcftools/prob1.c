@@ -45,8 +45,11 @@ struct __bcf_p1aux_t {
 	double *afs, *afs1; // afs: accumulative AFS; afs1: site posterior distribution
 	const uint8_t *PL; // point to PL
 	int PL_len;
+	int isa; // instruction set of the mc_cal_y_core() kernels; see mc_isa()
 };
 
+static int mc_isa(void);
+
 void bcf_p1_indel_prior(bcf_p1aux_t *ma, double x)
 {
 	int i;
@@ -159,10 +162,24 @@ bcf_p1aux_t *bcf_p1_init(int n, uint8_t *ploidy)
 	for (i = 0; i < 256; ++i)
 		ma->q2p[i] = pow(10., -i / 10.);
 	for (i = 0; i <= ma->M; ++i) ma->lf[i] = lgamma(i + 1);
+	ma->isa = mc_isa();
 	bcf_p1_init_prior(ma, MC_PTYPE_FULL, 1e-3); // the simplest prior
 	return ma;
 }
 
+// a copy of ma with the same priors and fresh work space; ma is not modified
+bcf_p1aux_t *bcf_p1_dup(const bcf_p1aux_t *ma)
+{
+	bcf_p1aux_t *b;
+	b = bcf_p1_init(ma->n, ma->ploidy);
+	b->n1 = ma->n1;
+	memcpy(b->phi, ma->phi, sizeof(double) * (ma->M + 1));
+	memcpy(b->phi_indel, ma->phi_indel, sizeof(double) * (ma->M + 1));
+	memcpy(b->phi1, ma->phi1, sizeof(double) * (ma->M + 1));
+	memcpy(b->phi2, ma->phi2, sizeof(double) * (ma->M + 1));
+	return b;
+}
+
 int bcf_p1_set_n1(bcf_p1aux_t *b, int n1)
 {
 	if (n1 == 0 || n1 >= b->n) return -1;
@@ -265,11 +282,130 @@ int bcf_p1_call_gt(const bcf_p1aux_t *ma, double f0, int k)
 
 #define TINY 1e-20
 
+/*
+  One diploid sample of the recursion in mc_cal_y_core(): z1[k] for k in
+  [beg,end], beg >= 2. The new values are added to sum in the order of k
+  and the sum is returned. mc_div() then normalizes z1. The SIMD kernels
+  do the same operations in the same order as the plain ones. They give
+  exactly the same z and t, so the kernel in use never changes the
+  output.
+ */
+typedef double (*mc_row2_f)(int beg, int end, int M0, const double p[3], const double *z0, double *z1, double sum);
+typedef void (*mc_div_f)(int beg, int end, double *z, double sum);
+
+static double mc_row2(int beg, int end, int M0, const double p[3], const double *z0, double *z1, double sum)
+{
+	int k;
+	for (k = beg; k <= end; ++k) {
+		double x = (double)k;
+		z1[k] = (M0 + 1 - x) * (M0 + 2 - x) * p[0] * z0[k] + x * (M0 + 2 - x) * p[1] * z0[k-1] + x * (x - 1) * p[2] * z0[k-2];
+		sum += z1[k];
+	}
+	return sum;
+}
+
+static void mc_div(int beg, int end, double *z, double sum)
+{
+	int k;
+	for (k = beg; k <= end; ++k) z[k] /= sum;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static double mc_row2_sse2(int beg, int end, int M0, const double p[3], const double *z0, double *z1, double sum)
+{
+	int k;
+	__m128d p0 = _mm_set1_pd(p[0]), p1 = _mm_set1_pd(p[1]), p2 = _mm_set1_pd(p[2]);
+	__m128d a1 = _mm_set1_pd(M0 + 1), a2 = _mm_set1_pd(M0 + 2), one = _mm_set1_pd(1.), two = _mm_set1_pd(2.);
+	__m128d x = _mm_set_pd(beg + 1, beg);
+	for (k = beg; k + 2 <= end + 1; k += 2) {
+		__m128d u, v, w, b = _mm_sub_pd(a2, x);
+		u = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(_mm_sub_pd(a1, x), b), p0), _mm_loadu_pd(z0 + k));
+		v = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(x, b), p1), _mm_loadu_pd(z0 + k - 1));
+		w = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(x, _mm_sub_pd(x, one)), p2), _mm_loadu_pd(z0 + k - 2));
+		_mm_storeu_pd(z1 + k, _mm_add_pd(_mm_add_pd(u, v), w));
+		sum += z1[k]; sum += z1[k+1];
+		x = _mm_add_pd(x, two);
+	}
+	return mc_row2(k, end, M0, p, z0, z1, sum);
+}
+
+static void mc_div_sse2(int beg, int end, double *z, double sum)
+{
+	int k;
+	__m128d s = _mm_set1_pd(sum);
+	for (k = beg; k + 2 <= end + 1; k += 2)
+		_mm_storeu_pd(z + k, _mm_div_pd(_mm_loadu_pd(z + k), s));
+	mc_div(k, end, z, sum);
+}
+
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MC_AVX2
+#include <immintrin.h>
+
+// no FMA, for the same results as the other kernels
+__attribute__((target("avx2")))
+static double mc_row2_avx2(int beg, int end, int M0, const double p[3], const double *z0, double *z1, double sum)
+{
+	int k;
+	__m256d p0 = _mm256_set1_pd(p[0]), p1 = _mm256_set1_pd(p[1]), p2 = _mm256_set1_pd(p[2]);
+	__m256d a1 = _mm256_set1_pd(M0 + 1), a2 = _mm256_set1_pd(M0 + 2), one = _mm256_set1_pd(1.), four = _mm256_set1_pd(4.);
+	__m256d x = _mm256_set_pd(beg + 3, beg + 2, beg + 1, beg);
+	for (k = beg; k + 4 <= end + 1; k += 4) {
+		__m256d u, v, w, b = _mm256_sub_pd(a2, x);
+		u = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_sub_pd(a1, x), b), p0), _mm256_loadu_pd(z0 + k));
+		v = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(x, b), p1), _mm256_loadu_pd(z0 + k - 1));
+		w = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(x, _mm256_sub_pd(x, one)), p2), _mm256_loadu_pd(z0 + k - 2));
+		_mm256_storeu_pd(z1 + k, _mm256_add_pd(_mm256_add_pd(u, v), w));
+		sum += z1[k]; sum += z1[k+1]; sum += z1[k+2]; sum += z1[k+3];
+		x = _mm256_add_pd(x, four);
+	}
+	_mm256_zeroupper();
+	return mc_row2(k, end, M0, p, z0, z1, sum);
+}
+
+__attribute__((target("avx2")))
+static void mc_div_avx2(int beg, int end, double *z, double sum)
+{
+	int k;
+	__m256d s = _mm256_set1_pd(sum);
+	for (k = beg; k + 4 <= end + 1; k += 4)
+		_mm256_storeu_pd(z + k, _mm256_div_pd(_mm256_loadu_pd(z + k), s));
+	_mm256_zeroupper();
+	mc_div(k, end, z, sum);
+}
+
+#endif
+
+// the best instruction set: 0 for plain C, 1 for SSE2 and 2 for AVX2
+static int mc_isa(void)
+{
+#ifdef MC_AVX2
+	if (__builtin_cpu_supports("avx2")) return 2;
+#endif
+#ifdef __SSE2__
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 {
 	double *z[2], *tmp, *pdg;
 	int _j, last_min, last_max;
+	mc_row2_f row2 = mc_row2;
+	mc_div_f div = mc_div;
 	assert(beg == 0 || ma->M == ma->n*2);
+#ifdef __SSE2__
+	if (ma->isa >= 1) row2 = mc_row2_sse2, div = mc_div_sse2;
+#endif
+#ifdef MC_AVX2
+	if (ma->isa >= 2) row2 = mc_row2_avx2, div = mc_div_avx2;
+#endif
 	z[0] = ma->z;
 	z[1] = ma->zswap;
 	pdg = ma->pdg;
@@ -289,13 +425,12 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 			for (; _min < _max && z[0][_min] < TINY; ++_min) z[0][_min] = z[1][_min] = 0.;
 			for (; _max > _min && z[0][_max] < TINY; --_max) z[0][_max] = z[1][_max] = 0.;
 			_max += 2;
-			if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-			if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-			for (k = _min < 2? 2 : _min; k <= _max; ++k)
-				z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-			for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+			if (_min == 0) k = 0, z[1][k] = (M0-k+1.) * (M0-k+2) * p[0] * z[0][k];
+			if (_min <= 1) k = 1, z[1][k] = (M0-k+1.) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2.) * p[1] * z[0][k-1];
+			for (k = _min, sum = 0.; k < 2; ++k) sum += z[1][k];
+			sum = row2(_min < 2? 2 : _min, _max, M0, p, z[0], z[1], sum);
 			ma->t += log(sum / (M * (M - 1.)));
-			for (k = _min; k <= _max; ++k) z[1][k] /= sum;
+			div(_min, _max, z[1], sum);
 			if (_min >= 1) z[1][_min-1] = 0.;
 			if (_min >= 2) z[1][_min-2] = 0.;
 			if (j < ma->n - 1) z[1][_max+1] = z[1][_max+2] = 0.;
@@ -332,13 +467,12 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 			} else if (ma->ploidy[j] == 2) {
 				p[0] = pdg[0]; p[1] = 2 * pdg[1]; p[2] = pdg[2];
 				_max += 2;
-				if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-				if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-				for (k = _min < 2? 2 : _min; k <= _max; ++k)
-					z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-				for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+				if (_min == 0) k = 0, z[1][k] = (M0-k+1.) * (M0-k+2) * p[0] * z[0][k];
+				if (_min <= 1) k = 1, z[1][k] = (M0-k+1.) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2.) * p[1] * z[0][k-1];
+				for (k = _min, sum = 0.; k < 2; ++k) sum += z[1][k];
+				sum = row2(_min < 2? 2 : _min, _max, M0, p, z[0], z[1], sum);
 				ma->t += log(sum / (M * (M - 1.)));
-				for (k = _min; k <= _max; ++k) z[1][k] /= sum;
+				div(_min, _max, z[1], sum);
 				if (_min >= 1) z[1][_min-1] = 0.;
 				if (_min >= 2) z[1][_min-2] = 0.;
 				if (j < ma->n - 1) z[1][_max+1] = z[1][_max+2] = 0.;
@@ -347,7 +481,7 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 			last_min = _min; last_max = _max;
 		}
 	}
-	if (z[0] != ma->z) memcpy(ma->z, z[0], sizeof(double) * (ma->M + 1));
+	if (z[0] != ma->z) ma->zswap = ma->z, ma->z = z[0]; // the result is always in ma->z
 }
 
 static void mc_cal_y(bcf_p1aux_t *ma)
@@ -569,6 +703,22 @@ int bcf_p1_cal(const bcf1_t *b, int do_contrast, bcf_p1aux_t *ma, bcf_p1rst_t *r
 	return 0;
 }
 
+// return the AFS accumulated so far and reset it in ma
+double *bcf_p1_take_afs(bcf_p1aux_t *ma)
+{
+	double *afs = ma->afs;
+	ma->afs = calloc(ma->M + 1, sizeof(double));
+	return afs;
+}
+
+// add an AFS returned by bcf_p1_take_afs() of a copy of ma, and free it
+void bcf_p1_add_afs(bcf_p1aux_t *ma, double *afs)
+{
+	int k;
+	for (k = 0; k <= ma->M; ++k) ma->afs[k] += afs[k];
+	free(afs);
+}
+
 void bcf_p1_dump_afs(bcf_p1aux_t *ma)
 {
 	int k;
@@ -578,3 +728,75 @@ void bcf_p1_dump_afs(bcf_p1aux_t *ma)
 	fprintf(stderr, "\n");
 	memset(ma->afs, 0, sizeof(double) * (ma->M + 1));
 }
+
+#ifdef PROB1_MAIN
+/* Benchmark of mc_cal_y_core() with each instruction set. Compile with:
+     gcc -O2 -DPROB1_MAIN -I.. prob1.c -o prob1 -L. -lbcf ../kstring.o ../bgzf.o ../knetfile.o -lz -lm -lpthread
+ */
+#include <unistd.h>
+#include <sys/time.h>
+
+static double mc_realtime(void)
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+// P(D|g) of n samples at a site of allele frequency f, at about dp reads per sample
+static void mc_sim_pdg(bcf_p1aux_t *ma, double f, int dp)
+{
+	int j, k;
+	for (j = 0; j < ma->n; ++j) {
+		double r = drand48(), *pdg = ma->pdg + j * 3;
+		int g = r < (1.-f)*(1.-f)? 0 : r < 1.-f*f? 1 : 2, d = lrand48() % (2 * dp + 1), pl[3];
+		for (k = 0; k < 3; ++k) {
+			pl[k] = d == 0? 0 : k == g? 0 : abs(k - g) * 3 * d + lrand48() % 5;
+			if (pl[k] > 255) pl[k] = 255;
+		}
+		pdg[0] = ma->q2p[pl[2]]; pdg[1] = ma->q2p[pl[1]]; pdg[2] = ma->q2p[pl[0]];
+	}
+}
+
+static int mc_bench(int n, int n_sites, int dp)
+{
+	bcf_p1aux_t *ma;
+	double *pdg, *z0, *t0;
+	int i, isa, n_diff = 0;
+	ma = bcf_p1_init(n, 0);
+	pdg = malloc(n_sites * n * 3 * sizeof(double));
+	z0 = malloc(n_sites * (ma->M + 1) * sizeof(double));
+	t0 = malloc(n_sites * sizeof(double));
+	srand48(11);
+	for (i = 0; i < n_sites; ++i) { // one site in three is a common variant
+		mc_sim_pdg(ma, i % 3 == 0? 0.3 : 0.001, dp);
+		memcpy(pdg + i * n * 3, ma->pdg, n * 3 * sizeof(double));
+	}
+	for (isa = 0; isa <= mc_isa(); ++isa) {
+		double t = mc_realtime();
+		ma->isa = isa;
+		for (i = 0; i < n_sites; ++i) {
+			memcpy(ma->pdg, pdg + i * n * 3, n * 3 * sizeof(double));
+			mc_cal_y_core(ma, 0);
+			if (isa == 0) memcpy(z0 + i * (ma->M + 1), ma->z, (ma->M + 1) * sizeof(double)), t0[i] = ma->t;
+			else if (memcmp(z0 + i * (ma->M + 1), ma->z, (ma->M + 1) * sizeof(double)) || t0[i] != ma->t) ++n_diff;
+		}
+		t = mc_realtime() - t; // includes copying pdg
+		printf("%s\t%d samples\t%d sites\t%.3f sec\t%.2f usec/site\n", isa == 0? "C" : isa == 1? "SSE2" : "AVX2", n, n_sites, t, t * 1e6 / n_sites);
+	}
+	bcf_p1_destroy(ma);
+	free(pdg); free(z0); free(t0);
+	return n_diff;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, dp = 4, n_diff = 0, n[4] = { 10, 100, 1000, 5000 };
+	while ((c = getopt(argc, argv, "d:")) >= 0)
+		if (c == 'd') dp = atoi(optarg);
+	for (i = 0; i < 4; ++i)
+		n_diff += mc_bench(n[i], 2000000 / n[i] / 4 + 20, dp);
+	printf("%d sites differ from the C kernels\n", n_diff);
+	return n_diff? 1 : 0;
+}
+#endif
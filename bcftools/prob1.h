@@ -26,9 +26,12 @@ extern "C" {
 	void bcf_p1_init_prior(bcf_p1aux_t *ma, int type, double theta);
 	void bcf_p1_init_subprior(bcf_p1aux_t *ma, int type, double theta);
 	void bcf_p1_destroy(bcf_p1aux_t *ma);
+	bcf_p1aux_t *bcf_p1_dup(const bcf_p1aux_t *ma);
 	int bcf_p1_cal(const bcf1_t *b, int do_contrast, bcf_p1aux_t *ma, bcf_p1rst_t *rst);
 	int bcf_p1_call_gt(const bcf_p1aux_t *ma, double f0, int k);
 	void bcf_p1_dump_afs(bcf_p1aux_t *ma);
+	double *bcf_p1_take_afs(bcf_p1aux_t *ma);
+	void bcf_p1_add_afs(bcf_p1aux_t *ma, double *afs);
 	int bcf_p1_read_prior(bcf_p1aux_t *ma, const char *fn);
 	int bcf_p1_set_n1(bcf_p1aux_t *b, int n1);
 	void bcf_p1_set_folded(bcf_p1aux_t *p1a); // only effective when set_n1() is not called
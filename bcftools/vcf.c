@@ -2,10 +2,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "bcf.h"
 #include "kstring.h"
 #include "kseq.h"
-KSTREAM_INIT(gzFile, gzread, 4096)
+KSTREAM_INIT(gzFile, gzread, 0x10000)
+
+struct __vcf_mt_t;
 
 typedef struct {
 	gzFile fp;
@@ -14,8 +17,13 @@ typedef struct {
 	void *refhash;
 	kstring_t line;
 	int max_ref;
+	int n_threads, m_type;
+	uint8_t *type; // the kind of each FORMAT field; see vcf_parse()
+	struct __vcf_mt_t *mt;
 } vcf_t;
 
+static void vcf_mt_destroy(struct __vcf_mt_t *m);
+
 bcf_hdr_t *vcf_hdr_read(bcf_t *bp)
 {
 	kstring_t meta, smpl;
@@ -67,8 +75,11 @@ bcf_t *vcf_open(const char *fn, const char *mode)
 	if (strchr(mode, 'r')) {
 		v->fp = strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(fileno(stdin), "r");
 		v->ks = ks_init(v->fp);
-	} else if (strchr(mode, 'w'))
+	} else if (strchr(mode, 'w')) {
 		v->fpout = strcmp(fn, "-")? fopen(fn, "w") : stdout;
+		if (v->fpout) setvbuf(v->fpout, 0, _IOFBF, 0x10000);
+	}
+	v->n_threads = 1;
 	return bp;
 }
 
@@ -105,12 +116,13 @@ int vcf_close(bcf_t *bp)
 	if (bp == 0) return -1;
 	if (!bp->is_vcf) return bcf_close(bp);
 	v = (vcf_t*)bp->v;
+	if (v->mt) vcf_mt_destroy(v->mt);
 	if (v->fp) {
 		ks_destroy(v->ks);
 		gzclose(v->fp);
 	}
 	if (v->fpout) fclose(v->fpout);
-	free(v->line.s);
+	free(v->line.s); free(v->type);
 	bcf_str2id_thorough_destroy(v->refhash);
 	free(v);
 	free(bp);
@@ -141,104 +153,353 @@ int vcf_write(bcf_t *bp, bcf_hdr_t *h, bcf1_t *b)
 	extern void bcf_fmt_core(const bcf_hdr_t *h, bcf1_t *b, kstring_t *s);
 	if (!bp->is_vcf) return bcf_write(bp, h, b);
 	bcf_fmt_core(h, b, &v->line);
+	kputc('\n', &v->line);
 	fwrite(v->line.s, 1, v->line.l, v->fpout);
-	fputc('\n', v->fpout);
-	return v->line.l + 1;
+	return v->line.l;
 }
 
-int vcf_read(bcf_t *bp, bcf_hdr_t *h, bcf1_t *b)
+
+/*
+  The VCF parser. A line is split at TABs in place, so CHROM is left as
+  a string at the start of the line. The FORMAT keys are looked up once
+  per record and the sample columns are converted straight into the
+  arrays of bcf1_t::gi, without copying the fields.
+ */
+
+#define VCF_OTHER 0
+#define VCF_GT    1
+#define VCF_GQ    2
+#define VCF_SP    3
+#define VCF_DP    4 // and DV
+#define VCF_PL    5
+#define VCF_GL    6
+
+// like strtol(q, &q, 10), without skipping spaces
+static inline int vcf_int(char **_q)
 {
-	int dret, k, i, sync = 0;
-	vcf_t *v = (vcf_t*)bp->v;
-	char *p, *q;
-	kstring_t str, rn;
-	ks_tokaux_t aux, a2;
-	if (!bp->is_vcf) return bcf_read(bp, h, b);
-	v->line.l = 0;
-	str.l = 0; str.m = b->m_str; str.s = b->str;
-	rn.l = rn.m = h->l_nm; rn.s = h->name;
-	if (ks_getuntil(v->ks, '\n', &v->line, &dret) < 0) return -1;
-	b->n_smpl = h->n_smpl;
-	for (p = kstrtok(v->line.s, "\t", &aux), k = 0; p; p = kstrtok(0, 0, &aux), ++k) {
-		*(char*)aux.p = 0;
-		if (k == 0) { // ref
-			int tid = bcf_str2id(v->refhash, p);
-			if (tid < 0) {
-				tid = bcf_str2id_add(v->refhash, strdup(p));
-				kputs(p, &rn); kputc('\0', &rn);
-				sync = 1;
+	char *q = *_q;
+	int x = 0, is_neg = 0;
+	if (*q == '-') is_neg = 1, ++q;
+	else if (*q == '+') ++q;
+	for (; *q >= '0' && *q <= '9'; ++q)
+		if (x < 0x1000000) x = x * 10 + (*q - '0');
+	*_q = q;
+	return is_neg? -x : x;
+}
+
+// the missing value of the i-th FORMAT field of sample j, as in "./."
+static void vcf_missing(bcf1_t *b, int type, int i, int j)
+{
+	int y = b->n_alleles * (b->n_alleles + 1) / 2;
+	switch (type) {
+	case VCF_GT: ((uint8_t*)b->gi[i].data)[j] = 1<<7; break;
+	case VCF_GQ: ((uint8_t*)b->gi[i].data)[j] = 0; break;
+	case VCF_SP: ((int32_t*)b->gi[i].data)[j] = 0; break;
+	case VCF_DP: ((uint16_t*)b->gi[i].data)[j] = 0; break;
+	case VCF_PL: memset((uint8_t*)b->gi[i].data + j * y, 0, y); break;
+	case VCF_GL: memset((float*)b->gi[i].data + j * y, 0, y * 4); break;
+	}
+}
+
+// sample column _q_ into the j-th sample of _b_; subfields left out at the end are missing
+static void vcf_parse_smpl(bcf1_t *b, const uint8_t *type, int j, char *q)
+{
+	int i, l, x, y = b->n_alleles * (b->n_alleles + 1) / 2;
+	if (strncmp(q, "./.", 3) == 0) {
+		for (i = 0; i < b->n_gi; ++i) vcf_missing(b, type[i], i, j);
+		return;
+	}
+	for (i = 0; i < b->n_gi; ++i) {
+		switch (type[i]) {
+		case VCF_GT:
+			if (q[0] == '.' || ((q[1] == '/' || q[1] == '|') && q[2] == '.')) x = 1<<7;
+			else if (q[1] == '/' || q[1] == '|') x = (q[0] - '0')<<3 | (q[2] - '0') | (q[1] == '|')<<6;
+			else x = (q[0] - '0')<<3 | (q[0] - '0'); // haploid
+			((uint8_t*)b->gi[i].data)[j] = x;
+			break;
+		case VCF_GQ: {
+				double _x = strtod(q, &q);
+				x = (int)(_x + .499);
+				((uint8_t*)b->gi[i].data)[j] = x > 255? 255 : x;
+				break;
+			}
+		case VCF_SP:
+			x = vcf_int(&q);
+			((uint32_t*)b->gi[i].data)[j] = x > 0xffff? 0xffff : x;
+			break;
+		case VCF_DP:
+			x = vcf_int(&q);
+			((uint16_t*)b->gi[i].data)[j] = x > 0xffff? 0xffff : x;
+			break;
+		case VCF_PL: {
+				uint8_t *d = (uint8_t*)b->gi[i].data + j * y;
+				for (l = 0; l < y; ++l) {
+					x = vcf_int(&q);
+					d[l] = x > 255? 255 : x;
+					while (*q && *q != ',' && *q != ':') ++q;
+					if (*q != ',') break;
+					++q;
+				}
+				if (l < y) memset(d + l + 1, 0, y - l - 1);
+				break;
 			}
-			b->tid = tid;
-		} else if (k == 1) { // pos
+		case VCF_GL: {
+				float *d = (float*)b->gi[i].data + j * y, f;
+				for (l = 0; l < y; ++l) {
+					f = strtod(q, &q);
+					d[l] = f > 0? -f/10. : f;
+					while (*q && *q != ',' && *q != ':') ++q;
+					if (*q != ',') break;
+					++q;
+				}
+				if (l < y) memset(d + l + 1, 0, (y - l - 1) * 4);
+				break;
+			}
+		}
+		while (*q && *q != ':') ++q; // to the next subfield
+		if (*q == 0) break;
+		++q;
+	}
+	for (++i; i < b->n_gi; ++i) vcf_missing(b, type[i], i, j);
+}
+
+// parse all but CHROM of the l-byte _line_ into _b_, which has b->n_smpl set
+static void vcf_parse(char *line, int l, bcf1_t *b, int *m_type, uint8_t **_type)
+{
+	char *p, *q, *end = line + l;
+	uint8_t *type = *_type;
+	kstring_t str;
+	int i, k;
+	str.l = 0; str.m = b->m_str; str.s = b->str;
+	for (p = line, k = 0;; p = q + 1, ++k) {
+		if ((q = memchr(p, '\t', end - p)) == 0) q = end;
+		*q = 0;
+		if (k == 1) { // pos
 			b->pos = atoi(p) - 1;
 		} else if (k == 5) { // qual
 			b->qual = (p[0] >= '0' && p[0] <= '9')? atof(p) : 0;
-		} else if (k <= 8) { // variable length strings
-			kputs(p, &str); kputc('\0', &str);
+		} else if (k >= 2 && k <= 8) { // variable length strings
+			kputsn(p, q - p, &str); kputc('\0', &str);
 			b->l_str = str.l; b->m_str = str.m; b->str = str.s;
-			if (k == 8) bcf_sync(b);
-		} else { // k > 9
-			if (strncmp(p, "./.", 3) == 0) {
+			if (k == 8) {
+				bcf_sync(b);
+				if (b->n_gi > *m_type) {
+					*m_type = b->n_gi;
+					kroundup32(*m_type);
+					*_type = type = realloc(type, *m_type);
+				}
 				for (i = 0; i < b->n_gi; ++i) {
-					if (b->gi[i].fmt == bcf_str2int("GT", 2)) {
-						((uint8_t*)b->gi[i].data)[k-9] = 1<<7;
-					} else if (b->gi[i].fmt == bcf_str2int("GQ", 2)) {
-						((uint8_t*)b->gi[i].data)[k-9] = 0;
-					} else if (b->gi[i].fmt == bcf_str2int("SP", 2)) {
-						((int32_t*)b->gi[i].data)[k-9] = 0;
-					} else if (b->gi[i].fmt == bcf_str2int("DP", 2) || b->gi[i].fmt == bcf_str2int("DV", 2)) {
-						((uint16_t*)b->gi[i].data)[k-9] = 0;
-					} else if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
-						int y = b->n_alleles * (b->n_alleles + 1) / 2;
-						memset((uint8_t*)b->gi[i].data + (k - 9) * y, 0, y);
-					} else if (b->gi[i].fmt == bcf_str2int("GL", 2)) {
-						int y = b->n_alleles * (b->n_alleles + 1) / 2;
-						memset((float*)b->gi[i].data + (k - 9) * y, 0, y * 4);
-					}
+					uint32_t f = b->gi[i].fmt;
+					if (f == bcf_str2int("GT", 2)) type[i] = VCF_GT;
+					else if (f == bcf_str2int("GQ", 2)) type[i] = VCF_GQ;
+					else if (f == bcf_str2int("SP", 2)) type[i] = VCF_SP;
+					else if (f == bcf_str2int("DP", 2) || f == bcf_str2int("DV", 2)) type[i] = VCF_DP;
+					else if (f == bcf_str2int("PL", 2)) type[i] = VCF_PL;
+					else if (f == bcf_str2int("GL", 2)) type[i] = VCF_GL;
+					else type[i] = VCF_OTHER;
 				}
-				goto endblock;
 			}
-			for (q = kstrtok(p, ":", &a2), i = 0; q && i < b->n_gi; q = kstrtok(0, 0, &a2), ++i) {
-				if (b->gi[i].fmt == bcf_str2int("GT", 2)) {
-					((uint8_t*)b->gi[i].data)[k-9] = (q[0] - '0')<<3 | (q[2] - '0') | (q[1] == '/'? 0 : 1) << 6;
-				} else if (b->gi[i].fmt == bcf_str2int("GQ", 2)) {
-					double _x = strtod(q, &q);
-					int x = (int)(_x + .499);
-					if (x > 255) x = 255;
-					((uint8_t*)b->gi[i].data)[k-9] = x;
-				} else if (b->gi[i].fmt == bcf_str2int("SP", 2)) {
-					int x = strtol(q, &q, 10);
-					if (x > 0xffff) x = 0xffff;
-					((uint32_t*)b->gi[i].data)[k-9] = x;
-				} else if (b->gi[i].fmt == bcf_str2int("DP", 2) || b->gi[i].fmt == bcf_str2int("DV", 2)) {
-					int x = strtol(q, &q, 10);
-					if (x > 0xffff) x = 0xffff;
-					((uint16_t*)b->gi[i].data)[k-9] = x;
-				} else if (b->gi[i].fmt == bcf_str2int("PL", 2)) {
-					int x, y, j;
-					uint8_t *data = (uint8_t*)b->gi[i].data;
-					y = b->n_alleles * (b->n_alleles + 1) / 2;
-					for (j = 0; j < y; ++j) {
-						x = strtol(q, &q, 10);
-						if (x > 255) x = 255;
-						data[(k-9) * y + j] = x;
-						++q;
-					}
-				} else if (b->gi[i].fmt == bcf_str2int("GL", 2)) {
-					int j, y;
-					float x, *data = (float*)b->gi[i].data;
-					y = b->n_alleles * (b->n_alleles + 1) / 2;
-					for (j = 0; j < y; ++j) {
-						x = strtod(q, &q);
-						data[(k-9) * y + j] = x > 0? -x/10. : x;
-						++q;
-					}
-				}
+		} else if (k > 8 && k - 9 < b->n_smpl) vcf_parse_smpl(b, type, k - 9, p);
+		if (q == end) break;
+	}
+	if (k >= 8) // samples without a column are missing
+		for (k -= 8; k < b->n_smpl; ++k)
+			for (i = 0; i < b->n_gi; ++i) vcf_missing(b, type[i], i, k);
+}
+
+// the tid of CHROM _p_; a new one is added to the dictionary
+static int vcf_tid(vcf_t *v, bcf_hdr_t *h, const char *p)
+{
+	int tid = bcf_str2id(v->refhash, p);
+	if (tid < 0) {
+		kstring_t rn;
+		rn.l = rn.m = h->l_nm; rn.s = h->name;
+		tid = bcf_str2id_add(v->refhash, strdup(p));
+		kputs(p, &rn); kputc('\0', &rn);
+		h->l_nm = rn.l; h->name = rn.s;
+		bcf_hdr_sync(h);
+	}
+	return tid;
+}
+
+/*
+  With vcf_set_threads(), one thread reads chunks of lines ahead and
+  the others parse them. vcf_read() takes the records in order and
+  looks up CHROM itself, as that may add a sequence to the header.
+ */
+
+#define VCF_CHUNK 1024 // lines in a chunk
+
+typedef struct {
+	int n, done;
+	kstring_t text; // the lines, each ended by NUL
+	int *off;       // off[i] is the start of the i-th line in text
+	bcf1_t **b;
+} vcf_chunk_t;
+
+typedef struct __vcf_mt_t {
+	kstream_t *ks;
+	int n_smpl, n_threads;
+	pthread_t rid, *wid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int n_slots, is_eof, is_quit, i;
+	vcf_chunk_t *slot;    // chunk i is in slot[i % n_slots]
+	int64_t n_read, n_taken, n_used;
+} vcf_mt_t;
+
+static void *vcf_reader(void *data)
+{
+	vcf_mt_t *m = (vcf_mt_t*)data;
+	int is_eof = 0, dret;
+	while (!is_eof) {
+		vcf_chunk_t *c;
+		int is_quit;
+		pthread_mutex_lock(&m->lock);
+		while (m->n_read - m->n_used == m->n_slots && !m->is_quit)
+			pthread_cond_wait(&m->cv, &m->lock);
+		is_quit = m->is_quit;
+		pthread_mutex_unlock(&m->lock);
+		if (is_quit) break;
+		c = &m->slot[m->n_read % m->n_slots];
+		c->text.l = 0;
+		for (c->n = 0; c->n < VCF_CHUNK; ++c->n) {
+			c->off[c->n] = c->text.l;
+			if (ks_getuntil2(m->ks, '\n', &c->text, &dret, 1) < 0) {
+				is_eof = 1;
+				break;
 			}
-		endblock: i = i;
+			kputc('\0', &c->text);
 		}
+		c->done = 0;
+		pthread_mutex_lock(&m->lock);
+		++m->n_read;
+		m->is_eof = is_eof;
+		pthread_cond_broadcast(&m->cv);
+		pthread_mutex_unlock(&m->lock);
 	}
-	h->l_nm = rn.l; h->name = rn.s;
-	if (sync) bcf_hdr_sync(h);
+	pthread_mutex_lock(&m->lock);
+	m->is_eof = 1;
+	pthread_cond_broadcast(&m->cv);
+	pthread_mutex_unlock(&m->lock);
+	return 0;
+}
+
+static void *vcf_worker(void *data)
+{
+	vcf_mt_t *m = (vcf_mt_t*)data;
+	uint8_t *type = 0;
+	int i, m_type = 0;
+	for (;;) {
+		vcf_chunk_t *c;
+		pthread_mutex_lock(&m->lock);
+		while (m->n_taken == m->n_read && !m->is_eof)
+			pthread_cond_wait(&m->cv, &m->lock);
+		if (m->n_taken == m->n_read || m->is_quit) {
+			pthread_mutex_unlock(&m->lock);
+			break;
+		}
+		c = &m->slot[m->n_taken++ % m->n_slots];
+		pthread_mutex_unlock(&m->lock);
+		for (i = 0; i < c->n; ++i) {
+			int l = (i + 1 < c->n? c->off[i+1] : c->text.l) - c->off[i] - 1;
+			c->b[i]->n_smpl = m->n_smpl;
+			vcf_parse(c->text.s + c->off[i], l, c->b[i], &m_type, &type);
+		}
+		pthread_mutex_lock(&m->lock);
+		c->done = 1;
+		pthread_cond_broadcast(&m->cv);
+		pthread_mutex_unlock(&m->lock);
+	}
+	free(type);
+	return 0;
+}
+
+static vcf_mt_t *vcf_mt_init(vcf_t *v, const bcf_hdr_t *h)
+{
+	vcf_mt_t *m;
+	int i, j;
+	m = calloc(1, sizeof(vcf_mt_t));
+	m->ks = v->ks, m->n_smpl = h->n_smpl, m->n_threads = v->n_threads;
+	m->n_slots = m->n_threads * 2;
+	m->slot = calloc(m->n_slots, sizeof(vcf_chunk_t));
+	for (i = 0; i < m->n_slots; ++i) {
+		m->slot[i].off = calloc(VCF_CHUNK, sizeof(int));
+		m->slot[i].b = calloc(VCF_CHUNK, sizeof(void*));
+		for (j = 0; j < VCF_CHUNK; ++j) m->slot[i].b[j] = calloc(1, sizeof(bcf1_t));
+	}
+	pthread_mutex_init(&m->lock, 0);
+	pthread_cond_init(&m->cv, 0);
+	m->wid = calloc(m->n_threads, sizeof(pthread_t));
+	pthread_create(&m->rid, 0, vcf_reader, m);
+	for (i = 0; i < m->n_threads; ++i) pthread_create(&m->wid[i], 0, vcf_worker, m);
+	return m;
+}
+
+static void vcf_mt_destroy(vcf_mt_t *m)
+{
+	int i, j;
+	pthread_mutex_lock(&m->lock);
+	m->is_quit = 1;
+	pthread_cond_broadcast(&m->cv);
+	pthread_mutex_unlock(&m->lock);
+	pthread_join(m->rid, 0);
+	for (i = 0; i < m->n_threads; ++i) pthread_join(m->wid[i], 0);
+	pthread_cond_destroy(&m->cv);
+	pthread_mutex_destroy(&m->lock);
+	for (i = 0; i < m->n_slots; ++i) {
+		for (j = 0; j < VCF_CHUNK; ++j) bcf_destroy(m->slot[i].b[j]);
+		free(m->slot[i].b); free(m->slot[i].off); free(m->slot[i].text.s);
+	}
+	free(m->slot); free(m->wid); free(m);
+}
+
+static int vcf_read_mt(vcf_t *v, bcf_hdr_t *h, bcf1_t *b)
+{
+	vcf_mt_t *m = v->mt;
+	vcf_chunk_t *c;
+	bcf1_t tmp;
+	char *line;
+	int l;
+	if (m == 0) m = v->mt = vcf_mt_init(v, h);
+	for (;;) { // wait for the chunk in order
+		int is_end;
+		pthread_mutex_lock(&m->lock);
+		while (!(m->n_used < m->n_read && m->slot[m->n_used % m->n_slots].done) && !(m->is_eof && m->n_used == m->n_read))
+			pthread_cond_wait(&m->cv, &m->lock);
+		is_end = (m->n_used == m->n_read);
+		pthread_mutex_unlock(&m->lock);
+		if (is_end) return -1;
+		c = &m->slot[m->n_used % m->n_slots];
+		if (m->i < c->n) break;
+		pthread_mutex_lock(&m->lock);
+		m->i = 0, ++m->n_used;
+		pthread_cond_broadcast(&m->cv);
+		pthread_mutex_unlock(&m->lock);
+	}
+	tmp = *b; *b = *c->b[m->i]; *c->b[m->i] = tmp; // the buffers of _b_ are reused for a later line
+	line = c->text.s + c->off[m->i];
+	l = (m->i + 1 < c->n? c->off[m->i+1] : c->text.l) - c->off[m->i] - 1;
+	b->tid = vcf_tid(v, h, line);
+	++m->i;
+	return l + 1;
+}
+
+void vcf_set_threads(bcf_t *bp, int n_threads)
+{
+	if (bp->is_vcf && bp->v && ((vcf_t*)bp->v)->fp)
+		((vcf_t*)bp->v)->n_threads = n_threads > 1? n_threads : 1;
+}
+
+int vcf_read(bcf_t *bp, bcf_hdr_t *h, bcf1_t *b)
+{
+	int dret;
+	vcf_t *v = (vcf_t*)bp->v;
+	if (!bp->is_vcf) return bcf_read(bp, h, b);
+	if (v->n_threads > 1) return vcf_read_mt(v, h, b);
+	if (ks_getuntil(v->ks, '\n', &v->line, &dret) < 0) return -1;
+	b->n_smpl = h->n_smpl;
+	vcf_parse(v->line.s, v->line.l, b, &v->m_type, &v->type);
+	b->tid = vcf_tid(v, h, v->line.s);
 	return v->line.l + 1;
 }
@@ -11,6 +11,15 @@
 #include "kseq.h"
 KSTREAM_INIT(gzFile, gzread, 16384)
 
+#include "ksort.h"
+
+typedef struct {
+	int tid, beg, end, line;
+} bedreg_t;
+
+#define bedreg_lt(a, b) ((a).tid < (b).tid || ((a).tid == (b).tid && (a).beg < (b).beg))
+KSORT_INIT(bedreg, bedreg_t, bedreg_lt)
+
 typedef struct {
 	bamFile fp;
 	bam_iter_t iter;
@@ -34,9 +43,12 @@ int main_bedcov(int argc, char *argv[])
 	bam_index_t **idx;
 	bam_header_t *h = 0;
 	aux_t **aux;
-	int *n_plp, dret, i, n, c, min_mapQ = 0;
+	int *cov, dret, i, j, n, c, tid, pos, n_reg = 0, m_reg = 0, head, min_mapQ = 0;
 	int64_t *cnt;
-	const bam_pileup1_t **plp;
+	char **lines;
+	bedreg_t *reg = 0;
+	bam_region_t *regs;
+	bam_cov_t it;
 
 	while ((c = getopt(argc, argv, "Q:")) >= 0) {
 		switch (c) {
@@ -64,16 +76,14 @@ int main_bedcov(int argc, char *argv[])
 		if (i == 0) h = bam_header_read(aux[0]->fp);
 	}
 	bam_init_header_hash(h);
-	cnt = calloc(n, 8);
 
+	// read all regions first, such that shared blocks are only read once
 	fp = gzopen(argv[optind], "rb");
 	ks = ks_init(fp);
-	n_plp = calloc(n, sizeof(int));
-	plp = calloc(n, sizeof(void*));
+	lines = 0;
 	while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
 		char *p, *q;
-		int tid, beg, end, pos;
-		bam_mplp_t mplp;
+		int beg, end;
 
 		for (p = q = str.s; *p && *p != '\t'; ++p);
 		if (*p != '\t') goto bed_error;
@@ -88,31 +98,55 @@ int main_bedcov(int argc, char *argv[])
 			*p = 0; end = atoi(q); *p = c;
 		} else goto bed_error;
 
-		for (i = 0; i < n; ++i) {
-			if (aux[i]->iter) bam_iter_destroy(aux[i]->iter);
-			aux[i]->iter = bam_iter_query(idx[i], tid, beg, end);
+		if (n_reg == m_reg) {
+			m_reg = m_reg? m_reg<<1 : 256;
+			reg = realloc(reg, m_reg * sizeof(bedreg_t));
+			lines = realloc(lines, m_reg * sizeof(char*));
 		}
-		mplp = bam_mplp_init(n, read_bam, (void**)aux);
-		bam_mplp_set_maxcnt(mplp, 64000);
-		memset(cnt, 0, 8 * n);
-		while (bam_mplp_auto(mplp, &tid, &pos, n_plp, plp) > 0)
-			if (pos >= beg && pos < end)
-				for (i = 0; i < n; ++i) cnt[i] += n_plp[i];
-		for (i = 0; i < n; ++i) {
-			kputc('\t', &str);
-			kputl(cnt[i], &str);
-		}
-		puts(str.s);
-		bam_mplp_destroy(mplp);
+		reg[n_reg].tid = tid, reg[n_reg].beg = beg, reg[n_reg].end = end, reg[n_reg].line = n_reg;
+		lines[n_reg++] = strdup(str.s);
 		continue;
 
 bed_error:
 		fprintf(stderr, "Errors in BED line '%s'\n", str.s);
 	}
-	free(n_plp); free(plp);
 	ks_destroy(ks);
 	gzclose(fp);
 
+	ks_introsort(bedreg, n_reg, reg);
+	regs = calloc(n_reg > 0? n_reg : 1, sizeof(bam_region_t));
+	for (j = 0; j < n_reg; ++j)
+		regs[j].tid = reg[j].tid, regs[j].beg = reg[j].beg, regs[j].end = reg[j].end;
+	for (i = 0; i < n; ++i)
+		aux[i]->iter = bam_iter_query_regs(idx[i], n_reg, regs);
+	free(regs);
+
+	// one pass over all regions; cnt[line*n+i] is the count of the i-th BAM
+	cnt = calloc(n_reg * n + 1, 8);
+	cov = calloc(n, sizeof(int));
+	it = bam_cov_init(n, read_bam, (void**)aux);
+	bam_cov_set_maxcnt(it, 64000);
+	head = 0;
+	while (bam_cov_auto(it, &tid, &pos, cov, 0) > 0) {
+		while (head < n_reg && (reg[head].tid < tid || (reg[head].tid == tid && reg[head].end <= pos))) ++head;
+		for (j = head; j < n_reg && reg[j].tid == tid && reg[j].beg <= pos; ++j)
+			if (pos < reg[j].end)
+				for (i = 0; i < n; ++i) cnt[reg[j].line * n + i] += cov[i];
+	}
+	bam_cov_destroy(it);
+
+	for (j = 0; j < n_reg; ++j) {
+		str.l = 0;
+		kputs(lines[j], &str);
+		for (i = 0; i < n; ++i) {
+			kputc('\t', &str);
+			kputl(cnt[j * n + i], &str);
+		}
+		puts(str.s);
+		free(lines[j]);
+	}
+	free(lines); free(reg);
+	free(cov);
 	free(cnt);
 	for (i = 0; i < n; ++i) {
 		if (aux[i]->iter) bam_iter_destroy(aux[i]->iter);
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <zlib.h>
+#include "bam.h"
 
 #ifdef _WIN32
 #define drand48() ((double)rand() / RAND_MAX)
@@ -96,6 +97,43 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end)
 	return bed_overlap_core(&kh_val(h, k), beg, end);
 }
 
+// the regions on _chr_, sorted, as beg<<32|end; NULL if there are none
+const uint64_t *bed_reglist(const void *_h, const char *chr, int *n)
+{
+	const reghash_t *h = (const reghash_t*)_h;
+	khint_t k;
+	*n = 0;
+	if (!h || (k = kh_get(reg, h, chr)) == kh_end(h)) return 0;
+	*n = kh_val(h, k).n;
+	return kh_val(h, k).a;
+}
+
+// the regions on the references of _header_, for bam_iter_query_regs()
+bam_region_t *bed_regions(const void *_h, const bam_header_t *header, int *n)
+{
+	const reghash_t *h = (const reghash_t*)_h;
+	bam_region_t *regs = 0;
+	int i, j, m = 0;
+	*n = 0;
+	for (i = 0; i < header->n_targets; ++i) {
+		const bed_reglist_t *p;
+		khint_t k = kh_get(reg, h, header->target_name[i]);
+		if (k == kh_end(h)) continue;
+		p = &kh_val(h, k);
+		if (*n + p->n > m) {
+			m = *n + p->n;
+			kroundup32(m);
+			regs = realloc(regs, m * sizeof(bam_region_t));
+		}
+		for (j = 0; j < p->n; ++j, ++*n) {
+			regs[*n].tid = i;
+			regs[*n].beg = p->a[j]>>32;
+			regs[*n].end = (int32_t)p->a[j];
+		}
+	}
+	return regs;
+}
+
 void *bed_read(const char *fn)
 {
 	reghash_t *h = kh_init(reg);
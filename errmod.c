@@ -2,6 +2,8 @@
 #include "errmod.h"
 #include "ksort.h"
 KSORT_INIT_GENERIC(uint16_t)
+#include "khash.h"
+KHASH_MAP_INIT_INT64(emc, int)
 
 typedef struct __errmod_coef_t {
 	double *fk, *beta, *lhet;
@@ -12,6 +14,31 @@ typedef struct {
 	uint32_t c[16];
 } call_aux_t;
 
+#ifndef kroundup32
+#define kroundup32(x) (--(x), (x)|=(x)>>1, (x)|=(x)>>2, (x)|=(x)>>4, (x)|=(x)>>8, (x)|=(x)>>16, ++(x))
+#endif
+
+#define ERRMOD_CSORT_MIN 64 // counting sort from this many bases; insertion sort and introsort are faster below
+#define ERRMOD_MAX_M 5
+
+#ifdef _WIN32
+#define erand48(x) drand48()
+#endif
+
+typedef struct {
+	int m, n_sig;
+	size_t sig; // offset in errmod_cache_t::sig
+	float q[ERRMOD_MAX_M * ERRMOD_MAX_M];
+} emc_entry_t;
+
+struct __errmod_cache_t {
+	int n, max;
+	emc_entry_t *e;
+	size_t l_sig, m_sig;
+	uint32_t *sig; // signatures of all entries, concatenated
+	khash_t(emc) *h;
+};
+
 static errmod_coef_t *cal_coef(double depcorr, double eta)
 {
 	int k, n, q;
@@ -70,21 +97,53 @@ void errmod_destroy(errmod_t *em)
 	free(em->coef->lhet); free(em->coef->fk); free(em->coef->beta);
 	free(em->coef); free(em);
 }
-// qual:6, strand:1, base:4
-int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
+errmod_cache_t *errmod_cache_init(int max)
+{
+	errmod_cache_t *c;
+	c = (errmod_cache_t*)calloc(1, sizeof(errmod_cache_t));
+	c->max = max > 0? max : 1;
+	c->e = (emc_entry_t*)calloc(c->max, sizeof(emc_entry_t));
+	c->h = kh_init(emc);
+	return c;
+}
+
+void errmod_cache_destroy(errmod_cache_t *c)
+{
+	if (c == 0) return;
+	kh_destroy(emc, c->h);
+	free(c->e); free(c->sig); free(c);
+}
+
+// sort the bases; the keys are at most 11 bits wide unless the caller passes a higher quality
+static void errmod_sort(int n, uint16_t *bases)
+{
+	uint8_t cnt[2048]; // n is at most 255
+	int i, j, k, lo = 0xffff, hi = 0;
+	if (n < ERRMOD_CSORT_MIN) {
+		ks_introsort(uint16_t, n, bases);
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		if (bases[i] < lo) lo = bases[i];
+		if (bases[i] > hi) hi = bases[i];
+	}
+	if (hi >= 2048) {
+		ks_introsort(uint16_t, n, bases);
+		return;
+	}
+	memset(cnt + lo, 0, hi - lo + 1);
+	for (i = 0; i < n; ++i) ++cnt[bases[i]];
+	for (k = lo, j = 0; k <= hi; ++k)
+		for (i = 0; i < cnt[k]; ++i) bases[j++] = k;
+}
+
+// likelihoods from n sorted bases
+static void errmod_cal_sorted(const errmod_t *em, int n, int m, const uint16_t *bases, float *q)
 {
 	call_aux_t aux;
 	int i, j, k, w[32];
 
-	if (m > m) return -1;
-	memset(q, 0, m * m * sizeof(float));
-	if (n == 0) return 0;
 	// calculate aux.esum and aux.fsum
-	if (n > 255) { // then sample 255 bases
-		ks_shuffle(uint16_t, n, bases);
-		n = 255;
-	}
-	ks_introsort(uint16_t, n, bases);
 	memset(w, 0, 32 * sizeof(int));
 	memset(&aux, 0, sizeof(call_aux_t));
 	for (j = n - 1; j >= 0; --j) { // calculate esum and fsum
@@ -126,5 +185,79 @@ int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
 		}
 		for (k = 0; k != m; ++k) if (q[j*m+k] < 0.0) q[j*m+k] = 0.0;
 	}
+}
+
+// ks_shuffle() on the erand48() state x
+static void errmod_shuffle(int n, uint16_t *a, unsigned short x[3])
+{
+	int i, j;
+	for (i = n; i > 1; --i) {
+		uint16_t tmp;
+		j = (int)(erand48(x) * i);
+		tmp = a[j]; a[j] = a[i-1]; a[i-1] = tmp;
+	}
+}
+
+// qual:6, strand:1, base:4
+int errmod_cal2(const errmod_t *em, errmod_cache_t *c, unsigned short *x, int n, int m, uint16_t *bases, float *q)
+{
+	uint32_t *sig;
+	uint64_t key;
+	int i, n_sig, absent;
+	khint_t k;
+	emc_entry_t *e;
+
+	if (m > m) return -1;
+	memset(q, 0, m * m * sizeof(float));
+	if (n == 0) return 0;
+	if (n > 255) { // then sample 255 bases
+		if (x) errmod_shuffle(n, bases, x);
+		else ks_shuffle(uint16_t, n, bases);
+		n = 255;
+	}
+	errmod_sort(n, bases);
+	if (c == 0 || m > ERRMOD_MAX_M) {
+		errmod_cal_sorted(em, n, m, bases, q);
+		return 0;
+	}
+	// the signature: (base, count) of each distinct base, in order
+	if (c->n == c->max) { // full; start over
+		kh_clear(emc, c->h);
+		c->n = 0, c->l_sig = 0;
+	}
+	if (c->l_sig + n > c->m_sig) {
+		c->m_sig = c->l_sig + n;
+		kroundup32(c->m_sig);
+		c->sig = (uint32_t*)realloc(c->sig, c->m_sig * 4);
+	}
+	sig = c->sig + c->l_sig;
+	for (i = 1, n_sig = 0, sig[0] = (uint32_t)bases[0]<<8 | 1; i < n; ++i) {
+		if (bases[i] == bases[i-1]) ++sig[n_sig];
+		else sig[++n_sig] = (uint32_t)bases[i]<<8 | 1;
+	}
+	++n_sig;
+	for (i = 0, key = 0xcbf29ce484222325ULL ^ m; i < n_sig; ++i)
+		key = (key ^ sig[i]) * 0x100000001b3ULL;
+	k = kh_put(emc, c->h, key, &absent);
+	if (!absent) {
+		e = &c->e[kh_val(c->h, k)];
+		if (e->m == m && e->n_sig == n_sig && memcmp(c->sig + e->sig, sig, n_sig * 4) == 0) {
+			memcpy(q, e->q, m * m * sizeof(float));
+			return 0;
+		}
+		errmod_cal_sorted(em, n, m, bases, q); // a hash collision; leave the entry alone
+		return 0;
+	}
+	errmod_cal_sorted(em, n, m, bases, q);
+	kh_val(c->h, k) = c->n;
+	e = &c->e[c->n++];
+	e->m = m, e->n_sig = n_sig, e->sig = c->l_sig;
+	memcpy(e->q, q, m * m * sizeof(float));
+	c->l_sig += n_sig;
 	return 0;
 }
+
+int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
+{
+	return errmod_cal2(em, 0, 0, n, m, bases, q);
+}
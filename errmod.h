@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 struct __errmod_coef_t;
+struct __errmod_cache_t;
+typedef struct __errmod_cache_t errmod_cache_t;
 
 typedef struct {
 	double depcorr;
@@ -21,4 +23,18 @@ void errmod_destroy(errmod_t *em);
  */
 int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q);
 
+/*
+	Most sites of a sample see one of few multisets of bases. A cache
+	keeps the likelihoods of the last max distinct multisets; it is
+	emptied when full. errmod_cal2() gives the same q[] as errmod_cal()
+	and, like it, sorts bases[]. c may be NULL.
+
+	Of more than 255 bases, 255 are sampled with erand48() on the state
+	x[3], which the caller seeds so that the result does not depend on
+	other threads; with x NULL, drand48() is used as in errmod_cal().
+ */
+errmod_cache_t *errmod_cache_init(int max);
+void errmod_cache_destroy(errmod_cache_t *c);
+int errmod_cal2(const errmod_t *em, errmod_cache_t *c, unsigned short *x, int n, int m, uint16_t *bases, float *q);
+
 #endif
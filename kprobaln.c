@@ -28,6 +28,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include "kprobaln.h"
 
 /*****************************************
@@ -38,12 +39,243 @@
 #define EM .33333333333
 
 static float g_qual2prob[256];
+static pthread_once_t g_qual2prob_once = PTHREAD_ONCE_INIT;
 
-#define set_u(u, b, i, k) { int x=(i)-(b); x=x>0?x:0; (u)=((k)-x+1)*3; }
+static void qual2prob_init(void)
+{
+	int i;
+	for (i = 0; i < 256; ++i)
+		g_qual2prob[i] = pow(10, -i/10.);
+}
+
+#ifdef _MAIN
+static int g_debug = 1;
+#endif
+
+#define set_u(u, b, i, k) { int x=(i)-(b); x=x>0?x:0; (u)=(k)-x+1; }
 
 kpa_par_t kpa_par_def = { 0.001, 0.1, 10 };
 kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
 
+/*
+  Row kernels. A row of the forward or backward matrix keeps the M, I
+  and D values of the band in three consecutive arrays. The M and I
+  values of a row only depend on the next or the previous row, so they
+  are computed by the kernels below over the whole band, with SIMD if
+  the CPU has it; D values, which depend on the neighbouring cell, are
+  filled afterwards. Each value is computed with the same operations in
+  the same order in all kernels, so results are identical whatever the
+  instruction set.
+ */
+
+// forward: M[j] = e[j] * (m0 * pM[j] + m3 * pI[j] + m6 * pD[j]); I[j] = EI * (m1 * qM[j] + m4 * qI[j])
+typedef void (*kpa_fwd_f)(int n, const double *e, const double *pM, const double *pI, const double *pD,
+						  const double *qM, const double *qI, double *M, double *I, const double *m);
+// backward: e[j] = em[j] * nM[j]; M[j] = e[j] * m0 + EI * m1 * nI[j]; I[j] = e[j] * m3 + EI * m4 * nI[j]
+typedef void (*kpa_bwd_f)(int n, const double *em, const double *nM, const double *nI, double *e,
+						  double *M, double *I, const double *m);
+typedef void (*kpa_scale_f)(int n, double *x, double y);
+
+static void kpa_fwd(int n, const double *e, const double *pM, const double *pI, const double *pD,
+					const double *qM, const double *qI, double *M, double *I, const double *m)
+{
+	int j;
+	for (j = 0; j < n; ++j) {
+		M[j] = e[j] * (m[0] * pM[j] + m[3] * pI[j] + m[6] * pD[j]);
+		I[j] = EI * (m[1] * qM[j] + m[4] * qI[j]);
+	}
+}
+
+static void kpa_bwd(int n, const double *em, const double *nM, const double *nI, double *e,
+					double *M, double *I, const double *m)
+{
+	int j;
+	double c1 = EI * m[1], c4 = EI * m[4];
+	for (j = 0; j < n; ++j) {
+		e[j] = em[j] * nM[j];
+		M[j] = e[j] * m[0] + c1 * nI[j];
+		I[j] = e[j] * m[3] + c4 * nI[j];
+	}
+}
+
+static void kpa_scale(int n, double *x, double y)
+{
+	int j;
+	for (j = 0; j < n; ++j) x[j] *= y;
+}
+
+/*
+  The D values follow D[j] = P[j] + a * D[j-1] along a row, which costs a
+  multiplication and an addition in sequence per cell. Full blocks of four
+  cells are evaluated with only one value carried from block to block; the
+  result differs from the cell-by-cell recurrence by rounding only. Cells
+  left over at the end of a row are done one by one.
+ */
+static inline void kpa_dfwd(int n, const double *M, double m2, const double *a4, double *D) // P[j] = m2 * M[j-1]
+{
+	int j;
+	double c = 0.;
+	for (j = 0; j + 4 <= n; j += 4) {
+		double p0 = m2 * M[j-1], p1 = m2 * M[j], p2 = m2 * M[j+1], p3 = m2 * M[j+2];
+		double t1 = p1 + a4[0] * p0, t2 = p2 + a4[0] * p1, t3 = p3 + a4[0] * p2;
+		double s2 = t2 + a4[1] * p0, s3 = t3 + a4[1] * t1;
+		D[j] = p0 + a4[0] * c; D[j+1] = t1 + a4[1] * c; D[j+2] = s2 + a4[2] * c;
+		c = D[j+3] = s3 + a4[3] * c;
+	}
+	for (; j < n; ++j) c = D[j] = m2 * M[j-1] + a4[0] * c;
+}
+
+static inline void kpa_dbwd(int n, const double *e, double m6, const double *a4, double *D) // P[j] = e[j] * m6; D[n] is 0
+{
+	int j;
+	double c = 0.;
+	for (j = n - 4; j >= 0; j -= 4) {
+		double p0 = e[j] * m6, p1 = e[j+1] * m6, p2 = e[j+2] * m6, p3 = e[j+3] * m6;
+		double t0 = p0 + a4[0] * p1, t1 = p1 + a4[0] * p2, t2 = p2 + a4[0] * p3;
+		double s0 = t0 + a4[1] * t2, s1 = t1 + a4[1] * p3;
+		D[j+3] = p3 + a4[0] * c; D[j+2] = t2 + a4[1] * c; D[j+1] = s1 + a4[2] * c;
+		c = D[j] = s0 + a4[3] * c;
+	}
+	for (j += 3; j >= 0; --j) c = D[j] = e[j] * m6 + a4[0] * c;
+}
+
+// the sum of M[j] + I[j] + D[j], accumulated in four interleaved parts
+static inline double kpa_sum3(int n, const double *M, const double *I, const double *D)
+{
+	int j;
+	double s[4] = { 0., 0., 0., 0. };
+	for (j = 0; j + 4 <= n; j += 4) {
+		s[0] += M[j+0] + I[j+0] + D[j+0];
+		s[1] += M[j+1] + I[j+1] + D[j+1];
+		s[2] += M[j+2] + I[j+2] + D[j+2];
+		s[3] += M[j+3] + I[j+3] + D[j+3];
+	}
+	for (; j < n; ++j) s[j&3] += M[j] + I[j] + D[j];
+	return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static void kpa_fwd_sse2(int n, const double *e, const double *pM, const double *pI, const double *pD,
+						 const double *qM, const double *qI, double *M, double *I, const double *m)
+{
+	int j;
+	__m128d m0 = _mm_set1_pd(m[0]), m1 = _mm_set1_pd(m[1]), m3 = _mm_set1_pd(m[3]);
+	__m128d m4 = _mm_set1_pd(m[4]), m6 = _mm_set1_pd(m[6]), ei = _mm_set1_pd(EI);
+	for (j = 0; j + 2 <= n; j += 2) {
+		__m128d t;
+		t = _mm_add_pd(_mm_mul_pd(m0, _mm_loadu_pd(pM + j)), _mm_mul_pd(m3, _mm_loadu_pd(pI + j)));
+		t = _mm_add_pd(t, _mm_mul_pd(m6, _mm_loadu_pd(pD + j)));
+		_mm_storeu_pd(M + j, _mm_mul_pd(_mm_loadu_pd(e + j), t));
+		t = _mm_add_pd(_mm_mul_pd(m1, _mm_loadu_pd(qM + j)), _mm_mul_pd(m4, _mm_loadu_pd(qI + j)));
+		_mm_storeu_pd(I + j, _mm_mul_pd(ei, t));
+	}
+	kpa_fwd(n - j, e + j, pM + j, pI + j, pD + j, qM + j, qI + j, M + j, I + j, m);
+}
+
+static void kpa_bwd_sse2(int n, const double *em, const double *nM, const double *nI, double *e,
+						 double *M, double *I, const double *m)
+{
+	int j;
+	__m128d m0 = _mm_set1_pd(m[0]), m3 = _mm_set1_pd(m[3]);
+	__m128d c1 = _mm_set1_pd(EI * m[1]), c4 = _mm_set1_pd(EI * m[4]);
+	for (j = 0; j + 2 <= n; j += 2) {
+		__m128d x = _mm_mul_pd(_mm_loadu_pd(em + j), _mm_loadu_pd(nM + j)), y = _mm_loadu_pd(nI + j);
+		_mm_storeu_pd(e + j, x);
+		_mm_storeu_pd(M + j, _mm_add_pd(_mm_mul_pd(x, m0), _mm_mul_pd(c1, y)));
+		_mm_storeu_pd(I + j, _mm_add_pd(_mm_mul_pd(x, m3), _mm_mul_pd(c4, y)));
+	}
+	kpa_bwd(n - j, em + j, nM + j, nI + j, e + j, M + j, I + j, m);
+}
+
+static void kpa_scale_sse2(int n, double *x, double y)
+{
+	int j;
+	__m128d z = _mm_set1_pd(y);
+	for (j = 0; j + 2 <= n; j += 2)
+		_mm_storeu_pd(x + j, _mm_mul_pd(_mm_loadu_pd(x + j), z));
+	kpa_scale(n - j, x + j, y);
+}
+
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define KPA_AVX2
+#include <immintrin.h>
+
+// No FMA: a fused multiply-add would round differently from the other kernels. The upper
+// halves are cleared before the tail goes to the plain kernels, which may use legacy SSE.
+__attribute__((target("avx2")))
+static void kpa_fwd_avx2(int n, const double *e, const double *pM, const double *pI, const double *pD,
+						 const double *qM, const double *qI, double *M, double *I, const double *m)
+{
+	int j;
+	__m256d m0 = _mm256_set1_pd(m[0]), m1 = _mm256_set1_pd(m[1]), m3 = _mm256_set1_pd(m[3]);
+	__m256d m4 = _mm256_set1_pd(m[4]), m6 = _mm256_set1_pd(m[6]), ei = _mm256_set1_pd(EI);
+	for (j = 0; j + 4 <= n; j += 4) {
+		__m256d t;
+		t = _mm256_add_pd(_mm256_mul_pd(m0, _mm256_loadu_pd(pM + j)), _mm256_mul_pd(m3, _mm256_loadu_pd(pI + j)));
+		t = _mm256_add_pd(t, _mm256_mul_pd(m6, _mm256_loadu_pd(pD + j)));
+		_mm256_storeu_pd(M + j, _mm256_mul_pd(_mm256_loadu_pd(e + j), t));
+		t = _mm256_add_pd(_mm256_mul_pd(m1, _mm256_loadu_pd(qM + j)), _mm256_mul_pd(m4, _mm256_loadu_pd(qI + j)));
+		_mm256_storeu_pd(I + j, _mm256_mul_pd(ei, t));
+	}
+	_mm256_zeroupper();
+	kpa_fwd(n - j, e + j, pM + j, pI + j, pD + j, qM + j, qI + j, M + j, I + j, m);
+}
+
+__attribute__((target("avx2")))
+static void kpa_bwd_avx2(int n, const double *em, const double *nM, const double *nI, double *e,
+						 double *M, double *I, const double *m)
+{
+	int j;
+	__m256d m0 = _mm256_set1_pd(m[0]), m3 = _mm256_set1_pd(m[3]);
+	__m256d c1 = _mm256_set1_pd(EI * m[1]), c4 = _mm256_set1_pd(EI * m[4]);
+	for (j = 0; j + 4 <= n; j += 4) {
+		__m256d x = _mm256_mul_pd(_mm256_loadu_pd(em + j), _mm256_loadu_pd(nM + j)), y = _mm256_loadu_pd(nI + j);
+		_mm256_storeu_pd(e + j, x);
+		_mm256_storeu_pd(M + j, _mm256_add_pd(_mm256_mul_pd(x, m0), _mm256_mul_pd(c1, y)));
+		_mm256_storeu_pd(I + j, _mm256_add_pd(_mm256_mul_pd(x, m3), _mm256_mul_pd(c4, y)));
+	}
+	_mm256_zeroupper();
+	kpa_bwd(n - j, em + j, nM + j, nI + j, e + j, M + j, I + j, m);
+}
+
+__attribute__((target("avx2")))
+static void kpa_scale_avx2(int n, double *x, double y)
+{
+	int j;
+	__m256d z = _mm256_set1_pd(y);
+	for (j = 0; j + 4 <= n; j += 4)
+		_mm256_storeu_pd(x + j, _mm256_mul_pd(_mm256_loadu_pd(x + j), z));
+	_mm256_zeroupper();
+	kpa_scale(n - j, x + j, y);
+}
+
+#endif
+
+// the best instruction set: 0 for plain C, 1 for SSE2 and 2 for AVX2
+static int kpa_isa(void)
+{
+#ifdef KPA_AVX2
+	if (__builtin_cpu_supports("avx2")) return 2;
+#endif
+#ifdef __SSE2__
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+// emission probabilities of reference bases 0-4 against query base qy of error probability ql
+static inline void kpa_emission(double em[5], int qy, double ql)
+{
+	int c;
+	for (c = 0; c < 5; ++c)
+		em[c] = (c > 3 || qy > 3)? 1. : c == qy? 1. - ql : ql * EM;
+}
+
 /*
   The topology of the profile HMM:
 
@@ -69,36 +301,50 @@ kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
    insertion). q[i] gives the phred scaled posterior probability of
    state[i] being wrong.
  */
-int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
-			   const kpa_par_t *c, int *state, uint8_t *q)
+static int kpa_glocal_core(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+						   const kpa_par_t *c, int *state, uint8_t *q, int isa)
 {
-	double **f, **b = 0, *s, m[9], sI, sM, bI, bM, pb;
+	double **f, **b = 0, *s, m[9], sI, sM, bI, bM, pb, *_f, *_b = 0, *e, *em, em4[5], a4[4];
 	float *qual, *_qual;
 	const uint8_t *ref, *query;
-	int bw, bw2, i, k, is_diff = 0, is_backward = 1, Pr;
+	uint8_t *rc;
+	int bw, bw2, W, i, k, is_diff = 0, is_backward = 1, Pr;
+	kpa_fwd_f fwd = kpa_fwd;
+	kpa_bwd_f bwd = kpa_bwd;
+	kpa_scale_f scale = kpa_scale;
 
     if ( l_ref<=0 || l_query<=0 ) return 0; // FIXME: this may not be an ideal fix, just prevents sefgault
 
 	/*** initialization ***/
+#ifdef __SSE2__
+	if (isa >= 1) fwd = kpa_fwd_sse2, bwd = kpa_bwd_sse2, scale = kpa_scale_sse2;
+#endif
+#ifdef KPA_AVX2
+	if (isa >= 2) fwd = kpa_fwd_avx2, bwd = kpa_bwd_avx2, scale = kpa_scale_avx2;
+#endif
 	is_backward = state && q? 1 : 0;
 	ref = _ref - 1; query = _query - 1; // change to 1-based coordinate
 	bw = l_ref > l_query? l_ref : l_query;
 	if (bw > c->bw) bw = c->bw;
 	if (bw < abs(l_ref - l_query)) bw = abs(l_ref - l_query);
 	bw2 = bw * 2 + 1;
+	W = bw2 + 2; // a row holds W M values, then W I values and W D values
 	// allocate the forward and backward matrices f[][] and b[][] and the scaling array s[]
 	f = calloc(l_query+1, sizeof(void*));
-	if (is_backward) b = calloc(l_query+1, sizeof(void*));
-	for (i = 0; i <= l_query; ++i) {    // FIXME: this will lead in segfault for l_query==0
-		f[i] = calloc(bw2 * 3 + 6, sizeof(double)); // FIXME: this is over-allocated for very short seqs
-		if (is_backward) b[i] = calloc(bw2 * 3 + 6, sizeof(double));
+	_f = calloc((size_t)(l_query+1) * W * 3, sizeof(double));
+	for (i = 0; i <= l_query; ++i) f[i] = _f + (size_t)i * W * 3;
+	if (is_backward) {
+		b = calloc(l_query+1, sizeof(void*));
+		_b = calloc((size_t)(l_query+1) * W * 3, sizeof(double));
+		for (i = 0; i <= l_query; ++i) b[i] = _b + (size_t)i * W * 3;
 	}
 	s = calloc(l_query+2, sizeof(double)); // s[] is the scaling factor to avoid underflow
+	e = calloc(W * 2, sizeof(double)); em = e + W; // emission probabilities in the band of a row
+	rc = malloc(l_ref + 2); // reference bases, with 4 for all ambiguous ones
+	for (k = 1; k <= l_ref; ++k) rc[k] = ref[k] > 3? 4 : ref[k];
 	// initialize qual
 	_qual = calloc(l_query, sizeof(float));
-	if (g_qual2prob[0] == 0)
-		for (i = 0; i < 256; ++i)
-			g_qual2prob[i] = pow(10, -i/10.);
+	pthread_once(&g_qual2prob_once, qual2prob_init); // BAQ and indel realignment may run on several threads
 	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
 	qual = _qual - 1;
 	// initialize transition probability
@@ -107,6 +353,7 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 	m[1*3+0] = (1 - c->e) * (1 - sI); m[1*3+1] = c->e * (1 - sI); m[1*3+2] = 0.;
 	m[2*3+0] = 1 - c->e; m[2*3+1] = 0.; m[2*3+2] = c->e;
 	bM = (1 - c->d) / l_ref; bI = c->d / l_ref; // (bM+bI)*l_ref==1
+	a4[0] = m[8]; a4[1] = a4[0] * m[8]; a4[2] = a4[1] * m[8]; a4[3] = a4[2] * m[8];
 	/*** forward ***/
 	// f[0]
 	set_u(k, bw, 0, 0);
@@ -118,44 +365,40 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 			int u;
 			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
 			set_u(u, bw, 1, k);
-			fi[u+0] = e * bM; fi[u+1] = EI * bI;
-			sum += fi[u] + fi[u+1];
+			fi[u] = e * bM; fi[W+u] = EI * bI;
+			sum += fi[u] + fi[W+u];
 		}
 		// rescale
 		s[1] = sum;
-		set_u(_beg, bw, 1, beg); set_u(_end, bw, 1, end); _end += 2;
-		for (k = _beg; k <= _end; ++k) fi[k] /= sum;
+		set_u(_beg, bw, 1, beg); set_u(_end, bw, 1, end);
+		for (k = _beg; k <= _end; ++k) fi[k] /= sum, fi[W+k] /= sum, fi[2*W+k] /= sum;
 	}
 	// f[2..l_query]
 	for (i = 2; i <= l_query; ++i) {
-		double *fi = f[i], *fi1 = f[i-1], sum, qli = qual[i];
-		int beg = 1, end = l_ref, x, _beg, _end;
-		uint8_t qyi = query[i];
+		double *fi = f[i], *fi1 = f[i-1], sum;
+		int beg = 1, end = l_ref, x, _beg, _end, d = (i > bw); // M[i-1][k-1] is at the same offset as M[i][k] if d, or one before
 		x = i - bw; beg = beg > x? beg : x; // band start
 		x = i + bw; end = end < x? end : x; // band end
-		for (k = beg, sum = 0.; k <= end; ++k) {
-			int u, v11, v01, v10;
-			double e;
-			e = (ref[k] > 3 || qyi > 3)? 1. : ref[k] == qyi? 1. - qli : qli * EM;
-			set_u(u, bw, i, k); set_u(v11, bw, i-1, k-1); set_u(v10, bw, i-1, k); set_u(v01, bw, i, k-1);
-			fi[u+0] = e * (m[0] * fi1[v11+0] + m[3] * fi1[v11+1] + m[6] * fi1[v11+2]);
-			fi[u+1] = EI * (m[1] * fi1[v10+0] + m[4] * fi1[v10+1]);
-			fi[u+2] = m[2] * fi[v01+0] + m[8] * fi[v01+2];
-			sum += fi[u] + fi[u+1] + fi[u+2];
-//			fprintf(stderr, "F (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, fi[u], fi[u+1], fi[u+2]); // DEBUG
-		}
+		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end);
+		kpa_emission(em4, query[i], qual[i]);
+		for (k = beg; k <= end; ++k) e[k-beg] = em4[rc[k]];
+		x = _beg + d;
+		fwd(end - beg + 1, e, fi1 + x - 1, fi1 + W + x - 1, fi1 + 2*W + x - 1, fi1 + x, fi1 + W + x, fi + _beg, fi + W + _beg, m);
+		// D[k] = m2 * M[k-1] + m8 * D[k-1]
+		kpa_dfwd(_end - _beg + 1, fi + _beg, m[2], a4, fi + 2*W + _beg);
+		sum = kpa_sum3(_end - _beg + 1, fi + _beg, fi + W + _beg, fi + 2*W + _beg);
 		// rescale
 		s[i] = sum;
-		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
-		for (k = _beg, sum = 1./sum; k <= _end; ++k) fi[k] *= sum;
+		sum = 1./sum;
+		scale(_end - _beg + 1, fi + _beg, sum); scale(_end - _beg + 1, fi + W + _beg, sum); scale(_end - _beg + 1, fi + 2*W + _beg, sum);
 	}
 	{ // f[l_query+1]
 		double sum;
 		for (k = 1, sum = 0.; k <= l_ref; ++k) {
 			int u;
 			set_u(u, bw, l_query, k);
-			if (u < 3 || u >= bw2*3+3) continue;
-		    sum += f[l_query][u+0] * sM + f[l_query][u+1] * sI;
+			if (u < 1 || u >= bw2+1) continue;
+		    sum += f[l_query][u] * sM + f[l_query][W+u] * sI;
 		}
 		s[l_query+1] = sum; // the last scaling factor
 	}
@@ -168,8 +411,7 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		Pr1 += -4.343 * log(p * l_ref * l_query);
 		Pr = (int)(Pr1 + .499);
 		if (!is_backward) { // skip backward and MAP
-			for (i = 0; i <= l_query; ++i) free(f[i]);
-			free(f); free(s); free(_qual);
+			free(f); free(_f); free(s); free(_qual); free(e); free(rc);
 			return Pr;
 		}
 	}
@@ -179,29 +421,27 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		int u;
 		double *bi = b[l_query];
 		set_u(u, bw, l_query, k);
-		if (u < 3 || u >= bw2*3+3) continue;
-		bi[u+0] = sM / s[l_query] / s[l_query+1]; bi[u+1] = sI / s[l_query] / s[l_query+1];
+		if (u < 1 || u >= bw2+1) continue;
+		bi[u] = sM / s[l_query] / s[l_query+1]; bi[W+u] = sI / s[l_query] / s[l_query+1];
 	}
 	// b[l_query-1..1]
 	for (i = l_query - 1; i >= 1; --i) {
-		int beg = 1, end = l_ref, x, _beg, _end;
-		double *bi = b[i], *bi1 = b[i+1], y = (i > 1), qli1 = qual[i+1];
-		uint8_t qyi1 = query[i+1];
+		int beg = 1, end = l_ref, x, _beg, _end, d = (i >= bw); // M[i+1][k] is at the offset of M[i][k] minus d
+		double *bi = b[i], *bi1 = b[i+1], y;
 		x = i - bw; beg = beg > x? beg : x;
 		x = i + bw; end = end < x? end : x;
-		for (k = end; k >= beg; --k) {
-			int u, v11, v01, v10;
-			double e;
-			set_u(u, bw, i, k); set_u(v11, bw, i+1, k+1); set_u(v10, bw, i+1, k); set_u(v01, bw, i, k+1);
-			e = (k >= l_ref? 0 : (ref[k+1] > 3 || qyi1 > 3)? 1. : ref[k+1] == qyi1? 1. - qli1 : qli1 * EM) * bi1[v11];
-			bi[u+0] = e * m[0] + EI * m[1] * bi1[v10+1] + m[2] * bi[v01+2]; // bi1[v11] has been foled into e.
-			bi[u+1] = e * m[3] + EI * m[4] * bi1[v10+1];
-			bi[u+2] = (e * m[6] + m[8] * bi[v01+2]) * y;
-//			fprintf(stderr, "B (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, bi[u], bi[u+1], bi[u+2]); // DEBUG
+		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end);
+		kpa_emission(em4, query[i+1], qual[i+1]);
+		for (k = beg; k <= end; ++k) em[k-beg] = k >= l_ref? 0. : em4[rc[k+1]];
+		x = _beg - d;
+		bwd(end - beg + 1, em, bi1 + x + 1, bi1 + W + x, e, bi + _beg, bi + W + _beg, m); // bi1[v11] is folded into e[]
+		if (i > 1) { // D[k] = e * m6 + m8 * D[k+1]; D stays 0 in b[1]
+			kpa_dbwd(_end - _beg + 1, e, m[6], a4, bi + 2*W + _beg);
+			for (k = _beg; k <= _end; ++k) bi[k] += m[2] * bi[2*W+k+1];
 		}
 		// rescale
-		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
-		for (k = _beg, y = 1./s[i]; k <= _end; ++k) bi[k] *= y;
+		y = 1./s[i];
+		scale(_end - _beg + 1, bi + _beg, y); scale(_end - _beg + 1, bi + W + _beg, y); scale(_end - _beg + 1, bi + 2*W + _beg, y);
 	}
 	{ // b[0]
 		int beg = 1, end = l_ref < bw + 1? l_ref : bw + 1;
@@ -210,8 +450,8 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 			int u;
 			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
 			set_u(u, bw, 1, k);
-			if (u < 3 || u >= bw2*3+3) continue;
-		    sum += e * b[1][u+0] * bM + EI * b[1][u+1] * bI;
+			if (u < 1 || u >= bw2+1) continue;
+		    sum += e * b[1][u] * bM + EI * b[1][W+u] * bI;
 		}
 		set_u(k, bw, 0, 0);
 		pb = b[0][k] = sum / s[0]; // if everything works as is expected, pb == 1.0
@@ -227,39 +467,89 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 			int u;
 			double z;
 			set_u(u, bw, i, k);
-			z = fi[u+0] * bi[u+0]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
-			z = fi[u+1] * bi[u+1]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
+			z = fi[u] * bi[u]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
+			z = fi[W+u] * bi[W+u]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
 		}
 		max /= sum; sum *= s[i]; // if everything works as is expected, sum == 1.0
 		if (state) state[i-1] = max_k;
 		if (q) k = (int)(-4.343 * log(1. - max) + .499), q[i-1] = k > 100? 99 : k;
 #ifdef _MAIN
-		fprintf(stderr, "(%.10lg,%.10lg) (%d,%d:%c,%c:%d) %lg\n", pb, sum, i-1, max_k>>2,
+		if (g_debug) fprintf(stderr, "(%.10lg,%.10lg) (%d,%d:%c,%c:%d) %lg\n", pb, sum, i-1, max_k>>2,
 				"ACGT"[query[i]], "ACGT"[ref[(max_k>>2)+1]], max_k&3, max); // DEBUG
 #endif
 	}
 	/*** free ***/
-	for (i = 0; i <= l_query; ++i) {
-		free(f[i]); free(b[i]);
-	}
-	free(f); free(b); free(s); free(_qual);
+	free(f); free(b); free(_f); free(_b); free(s); free(_qual); free(e); free(rc);
 	return Pr;
 }
 
+int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
+			   const kpa_par_t *c, int *state, uint8_t *q)
+{
+	return kpa_glocal_core(_ref, l_ref, _query, l_query, iqual, c, state, q, kpa_isa());
+}
+
 #ifdef _MAIN
 #include <unistd.h>
+#include <sys/time.h>
+
+static double kpa_realtime(void)
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+// align n random reads of length l with a few errors against their reference, with each instruction set
+static int kpa_bench(int n, int l)
+{
+	uint8_t *ref, *query, *qual, *q, *q0;
+	int i, j, isa, *state, *state0, n_diff = 0;
+	ref = malloc((l + 20) * n); query = malloc(l * n); qual = malloc(l * n);
+	q = malloc(l); q0 = malloc(l * n);
+	state = malloc(l * sizeof(int)); state0 = malloc(l * n * sizeof(int));
+	srand(11);
+	for (i = 0; i < (l + 20) * n; ++i) ref[i] = rand() & 3;
+	for (i = 0; i < n; ++i) { // substitutions, and an indel in a fifth of the reads
+		int indel = i % 5 == 0? rand() % 7 - 3 : 0, pos = rand() % l;
+		for (j = 0; j < l; ++j) {
+			int k = j < pos? j : j + indel;
+			query[i*l+j] = rand() % 50 == 0? rand() & 3 : ref[i*(l+20) + 10 + (k < -10? -10 : k)];
+			qual[i*l+j] = 2 + rand() % 39;
+		}
+	}
+	g_debug = 0;
+	for (isa = 0; isa <= kpa_isa(); ++isa) {
+		double t = kpa_realtime();
+		for (i = 0; i < n; ++i) {
+			kpa_glocal_core(ref + i * (l + 20), l + 20, query + i * l, l, qual + i * l, &kpa_par_def, state, q, isa);
+			if (isa == 0) memcpy(q0 + i * l, q, l), memcpy(state0 + i * l, state, l * sizeof(int));
+			else if (memcmp(q0 + i * l, q, l) || memcmp(state0 + i * l, state, l * sizeof(int))) ++n_diff;
+		}
+		t = kpa_realtime() - t;
+		printf("%s\t%d reads of %dbp\t%.3f sec\t%.2f usec/read\n", isa == 0? "C" : isa == 1? "SSE2" : "AVX2", n, l, t, t * 1e6 / n);
+	}
+	printf("%d reads differ from the C kernels\n", n_diff);
+	free(ref); free(query); free(qual); free(q); free(q0); free(state); free(state0);
+	return n_diff? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	uint8_t conv[256], *iqual, *ref, *query;
-	int c, l_ref, l_query, i, q = 30, b = 10, P;
-	while ((c = getopt(argc, argv, "b:q:")) >= 0) {
+	int c, l_ref, l_query, i, q = 30, b = 10, P, n_bench = 0, l_bench = 100;
+	while ((c = getopt(argc, argv, "b:q:n:l:")) >= 0) {
 		switch (c) {
 		case 'b': b = atoi(optarg); break;
 		case 'q': q = atoi(optarg); break;
+		case 'n': n_bench = atoi(optarg); break;
+		case 'l': l_bench = atoi(optarg); break;
 		}
 	}
+	if (n_bench > 0) return kpa_bench(n_bench, l_bench);
 	if (optind + 2 > argc) {
 		fprintf(stderr, "Usage: %s [-q %d] [-b %d] <ref> <query>\n", argv[0], q, b); // example: acttc attc
+		fprintf(stderr, "       %s -n nReads [-l %d]   # benchmark\n", argv[0], l_bench);
 		return 1;
 	}
 	memset(conv, 4, 256);
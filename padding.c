@@ -17,6 +17,7 @@ static void replace_cigar(bam1_t *b, int n, uint32_t *cigar)
 		b->data_len += (n - b->core.n_cigar) * 4;
 		b->core.n_cigar = n;
 	} else memcpy(b->data + b->core.l_qname, cigar, n * 4);
+	b->cs.is_valid = 0;
 }
 
 #define write_cigar(_c, _n, _m, _v) do { \
@@ -134,6 +135,7 @@ int bam_pad2unpad(bamFile in, bamFile out)
 			n2 = k;
 			replace_cigar(b, n2, cigar2);
 			b->core.pos = posmap[b->core.pos];
+			bam_cigsum_update(b);
 		}
 		bam_write1(out, b);
 	}
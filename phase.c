@@ -318,7 +318,7 @@ static void dump_aln(phaseg_t *g, int min_pos, const nseq_t *hash)
 		khint_t k;
 		bam1_t *b = g->b[i];
 		key = X31_hash_string(bam1_qname(b));
-		end = bam_calend(&b->core, bam1_cigar(b));
+		end = bam1_calend(b);
 		if (end > min_pos) break;
 		k = kh_get(64, hash, key);
 		if (k == kh_end(hash)) which = 3;
@@ -651,13 +651,13 @@ int main_phase(int argc, char *argv[])
 				if (vpos - f->vpos + 1 < MAX_VARS) {
 					f->vlen = vpos - f->vpos + 1;
 					f->seq[f->vlen-1] = c;
-					f->end = bam_calend(&p->b->core, bam1_cigar(p->b));
+					f->end = bam1_calend(p->b);
 				}
 				dophase = 0;
 			} else { // absent
 				memset(f->seq, 0, MAX_VARS);
 				f->beg = p->b->core.pos;
-				f->end = bam_calend(&p->b->core, bam1_cigar(p->b));
+				f->end = bam1_calend(p->b);
 				f->vpos = vpos, f->vlen = 1, f->seq[0] = c, f->single = f->phased = f->flip = f->ambig = 0;
 			}
 		}
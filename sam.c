@@ -13,7 +13,7 @@ bam_header_t *bam_header_dup(const bam_header_t *h0)
 	h = bam_header_init();
 	*h = *h0;
         h->hash = h->rg2lib = 0;
-	h->header = 0;
+	h->header = 0; h->dict = 0;
 	h->text = (char*)calloc(h->l_text + 1, 1);
 	memcpy(h->text, h0->text, h->l_text);
 	h->target_len = (uint32_t*)calloc(h->n_targets, 4);
@@ -22,7 +22,6 @@ bam_header_t *bam_header_dup(const bam_header_t *h0)
 		h->target_len[i] = h0->target_len[i];
 		h->target_name[i] = strdup(h0->target_name[i]);
 	}
-	if (h->header == 0) h->header = sam_header_parse2(h->text);
 	return h;
 }
 static void append_header_text(bam_header_t *header, char* text, int len)
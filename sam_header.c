@@ -17,6 +17,7 @@ typedef struct {
 
 KHASH_INIT(str, sam_header_tag_t, char *, 1, __tag_hash_func, __tageq);
 KHASH_INIT(records, sam_header_tag_t, sam_header_records_t*, 1, __tag_hash_func, __tageq);
+KHASH_MAP_INIT_STR(hdict, int32_t)
 
 const char *SAM_HEADER_TYPE_TAGS[] = {"HD", "SQ", "RG", "PG", "CO", NULL};
 const int32_t SAM_HEADER_TYPE_TAGS_MAX[] = {1, INT_MAX, INT_MAX, INT_MAX, INT_MAX, -1};
@@ -943,6 +944,151 @@ sam_header_write(const sam_header_t *h)
   return text;
 }
 
+static const char *SAM_HDICT_ID_TAGS[] = {NULL, "SN", "ID", "ID", NULL};
+
+static inline void
+sam_hdict_add_tv(sam_hdict_t *d, const char *tag, char *value)
+{
+  if(d->n_tv == d->m_tv) {
+      d->m_tv = d->m_tv? d->m_tv<<1 : 256;
+      d->tv = realloc(d->tv, sizeof(sam_hdict_tv_t) * d->m_tv);
+  }
+  d->tv[d->n_tv].tag[0] = tag[0]; d->tv[d->n_tv].tag[1] = tag[1];
+  d->tv[d->n_tv++].value = value;
+}
+
+static inline char*
+sam_hdict_find(const sam_hdict_t *d, int32_t beg, int32_t len, const char *tag)
+{
+  int32_t i;
+  for(i=beg;i<beg+len;i++) {
+      if(d->tv[i].tag[0] == tag[0] && d->tv[i].tag[1] == tag[1]) return d->tv[i].value;
+  }
+  return NULL;
+}
+
+sam_hdict_t*
+sam_hdict_parse(const char *text, int32_t l_text)
+{
+  sam_hdict_t *d = NULL;
+  char *p, *q, *end;
+  int32_t i;
+
+  d = calloc(1, sizeof(sam_hdict_t));
+  for(i=0;i<SAM_HEADER_TYPE_NUM;i++) d->recs[i].hash = kh_init(hdict);
+  if(NULL == text || l_text <= 0) return d;
+  d->arena = malloc(l_text + 1);
+  memcpy(d->arena, text, l_text);
+  d->arena[l_text] = '\0';
+
+  for(p = d->arena, end = d->arena + l_text; p < end && 0 != (*p); p = q + 1) {
+      sam_hdict_recs_t *r;
+      char **tags_req;
+      int32_t type, beg;
+      // tokenize the line in place
+      for(q = p; q < end && 0 != (*q) && '\n' != (*q); q++);
+      if(q > p && '\r' == q[-1]) q[-1] = '\0';
+      if(0 == (*q)) end = q; // the last line, or an embedded NUL
+      (*q) = '\0';
+      if('@' != p[0] || 0 == p[1] || 0 == p[2] || ('\t' != p[3] && 0 != p[3])) continue;
+      type = sam_header_tag2int(p + 1, SAM_HEADER_TYPE_TAGS);
+      if(type < 0) continue; // non-standard record type
+      beg = d->n_tv;
+      if(SAM_HEADER_TYPE_CO == type) { // CO can contain anything, including tabs
+          sam_hdict_add_tv(d, "  ", 0 == p[3]? p + 3 : p + 4);
+      } else {
+          char *f = p + 3, *g;
+          int last = (0 == (*f));
+          while(!last) {
+              f++; // skip the tab
+              for(g = f; 0 != (*g) && '\t' != (*g); g++);
+              last = (0 == (*g));
+              (*g) = '\0';
+              if(g - f >= 3 && ':' == f[2]) sam_hdict_add_tv(d, f, f + 3);
+              f = g;
+          }
+      }
+      // check the required tags
+      tags_req = (char**)SAM_HEADER_TAGS_REQ[type];
+      while(NULL != tags_req && NULL != (*tags_req)) {
+          if(NULL == sam_hdict_find(d, beg, d->n_tv - beg, (*tags_req))) break;
+          tags_req++;
+      }
+      if(NULL != tags_req && NULL != (*tags_req)) {
+          debug("[%s] required tag [%s] missing from record type [%c%c]\n", __func__, (*tags_req), p[1], p[2]);
+          d->n_tv = beg;
+          continue;
+      }
+      // add the record
+      r = &d->recs[type];
+      if(r->n == r->m) {
+          r->m = r->m? r->m<<1 : 16;
+          r->beg = realloc(r->beg, sizeof(int32_t) * r->m);
+          r->len = realloc(r->len, sizeof(int32_t) * r->m);
+      }
+      r->beg[r->n] = beg; r->len[r->n] = d->n_tv - beg;
+      if(NULL != SAM_HDICT_ID_TAGS[type]) {
+          khash_t(hdict) *hash = (khash_t(hdict)*)r->hash;
+          int ret;
+          khiter_t k = kh_put(hdict, hash, sam_hdict_find(d, beg, d->n_tv - beg, SAM_HDICT_ID_TAGS[type]), &ret);
+          if(0 == ret) debug("[%s] value for %c%c.%s was not unique\n", __func__, p[1], p[2], SAM_HDICT_ID_TAGS[type]);
+          else kh_value(hash, k) = r->n;
+      }
+      r->n++;
+  }
+  return d;
+}
+
+void
+sam_hdict_destroy(sam_hdict_t *d)
+{
+  int32_t i;
+  if(NULL == d) return;
+  for(i=0;i<SAM_HEADER_TYPE_NUM;i++) {
+      free(d->recs[i].beg); free(d->recs[i].len);
+      kh_destroy(hdict, (khash_t(hdict)*)d->recs[i].hash);
+  }
+  free(d->tv);
+  free(d->arena);
+  free(d);
+}
+
+int32_t
+sam_hdict_n(const sam_hdict_t *d, const char type_tag[2])
+{
+  int32_t type = sam_header_tag2int(type_tag, SAM_HEADER_TYPE_TAGS);
+  return (NULL == d || type < 0)? 0 : d->recs[type].n;
+}
+
+int32_t
+sam_hdict_index(const sam_hdict_t *d, const char type_tag[2], const char *id)
+{
+  khash_t(hdict) *hash;
+  khiter_t k;
+  int32_t type = sam_header_tag2int(type_tag, SAM_HEADER_TYPE_TAGS);
+  if(NULL == d || NULL == id || type < 0) return -1;
+  hash = (khash_t(hdict)*)d->recs[type].hash;
+  k = kh_get(hdict, hash, id);
+  return k == kh_end(hash)? -1 : kh_value(hash, k);
+}
+
+const char*
+sam_hdict_value(const sam_hdict_t *d, const char type_tag[2], int32_t i, const char tag[2])
+{
+  const sam_hdict_recs_t *r;
+  int32_t type = sam_header_tag2int(type_tag, SAM_HEADER_TYPE_TAGS);
+  if(NULL == d || type < 0) return NULL;
+  r = &d->recs[type];
+  if(i < 0 || r->n <= i) return NULL;
+  return sam_hdict_find(d, r->beg[i], r->len[i], tag);
+}
+
+const char*
+sam_hdict_get(const sam_hdict_t *d, const char type_tag[2], const char *id, const char tag[2])
+{
+  return sam_hdict_value(d, type_tag, sam_hdict_index(d, type_tag, id), tag);
+}
+
 extern void bam_init_header_hash(bam_header_t *header);
 
 bam_header_t*
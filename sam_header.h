@@ -288,6 +288,104 @@ extern "C" {
     int32_t
       sam_header_check(sam_header_t *h);
 
+    /*! @typedef
+      @abstract A tag and its value within a header dictionary.
+      @field  tag    the tag (key)
+      @field  value  the value, pointing into sam_hdict_t::arena
+      */
+    typedef struct {
+        char tag[2];
+        char *value;
+    } sam_hdict_tv_t;
+
+    /*! @typedef
+      @abstract The records of one type within a header dictionary.
+      @field  n      the number of records
+      @field  m      the allocated number of records
+      @field  beg    for each record, the index of its first tag-value pair
+      @field  len    for each record, the number of tag-value pairs
+      @field  hash   hash from the identifying value (SN for @SQ, ID for @RG/@PG) to the record index
+      */
+    typedef struct {
+        int32_t n, m;
+        int32_t *beg, *len;
+        void *hash;
+    } sam_hdict_recs_t;
+
+    /*! @typedef
+      @abstract Read-only dictionary of the header text, built in a single pass.
+      @field  arena  a copy of the header text; all keys and values point into it
+      @field  n_tv   the number of tag-value pairs
+      @field  m_tv   the allocated number of tag-value pairs
+      @field  tv     the tag-value pairs of all records
+      @field  recs   the records for each of the standard record types
+      @discussion  Unlike sam_header_t, no string is allocated per tag, so
+      this scales to headers with hundreds of thousands of lines.
+      */
+    typedef struct {
+        char *arena;
+        int32_t n_tv, m_tv;
+        sam_hdict_tv_t *tv;
+        sam_hdict_recs_t recs[SAM_HEADER_TYPE_NUM];
+    } sam_hdict_t;
+
+    /*!
+      @abstract Parse the header text into a dictionary.
+      @param  text    the textual representation of the header
+      @param  l_text  the length of the text
+      @return         the dictionary; records lacking a required tag are skipped
+     */
+    sam_hdict_t*
+      sam_hdict_parse(const char *text, int32_t l_text);
+
+    /*!
+      @abstract Destroys the dictionary.
+      @param  d  the dictionary
+     */
+    void
+      sam_hdict_destroy(sam_hdict_t *d);
+
+    /*!
+      @abstract The number of records of the given type.
+      @param  d         the dictionary
+      @param  type_tag  the record type (e.g. "SQ", "RG" or "PG")
+      @return           the number of records
+     */
+    int32_t
+      sam_hdict_n(const sam_hdict_t *d, const char type_tag[2]);
+
+    /*!
+      @abstract Gets the index of the record identified by its SN (@SQ) or ID (@RG/@PG) value.
+      @param  d         the dictionary
+      @param  type_tag  the record type
+      @param  id        the identifying value
+      @return           the index of the record, -1 if none is found
+     */
+    int32_t
+      sam_hdict_index(const sam_hdict_t *d, const char type_tag[2], const char *id);
+
+    /*!
+      @abstract Gets a value from the i-th record of the given type.
+      @param  d         the dictionary
+      @param  type_tag  the record type
+      @param  i         the index of the record
+      @param  tag       the tag
+      @return           the value, NULL if the tag is not present
+     */
+    const char*
+      sam_hdict_value(const sam_hdict_t *d, const char type_tag[2], int32_t i, const char tag[2]);
+
+    /*!
+      @abstract Gets a value from the record identified by its SN (@SQ) or ID (@RG/@PG) value.
+      @param  d         the dictionary
+      @param  type_tag  the record type
+      @param  id        the identifying value
+      @param  tag       the tag
+      @return           the value, NULL if the record or the tag is not present
+     */
+    const char*
+      sam_hdict_get(const sam_hdict_t *d, const char type_tag[2], const char *id, const char tag[2]);
+
     /*!
       @abstract Populations the BAM Header fields from the internal SAM Header
       @param  h the BAM header
@@ -51,7 +51,7 @@ static int process_aln(const bam_header_t *h, bam1_t *b)
 	}
 	if (b->core.qual < g_min_mapQ || ((b->core.flag & g_flag_on) != g_flag_on) || (b->core.flag & g_flag_off))
 		return 1;
-	if (g_bed && b->core.tid >= 0 && !bed_overlap(g_bed, h->target_name[b->core.tid], b->core.pos, bam_calend(&b->core, bam1_cigar(b))))
+	if (g_bed && b->core.tid >= 0 && !bed_overlap(g_bed, h->target_name[b->core.tid], b->core.pos, bam1_calend(b)))
 		return 1;
 	if (g_subsam_frac > 0.) {
 		uint32_t k = __ac_X31_hash_string(bam1_qname(b)) + g_subsam_seed;
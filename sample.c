@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "sample.h"
+#include "sam_header.h"
 #include "khash.h"
 KHASH_MAP_INIT_STR(sm, int)
 
@@ -51,45 +52,34 @@ static void add_pair(bam_sample_t *sm, khash_t(sm) *sm2id, const char *key, cons
 
 int bam_smpl_add(bam_sample_t *sm, const char *fn, const char *txt)
 {
-	const char *p = txt, *q, *r;
-	kstring_t buf, first_sm;
-	int n = 0;
+	kstring_t buf;
+	const char *first_sm = 0;
+	int i, n = 0, n_rg;
+	sam_hdict_t *d;
 	khash_t(sm) *sm2id = (khash_t(sm)*)sm->sm2id;
 	if (txt == 0) {
 		add_pair(sm, sm2id, fn, fn);
 		return 0;
 	}
 	memset(&buf, 0, sizeof(kstring_t));
-    memset(&first_sm, 0, sizeof(kstring_t));
-	while ((q = strstr(p, "@RG")) != 0) {
-		p = q + 3;
-		r = q = 0;
-		if ((q = strstr(p, "\tID:")) != 0) q += 4;
-		if ((r = strstr(p, "\tSM:")) != 0) r += 4;
-		if (r && q) {
-			char *u, *v;
-			int oq, or;
-			for (u = (char*)q; *u && *u != '\t' && *u != '\n'; ++u);
-			for (v = (char*)r; *v && *v != '\t' && *v != '\n'; ++v);
-			oq = *u; or = *v; *u = *v = '\0';
-			buf.l = 0; kputs(fn, &buf); kputc('/', &buf); kputs(q, &buf);
-			add_pair(sm, sm2id, buf.s, r);
-            if ( !first_sm.s )
-                kputs(r,&first_sm); 
-			*u = oq; *v = or;
-		} else break;
-		p = q > r? q : r;
+	d = sam_hdict_parse(txt, strlen(txt));
+	n_rg = sam_hdict_n(d, "RG");
+	for (i = 0; i < n_rg; ++i) {
+		const char *id = sam_hdict_value(d, "RG", i, "ID");
+		const char *s = sam_hdict_value(d, "RG", i, "SM");
+		if (id == 0 || s == 0) break;
+		buf.l = 0; kputs(fn, &buf); kputc('/', &buf); kputs(id, &buf);
+		add_pair(sm, sm2id, buf.s, s);
+		if (first_sm == 0) first_sm = s;
 		++n;
 	}
 	if (n == 0) add_pair(sm, sm2id, fn, fn);
-    // If there is only one RG tag present in the header and reads are not annotated, don't refuse to work but
-    //  use the tag instead.
-    else if ( n==1 && first_sm.s )
-        add_pair(sm,sm2id,fn,first_sm.s);
-    if ( first_sm.s )
-        free(first_sm.s);
-
-//	add_pair(sm, sm2id, fn, fn);
+	else if (n == 1 && first_sm) {
+		// If there is only one RG tag present in the header and reads are not annotated, don't refuse to work but
+		//  use the tag instead.
+		add_pair(sm, sm2id, fn, first_sm);
+	}
+	sam_hdict_destroy(d);
 	free(buf.s);
 	return 0;
 }